@@ -0,0 +1,386 @@
+;
+; LZSS Compressed SAP player for 16 match bits, with sound effects
+; ----------------------------------------------------------------
+;
+; (c) 2020 DMSC
+; Code under MIT license, see LICENSE file.
+;
+; This player uses:
+;  Match length: 8 bits  (1 to 256)
+;  Match offset: 8 bits  (1 to 256)
+;  Min length: 1
+;  Total match bits: 16 bits
+;
+; Compress using:
+;  lzss -6 input.rsap test.lz16
+;  lzss -6 -E 6,7 effect.rsap test.lzx
+;
+; Assemble this file with MADS assembler, the compressed song is expected in
+; the `test.lz16` file and the effect in the `test.lzx` file at assembly time.
+;
+; The effect only writes the registers in its header, after the music in each
+; frame. The music is always decoded, so at the end of the effect the player
+; writes the current music value of the effect registers. In this example the
+; effect starts every 256 frames, a game would call start_fx instead.
+;
+; The plater needs 256 bytes of buffer for each pokey register stored, and
+; 256 bytes for each register of the effect, for a full SAP file and an
+; effect of two registers this is 2816 bytes.
+;
+FX_MAX = 9      ; Maximum number of registers of the effect
+FX_START = 100  ; Frames before the first effect
+
+    org $80
+
+chn_copy    .ds     9
+chn_pos     .ds     9
+bptr        .ds     2
+cur_pos     .ds     1
+chn_bits    .ds     1
+fx_copy     .ds     9
+fx_pos      .ds     9
+fx_bptr     .ds     2
+fx_cur      .ds     1
+fx_idx      .ds     1
+fx_on       .ds     1
+fx_wait     .ds     1
+fx_mask     .ds     2
+fx_regs     .ds     FX_MAX + 1  ; Effect registers from the last, ends in $FF
+fx_page     .ds     FX_MAX      ; Buffer page of each effect register
+fx_mskip    .ds     FX_MAX      ; Not 0 if the music does not write the register
+
+bit_data    .byte   1
+fx_bit_data .byte   1
+
+.proc get_byte
+    lda song_data+1
+    inc song_ptr
+    bne skip
+    inc song_ptr+1
+skip
+    rts
+.endp
+song_ptr = get_byte + 1
+
+.proc get_fx_byte
+    lda fx_data
+    inc fx_ptr
+    bne skip
+    inc fx_ptr+1
+skip
+    rts
+.endp
+fx_ptr = get_fx_byte + 1
+
+
+POKEY = $D200
+
+    org $2000
+buffers
+    .ds 256 * 9
+fx_buffers
+    .ds 256 * FX_MAX
+
+song_data
+        ins     'test.lz16'
+song_end
+
+fx_data
+        ins     'test.lzx'
+fx_end
+
+; Skipped channel bit of each register in the song header
+chn_bit     .byte   $00, $80, $40, $20, $10, $08, $04, $02, $01
+
+start
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Song Initialization - this runs in the first tick:
+;
+.proc init_song
+
+    ; Example: here initializes song pointer:
+    ; sta song_ptr
+    ; stx song_ptr + 1
+
+    ; Init all channels:
+    ldx #8
+    ldy #0
+clear
+    ; Read just init value and store into buffer and POKEY
+    jsr get_byte
+    sta POKEY, x
+    sty chn_copy, x
+cbuf
+    sta buffers + 255
+    inc cbuf + 2
+    dex
+    bpl clear
+
+    ; Initialize buffer pointers:
+    sty bptr
+    sty fx_bptr
+    sty cur_pos
+
+    ; No effect playing
+    sty fx_on
+    lda #FX_START
+    sta fx_wait
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Wait for next frame
+;
+.proc wait_frame
+
+    lda 20
+delay
+    cmp 20
+    beq delay
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the song
+;
+.proc play_frame
+    lda #>buffers
+    sta bptr+1
+
+    lda song_data
+    sta chn_bits
+    ldx #8
+
+    ; Loop through all "channels", one for each POKEY register
+chn_loop:
+    lsr chn_bits
+    bcs skip_chn       ; C=1 : skip this channel
+
+    lda chn_copy, x    ; Get status of this stream
+    bne do_copy_byte   ; If > 0 we are copying bytes
+
+    ; We are decoding a new match/literal
+    lsr bit_data       ; Get next bit
+    bne got_bit
+    jsr get_byte       ; Not enough bits, refill!
+    ror                ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta bit_data       ;
+got_bit:
+    jsr get_byte       ; Always read a byte, it could mean "match size/offset" or "literal byte"
+    bcs store          ; Bit = 1 is "literal", bit = 0 is "match"
+
+    sta chn_pos, x     ; Store in "copy pos"
+
+    jsr get_byte
+    sta chn_copy, x    ; Store in "copy length"
+
+                        ; And start copying first byte
+do_copy_byte:
+    dec chn_copy, x     ; Decrease match length, increase match position
+    inc chn_pos, x
+    ldy chn_pos, x
+
+    ; Now, read old data, jump to data store
+    lda (bptr), y
+
+store:
+    ldy cur_pos
+    sta POKEY, x        ; Store to output and buffer
+    sta (bptr), y
+
+skip_chn:
+    ; Increment channel buffer pointer
+    inc bptr+1
+
+    dex
+    bpl chn_loop        ; Next channel
+
+    inc cur_pos
+.endp
+
+    ; Play the effect over the music
+    jsr play_fx
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Check for ending of song and jump to the next frame
+;
+.proc check_end_song
+    lda song_ptr + 1
+    cmp #>song_end
+    bne wait_frame
+    lda song_ptr
+    cmp #<song_end
+    bne wait_frame
+.endp
+
+end_loop
+    rts
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the effect, only the effect registers are decoded
+;
+.proc play_fx
+    lda fx_on
+    bne play
+
+    ; Example: starts the effect every 256 frames
+    dec fx_wait
+    bne done
+    jmp start_fx
+done
+    rts
+
+play
+    ; At the end of the effect, restore the registers of the music
+    lda fx_ptr + 1
+    cmp #>fx_end
+    bne not_end
+    lda fx_ptr
+    cmp #<fx_end
+    bne not_end
+    jmp restore_fx
+
+not_end
+    ldy #0
+
+    ; Loop through the effect registers, from the last
+chn_loop:
+    sty fx_idx
+    ldx fx_regs, y
+    bmi last
+    lda fx_page, y
+    sta fx_bptr+1
+
+    lda fx_copy, x     ; Get status of this stream
+    bne do_copy_byte   ; If > 0 we are copying bytes
+
+    ; We are decoding a new match/literal
+    lsr fx_bit_data    ; Get next bit
+    bne got_bit
+    jsr get_fx_byte    ; Not enough bits, refill!
+    ror                ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta fx_bit_data    ;
+got_bit:
+    jsr get_fx_byte    ; Always read a byte, it could mean "match size/offset" or "literal byte"
+    bcs store          ; Bit = 1 is "literal", bit = 0 is "match"
+
+    sta fx_pos, x      ; Store in "copy pos"
+
+    jsr get_fx_byte
+    sta fx_copy, x     ; Store in "copy length"
+
+                        ; And start copying first byte
+do_copy_byte:
+    dec fx_copy, x      ; Decrease match length, increase match position
+    inc fx_pos, x
+    ldy fx_pos, x
+
+    ; Now, read old data, jump to data store
+    lda (fx_bptr), y
+
+store:
+    ldy fx_cur
+    sta POKEY, x        ; Store to output and buffer
+    sta (fx_bptr), y
+
+    ldy fx_idx
+    iny
+    bne chn_loop        ; Next register
+
+last
+    inc fx_cur
+    rts
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Start the effect: reads the registers of the effect from the header, and
+; writes the initial values.
+;
+.proc start_fx
+    lda #<fx_data
+    sta fx_ptr
+    lda #>fx_data
+    sta fx_ptr+1
+    jsr get_fx_byte
+    sta fx_mask
+    jsr get_fx_byte
+    sta fx_mask+1
+
+    lda #1
+    sta fx_bit_data
+    sta fx_on
+    ldy #0
+    sty fx_cur
+
+    ; The bits are set for the registers not in the effect, from the last
+    ldx #8
+reg_loop
+    lsr fx_mask+1
+    ror fx_mask
+    bcs next_reg
+
+    txa
+    sta fx_regs, y
+    lda song_data
+    and chn_bit, x
+    sta fx_mskip, y
+    tya
+    clc
+    adc #>fx_buffers
+    sta fx_page, y
+    sta ibuf + 2
+    lda #0
+    sta fx_copy, x
+
+    ; Read just init value and store into buffer and POKEY
+    jsr get_fx_byte
+    sta POKEY, x
+ibuf
+    sta fx_buffers + 255
+    iny
+next_reg
+    dex
+    bpl reg_loop
+
+    lda #$FF
+    sta fx_regs, y
+    rts
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Stop the effect, writing the current music value of the effect registers:
+; the last value in the buffer, or the initial value if the music does not
+; write the register.
+;
+.proc restore_fx
+    lda #0
+    sta fx_on
+    tay
+reg_loop
+    ldx fx_regs, y
+    bmi done
+    sty fx_idx
+
+    lda #>(buffers + 8 * 256)
+    sec
+    sbc fx_regs, y
+    sta bptr+1
+    lda fx_mskip, y
+    beq last_frame
+    ldy #255
+    bne read
+last_frame
+    ldy cur_pos
+    dey
+read
+    lda (bptr), y
+    sta POKEY, x
+
+    ldy fx_idx
+    iny
+    bne reg_loop
+done
+    rts
+.endp
+
+
+    run start
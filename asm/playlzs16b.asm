@@ -0,0 +1,232 @@
+;
+; LZSS Compressed SAP player for 16 match bits, cartridge bank version
+; --------------------------------------------------------------------
+;
+; (c) 2020 DMSC
+; Code under MIT license, see LICENSE file.
+;
+; This player uses:
+;  Match length: 8 bits  (1 to 256)
+;  Match offset: 8 bits  (1 to 256)
+;  Min length: 2
+;  Total match bits: 16 bits
+;
+; Compress using:
+;  lzss -6 -B 8 input.rsap song.bin
+;
+; The compressed song is read from cartridge banks, starting at bank 0 with
+; the bank table written by the compressor. The banks are mapped in the
+; window at BANK_START, selected by writing the bank number to BANK_SEL,
+; change the values below for your cartridge type. The player code and the
+; buffers must be outside of the window.
+;
+; Switching banks adds 14 cycles each 256 bytes read, only when the song
+; pointer crosses to a new page.
+;
+; The plater needs 256 bytes of buffer for each pokey register stored, for a
+; full SAP file this is 2304 bytes.
+;
+BANK_START = $A000
+BANK_SIZE = $2000
+BANK_SEL = $D500
+
+    org $80
+
+chn_copy    .ds     9
+chn_pos     .ds     9
+bptr        .ds     2
+cur_pos     .ds     1
+chn_bits    .ds     1
+chn_hdr     .ds     1
+cur_bank    .ds     1
+end_bank    .ds     1
+end_ptr     .ds     2
+
+bit_data    .byte   1
+
+.proc get_byte
+    lda BANK_START
+    inc song_ptr
+    bne skip
+    inc song_ptr+1
+    pha
+    lda song_ptr+1
+    eor #>(BANK_START + BANK_SIZE)
+    beq next_bank
+    pla
+skip
+    rts
+
+    ; Go to the start of the next bank, keeping A, X, Y and C
+next_bank
+    inc cur_bank
+    lda cur_bank
+    sta BANK_SEL
+    lda #>BANK_START
+    sta song_ptr+1
+    pla
+    rts
+.endp
+song_ptr = get_byte + 1
+
+
+POKEY = $D200
+
+    org $2000
+buffers
+    .ds 256 * 9
+
+
+start
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Song Initialization - this runs in the first tick:
+;
+.proc init_song
+
+    ; Select the first bank, holding the bank table
+    lda #0
+    sta cur_bank
+    sta BANK_SEL
+
+    ; Get end of song from the used bytes of the last bank
+    lda BANK_START          ; Number of banks
+    asl
+    tay
+    lda BANK_START-1, y
+    sta end_ptr
+    ldx BANK_START
+    dex
+    lda BANK_START, y
+    cmp #>BANK_SIZE         ; A full last bank ends at the start of the next
+    bcc not_full
+    inx
+    lda #0
+not_full
+    clc
+    adc #>BANK_START
+    sta end_ptr+1
+    stx end_bank
+
+    ; Skip the bank table and read the header
+    iny
+    lda BANK_START, y
+    sta chn_hdr
+    iny
+    sty song_ptr
+    lda #>BANK_START
+    cpy #0              ; With 127 banks the song starts at the next page
+    bne no_wrap
+    lda #>(BANK_START + 256)
+no_wrap
+    sta song_ptr+1
+
+    ; Init all channels:
+    ldx #8
+    ldy #0
+clear
+    ; Read just init value and store into buffer and POKEY
+    jsr get_byte
+    sta POKEY, x
+    sty chn_copy, x
+cbuf
+    sta buffers + 255
+    inc cbuf + 2
+    dex
+    bpl clear
+
+    ; Initialize buffer pointer:
+    sty bptr
+    sty cur_pos
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Wait for next frame
+;
+.proc wait_frame
+
+    lda 20
+delay
+    cmp 20
+    beq delay
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the song
+;
+.proc play_frame
+    lda #>buffers
+    sta bptr+1
+
+    lda chn_hdr
+    sta chn_bits
+    ldx #8
+
+    ; Loop through all "channels", one for each POKEY register
+chn_loop:
+    lsr chn_bits
+    bcs skip_chn       ; C=1 : skip this channel
+
+    lda chn_copy, x    ; Get status of this stream
+    bne do_copy_byte   ; If > 0 we are copying bytes
+
+    ; We are decoding a new match/literal
+    lsr bit_data       ; Get next bit
+    bne got_bit
+    jsr get_byte       ; Not enough bits, refill!
+    ror                ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta bit_data       ;
+got_bit:
+    jsr get_byte       ; Always read a byte, it could mean "match size/offset" or "literal byte"
+    bcs store          ; Bit = 1 is "literal", bit = 0 is "match"
+
+    sta chn_pos, x     ; Store in "copy pos"
+
+    jsr get_byte
+    sta chn_copy, x    ; Store in "copy length"
+
+                        ; And start copying first byte
+do_copy_byte:
+    dec chn_copy, x     ; Decrease match length, increase match position
+    inc chn_pos, x
+    ldy chn_pos, x
+
+    ; Now, read old data, jump to data store
+    lda (bptr), y
+
+store:
+    ldy cur_pos
+    sta POKEY, x        ; Store to output and buffer
+    sta (bptr), y
+
+skip_chn:
+    ; Increment channel buffer pointer
+    inc bptr+1
+
+    dex
+    bpl chn_loop        ; Next channel
+
+    inc cur_pos
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Check for ending of song and jump to the next frame
+;
+.proc check_end_song
+    lda song_ptr + 1
+    cmp end_ptr + 1
+    bne wait_frame
+    lda song_ptr
+    cmp end_ptr
+    bne wait_frame
+    lda cur_bank
+    cmp end_bank
+    bne wait_frame
+.endp
+
+end_loop
+    rts
+
+
+    run start
+
@@ -0,0 +1,257 @@
+;
+; LZSS Compressed SAP player for 16 match bits, repeated sections version
+; -----------------------------------------------------------------------
+;
+; (c) 2020 DMSC
+; Code under MIT license, see LICENSE file.
+;
+; This player uses:
+;  Match length: 8 bits  (1 to 256)
+;  Match offset: 8 bits  (1 to 256)
+;  Min length: 2
+;  Total match bits: 16 bits
+;
+; Compress using:
+;  lzss -6 -r 256 input.rsap test.lz16
+;
+; The song is stored as a list of blocks, each one compressed as a song, and
+; a play order of the blocks. At the start of each block the player reads
+; the initial values of the channels, as in the first frame of the song.
+;
+; Assemble this file with MADS assembler, the compressed song is expected in
+; the `test.lz16` file at assembly time.
+;
+; The plater needs 256 bytes of buffer for each pokey register stored, for a
+; full SAP file this is 2304 bytes.
+;
+    org $80
+
+chn_copy    .ds     9
+chn_pos     .ds     9
+bptr        .ds     2
+cur_pos     .ds     1
+chn_bits    .ds     1
+chn_hdr     .ds     1
+frames      .ds     2
+steps       .ds     2
+order_ptr   .ds     2
+
+bit_data    .byte   1
+
+.proc get_byte
+    lda song_data
+    inc song_ptr
+    bne skip
+    inc song_ptr+1
+skip
+    rts
+.endp
+song_ptr = get_byte + 1
+
+
+POKEY = $D200
+
+    org $2000
+buffers
+    .ds 256 * 9
+
+song_data
+        ins     'test.lz16'
+song_end
+
+
+start
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Song Initialization - this runs in the first tick:
+;
+.proc init_song
+
+    ; The play order is after the block table, 4 bytes per block
+    lda #0
+    sta order_ptr+1
+    lda song_data
+    asl
+    rol order_ptr+1
+    asl
+    rol order_ptr+1
+    adc #<(song_data+3)
+    sta order_ptr
+    lda order_ptr+1
+    adc #>(song_data+3)
+    sta order_ptr+1
+
+    ; Number of steps in the play order
+    lda song_data+1
+    sta steps
+    lda song_data+2
+    sta steps+1
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Start the next block of the play order, this plays the first frame:
+;
+.proc next_block
+    lda steps
+    ora steps+1
+    bne get_step
+    jmp end_loop
+get_step
+    lda steps
+    bne no_borrow
+    dec steps+1
+no_borrow
+    dec steps
+
+    ; Read block number and get the block table entry
+    ldy #0
+    sty bptr+1
+    lda (order_ptr), y
+    inc order_ptr
+    bne ok_order
+    inc order_ptr+1
+ok_order
+    asl
+    rol bptr+1
+    asl
+    rol bptr+1
+    adc #<(song_data+3)
+    sta bptr
+    lda bptr+1
+    adc #>(song_data+3)
+    sta bptr+1
+
+    ; Block start and number of frames
+    lda (bptr), y
+    clc
+    adc #<song_data
+    sta song_ptr
+    iny
+    lda (bptr), y
+    adc #>song_data
+    sta song_ptr+1
+    iny
+    lda (bptr), y
+    sta frames
+    iny
+    lda (bptr), y
+    sta frames+1
+
+    ; Each block starts with the skipped channels and initial values
+    jsr get_byte
+    sta chn_hdr
+    lda #1
+    sta bit_data
+    lda #>buffers
+    sta cbuf + 2
+
+    ; Init all channels:
+    ldx #8
+    ldy #0
+clear
+    ; Read just init value and store into buffer and POKEY
+    jsr get_byte
+    sta POKEY, x
+    sty chn_copy, x
+cbuf
+    sta buffers + 255
+    inc cbuf + 2
+    dex
+    bpl clear
+
+    ; Initialize buffer pointer:
+    sty bptr
+    sty cur_pos
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Wait for next frame
+;
+.proc wait_frame
+
+    lda 20
+delay
+    cmp 20
+    beq delay
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Count the frames of the block and go to the next block at the end
+;
+.proc check_end_block
+    lda frames
+    bne no_borrow
+    dec frames+1
+no_borrow
+    dec frames
+    lda frames
+    ora frames+1
+    bne play_frame
+    jmp next_block
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the song
+;
+.proc play_frame
+    lda #>buffers
+    sta bptr+1
+
+    lda chn_hdr
+    sta chn_bits
+    ldx #8
+
+    ; Loop through all "channels", one for each POKEY register
+chn_loop:
+    lsr chn_bits
+    bcs skip_chn       ; C=1 : skip this channel
+
+    lda chn_copy, x    ; Get status of this stream
+    bne do_copy_byte   ; If > 0 we are copying bytes
+
+    ; We are decoding a new match/literal
+    lsr bit_data       ; Get next bit
+    bne got_bit
+    jsr get_byte       ; Not enough bits, refill!
+    ror                ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta bit_data       ;
+got_bit:
+    jsr get_byte       ; Always read a byte, it could mean "match size/offset" or "literal byte"
+    bcs store          ; Bit = 1 is "literal", bit = 0 is "match"
+
+    sta chn_pos, x     ; Store in "copy pos"
+
+    jsr get_byte
+    sta chn_copy, x    ; Store in "copy length"
+
+                        ; And start copying first byte
+do_copy_byte:
+    dec chn_copy, x     ; Decrease match length, increase match position
+    inc chn_pos, x
+    ldy chn_pos, x
+
+    ; Now, read old data, jump to data store
+    lda (bptr), y
+
+store:
+    ldy cur_pos
+    sta POKEY, x        ; Store to output and buffer
+    sta (bptr), y
+
+skip_chn:
+    ; Increment channel buffer pointer
+    inc bptr+1
+
+    dex
+    bpl chn_loop        ; Next channel
+
+    inc cur_pos
+    jmp wait_frame
+.endp
+
+end_loop
+    rts
+
+
+    run start
+
@@ -0,0 +1,309 @@
+;
+; LZSS Compressed SAP player for 16 match bits, song archive version
+; ------------------------------------------------------------------
+;
+; (c) 2020 DMSC
+; Code under MIT license, see LICENSE file.
+;
+; This player uses:
+;  Match length: 8 bits  (1 to 256)
+;  Match offset: 8 bits  (1 to 256)
+;  Min length: 2
+;  Total match bits: 16 bits
+;
+; Build the archive using:
+;  lzssarc -6 test.lza song1.rsap song2.rsap ...
+;
+; The archive has an index with the channel table of each song, so any song
+; starts in the same time. Each register stream is compressed alone, with
+; its own pointer and flag bits, and the constant streams are only written
+; at the start. The player plays songs of one POKEY chip, and the archive
+; must fit in memory, as only the low 16 bits of the stream offsets are used.
+;
+; Assemble this file with MADS assembler, the archive is expected in the
+; `test.lza` file at assembly time, and the song to play in SONG.
+;
+; The plater needs 256 bytes of buffer for each pokey register stored, for a
+; full SAP file this is 2304 bytes.
+;
+SONG = 0
+
+    org $80
+
+chn_ptr     .ds     18      ; Stream pointer, two bytes for each channel
+chn_copy    .ds     18      ; Copy length, and copy pos in the next byte
+chn_bits    .ds     18      ; Flag bits, 0 for the constant streams
+chn_pos = chn_copy + 1
+bptr        .ds     2
+cur_pos     .ds     1
+chn         .ds     1
+frames      .ds     3
+tptr        .ds     2
+sptr        .ds     2
+
+POKEY = $D200
+
+    org $2000
+buffers
+    .ds 256 * 9
+
+song_data
+        ins     'test.lza'
+song_end
+
+; Reads the next byte of the stream, X is two times the channel number
+.proc get_byte
+    lda (chn_ptr, x)
+    inc chn_ptr, x
+    bne skip
+    inc chn_ptr+1, x
+skip
+    rts
+.endp
+
+start
+    lda #SONG
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Song Initialization - this runs in the first tick, with the song number
+; in A:
+;
+.proc init_song
+
+    ; Song index entry, 6 bytes for each song after the 8 bytes header
+    ldy #0
+    sty tptr+1
+    sta tptr
+    asl
+    rol tptr+1
+    adc tptr
+    bcc no_carry
+    inc tptr+1
+no_carry
+    asl
+    rol tptr+1
+    adc #<(song_data+8)
+    sta tptr
+    lda tptr+1
+    adc #>(song_data+8)
+    sta tptr+1
+
+    ; Number of frames
+    ldy #2
+    lda (tptr), y
+    sta frames
+    iny
+    lda (tptr), y
+    sta frames+1
+    iny
+    lda (tptr), y
+    sta frames+2
+
+    ; Channel table of the song
+    ldy #0
+    lda (tptr), y
+    clc
+    adc #<song_data
+    pha
+    iny
+    lda (tptr), y
+    adc #>song_data
+    sta tptr+1
+    pla
+    sta tptr
+
+    ; Init all channels, from channel 0 at the last buffer:
+    lda #>(buffers + 8 * 256)
+    sta cbuf + 2
+    ldx #0
+    stx chn
+chn_init
+    ldy #0
+    sty chn_copy, x
+    sty chn_bits, x
+    lda (tptr), y       ; Stream number, $FFFF for constant streams
+    sta sptr
+    iny
+    lda (tptr), y
+    sta sptr+1
+    iny
+    and sptr
+    cmp #$FF
+    bne coded
+    lda (tptr), y       ; Value of the constant stream
+    jmp store
+
+coded
+    ; Stream table entry, 3 bytes for each stream
+    lda sptr
+    asl
+    tay
+    lda sptr+1
+    rol
+    pha
+    tya
+    clc
+    adc sptr
+    sta sptr
+    pla
+    adc sptr+1
+    sta sptr+1
+    lda sptr
+    clc
+    adc song_data+4     ; Offset of the stream table
+    sta sptr
+    lda sptr+1
+    adc song_data+5
+    sta sptr+1
+    lda sptr
+    clc
+    adc #<song_data
+    sta sptr
+    lda sptr+1
+    adc #>song_data
+    sta sptr+1
+
+    ; Stream start
+    ldy #0
+    lda (sptr), y
+    clc
+    adc #<song_data
+    sta chn_ptr, x
+    iny
+    lda (sptr), y
+    adc #>song_data
+    sta chn_ptr+1, x
+
+    lda #1
+    sta chn_bits, x
+
+    ; Read just init value from the stream
+    jsr get_byte
+
+store
+    ; Store into buffer and POKEY
+    ldy chn
+    sta POKEY, y
+cbuf
+    sta buffers + 255
+    dec cbuf + 2
+
+    ; Next channel table entry
+    lda tptr
+    clc
+    adc #3
+    sta tptr
+    bcc no_carry2
+    inc tptr+1
+no_carry2
+    inx
+    inx
+    inc chn
+    cpx #18
+    bne chn_init
+
+    ; Initialize buffer pointer:
+    ldy #0
+    sty bptr
+    sty cur_pos
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Count the frames and check for ending of song, the first frame was
+; already played in the initialization.
+;
+.proc check_end_song
+    lda frames
+    bne no_borrow
+    lda frames+1
+    bne no_borrow1
+    dec frames+2
+no_borrow1
+    dec frames+1
+no_borrow
+    dec frames
+    lda frames
+    ora frames+1
+    ora frames+2
+    bne wait_frame
+    jmp end_loop
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Wait for next frame
+;
+.proc wait_frame
+
+    lda 20
+delay
+    cmp 20
+    beq delay
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the song
+;
+.proc play_frame
+    lda #>buffers
+    sta bptr+1
+
+    lda #8
+    sta chn
+    ldx #16
+
+    ; Loop through all "channels", one for each POKEY register
+chn_loop:
+    lda chn_bits, x    ; Constant streams have no flag bits
+    beq skip_chn
+
+    lda chn_copy, x    ; Get status of this stream
+    bne do_copy_byte   ; If > 0 we are copying bytes
+
+    ; We are decoding a new match/literal
+    lsr chn_bits, x    ; Get next bit
+    bne got_bit
+    jsr get_byte       ; Not enough bits, refill!
+    ror                ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta chn_bits, x    ;
+got_bit:
+    jsr get_byte       ; Always read a byte, it could mean "match size/offset" or "literal byte"
+    bcs store          ; Bit = 1 is "literal", bit = 0 is "match"
+
+    sta chn_pos, x     ; Store in "copy pos"
+
+    jsr get_byte
+    sta chn_copy, x    ; Store in "copy length"
+
+                        ; And start copying first byte
+do_copy_byte:
+    dec chn_copy, x     ; Decrease match length, increase match position
+    inc chn_pos, x
+    ldy chn_pos, x
+
+    ; Now, read old data, jump to data store
+    lda (bptr), y
+
+store:
+    ldy chn
+    sta POKEY, y        ; Store to output and buffer
+    ldy cur_pos
+    sta (bptr), y
+
+skip_chn:
+    ; Increment channel buffer pointer
+    inc bptr+1
+    dec chn
+
+    dex
+    dex
+    bpl chn_loop        ; Next channel
+
+    inc cur_pos
+    jmp check_end_song
+.endp
+
+end_loop
+    rts
+
+
+    run start
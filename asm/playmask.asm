@@ -0,0 +1,129 @@
+;
+; Change-mask SAP player
+; ----------------------
+;
+; (c) 2020 DMSC
+; Code under MIT license, see LICENSE file.
+;
+; Each frame has one bit for each register that is not skipped, set if the
+; register changed, followed by the new values. The mask bits of each frame
+; start in a new byte, and the next mask byte is read after the values of
+; the first 8 registers.
+;
+; Compress using:
+;  sapcomp -c mask input.rsap test.msk
+;
+; Assemble this file with MADS assembler, the compressed song is expected in
+; the `test.msk` file at assembly time.
+;
+; The player does not need any buffer, only the POKEY registers.
+;
+    org $80
+
+chn_skip    .ds     1
+chn_bits    .ds     1
+mask_bits   .ds     1
+
+.proc get_byte
+    lda song_data
+    inc song_ptr
+    bne skip
+    inc song_ptr+1
+skip
+    rts
+.endp
+song_ptr = get_byte + 1
+
+
+POKEY = $D200
+
+    org $2000
+
+song_data
+        ins     'test.msk'
+song_end
+
+
+start
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Song Initialization - this runs in the first tick:
+;
+.proc init_song
+
+    ; Example: here initializes song pointer:
+    ; sta song_ptr
+    ; stx song_ptr + 1
+
+    ; Skipped channels
+    jsr get_byte
+    sta chn_skip
+
+    ; Init all channels:
+    ldx #8
+clear
+    jsr get_byte
+    sta POKEY, x
+    dex
+    bpl clear
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Wait for next frame
+;
+.proc wait_frame
+
+    lda 20
+delay
+    cmp 20
+    beq delay
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the song
+;
+.proc play_frame
+    lda chn_skip
+    sta chn_bits
+    lda #1              ; Each frame starts a new mask byte
+    sta mask_bits
+    ldx #8
+
+    ; Loop through all "channels", one for each POKEY register
+chn_loop:
+    lsr chn_bits
+    bcs skip_chn        ; C=1 : skip this channel
+
+    lsr mask_bits       ; Get next bit
+    bne got_bit
+    jsr get_byte        ; Not enough bits, refill!
+    ror                 ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta mask_bits       ;
+got_bit:
+    bcc skip_chn        ; Bit = 0 is "not changed"
+
+    jsr get_byte        ; Read new value
+    sta POKEY, x
+
+skip_chn:
+    dex
+    bpl chn_loop        ; Next channel
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Check for ending of song and jump to the next frame
+;
+.proc check_end_song
+    lda song_ptr + 1
+    cmp #>song_end
+    bne wait_frame
+    lda song_ptr
+    cmp #<song_end
+    bne wait_frame
+.endp
+
+end_loop
+    rts
+
+
+    run start
@@ -0,0 +1,178 @@
+;
+; Change-mask SAP player, LZSS compressed version
+; -----------------------------------------------
+;
+; (c) 2020 DMSC
+; Code under MIT license, see LICENSE file.
+;
+; This is the `asm/playmask.asm` player, with the change-mask stream
+; compressed as one LZSS stream with:
+;  Match length: 8 bits  (1 to 256)
+;  Match offset: 8 bits  (1 to 256)
+;  Min length: 1
+;  Total match bits: 16 bits
+;
+; Compress using:
+;  sapcomp -c mask-lz input.rsap test.mlz
+;
+; Assemble this file with MADS assembler, the compressed song is expected in
+; the `test.mlz` file at assembly time.
+;
+; The player needs only one buffer of 256 bytes, for the LZSS stream.
+;
+    org $80
+
+chn_skip    .ds     1
+chn_bits    .ds     1
+mask_bits   .ds     1
+copy_len    .ds     1
+copy_pos    .ds     1
+cur_pos     .ds     1
+
+bit_data    .byte   1
+
+.proc get_lz
+    lda song_data
+    inc song_ptr
+    bne skip
+    inc song_ptr+1
+skip
+    rts
+.endp
+song_ptr = get_lz + 1
+
+
+POKEY = $D200
+
+    org $2000
+buffer
+    .ds 256
+
+song_data
+        ins     'test.mlz'
+song_end
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Returns the next byte of the change-mask stream, decoding the LZSS stream
+;
+.proc get_byte
+    lda copy_len        ; If > 0 we are copying bytes
+    bne do_copy_byte
+
+    ; We are decoding a new match/literal
+    lsr bit_data        ; Get next bit
+    bne got_bit
+    jsr get_lz          ; Not enough bits, refill!
+    ror                 ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta bit_data        ;
+got_bit:
+    jsr get_lz          ; Always read a byte, it could mean "match size/offset" or "literal byte"
+    bcs store           ; Bit = 1 is "literal", bit = 0 is "match"
+
+    sta copy_pos        ; Store in "copy pos"
+
+    jsr get_lz
+    sta copy_len        ; Store in "copy length"
+
+                        ; And start copying first byte
+do_copy_byte:
+    dec copy_len        ; Decrease match length, increase match position
+    inc copy_pos
+    ldy copy_pos
+
+    ; Now, read old data
+    lda buffer, y
+
+store:
+    ldy cur_pos         ; Store to buffer
+    sta buffer, y
+    inc cur_pos
+    rts
+.endp
+
+
+start
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Song Initialization - this runs in the first tick:
+;
+.proc init_song
+
+    ; The first byte is the LZSS initial value, at the end of the buffer
+    ldy #0
+    sty copy_len
+    sty cur_pos
+    jsr get_lz
+    sta buffer + 255
+    sta chn_skip
+
+    ; Init all channels:
+    ldx #8
+clear
+    jsr get_byte
+    sta POKEY, x
+    dex
+    bpl clear
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Wait for next frame
+;
+.proc wait_frame
+
+    lda 20
+delay
+    cmp 20
+    beq delay
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the song
+;
+.proc play_frame
+    lda chn_skip
+    sta chn_bits
+    lda #1              ; Each frame starts a new mask byte
+    sta mask_bits
+    ldx #8
+
+    ; Loop through all "channels", one for each POKEY register
+chn_loop:
+    lsr chn_bits
+    bcs skip_chn        ; C=1 : skip this channel
+
+    lsr mask_bits       ; Get next bit
+    bne got_bit
+    jsr get_byte        ; Not enough bits, refill!
+    sec                 ; get_byte does not keep C
+    ror                 ; Extract a new bit and add a 1 at the high bit
+    sta mask_bits       ;
+got_bit:
+    bcc skip_chn        ; Bit = 0 is "not changed"
+
+    jsr get_byte        ; Read new value
+    sta POKEY, x
+
+skip_chn:
+    dex
+    bpl chn_loop        ; Next channel
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Check for ending of song and jump to the next frame, the last byte of the
+; LZSS stream is always a literal.
+;
+.proc check_end_song
+    lda song_ptr + 1
+    cmp #>song_end
+    bne wait_frame
+    lda song_ptr
+    cmp #<song_end
+    bne wait_frame
+.endp
+
+end_loop
+    rts
+
+
+    run start
@@ -0,0 +1,234 @@
+;
+; LZSS Compressed SAP player for 16 match bits, paired registers version
+; ----------------------------------------------------------------------
+;
+; (c) 2020 DMSC
+; Code under MIT license, see LICENSE file.
+;
+; This player uses:
+;  Match length: 8 bits  (1 to 255 for pairs, 1 to 256 for the others)
+;  Match offset: 8 bits  (1 to 256)
+;  Min length: 1
+;  Total match bits: 16 bits
+;
+; Compress using:
+;  sapcomp -c pair-6 input.rsap test.lzr
+;
+; Assemble this file with MADS assembler, the compressed song is expected in
+; the `test.lzr` file at assembly time.
+;
+; The byte after the skipped channels has one bit for each pair of registers
+; that is compressed as one stream, the literals of a pair have two bytes and
+; the matches copy both registers. The stream is read in the last register of
+; the pair, that sets the copy of the first register, so the first register
+; only copies bytes from its buffer.
+;
+; The plater needs 256 bytes of buffer for each pokey register stored, for a
+; full SAP file this is 2304 bytes.
+;
+    org $80
+
+chn_copy    .ds     9
+chn_pos     .ds     9
+chn_pair    .ds     9       ; First register of the pair, $FF if none
+chn_ppage   .ds     9       ; Buffer page of the first register of the pair
+bptr        .ds     2
+pptr        .ds     2
+cur_pos     .ds     1
+chn_bits    .ds     1
+
+bit_data    .byte   1
+
+.proc get_byte
+    lda song_data+2
+    inc song_ptr
+    bne skip
+    inc song_ptr+1
+skip
+    rts
+.endp
+song_ptr = get_byte + 1
+
+
+POKEY = $D200
+
+    org $2000
+buffers
+    .ds 256 * 9
+
+song_data
+        ins     'test.lzr'
+song_end
+
+; Registers of each pair in the pair mask: AUDF and AUDC of each channel,
+; and the AUDF of the 16 bit channels.
+pair_mask   .byte   $01, $02, $04, $08, $10, $20
+pair_first  .byte   0, 2, 4, 6, 0, 4
+pair_last   .byte   1, 3, 5, 7, 2, 6
+
+start
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Song Initialization - this runs in the first tick:
+;
+.proc init_song
+
+    ; Example: here initializes song pointer:
+    ; sta song_ptr
+    ; stx song_ptr + 1
+
+    ; Init all channels:
+    ldx #8
+    ldy #0
+clear
+    lda #$FF
+    sta chn_pair, x
+    ; Read just init value and store into buffer and POKEY
+    jsr get_byte
+    sta POKEY, x
+    sty chn_copy, x
+cbuf
+    sta buffers + 255
+    inc cbuf + 2
+    dex
+    bpl clear
+
+    ; Initialize buffer pointers:
+    sty bptr
+    sty pptr
+    sty cur_pos
+
+    ; Set the pairs
+    ldy #5
+pairs
+    lda song_data+1
+    and pair_mask, y
+    beq no_pair
+    ldx pair_last, y
+    lda pair_first, y
+    sta chn_pair, x
+    lda #>(buffers + 8 * 256)
+    sec
+    sbc pair_first, y
+    sta chn_ppage, x
+no_pair
+    dey
+    bpl pairs
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Wait for next frame
+;
+.proc wait_frame
+
+    lda 20
+delay
+    cmp 20
+    beq delay
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Play one frame of the song
+;
+.proc play_frame
+    lda #>buffers
+    sta bptr+1
+
+    lda song_data
+    sta chn_bits
+    ldx #8
+
+    ; Loop through all "channels", one for each POKEY register
+chn_loop:
+    lsr chn_bits
+    bcs skip_chn       ; C=1 : skip this channel
+
+    lda chn_copy, x    ; Get status of this stream
+    bne do_copy_byte   ; If > 0 we are copying bytes
+
+    ; We are decoding a new match/literal
+    lsr bit_data       ; Get next bit
+    bne got_bit
+    jsr get_byte       ; Not enough bits, refill!
+    ror                ; Extract a new bit and add a 1 at the high bit (from C set above)
+    sta bit_data       ;
+got_bit:
+    jsr get_byte       ; Always read a byte, it could mean "match size/offset" or "literal byte"
+    ldy chn_pair, x    ; Y = first register of the pair, does not change C
+    bcc match          ; Bit = 1 is "literal", bit = 0 is "match"
+    bmi store          ; Literal of one register
+    jmp pair_literal
+
+match:
+    sta chn_pos, x     ; Store in "copy pos"
+
+    jsr get_byte
+    sta chn_copy, x    ; Store in "copy length"
+
+    cpy #0
+    bmi do_copy_byte
+    sta chn_copy, y    ; The first register of the pair copies the same bytes
+    lda chn_pos, x
+    sta chn_pos, y
+
+                        ; And start copying first byte
+do_copy_byte:
+    dec chn_copy, x     ; Decrease match length, increase match position
+    inc chn_pos, x
+    ldy chn_pos, x
+
+    ; Now, read old data, jump to data store
+    lda (bptr), y
+
+store:
+    ldy cur_pos
+    sta POKEY, x        ; Store to output and buffer
+    sta (bptr), y
+
+skip_chn:
+    ; Increment channel buffer pointer
+    inc bptr+1
+
+    dex
+    bpl chn_loop        ; Next channel
+
+    inc cur_pos
+.endp
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Check for ending of song and jump to the next frame
+;
+.proc check_end_song
+    lda song_ptr + 1
+    cmp #>song_end
+    bne wait_frame
+    lda song_ptr
+    cmp #<song_end
+    bne wait_frame
+.endp
+
+end_loop
+    rts
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Literal of a pair, the second byte is stored in the buffer of the first
+; register, that copies it in this frame. Y is the first register.
+;
+.proc pair_literal
+    pha
+    lda #1
+    sta chn_copy, y
+    lda cur_pos
+    adc #$FE           ; C = 1, so this is cur_pos - 1
+    sta chn_pos, y
+    lda chn_ppage, x
+    sta pptr+1
+    jsr get_byte
+    ldy cur_pos
+    sta (pptr), y
+    pla
+    jmp play_frame.store
+.endp
+
+
+    run start
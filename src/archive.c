@@ -0,0 +1,275 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Song archive: many songs compressed in one image, with an index to start
+ * any song without reading the others. Each register stream is compressed
+ * alone, so the streams that are the same in many songs are stored once.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "archive.h"
+#include "codec_lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static int get24(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static void put16(uint8_t *p, int x)
+{
+    p[0] = x & 0xFF;
+    p[1] = (x >> 8) & 0xFF;
+}
+
+static void put24(uint8_t *p, int x)
+{
+    put16(p, x);
+    p[2] = (x >> 16) & 0xFF;
+}
+
+// Returns 1 if all the stream has the value of the first frame
+static int stream_constant(const struct sapr *s, int chn)
+{
+    for(int j=1; j<s->size; j++)
+        if( s->data[chn][j] != s->data[chn][0] )
+            return 0;
+    return 1;
+}
+
+// Returns 1 if the parsed stream ends in a match
+static int last_is_match(const struct lzss *p, const struct lzop *lz)
+{
+    int last = 0;
+    for(int pos = 1; pos < lz->size; )
+    {
+        last = lz->mlen[pos] >= p->min_mlen;
+        pos += last ? lz->mlen[pos] : 1;
+    }
+    return last;
+}
+
+// Writes the parsed stream as a song with only this stream
+static void encode_stream(struct lzss *p, struct bf *b, struct lzop *lz)
+{
+    if( last_is_match(p, lz) )
+        lzop_backfill(p, lz, 1);
+    add_byte(b, lz->data[0]);
+    bflush(b);
+    int lpos = 0;
+    for(int pos = 1; pos < lz->size; pos++)
+        lpos = lzop_encode(p, b, lz, pos, lpos);
+}
+
+int archive_build(struct codec *c, const struct sapr *songs, int nsongs,
+                  struct bf *b, struct archive_stats *st)
+{
+    struct lzss *p = c->priv;
+    if( nsongs < 1 || nsongs > ARCHIVE_MAX_SONGS )
+        return -1;
+
+    // Compress all the streams, storing the different ones
+    int total = 0;
+    for(int f=0; f<nsongs; f++)
+        total += songs[f].nchn;
+    struct bf *sb = calloc(total, sizeof(struct bf));
+    int *sid = malloc(sizeof(int) * total);
+    if( !sb || !sid )
+    {
+        fprintf(stderr, "error: out of memory building archive\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(st, 0, sizeof(*st));
+    memset(p->stat_len, 0, sizeof(int) * (p->max_mlen + 1));
+    memset(p->stat_off, 0, sizeof(int) * (p->max_off + 1));
+
+    int nst = 0, k = 0, err = 0;
+    for(int f=0; f<nsongs; f++)
+    {
+        const struct sapr *s = &songs[f];
+        int chn_skip[SAPR_MAX_CHN];
+        void *ps[SAPR_MAX_CHN];
+        if( s->size < 1 || s->size > ARCHIVE_MAX_FRAMES )
+            err = -1;
+        for(int i=0; i<SAPR_MAX_CHN; i++)
+            chn_skip[i] = i >= s->nchn || stream_constant(s, i);
+        codec_parse(&c, 1, s, chn_skip, ps);
+        for(int i=0; i<s->nchn; i++, k++)
+        {
+            if( chn_skip[i] )
+            {
+                sid[k] = -1;
+                st->constant++;
+                continue;
+            }
+            struct bf *n = &sb[nst];
+            bf_init(n);
+            encode_stream(p, n, ps[i]);
+            st->streams++;
+            int j;
+            for(j=0; j<nst; j++)
+                if( sb[j].len == n->len && !memcmp(sb[j].buf, n->buf, n->len) )
+                    break;
+            sid[k] = j;
+            if( j < nst )
+            {
+                st->saved += n->len;
+                bf_free(n);
+            }
+            else
+                nst++;
+        }
+        codec_parse_free(&c, 1, ps);
+    }
+    st->stored = nst;
+
+    // Write the header, the index and the channel tables
+    int base = b->len;
+    int stbl = ARCHIVE_HDR_SIZE + ARCHIVE_SONG_SIZE * nsongs + 3 * total;
+    int pos = stbl + 3 * (nst + 1);
+    if( stbl > 0xFFFF || nst > 0xFFFE )
+        err = -1;
+    uint8_t hdr[ARCHIVE_HDR_SIZE + ARCHIVE_SONG_SIZE];
+    hdr[0] = nsongs;
+    hdr[1] = p->bits_moff;
+    hdr[2] = p->bits_mlen;
+    hdr[3] = p->min_mlen;
+    put16(hdr + 4, stbl);
+    put16(hdr + 6, nst);
+    for(int i=0; i<ARCHIVE_HDR_SIZE; i++)
+        add_byte(b, hdr[i]);
+    int tbl = ARCHIVE_HDR_SIZE + ARCHIVE_SONG_SIZE * nsongs;
+    for(int f=0; f<nsongs; f++)
+    {
+        put16(hdr, tbl);
+        put24(hdr + 2, songs[f].size);
+        hdr[5] = songs[f].nchn;
+        for(int i=0; i<ARCHIVE_SONG_SIZE; i++)
+            add_byte(b, hdr[i]);
+        tbl += 3 * songs[f].nchn;
+    }
+    k = 0;
+    for(int f=0; f<nsongs; f++)
+        for(int i=0; i<songs[f].nchn; i++, k++)
+        {
+            put16(hdr, sid[k] < 0 ? 0xFFFF : sid[k]);
+            hdr[2] = songs[f].data[i][0];
+            for(int j=0; j<3; j++)
+                add_byte(b, hdr[j]);
+        }
+
+    // The stream table and the streams
+    for(int i=0; i<=nst; i++)
+    {
+        put24(hdr, pos);
+        for(int j=0; j<3; j++)
+            add_byte(b, hdr[j]);
+        if( i < nst )
+            pos += sb[i].len;
+    }
+    if( pos > 0xFFFFFF )
+        err = -1;
+    for(int i=0; i<nst; i++)
+    {
+        for(int j=0; j<sb[i].len; j++)
+            add_byte(b, sb[i].buf[j]);
+        bf_free(&sb[i]);
+    }
+    if( b->len - base != pos )
+        err = -1;
+    free(sb);
+    free(sid);
+    return err;
+}
+
+int archive_count(const uint8_t *img, int len)
+{
+    if( len < ARCHIVE_HDR_SIZE || !img[0] )
+        return -1;
+    // LZSS parameters, as checked by lzss_opts_check()
+    if( img[1] > 12 || img[2] < 2 || img[1] + img[2] < 8 || img[1] + img[2] > 16 ||
+        img[3] < 1 || img[3] > 16 )
+        return -1;
+    int stbl = get16(img + 4), nst = get16(img + 6);
+    if( stbl < ARCHIVE_HDR_SIZE + ARCHIVE_SONG_SIZE * img[0] ||
+        stbl + 3 * (nst + 1) > len || get24(img + stbl + 3 * nst) != len )
+        return -1;
+    return img[0];
+}
+
+int archive_index(const uint8_t *img, int len, int n, struct archive_song *as)
+{
+    if( n < 0 || n >= archive_count(img, len) )
+        return -1;
+    const uint8_t *e = img + ARCHIVE_HDR_SIZE + ARCHIVE_SONG_SIZE * n;
+    int tbl = get16(e);
+    as->frames = get24(e + 2);
+    as->nchn = e[5];
+    if( (as->nchn != 9 && as->nchn != 18) || tbl + 3 * as->nchn > get16(img + 4) )
+        return -1;
+    for(int i=0; i<as->nchn; i++)
+    {
+        int x = get16(img + tbl + 3 * i);
+        as->stream[i] = x == 0xFFFF ? -1 : x;
+        as->value[i] = img[tbl + 3 * i + 2];
+        if( as->stream[i] >= get16(img + 6) )
+            return -1;
+    }
+    return 0;
+}
+
+int archive_decode(const uint8_t *img, int len, int n, struct sapr *s)
+{
+    struct archive_song as;
+    if( archive_index(img, len, n, &as) || as.frames > SAPR_MAX_FRAMES )
+        return -1;
+
+    struct codec *c = lzss_new(img[1], img[2], img[3], 0, 1);
+    int stbl = get16(img + 4);
+    s->size = as.frames;
+    s->nchn = as.nchn;
+    s->arena = 0;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        s->data[i] = i < as.nchn ? arena_alloc(0, as.frames) : 0;
+        s->xform[i] = 0;
+    }
+
+    // Each stream is decoded as a song with one stream
+    int err = 0;
+    for(int i=0; i<as.nchn && !err; i++)
+    {
+        if( as.stream[i] < 0 )
+        {
+            memset(s->data[i], as.value[i], as.frames);
+            continue;
+        }
+        const uint8_t *t = img + stbl + 3 * as.stream[i];
+        int start = get24(t), end = get24(t + 3);
+        struct sapr one;
+        if( start < stbl || end < start || end > len ||
+            c->ops->decode(c, &one, img + start, end - start, 1) )
+            err = -1;
+        else
+        {
+            if( one.size != as.frames )
+                err = -1;
+            else
+                memcpy(s->data[i], one.data[0], as.frames);
+            sapr_free(&one);
+        }
+    }
+    codec_free(c);
+    if( err )
+        sapr_free(s);
+    return err;
+}
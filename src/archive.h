@@ -0,0 +1,68 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Song archive: many songs compressed in one image, with an index to start
+ * any song without reading the others. Each register stream is compressed
+ * alone, so the streams that are the same in many songs are stored once.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// The archive image, all values little-endian and all offsets from the start
+// of the image:
+//  - number of songs, one byte,
+//  - LZSS parameters: offset bits, length bits and minimum match length,
+//    one byte each, the format is always the current version,
+//  - offset of the stream table and number of stored streams, 16 bit,
+//  - the song index, 6 bytes for each song: offset of the channel table of
+//    the song, 16 bit, number of frames, 24 bit, and number of streams of
+//    the song, 9 or 18,
+//  - the channel tables, 3 bytes for each stream of each song: the stored
+//    stream number, 16 bit, or $FFFF if the stream is constant, and the
+//    value of the constant stream,
+//  - the stream table, the offset of each stored stream, 24 bit, and the
+//    end of the image,
+//  - the stored streams, each one compressed as a song with one stream.
+//    The player counts the frames, but the streams still end in a literal.
+#define ARCHIVE_MAX_SONGS 255
+#define ARCHIVE_MAX_FRAMES 0xFFFFFF
+#define ARCHIVE_SONG_SIZE 6
+#define ARCHIVE_HDR_SIZE 8
+
+struct archive_stats
+{
+    int streams;        // Number of compressed streams in all the songs
+    int stored;         // Number of different compressed streams stored
+    int constant;       // Number of constant streams, only in the index
+    long saved;         // Bytes of the repeated streams not stored
+};
+
+// Index of one song of the archive
+struct archive_song
+{
+    int frames;
+    int nchn;
+    int stream[SAPR_MAX_CHN];   // Stored stream number, -1 if constant
+    int value[SAPR_MAX_CHN];    // Value of the constant streams
+};
+
+// Compresses the songs with the LZSS codec "c" and writes the archive,
+// returns 0 on success or -1 if there are too many songs or frames, or
+// the header does not fit the 16 bit offsets.
+int archive_build(struct codec *c, const struct sapr *songs, int nsongs,
+                  struct bf *b, struct archive_stats *st);
+
+// Returns the number of songs of the archive, or -1 if the header is not
+// valid.
+int archive_count(const uint8_t *img, int len);
+
+// Reads the index of song "n", returns 0 on success.
+int archive_index(const uint8_t *img, int len, int n, struct archive_song *as);
+
+// Decodes song "n" of the archive, returns 0 on success.
+int archive_decode(const uint8_t *img, int len, int n, struct sapr *s);
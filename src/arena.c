@@ -0,0 +1,133 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Arena memory allocator, used to reuse the parsing buffers between songs.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "arena.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK (1024*1024)
+
+struct arena_blk
+{
+    struct arena_blk *next;
+    size_t size;
+    size_t used;
+    uint8_t *data;
+};
+
+void arena_init(struct arena *a)
+{
+    a->blk = 0;
+    a->total = 0;
+    pthread_mutex_init(&a->lock, 0);
+}
+
+static void free_blocks(struct arena_blk *b)
+{
+    while( b )
+    {
+        struct arena_blk *n = b->next;
+        free(b->data);
+        free(b);
+        b = n;
+    }
+}
+
+void arena_free(struct arena *a)
+{
+    free_blocks(a->blk);
+    a->blk = 0;
+    a->total = 0;
+    pthread_mutex_destroy(&a->lock);
+}
+
+static struct arena_blk *new_block(size_t size)
+{
+    struct arena_blk *b = malloc(sizeof(*b));
+    if( b )
+    {
+        b->data = malloc(size);
+        b->size = size;
+        b->used = 0;
+        b->next = 0;
+        if( !b->data )
+        {
+            free(b);
+            b = 0;
+        }
+    }
+    if( !b )
+    {
+        fprintf(stderr, "error: out of memory, can't allocate %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return b;
+}
+
+void arena_reset(struct arena *a)
+{
+    if( !a->blk )
+        return;
+    if( a->blk->next )
+    {
+        // More than one block, replace all with one block of the total size
+        free_blocks(a->blk);
+        a->blk = new_block(a->total);
+    }
+    a->blk->used = 0;
+    a->total = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    if( !a )
+    {
+        void *p = malloc(size ? size : 1);
+        if( !p )
+        {
+            fprintf(stderr, "error: out of memory, can't allocate %zu bytes\n", size);
+            exit(EXIT_FAILURE);
+        }
+        return p;
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    pthread_mutex_lock(&a->lock);
+    if( !a->blk || a->blk->used + size > a->blk->size )
+    {
+        size_t bsize = size > ARENA_MIN_BLOCK ? size : ARENA_MIN_BLOCK;
+        if( a->blk && bsize < a->blk->size * 2 )
+            bsize = a->blk->size * 2;
+        struct arena_blk *b = new_block(bsize);
+        b->next = a->blk;
+        a->blk = b;
+    }
+    void *p = a->blk->data + a->blk->used;
+    a->blk->used += size;
+    a->total += size;
+    pthread_mutex_unlock(&a->lock);
+    return p;
+}
+
+void *arena_calloc(struct arena *a, size_t size)
+{
+    void *p = arena_alloc(a, size);
+    memset(p, 0, size);
+    return p;
+}
+
+void arena_release(struct arena *a, void *p)
+{
+    if( !a )
+        free(p);
+}
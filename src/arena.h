@@ -0,0 +1,37 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Arena memory allocator, used to reuse the parsing buffers between songs.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct arena_blk;
+
+// All the memory allocated from the arena is released at once with
+// arena_reset(), keeping the memory for the next allocations.
+// All functions accept a NULL arena, using normal malloc and free.
+struct arena
+{
+    struct arena_blk *blk;  // List of memory blocks, current first
+    size_t total;           // Total bytes allocated since last reset
+    pthread_mutex_t lock;
+};
+
+void arena_init(struct arena *a);
+// Releases all the memory of the arena to the system
+void arena_free(struct arena *a);
+// Releases all the allocations, keeps one block big enough for all of them
+void arena_reset(struct arena *a);
+
+void *arena_alloc(struct arena *a, size_t size);
+// Allocates zeroed memory
+void *arena_calloc(struct arena *a, size_t size);
+// Frees one allocation, only needed if the arena is NULL
+void arena_release(struct arena *a, void *p);
@@ -0,0 +1,101 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Splitting of the compressed stream in cartridge banks.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "bank.h"
+#include <stdlib.h>
+#include <string.h>
+
+int bank_count(int len, int bank_size)
+{
+    // The table size depends on the number of banks, iterate until stable
+    int n = 1;
+    while( len + 1 + 2 * n > n * bank_size )
+        n++;
+    return n > BANK_MAX ? -1 : n;
+}
+
+int bank_write(const struct bf *x, int bank_size, FILE *out)
+{
+    int n = bank_count(x->len, bank_size);
+    if( n < 0 )
+        return -2;
+
+    uint8_t *img = malloc(bank_size);
+    if( !img )
+        return -1;
+    int pos = 0;
+    for(int b=0; b<n; b++)
+    {
+        int start = 0;
+        memset(img, 0xFF, bank_size);
+        if( !b )
+        {
+            // Bank table
+            int rem = x->len + 1 + 2 * n;
+            img[0] = n;
+            for(int i=0; i<n; i++)
+            {
+                int used = rem < bank_size ? rem : bank_size;
+                img[1 + 2 * i] = used & 0xFF;
+                img[2 + 2 * i] = used >> 8;
+                rem -= used;
+            }
+            start = 1 + 2 * n;
+        }
+        int l = x->len - pos;
+        if( l > bank_size - start )
+            l = bank_size - start;
+        memcpy(img + start, x->buf + pos, l);
+        pos += l;
+        if( 1 != fwrite(img, bank_size, 1, out) )
+        {
+            free(img);
+            return -1;
+        }
+    }
+    free(img);
+    return 0;
+}
+
+uint8_t *bank_read(const uint8_t *img, int len, int bank_size, int *out_len)
+{
+    if( len < 1 || img[0] < 1 || img[0] > BANK_MAX )
+        return 0;
+    int n = img[0];
+    int tsize = 1 + 2 * n;
+
+    // Check the table and get the total size
+    int total = 0;
+    for(int b=0; b<n; b++)
+    {
+        int used = img[1 + 2 * b] | (img[2 + 2 * b] << 8);
+        if( used > bank_size || (!b && used < tsize) || (b && used < 1) ||
+            (b < n - 1 && used != bank_size) ||
+            b * bank_size + used > len )
+            return 0;
+        total += used;
+    }
+    total -= tsize;
+
+    // Copy the used part of each bank
+    uint8_t *data = malloc(total ? total : 1);
+    if( !data )
+        return 0;
+    int pos = 0;
+    for(int b=0; b<n; b++)
+    {
+        int start = b ? 0 : tsize;
+        int used = img[1 + 2 * b] | (img[2 + 2 * b] << 8);
+        memcpy(data + pos, img + b * bank_size + start, used - start);
+        pos += used - start;
+    }
+    *out_len = total;
+    return data;
+}
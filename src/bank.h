@@ -0,0 +1,33 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Splitting of the compressed stream in cartridge banks.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "bitbuf.h"
+
+// The banked image starts with a bank table in the first bank: one byte with
+// the number of banks, followed by the bytes used in each bank as 16 bit
+// little-endian values, counting the table. The compressed stream follows,
+// continuing at the start of each bank, and the last bank is filled with $FF.
+//
+// The player reads the stream linearly, so the flag and half-byte groups
+// of "struct bf" stay the same across the bank boundaries.
+#define BANK_MAX 127
+
+// Returns the number of banks needed for "len" bytes, or -1 if too big.
+int bank_count(int len, int bank_size);
+
+// Writes the buffer split in banks, returns 0 on success, -1 on write error
+// and -2 if the song needs more than BANK_MAX banks.
+int bank_write(const struct bf *x, int bank_size, FILE *out);
+
+// Reads the stream from a banked image, following the bank table as the
+// player does. Returns the stream in a new allocated buffer, or 0 if the
+// bank table is not valid.
+uint8_t *bank_read(const uint8_t *img, int len, int bank_size, int *out_len);
@@ -0,0 +1,197 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Bit encoding functions, shared by all the codecs.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "bitbuf.h"
+#include <stdlib.h>
+#include <string.h>
+
+void bf_init(struct bf *x)
+{
+    x->buf = 0;
+    x->alloc = 0;
+    x->len = 0;
+    x->bnum = 0;
+    x->bpos = -1;
+    x->hpos = -1;
+}
+
+void bf_free(struct bf *x)
+{
+    free(x->buf);
+    bf_init(x);
+}
+
+void bf_reset(struct bf *x)
+{
+    x->len = 0;
+    x->bnum = 0;
+    x->bpos = -1;
+    x->hpos = -1;
+}
+
+void bflush(struct bf *x)
+{
+    x->bnum = 0;
+    x->bpos = -1;
+    x->hpos = -1;
+}
+
+void bflush_bits(struct bf *x)
+{
+    x->bnum = 0;
+    x->bpos = -1;
+}
+
+int bf_write(const struct bf *x, FILE *out)
+{
+    if( x->len && 1 != fwrite(x->buf, x->len, 1, out) )
+        return -1;
+    return 0;
+}
+
+int bf_write_ready(struct bf *x, FILE *out)
+{
+    int n = x->len;
+    if( x->bpos >= 0 && x->bpos < n )
+        n = x->bpos;
+    if( x->hpos >= 0 && x->hpos < n )
+        n = x->hpos;
+    if( n && 1 != fwrite(x->buf, n, 1, out) )
+        return -1;
+    memmove(x->buf, x->buf + n, x->len - n);
+    x->len -= n;
+    if( x->bpos >= 0 )
+        x->bpos -= n;
+    if( x->hpos >= 0 )
+        x->hpos -= n;
+    return 0;
+}
+
+// Adds one byte to the buffer, returns the position
+static int bf_grow(struct bf *x)
+{
+    if( x->len >= x->alloc )
+    {
+        x->alloc = x->alloc ? x->alloc * 2 : 65536;
+        x->buf = realloc(x->buf, x->alloc);
+        if( !x->buf )
+        {
+            fprintf(stderr, "error: out of memory writing output\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    x->buf[x->len] = 0;
+    return x->len++;
+}
+
+void add_bit(struct bf *x, int bit)
+{
+    if( x->bpos < 0 )
+    {
+        // Adds a new byte holding bits
+        x->bpos = bf_grow(x);
+        x->bnum = 0;
+    }
+    if( bit )
+        x->buf[x->bpos] |= 1 << x->bnum;
+    x->bnum++;
+    if( x->bnum == 8 )
+    {
+        x->bpos = -1;
+        x->bnum = 0;
+    }
+}
+
+void add_byte(struct bf *x, int byte)
+{
+    // Grow first, the buffer can move
+    int pos = bf_grow(x);
+    x->buf[pos] = byte;
+}
+
+void add_hbyte(struct bf *x, int hbyte)
+{
+    if( x->hpos < 0 )
+    {
+        // Adds a new byte holding half-bytes
+        x->hpos = bf_grow(x);
+        x->buf[x->hpos] = hbyte & 0x0F;
+    }
+    else
+    {
+        // Fixes last h-byte
+        x->buf[x->hpos] |= hbyte << 4;
+        x->hpos = -1;
+    }
+}
+
+void br_init(struct br *x, const uint8_t *buf, int len)
+{
+    x->buf = buf;
+    x->len = len;
+    x->pos = 0;
+    x->err = 0;
+    br_flush(x);
+}
+
+void br_flush(struct br *x)
+{
+    x->bnum = 8;
+    x->bval = 0;
+    x->hval = -1;
+}
+
+void br_flush_bits(struct br *x)
+{
+    x->bnum = 8;
+    x->bval = 0;
+}
+
+int br_end(const struct br *x)
+{
+    return x->pos >= x->len;
+}
+
+int get_byte(struct br *x)
+{
+    if( x->pos >= x->len )
+    {
+        x->err = 1;
+        return 0;
+    }
+    return x->buf[x->pos++];
+}
+
+int get_bit(struct br *x)
+{
+    if( x->bnum == 8 )
+    {
+        // Reads a new byte holding bits
+        x->bval = get_byte(x);
+        x->bnum = 0;
+    }
+    return (x->bval >> x->bnum++) & 1;
+}
+
+int get_hbyte(struct br *x)
+{
+    if( x->hval < 0 )
+    {
+        // Reads a new byte holding half-bytes
+        x->hval = get_byte(x);
+        return x->hval & 0x0F;
+    }
+    else
+    {
+        int h = x->hval >> 4;
+        x->hval = -1;
+        return h;
+    }
+}
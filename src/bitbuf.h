@@ -0,0 +1,65 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Bit encoding functions, shared by all the codecs.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Output buffer, holds the full compressed file in memory.
+struct bf
+{
+    uint8_t *buf;
+    int len;
+    int alloc;
+    int bnum;
+    int bpos;
+    int hpos;
+};
+
+void bf_init(struct bf *x);
+void bf_free(struct bf *x);
+// Clears the buffer, keeping the allocated memory
+void bf_reset(struct bf *x);
+// Terminates the current bit and half-byte groups, next bits start a new byte
+void bflush(struct bf *x);
+// Terminates only the current bit group
+void bflush_bits(struct bf *x);
+// Writes all the buffer to the file, returns 0 on success
+int bf_write(const struct bf *x, FILE *out);
+// Writes the bytes before the current bit and half-byte groups, that are not
+// modified anymore, and removes them from the buffer. Returns 0 on success.
+int bf_write_ready(struct bf *x, FILE *out);
+
+void add_bit(struct bf *x, int bit);
+void add_byte(struct bf *x, int byte);
+void add_hbyte(struct bf *x, int hbyte);
+
+// Input buffer, reads the bits in the same order as they are written.
+struct br
+{
+    const uint8_t *buf;
+    int len;
+    int pos;
+    int bnum;
+    int bval;
+    int hval;
+    int err;        // Set if reading past the end of the buffer
+};
+
+void br_init(struct br *x, const uint8_t *buf, int len);
+// Terminates the current bit and half-byte groups, as bflush
+void br_flush(struct br *x);
+void br_flush_bits(struct br *x);
+// Returns 1 if all the buffer was read
+int br_end(const struct br *x);
+
+int get_bit(struct br *x);
+int get_byte(struct br *x);
+int get_hbyte(struct br *x);
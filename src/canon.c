@@ -0,0 +1,302 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Canonical form of the inaudible register values.
+ *
+ * The read loop already simplifies each AUDC value alone, here the other
+ * registers are used to detect the values that can't be heard: the AUDF of
+ * silent or volume-only channels, and the AUDCTL bits that don't change any
+ * channel playing. Those values are replaced so the matches are longer.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "canon.h"
+#include "xform.h"
+#include <stdlib.h>
+#include <string.h>
+
+// AUDCTL bits
+#define CTL_POLY9  0x80
+#define CTL_CH1HI  0x40
+#define CTL_CH3HI  0x20
+#define CTL_JOIN12 0x10
+#define CTL_JOIN34 0x08
+#define CTL_HP13   0x04
+#define CTL_HP24   0x02
+#define CTL_15KHZ  0x01
+
+// Candidate fills for the inaudible bits
+enum canon_fill
+{
+    CF_NONE = 0,    // Keep the values
+    CF_HOLD,        // Value of the previous frame
+    CF_MATCH,       // Extend the longest match
+    CF_COUNT
+};
+static const char *fill_names[CF_COUNT] = { "none", "hold", "match" };
+
+// Calculates the audible bits of the 9 registers of one POKEY
+static void pokey_care(const uint8_t r[9], uint8_t care[9])
+{
+    int ctl = r[8];
+    int act[4], tone[4], need[4];
+    for(int k=0; k<4; k++)
+    {
+        int audc = r[2*k+1];
+        act[k] = (audc & 0x0F) != 0;
+        tone[k] = act[k] && !(audc & 0x10);
+        need[k] = tone[k];
+    }
+    // The high-pass filters are clocked by channels 3 and 4, also with the
+    // volume-only mode
+    if( (ctl & CTL_HP13) && act[0] )
+        need[2] = 1;
+    if( (ctl & CTL_HP24) && act[1] )
+        need[3] = 1;
+    // Joined channels use the AUDF of the low channel
+    if( (ctl & CTL_JOIN12) && need[1] )
+        need[0] = 1;
+    if( (ctl & CTL_JOIN34) && need[3] )
+        need[2] = 1;
+
+    int cm = 0;
+    if( need[0] )
+        cm |= CTL_CH1HI;
+    if( need[2] )
+        cm |= CTL_CH3HI;
+    if( act[0] || act[1] )
+        cm |= CTL_JOIN12;
+    if( act[2] || act[3] )
+        cm |= CTL_JOIN34;
+    if( act[0] )
+        cm |= CTL_HP13;
+    if( act[1] )
+        cm |= CTL_HP24;
+    // Base clock, for the channels not clocked at 1.79MHz
+    if( (need[0] && !(ctl & CTL_CH1HI)) ||
+        (need[1] && !((ctl & CTL_JOIN12) && (ctl & CTL_CH1HI))) ||
+        (need[2] && !(ctl & CTL_CH3HI)) ||
+        (need[3] && !((ctl & CTL_JOIN34) && (ctl & CTL_CH3HI))) )
+        cm |= CTL_15KHZ;
+    // Polynomial counter, for the channels with 17 bit noise
+    for(int k=0; k<4; k++)
+        if( tone[k] && !(r[2*k+1] & 0x60) )
+            cm |= CTL_POLY9;
+
+    for(int k=0; k<4; k++)
+    {
+        care[2*k] = need[k] ? 0xFF : 0;
+        care[2*k+1] = 0xFF;
+    }
+    care[8] = cm;
+}
+
+// Gets the registers of the POKEY of stream "chn" at "frame"
+static void pokey_regs(const struct sapr *s, int chn, int frame, uint8_t r[9])
+{
+    int p = chn - chn % 9;
+    for(int i=0; i<9; i++)
+        r[i] = s->data[p+i][frame];
+}
+
+uint8_t canon_care(const struct sapr *s, int chn, int frame)
+{
+    uint8_t r[9], care[9];
+    pokey_regs(s, chn, frame, r);
+    pokey_care(r, care);
+    return care[chn % 9];
+}
+
+int canon_verify(const struct sapr *a, const struct sapr *b)
+{
+    if( a->nchn != b->nchn || a->size != b->size )
+        return 0;
+    for(int j=0; j<a->size; j++)
+        for(int p=0; p<a->nchn; p+=9)
+        {
+            uint8_t ra[9], rb[9], ca[9], cb[9];
+            pokey_regs(a, p, j, ra);
+            pokey_regs(b, p, j, rb);
+            pokey_care(ra, ca);
+            pokey_care(rb, cb);
+            for(int i=0; i<9; i++)
+                if( ca[i] != cb[i] || ((ra[i] ^ rb[i]) & ca[i]) )
+                    return j;
+        }
+    return -1;
+}
+
+// Value with the audible bits of "val" and the other bits of "fill"
+static uint8_t merge(uint8_t val, uint8_t fill, uint8_t care)
+{
+    return (val & care) | (fill & ~care);
+}
+
+// Fills the inaudible bits with the value of the previous frame
+static void fill_hold(const uint8_t *d, const uint8_t *care, uint8_t *out, int size)
+{
+    for(int j=0; j<size; j++)
+        out[j] = j ? merge(d[j], out[j-1], care[j]) : d[j];
+}
+
+// Fills the inaudible bits extending the longest match at each position,
+// using a window of "max_off" bytes and matches up to "max_len".
+static void fill_match(const uint8_t *d, const uint8_t *care, uint8_t *out, int size,
+                       int max_off, int max_len)
+{
+    int pos = 0;
+    while( pos < size )
+    {
+        // Search the longest match, the inaudible bits match any value
+        int best = 0, best_off = 0;
+        for(int off=1; off<=max_off && off<=pos; off++)
+        {
+            int l = 0;
+            while( l < max_len && pos + l < size )
+            {
+                // The source can be inside the match, already filled
+                int q = pos + l;
+                uint8_t src = out[q - off];
+                if( (src ^ d[q]) & care[q] )
+                    break;
+                out[q] = merge(d[q], src, care[q]);
+                l++;
+            }
+            if( l > best )
+            {
+                best = l;
+                best_off = off;
+            }
+        }
+        if( best < 2 )
+        {
+            out[pos] = pos ? merge(d[pos], out[pos-1], care[pos]) : d[pos];
+            pos++;
+            continue;
+        }
+        // Store the best match
+        for(int l=0; l<best; l++, pos++)
+            out[pos] = merge(d[pos], out[pos - best_off], care[pos]);
+    }
+}
+
+int canon_song(struct codec *c, struct sapr *s, FILE *out, int level)
+{
+    int sz = s->size, nchn = s->nchn;
+    if( !sz )
+        return 0;
+
+    // Audible bits of all the streams, from the original song
+    struct sapr orig = *s;
+    uint8_t *care[SAPR_MAX_CHN];
+    for(int i=0; i<nchn; i++)
+        care[i] = arena_alloc(s->arena, sz);
+    for(int j=0; j<sz; j++)
+        for(int p=0; p<nchn; p+=9)
+        {
+            uint8_t r[9], cr[9];
+            pokey_regs(s, p, j, r);
+            pokey_care(r, cr);
+            for(int i=0; i<9; i++)
+                care[p+i][j] = cr[i];
+        }
+
+    // Fill each stream with all the candidates and parse. If the format has
+    // stream transforms, use the best transform of each candidate, the XOR
+    // transform uses the same candidate for the other stream.
+    int max_len = c->max_mlen ? c->max_mlen : 256;
+    int bits[CF_COUNT][SAPR_MAX_CHN];
+    uint8_t *fill[CF_COUNT][SAPR_MAX_CHN];
+    uint8_t *tmp = c->xform ? arena_alloc(s->arena, sz * nchn) : 0;
+    for(int cf=0; cf<CF_COUNT; cf++)
+    {
+        for(int i=0; i<nchn; i++)
+        {
+            bits[cf][i] = -1;
+            fill[cf][i] = s->data[i];
+            if( cf == CF_HOLD )
+            {
+                fill[cf][i] = arena_alloc(s->arena, sz);
+                fill_hold(s->data[i], care[i], fill[cf][i], sz);
+            }
+            else if( cf == CF_MATCH )
+            {
+                fill[cf][i] = arena_alloc(s->arena, sz);
+                fill_match(s->data[i], care[i], fill[cf][i], sz, c->max_off, max_len);
+            }
+        }
+        for(int xf=XF_NONE; xf<XF_COUNT; xf++)
+        {
+            if( xf != XF_NONE && !c->xform )
+                continue;
+            struct sapr t = *s;
+            int skip[SAPR_MAX_CHN];
+            void *st[SAPR_MAX_CHN];
+            for(int i=0; i<nchn; i++)
+                t.data[i] = fill[cf][i];
+            for(int i=0; i<SAPR_MAX_CHN; i++)
+            {
+                skip[i] = i >= nchn;
+                if( skip[i] || xf == XF_NONE )
+                    continue;
+                // Streams without the transform are parsed again untransformed
+                if( xform_apply(&t, i, xf, tmp + i * sz) )
+                    memcpy(tmp + i * sz, fill[cf][i], sz);
+            }
+            if( xf != XF_NONE )
+                for(int i=0; i<nchn; i++)
+                    t.data[i] = tmp + i * sz;
+            codec_parse(&c, 1, &t, skip, st);
+            for(int i=0; i<nchn; i++)
+            {
+                int b = c->ops->parse_bits(st[i], 0);
+                if( bits[cf][i] < 0 || b < bits[cf][i] )
+                    bits[cf][i] = b;
+            }
+            codec_parse_free(&c, 1, st);
+        }
+    }
+    if( tmp )
+        arena_release(s->arena, tmp);
+
+    // Select the best fill for each stream
+    int gain[CF_COUNT] = { 0 }, count[CF_COUNT] = { 0 }, changed = 0;
+    for(int i=0; i<nchn; i++)
+    {
+        int best = CF_NONE;
+        for(int cf=1; cf<CF_COUNT; cf++)
+            if( bits[cf][i] < bits[best][i] )
+                best = cf;
+        for(int j=0; j<sz; j++)
+            changed += fill[best][i][j] != s->data[i][j];
+        s->data[i] = fill[best][i];
+        gain[best] += bits[CF_NONE][i] - bits[best][i];
+        count[best]++;
+        if( level > 1 && best != CF_NONE )
+            fprintf(out," Stream #%d: %s fill, %d bits saved\n", i, fill_names[best],
+                    bits[CF_NONE][i] - bits[best][i]);
+    }
+
+    // Verify and release the unused buffers
+    int err = canon_verify(&orig, s);
+    if( err >= 0 )
+        fprintf(stderr, "canonical form: internal error, frame %d sounds different\n", err);
+    for(int i=0; i<nchn; i++)
+    {
+        for(int cf=0; cf<CF_COUNT; cf++)
+            if( fill[cf][i] != s->data[i] )
+                arena_release(s->arena, fill[cf][i]);
+        arena_release(s->arena, care[i]);
+    }
+    if( level )
+    {
+        fprintf(out,"Canonical: %d values changed, verified, ", changed);
+        for(int cf=1; cf<CF_COUNT; cf++)
+            fprintf(out,"%s fill %d streams %d bytes saved%s", fill_names[cf], count[cf],
+                    gain[cf] / 8, cf < CF_COUNT - 1 ? ", " : "\n");
+    }
+    return err >= 0 ? -1 : 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Canonical form of the inaudible register values.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// Returns the bits of the value of stream "chn" at "frame" that change the
+// sound, the other bits can have any value. Depends only on the audible bits
+// of the other registers of the same POKEY.
+uint8_t canon_care(const struct sapr *s, int chn, int frame);
+
+// Compares the audible bits of two songs, returns the first frame that
+// sounds different, or -1 if both sound the same.
+int canon_verify(const struct sapr *a, const struct sapr *b);
+
+// Replaces the inaudible bits of each stream with the values that give the
+// smallest parse with the codec, and verifies that the song sounds the
+// same. Shows the changes if "level" > 0. Returns 0 on success.
+int canon_song(struct codec *c, struct sapr *s, FILE *out, int level);
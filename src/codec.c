@@ -0,0 +1,364 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Codec front-end: presets and parallel parsing of the streams.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Minimum size of each part when parsing one stream in parts
+#define SPLIT_MIN_PART 4096
+
+const char *codec_preset_names = "lzss-8,lzss-2,lzss-6,lz4s,mask,mask-lz,pool-2,pool-6,pair-6";
+const char *codec_decoder_names = "lzss-8,lzss-2,lzss-6,mask,mask-lz,pool-2,pool-6,pair-6";
+static int parse_threads = 1;
+static int split_threads = 0;
+
+void codec_set_threads(int enable)
+{
+    parse_threads = enable;
+}
+
+void codec_set_split(int nthreads)
+{
+    split_threads = nthreads;
+}
+
+
+struct codec *codec_preset(const char *name, int format_version, int force_last_literal)
+{
+    struct codec *c = 0;
+    if( !strcmp(name, "lzss-8") )
+        c = lzss_new(4, 4, 2, format_version, force_last_literal);
+    else if( !strcmp(name, "lzss-2") )
+        c = lzss_new(7, 5, 2, format_version, force_last_literal);
+    else if( !strcmp(name, "lzss-6") )
+        c = lzss_new(8, 8, 1, format_version, force_last_literal);
+    else if( !strcmp(name, "lz4s") )
+        c = lz4s_new(8, 255, 255);
+    else if( !strcmp(name, "mask") )
+        c = mask_new(0);
+    else if( !strcmp(name, "mask-lz") )
+        c = mask_new(1);
+    else if( !strcmp(name, "pool-2") )
+        c = pool_new(7);
+    else if( !strcmp(name, "pool-6") )
+        c = pool_new(8);
+    else if( !strcmp(name, "pair-6") )
+        c = pair_new(8);
+    if( c )
+        snprintf(c->name, sizeof(c->name), "%s", name);
+    return c;
+}
+
+void codec_free(struct codec *c)
+{
+    if( c )
+        c->ops->free(c);
+}
+
+const char *codec_player(const struct codec *c, const struct sapr *s)
+{
+    const char *p = s->nchn > 9 ? c->player2 : c->player;
+    return p ? p : "-";
+}
+
+// Parses one stream with all the codecs
+struct parse_job
+{
+    struct codec **c;
+    int nc;
+    const uint8_t *data;
+    int size;
+    int start;      // First position to parse
+    struct arena *arena;
+    void **st;      // Parser states, one for each codec
+    int stride;     // Separation of states in the array
+};
+
+static void *parse_thread(void *arg)
+{
+    struct parse_job *j = arg;
+    int max_off = 0;
+    for(int n=0; n<j->nc; n++)
+    {
+        j->st[n * j->stride] = j->c[n]->ops->parse_new(j->c[n], j->data, j->size,
+                                                             j->arena);
+        if( j->c[n]->max_off > max_off )
+            max_off = j->c[n]->max_off;
+    }
+
+    struct mrun m;
+    mrun_init(&m, j->data, j->size, max_off);
+    while( m.pos > j->start )
+    {
+        mrun_step(&m);
+        for(int n=0; n<j->nc; n++)
+            j->c[n]->ops->parse_pos(j->c[n], j->st[n * j->stride], &m);
+    }
+    mrun_free(&m);
+    return 0;
+}
+
+// Parses the streams split in parts. Each part runs the match finder from
+// "max_mlen" bytes after the end of the part, so the match lengths are the
+// same as going from the end of the stream. The matches of all the parts are
+// found in parallel, and then each stream is parsed from the stored matches.
+struct split_part
+{
+    int chn;
+    int start;
+    int end;
+};
+
+struct split_parse
+{
+    struct codec **c;
+    int nc;
+    struct parse_job *job;
+    struct split_part *part;
+    int npart;
+    int max_off;
+    int max_mlen;
+    int next;       // Next work item of the current phase
+    int nwork;      // Number of work items of the current phase
+    int phase;      // 0 = find matches of each part, 1 = parse each stream
+    pthread_mutex_t lock;
+};
+
+static void split_match(struct split_parse *sp, const struct split_part *pt)
+{
+    struct parse_job *j = &sp->job[pt->chn];
+    struct mrun m;
+    mrun_init(&m, j->data, j->size, sp->max_off);
+    if( pt->end + sp->max_mlen < j->size )
+        m.pos = pt->end + sp->max_mlen;
+    while( m.pos > pt->start )
+    {
+        mrun_step(&m);
+        if( m.pos < pt->end )
+            for(int n=0; n<sp->nc; n++)
+                sp->c[n]->ops->parse_match(sp->c[n], j->st[n * j->stride], &m);
+    }
+    mrun_free(&m);
+}
+
+static void *split_thread(void *arg)
+{
+    struct split_parse *sp = arg;
+    for(;;)
+    {
+        pthread_mutex_lock(&sp->lock);
+        int w = sp->next++;
+        pthread_mutex_unlock(&sp->lock);
+        if( w >= sp->nwork )
+            return 0;
+        if( sp->phase == 0 )
+            split_match(sp, &sp->part[w]);
+        else
+        {
+            struct parse_job *j = &sp->job[sp->part[w].chn];
+            for(int n=0; n<sp->nc; n++)
+                sp->c[n]->ops->parse_range(sp->c[n], j->st[n * j->stride], j->start);
+        }
+    }
+}
+
+// Runs the work items of the current phase in "nthreads" threads
+static void split_run(struct split_parse *sp, int nwork, int nthreads)
+{
+    pthread_t th[nthreads];
+    int started[nthreads];
+    sp->next = 0;
+    sp->nwork = nwork;
+    for(int t=1; t<nthreads; t++)
+        started[t] = (0 == pthread_create(&th[t], 0, split_thread, sp));
+    split_thread(sp);
+    for(int t=1; t<nthreads; t++)
+        if( started[t] )
+            pthread_join(th[t], 0);
+}
+
+static void split_parse(struct codec **c, int nc, struct parse_job *job,
+                        const int chn_skip[SAPR_MAX_CHN], int nchn, int nthreads)
+{
+    struct split_parse sp;
+    sp.c = c;
+    sp.nc = nc;
+    sp.job = job;
+    sp.max_off = 0;
+    sp.max_mlen = 0;
+    for(int n=0; n<nc; n++)
+    {
+        if( c[n]->max_off > sp.max_off )
+            sp.max_off = c[n]->max_off;
+        if( c[n]->max_mlen > sp.max_mlen )
+            sp.max_mlen = c[n]->max_mlen;
+    }
+
+    // Split the streams in about four parts for each thread
+    int nstream = 0, len = 0;
+    for(int i=0; i<nchn; i++)
+        if( !chn_skip[i] )
+        {
+            nstream++;
+            len = job[i].size - job[i].start;
+        }
+    int psize = (int)(((long)len * nstream + 4 * nthreads - 1) / (4 * nthreads));
+    if( psize < SPLIT_MIN_PART )
+        psize = SPLIT_MIN_PART;
+    sp.part = malloc(sizeof(struct split_part) * nstream * (len / psize + 1));
+    sp.npart = 0;
+    for(int i=0; i<nchn; i++)
+    {
+        if( chn_skip[i] )
+            continue;
+        for(int n=0; n<nc; n++)
+            job[i].st[n * job[i].stride] = c[n]->ops->parse_new(c[n], job[i].data,
+                                                                 job[i].size, job[i].arena);
+        for(int p=job[i].start; p<job[i].size; p+=psize)
+        {
+            struct split_part *pt = &sp.part[sp.npart++];
+            pt->chn = i;
+            pt->start = p;
+            pt->end = p + psize < job[i].size ? p + psize : job[i].size;
+        }
+    }
+
+    pthread_mutex_init(&sp.lock, 0);
+    // Find the matches of all the parts
+    sp.phase = 0;
+    split_run(&sp, sp.npart, nthreads);
+    // Parse each stream, using the first part of each one as the work item
+    int np = 0;
+    for(int w=0; w<sp.npart; w++)
+        if( !w || sp.part[w].chn != sp.part[w-1].chn )
+            sp.part[np++] = sp.part[w];
+    sp.phase = 1;
+    split_run(&sp, np, nthreads < np ? nthreads : np);
+    pthread_mutex_destroy(&sp.lock);
+    free(sp.part);
+}
+
+// Returns the number of threads to parse in parts, or 0 to parse each stream
+// in one part.
+static int split_count(struct codec **c, int nc, int len)
+{
+    int nthreads = split_threads;
+    if( nthreads <= 0 )
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if( nthreads <= 1 || len < 2 * SPLIT_MIN_PART )
+        return 0;
+    for(int n=0; n<nc; n++)
+        if( !c[n]->ops->parse_match || !c[n]->ops->parse_range )
+            return 0;
+    return nthreads;
+}
+
+int codec_parse_range(struct codec **c, int nc, const struct sapr *s,
+                      const int chn_skip[SAPR_MAX_CHN], int start, int len, void **st)
+{
+    struct parse_job job[SAPR_MAX_CHN];
+    pthread_t th[SAPR_MAX_CHN];
+    int started[SAPR_MAX_CHN];
+
+    // Include the data before start that is inside the match window
+    int hist = 0;
+    for(int n=0; n<nc; n++)
+        if( c[n]->max_off > hist )
+            hist = c[n]->max_off;
+    if( hist > start )
+        hist = start;
+
+    int nstreams = 0;
+    for(int i=0; i<s->nchn; i++)
+        nstreams += !chn_skip[i];
+    for(int n=0; n<nc; n++)
+        c[n]->nstreams = nstreams;
+
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        for(int n=0; n<nc; n++)
+            st[n*SAPR_MAX_CHN+i] = 0;
+        started[i] = 0;
+        if( i >= s->nchn )
+            continue;
+        job[i].c = c;
+        job[i].nc = nc;
+        job[i].data = s->data[i] + start - hist;
+        job[i].size = hist + len;
+        job[i].start = hist;
+        job[i].arena = s->arena;
+        job[i].st = st + i;
+        job[i].stride = SAPR_MAX_CHN;
+    }
+
+    // Split long streams in parts if there are many CPUs
+    int nsplit = split_count(c, nc, len);
+    if( nsplit )
+    {
+        split_parse(c, nc, job, chn_skip, s->nchn, nsplit);
+        return hist;
+    }
+
+    // Start one thread for each stream, parse in this thread if we can't
+    for(int i=0; i<s->nchn; i++)
+        if( !chn_skip[i] )
+        {
+            if( parse_threads && 0 == pthread_create(&th[i], 0, parse_thread, &job[i]) )
+                started[i] = 1;
+            else
+                parse_thread(&job[i]);
+        }
+
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+        if( started[i] )
+            pthread_join(th[i], 0);
+    return hist;
+}
+
+void codec_parse(struct codec **c, int nc, const struct sapr *s,
+                 const int chn_skip[SAPR_MAX_CHN], void **st)
+{
+    codec_parse_range(c, nc, s, chn_skip, 0, s->size, st);
+}
+
+void codec_parse_free(struct codec **c, int nc, void **st)
+{
+    for(int n=0; n<nc; n++)
+        for(int i=0; i<SAPR_MAX_CHN; i++)
+            if( st[n*SAPR_MAX_CHN+i] )
+            {
+                c[n]->ops->parse_free(st[n*SAPR_MAX_CHN+i]);
+                st[n*SAPR_MAX_CHN+i] = 0;
+            }
+}
+
+int codec_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                 const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN])
+{
+    c->ops->encode(c, b, s, chn_skip, st);
+    bflush(b);
+    return b->len;
+}
+
+void codec_stream_stats(const struct codec *c, FILE *out, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total)
+{
+    int sz = s->size;
+    for(int i=0; i<s->nchn; i++)
+        if( !chn_skip[i] )
+        {
+            int bits = c->ops->parse_bits(st[i], 0);
+            fprintf(out," Stream #%d: %d bits,\t%5.2f%%,\t%5.2f%% of output\n", i,
+                    bits, (100.0*bits) / (8.0*sz), (100.0*bits)/(8.0*total) );
+        }
+}
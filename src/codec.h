@@ -0,0 +1,158 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Codec backend interface.
+ *
+ * A codec parses each register stream of the song using the shared match
+ * finder, and then writes the compressed song from the parsed streams. The
+ * front-end reads the song once and can run many codecs over it in one pass.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "bitbuf.h"
+#include "match.h"
+#include "sapr.h"
+
+struct codec;
+
+struct codec_ops
+{
+    // Allocates the parser state for one stream, using the memory arena
+    void *(*parse_new)(const struct codec *c, const uint8_t *data, int size,
+                       struct arena *a);
+    // Parses the current position of the match finder, called for each
+    // position from the end of the stream to the start.
+    void (*parse_pos)(const struct codec *c, void *st, const struct mrun *m);
+    // Returns the number of bits needed to encode the parsed stream from the
+    // given position to the end
+    int (*parse_bits)(const void *st, int pos);
+    void (*parse_free)(void *st);
+    // Optional, to parse long streams in parts in parallel. The first only
+    // stores the match at the match finder position, and can be called for
+    // the positions in any order; the match lengths are only valid up to
+    // "max_mlen". The second then parses from the stored matches, the same as
+    // calling parse_pos() from the end of the stream to "start".
+    void (*parse_match)(const struct codec *c, void *st, const struct mrun *m);
+    void (*parse_range)(const struct codec *c, void *st, int start);
+    // Writes the compressed song from the parsed streams
+    void (*encode)(struct codec *c, struct bf *b, const struct sapr *s,
+                   const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN]);
+    // Writes compression statistics of the last encoded song
+    void (*stats)(const struct codec *c, FILE *out, const struct sapr *s,
+                  const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total, int level);
+    // Decodes a compressed song with "nchn" streams, NULL if the codec has
+    // no decoder. Returns 0 on success.
+    int (*decode)(const struct codec *c, struct sapr *s, const uint8_t *buf,
+                  int len, int nchn);
+    // Writes the source of a player specialised for the last encoded song,
+    // that includes "song_file", and shows the savings against the generic
+    // player. NULL if not available, returns 0 on success.
+    int (*write_player)(const struct codec *c, FILE *f, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN],
+                        const char *song_file, FILE *out);
+    void (*free)(struct codec *c);
+};
+
+struct codec
+{
+    const struct codec_ops *ops;
+    char name[32];      // Codec name, including the parameters
+    const char *player; // Player source for this codec, or NULL if none.
+    const char *player2;// Player source for two POKEY chips, or NULL if none.
+    int max_off;        // Match window needed from the match finder
+    int max_mlen;       // Longest match used, only needed with parse_match
+    int xform;          // The format stores stream transforms, the song must
+                        // be transformed with xform_select() before parsing.
+    FILE *msg;          // Warnings of the encoder, stderr if NULL
+    int nstreams;       // Streams not skipped of the song being parsed, set by
+                        // codec_parse_range(), 0 if not known.
+    void *priv;         // Codec parameters and statistics
+};
+
+// LZSS codec, see "lzss -h" for the parameters.
+struct codec *lzss_new(int bits_moff, int bits_mlen, int min_mlen,
+                       int format_version, int force_last_literal);
+// LZ4S codec, see "lz4s -h" for the parameters.
+struct codec *lz4s_new(int bits_moff, int max_mlen, int max_llen);
+// Change-mask codec, stores the changed registers of each frame. With "lz"
+// the result is compressed as one LZSS stream.
+struct codec *mask_new(int lz);
+// Shared pool codec, LZSS with a history of 2^bits_moff frames for each
+// stream, and matches from the history of any stream.
+struct codec *pool_new(int bits_moff);
+// Paired register codec, LZSS with 2^bits_moff frames of history, joining
+// the pairs of registers that compress better as one stream of 16 bit values.
+struct codec *pair_new(int bits_moff);
+
+// LZSS command line options, shared by all the programs accepting them
+struct lzss_opts
+{
+    int bits_moff;          // Number of bits used for OFFSET
+    int bits_mlen;          // Number of bits used for MATCH
+    int bits_mtotal;        // Total number of bits
+    int bits_set;           // Which of the above were given
+    int min_mlen;           // Minimum match length
+    int force_last_literal;
+    int format_version;     // LZSS format version - 0 means last version,
+                            // 2 is with the transform of each stream, 3 is
+                            // with the number of frames in the header, 4 is
+                            // with variable length matches, 5 is with the
+                            // flag bits of each frame in one field
+    int format_set;         // Number of format options given
+};
+// Option characters for getopt
+#define LZSS_OPTS "o:l:m:b:826exTnVg"
+
+void lzss_opts_init(struct lzss_opts *o);
+// Processes one option, returns 1 if it is an LZSS option
+int lzss_opts_set(struct lzss_opts *o, int opt, const char *arg);
+// Calculates the match bits, returns an error message or NULL if valid
+const char *lzss_opts_check(struct lzss_opts *o);
+struct codec *lzss_opts_codec(const struct lzss_opts *o);
+
+// Returns a codec with one of the standard presets, NULL if the name is not
+// valid. The format options only apply to the LZSS presets.
+struct codec *codec_preset(const char *name, int format_version, int force_last_literal);
+// Comma separated list of all the presets
+extern const char *codec_preset_names;
+// Comma separated list of the presets with a decoder
+extern const char *codec_decoder_names;
+
+void codec_free(struct codec *c);
+// Returns the player source for the song, or "-" if there is no player.
+const char *codec_player(const struct codec *c, const struct sapr *s);
+
+// Parses all the streams of the song with all the codecs, sharing one match
+// finder per stream. The streams are processed in parallel. The parser state
+// for codec "n" and stream "i" is returned in st[n*SAPR_MAX_CHN+i], NULL for the
+// skipped streams.
+void codec_parse(struct codec **c, int nc, const struct sapr *s,
+                 const int chn_skip[SAPR_MAX_CHN], void **st);
+void codec_parse_free(struct codec **c, int nc, void **st);
+
+// Parses only "len" frames from "start", as if the song ended there. The
+// parser states hold the data from some frames before "start", so matches
+// can reference the previous data; returns the position of "start" in the
+// parser states.
+int codec_parse_range(struct codec **c, int nc, const struct sapr *s,
+                      const int chn_skip[SAPR_MAX_CHN], int start, int len, void **st);
+
+// Writes the compressed song to the buffer, returns the size in bytes.
+int codec_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                 const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN]);
+
+// Writes the compressed size of each stream
+void codec_stream_stats(const struct codec *c, FILE *out, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total);
+
+// Enables or disables parsing each stream in a separate thread, the default
+// is enabled.
+void codec_set_threads(int enable);
+// Number of threads used to parse the long streams in parts, 0 uses one for
+// each CPU, the default, and 1 disables it. The result is the same as parsing
+// each stream in one part.
+void codec_set_split(int nthreads);
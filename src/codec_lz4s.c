@@ -0,0 +1,296 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * This implementa an optimal (modified) LZ4 compressor for the SAP-R music
+ * files.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec.h"
+#include <stdlib.h>
+
+///////////////////////////////////////////////////////
+// LZ4S compression functions
+struct lz4s
+{
+    int bits_moff;      // Number of bits used for OFFSET
+    int min_mlen;       // Minimum match length
+    int max_mlen;       // Maximum match length (unlimited in LZ4)
+    int max_llen;       // Maximum literal length (unlimited in LZ4)
+    int max_off;        // Maximum offset
+};
+
+// Struct for LZ4 optimal parsing
+struct lzop
+{
+    const uint8_t *data;// The data to compress
+    int size;           // Data size
+    int *bits;          // Number of bits needed to code from position
+    int *mlen;          // Match/literal length at position, >0 match, <0 literal.
+    int *mpos;          // Best match offset at position
+    struct arena *arena;// Memory for the arrays
+    int in_literal;     // Inside match during encoding
+};
+
+static void *lzop_new(const struct codec *c, const uint8_t *data, int size,
+                      struct arena *a)
+{
+    struct lzop *lz = arena_alloc(a, sizeof(*lz));
+    lz->arena = a;
+    lz->data = data;
+    lz->size = size;
+    lz->bits = arena_alloc(a, sizeof(int) * (size + 1));
+    lz->mlen = arena_alloc(a, sizeof(int) * (size + 1));
+    lz->mpos = arena_alloc(a, sizeof(int) * (size + 1));
+    lz->in_literal = 0;
+    return lz;
+}
+
+static void lzop_free(void *st)
+{
+    struct lzop *lz = st;
+    arena_release(lz->arena, lz->bits);
+    arena_release(lz->arena, lz->mlen);
+    arena_release(lz->arena, lz->mpos);
+    arena_release(lz->arena, lz);
+}
+
+static int lzop_bits(const void *st, int pos)
+{
+    const struct lzop *lz = st;
+    return pos < lz->size ? lz->bits[pos] : 0;
+}
+
+// Returns the cost of writing this length
+static int mlen_cost(const struct lz4s *p, int l)
+{
+    int n = 0;
+    if( l > p->max_mlen )
+        return 1<<30; // Infinite cost
+    if( l < 15 )
+        return n;
+    l -= 15;
+    while( l > 255 )
+    {
+        l -= 255;
+        n++;
+    }
+    return 8*(n+1);
+}
+
+// Returns the *extra* cost of writing this length
+static int llen_cost(const struct lz4s *p, int l)
+{
+    if( l >= p->max_llen )
+        return 24; // Encode a "bad match"
+    if( l == 1 )
+        return 8;
+    l -= 15;
+    while( l > 0 )
+        l -= 255;
+    return l ? 0 : 8;
+}
+
+// Calculate optimal encoding at the match finder position, must be called
+// for all positions from the end of stream.
+static void lzop_parse_pos(const struct codec *c, void *st, const struct mrun *m)
+{
+    const struct lz4s *p = c->priv;
+    struct lzop *lz = st;
+    int pos = m->pos;
+
+    // Initialize last positions of the array
+    if( pos == lz->size - 1 )
+    {
+        lz->bits[lz->size-1] = 8;
+        lz->mlen[lz->size-1] = -1;
+        lz->bits[lz->size] = 0;
+        lz->mlen[lz->size] = 0;
+        return;
+    }
+
+    // Get best match at this position
+    int mp = 0;
+    int ml = mrun_match(m, p->max_off, p->max_mlen, lz->size, &mp);
+
+    // Init "no-match" case
+    int llen = lz->mlen[pos+1] > 0 ? 1 : 1 - lz->mlen[pos+1];
+    int best = lz->bits[pos+1] + 8 + llen_cost(p, llen);
+
+    // Check all posible match lengths, store best
+    lz->bits[pos] = best;
+    lz->mpos[pos] = mp;
+    lz->mlen[pos] = -llen;
+    for(int l=p->min_mlen; l<=ml; l++)
+    {
+        int b = lz->bits[pos+l] + (p->bits_moff>8?16:8) + mlen_cost(p, l-2);
+        if( lz->mlen[pos+l] > 0 )
+            b += 8;
+        if( b <= best )
+        {
+            best = b;
+            lz->bits[pos] = best;
+            lz->mlen[pos] = l;
+            lz->mpos[pos] = mp;
+        }
+    }
+}
+
+static void encode_len(struct bf *b, int len, int max)
+{
+    add_hbyte(b, len < 15 ? len : 15);
+    if( max < 16 || len < 15 )
+        return;
+    if( max >= 256 )
+    {
+        len -= 15;
+        max -= 15;
+    }
+    add_byte(b, len < 255 ? len : 255);
+    while( len >= 255 && max > 255 )
+    {
+        len -= 255;
+        max -= 255;
+        add_byte(b, len);
+    }
+}
+
+static int lzop_encode(const struct lz4s *p, struct bf *b, struct lzop *lz, int pos, int lpos)
+{
+    if( pos <= lpos )
+    {
+        if( lz->in_literal )
+        {
+//            fprintf(stderr,"L.: %02x\n", lz->data[pos]);
+            add_byte(b, lz->data[pos]);
+        }
+        return lpos;
+    }
+
+    int mlen = lz->mlen[pos];
+    int mpos = lz->mpos[pos];
+
+    // Encode best from filled table
+    if( mlen < p->min_mlen )
+    {
+        // No match, just encode the byte
+        mlen = -mlen;
+        if( mlen > p->max_llen )
+            mlen = p->max_llen;
+//        fprintf(stderr,"L[%d]: %02x\n", mlen, lz->data[pos]);
+        if( lz->in_literal )
+        {
+            // Already on literal - encode a zero length match to terminate
+            add_hbyte(b, 15);
+            add_byte(b, 0);
+        }
+        // Encode new literal count
+        encode_len(b, mlen, p->max_llen);
+        // And first literal
+        add_byte(b, lz->data[pos]);
+        lz->in_literal = 1;
+    }
+    else
+    {
+        int code_pos = (pos - 1 - mpos) & (p->max_off - 1);
+//        fprintf(stderr,"M(%d): %02x : %02x\n", mlen, code_pos, mlen);
+        if( !lz->in_literal )
+        {
+            // Already on match - encode a zero length literal
+            add_hbyte(b, 0);
+        }
+        encode_len(b, mlen-2, p->max_mlen);
+        if( p->bits_moff )
+            add_byte(b,code_pos & 0xFF );
+        if( p->bits_moff > 8 )
+            add_byte(b,code_pos >> 8 );
+
+        lz->in_literal = 0;
+    }
+    return pos + mlen - 1;
+}
+
+static void lz4s_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN])
+{
+    const struct lz4s *p = c->priv;
+    struct lzop **lz = (struct lzop **)st;
+    int lpos[SAPR_MAX_CHN];
+
+    // Store skipped channels with the channel value
+    for(int i=s->nchn-1; i>=0; i--)
+    {
+        lpos[i] = -1;
+        if( chn_skip[i] )
+        {
+            add_bit(b,1);
+            add_byte(b,*s->data[i]);
+        }
+        else if( i )
+            add_bit(b,0);
+    }
+    bflush(b);
+
+    // Compress
+    for(int i=0; i<s->nchn; i++)
+        if( !chn_skip[i] )
+            lz[i]->in_literal = 0;
+    for(int pos = 0; pos < s->size; pos++)
+        for(int i=s->nchn-1; i>=0; i--)
+            if( !chn_skip[i] )
+                lpos[i] = lzop_encode(p, b, lz[i], pos, lpos[i]);
+}
+
+static void lz4s_stats(const struct codec *c, FILE *out, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total, int level)
+{
+    const struct lz4s *p = c->priv;
+    int sz = s->size;
+    fprintf(out,"LZ4S: max offset= %d,\tmax mlen= %d,\tmax llen= %d,\t",
+            p->max_off, p->max_mlen, p->max_llen);
+    fprintf(out,"ratio: %5d / %d = %5.2f%%\n", total, s->nchn*sz,
+            (100.0*total) / (1.0*s->nchn*sz));
+    if( level )
+        codec_stream_stats(c, out, s, chn_skip, st, total);
+}
+
+static void lz4s_free(struct codec *c)
+{
+    free(c->priv);
+    free(c);
+}
+
+static const struct codec_ops lz4s_ops = {
+    lzop_new,
+    lzop_parse_pos,
+    lzop_bits,
+    lzop_free,
+    0,
+    0,
+    lz4s_encode,
+    lz4s_stats,
+    0,
+    0,
+    lz4s_free
+};
+
+struct codec *lz4s_new(int bits_moff, int max_mlen, int max_llen)
+{
+    struct codec *c = calloc(1, sizeof(*c));
+    struct lz4s *p = calloc(1, sizeof(*p));
+
+    p->bits_moff = bits_moff;
+    p->min_mlen = 2;
+    p->max_mlen = max_mlen;
+    p->max_llen = max_llen;
+    p->max_off = 1<<bits_moff;
+
+    c->ops = &lz4s_ops;
+    c->max_off = p->max_off;
+    c->priv = p;
+    snprintf(c->name, sizeof(c->name), "lz4s-%d/%d/%d", bits_moff, max_mlen, max_llen);
+    return c;
+}
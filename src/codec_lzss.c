@@ -0,0 +1,981 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * This implementa an optimal LZSS compressor for the SAP-R music files.
+ * The compressed files can be played in an Atari using the included
+ * assembly programs, depending on the specific parameters.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec_lzss.h"
+#include "dict.h"
+#include "xform.h"
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////
+// LZSS compression functions
+static int max(int a, int b)
+{
+    return a>b ? a : b;
+}
+
+#define bits_literal (1+8)      // Number of bits for encoding a literal
+
+static void *lzop_new(const struct codec *c, const uint8_t *data, int size,
+                      struct arena *a)
+{
+    struct lzop *lz = arena_alloc(a, sizeof(*lz));
+    lz->arena = a;
+    lz->data = data;
+    lz->size = size;
+    lz->bits = arena_calloc(a, sizeof(int) * size);
+    lz->mlen = arena_calloc(a, sizeof(int) * size);
+    lz->mpos = arena_calloc(a, sizeof(int) * size);
+    lz->win_size = ((const struct lzss *)c->priv)->max_mlen + 1;
+    lz->win = arena_alloc(a, sizeof(int) * lz->win_size);
+    lz->win_first = 0;
+    lz->win_count = 0;
+    return lz;
+}
+
+static void lzop_free(void *st)
+{
+    struct lzop *lz = st;
+    arena_release(lz->arena, lz->bits);
+    arena_release(lz->arena, lz->mlen);
+    arena_release(lz->arena, lz->mpos);
+    arena_release(lz->arena, lz->win);
+    arena_release(lz->arena, lz);
+}
+
+static int lzop_bits(const void *st, int pos)
+{
+    const struct lzop *lz = st;
+    return pos < lz->size ? lz->bits[pos] : 0;
+}
+
+// Updates the window of match ends for "pos", must be called for all
+// positions from the end of the stream, "lz->win_count" is set to 0 at the
+// last position.
+static inline void lzop_window(struct lzop *lz, int pos, int min_mlen, int max_mlen)
+{
+    int n = lz->win_size;
+    // Remove the positions after the longest match
+    while( lz->win_count &&
+           lz->win[(lz->win_first + lz->win_count - 1) % n] > pos + max_mlen )
+        lz->win_count--;
+    // Add the end of the shortest match, removing the ones with more bits
+    int e = pos + min_mlen;
+    if( e < lz->size )
+    {
+        while( lz->win_count && lz->bits[lz->win[lz->win_first]] > lz->bits[e] )
+        {
+            lz->win_first = (lz->win_first + 1) % n;
+            lz->win_count--;
+        }
+        lz->win_first = (lz->win_first + n - 1) % n;
+        lz->win[lz->win_first] = e;
+        lz->win_count++;
+    }
+}
+
+// Selects the best encoding at "pos" given the longest match found there,
+// needs the parse of all the following positions.
+static inline void lzop_choose(struct lzop *lz, int pos, int ml, int mp,
+                               int min_mlen, int max_mlen, int bits_match)
+{
+    lzop_window(lz, pos, min_mlen, max_mlen);
+
+    // Init "no-match" case
+    int best = lz->bits[pos+1] + bits_literal;
+
+    // Check all posible match lengths, store best
+    lz->bits[pos] = best;
+    lz->mlen[pos] = 0;
+    lz->mpos[pos] = mp;
+    if( ml == max_mlen && pos + max_mlen < lz->size && lz->win_count )
+    {
+        // All the lengths are possible, the window has the largest of the
+        // lengths with the minimum bits, as the loop below.
+        int e = lz->win[(lz->win_first + lz->win_count - 1) % lz->win_size];
+        int b = lz->bits[e] + bits_match;
+        if( b < best )
+        {
+            lz->bits[pos] = b;
+            lz->mlen[pos] = e - pos;
+        }
+        return;
+    }
+    for(int l=ml; l>=min_mlen; l--)
+    {
+        int b;
+        if( pos+l < lz->size )
+            b = lz->bits[pos+l] + bits_match;
+        else
+            b = 0;
+        if( b < best )
+        {
+            best = b;
+            lz->bits[pos] = best;
+            lz->mlen[pos] = l;
+            lz->mpos[pos] = mp;
+        }
+    }
+}
+
+// Selects the best encoding at "pos" in the formats with variable length
+// matches, the lengths above "max_short" need one more byte.
+static inline void lzop_choose_var(struct lzop *lz, int pos, int ml, int mp,
+                                   int min_mlen, int max_short, int bits_match)
+{
+    // Init "no-match" case
+    int best = lz->bits[pos+1] + bits_literal;
+
+    // Check all posible match lengths, store best
+    lz->bits[pos] = best;
+    lz->mlen[pos] = 0;
+    lz->mpos[pos] = mp;
+    for(int l=ml; l>=min_mlen; l--)
+    {
+        int b;
+        if( pos+l < lz->size )
+            b = lz->bits[pos+l] + bits_match + (l > max_short ? 8 : 0);
+        else
+            b = 0;
+        if( b < best )
+        {
+            best = b;
+            lz->bits[pos] = best;
+            lz->mlen[pos] = l;
+            lz->mpos[pos] = mp;
+        }
+    }
+}
+
+// Parse step for the given parameters, and for the variable length matches
+#define LZS_NAME       lzop_step
+#define LZS_MATCH      lzop_match
+#define LZS_MAX_OFF    p->max_off
+#define LZS_MAX_MLEN   p->max_mlen
+#define LZS_MIN_MLEN   p->min_mlen
+#define LZS_BITS_MATCH p->bits_match
+#include "lzss_step.h"
+
+#define LZS_NAME       lzop_step_v
+#define LZS_MATCH      lzop_match_v
+#define LZS_MAX_OFF    p->max_off
+#define LZS_MAX_MLEN   p->max_mlen
+#define LZS_MIN_MLEN   p->min_mlen
+#define LZS_BITS_MATCH p->bits_match
+#define LZS_CHOOSE(lz, pos, ml, mp, min_mlen, max_mlen, bits_match) \
+        lzop_choose_var(lz, pos, ml, mp, min_mlen, p->max_short, bits_match)
+#include "lzss_step.h"
+
+
+static void lzop_parse_pos(const struct codec *c, void *st, const struct mrun *m)
+{
+    const struct lzss *p = c->priv;
+    p->step(p, st, m);
+}
+
+static void lzop_parse_match(const struct codec *c, void *st, const struct mrun *m)
+{
+    const struct lzss *p = c->priv;
+    p->match(p, st, m);
+}
+
+// Parses from the matches stored by lzop_parse_match(), the same as calling
+// lzop_parse_pos() from the end of the stream to "start".
+static void lzop_parse_range(const struct codec *c, void *st, int start)
+{
+    const struct lzss *p = c->priv;
+    struct lzop *lz = st;
+    for(int pos=lz->size-1; pos>=start; pos--)
+    {
+        if( pos == lz->size - 1 )
+        {
+            lz->mlen[pos] = 0;
+            lz->bits[pos] = bits_literal;
+            lz->win_count = 0;
+        }
+        else if( p->fmt_varlen )
+            lzop_choose_var(lz, pos, lz->mlen[pos], lz->mpos[pos], p->min_mlen,
+                            p->max_short, p->bits_match);
+        else
+            lzop_choose(lz, pos, lz->mlen[pos], lz->mpos[pos], p->min_mlen,
+                        p->max_mlen, p->bits_match);
+    }
+}
+
+// Calculate optimal encoding from the end of stream.
+// if last_literal is 1, we force the last byte to be encoded as a literal.
+void lzop_backfill(const struct lzss *p, struct lzop *lz, int last_literal)
+{
+    // If no bytes, nothing to do
+    if(!lz->size)
+        return;
+
+    struct mrun m;
+    mrun_init(&m, lz->data, lz->size, p->max_off);
+
+    if(last_literal)
+    {
+        // Forced last literal - process one byte less
+        lz->mlen[lz->size-1] = 0;
+        lz->size --;
+        mrun_step(&m);
+    }
+
+    // Go backwards in file storing best parsing
+    while( m.pos > 0 )
+    {
+        mrun_step(&m);
+        p->step(p, lz, &m);
+    }
+    mrun_free(&m);
+
+    // Fixup size again
+    if( last_literal )
+        lz->size ++;
+}
+
+// Copies the parse at position "q" of "old" to position "pos", adding "db" to
+// the number of bits
+static void lzop_copy(struct lzop *lz, int pos, const struct lzop *old, int q, int db)
+{
+    lz->bits[pos] = old->bits[q] + db;
+    lz->mlen[pos] = old->mlen[q];
+    lz->mpos[pos] = old->mpos[q];
+}
+
+int lzop_reparse(const struct lzss *p, struct lzop *lz, const struct lzop *old)
+{
+    int n = lz->size, n0 = old->size;
+    if( !n )
+        return 0;
+
+    // Frames equal at the start and at the end of the two streams
+    int mn = n < n0 ? n : n0;
+    int pre = 0, suf = 0;
+    while( pre < mn && lz->data[pre] == old->data[pre] )
+        pre++;
+    while( suf < mn && lz->data[n-1-suf] == old->data[n0-1-suf] )
+        suf++;
+    if( pre == n && n == n0 )
+    {
+        for(int pos=0; pos<n; pos++)
+            lzop_copy(lz, pos, old, pos, 0);
+        return 0;
+    }
+
+    // From "tail" to the end all the match window is in the equal frames, so
+    // the parse is the same as the old one.
+    int d = n - n0;
+    int tail = n - suf + p->max_off;
+    if( tail > n )
+        tail = n;
+    for(int pos=tail; pos<n; pos++)
+        lzop_copy(lz, pos, old, pos - d, 0);
+
+    // Rebuild the window of match ends from the copied positions, and start
+    // the match finder "max_mlen" bytes after the first position to parse,
+    // as when parsing in parts.
+    lz->win_count = 0;
+    for(int x = tail + p->max_mlen - p->min_mlen; x >= tail; x--)
+        if( x < n - 1 )
+            lzop_window(lz, x, p->min_mlen, p->max_mlen);
+    struct mrun m;
+    mrun_init(&m, lz->data, n, p->max_off);
+    if( tail + p->max_mlen < n )
+        m.pos = tail + p->max_mlen;
+
+    // Parse to the start, until the bits are the old ones plus a constant for
+    // "max_mlen" positions before the changed frames: all the positions
+    // before have the same matches and the same choices.
+    int parsed = 0, same = 0, db = 0;
+    while( m.pos > 0 )
+    {
+        mrun_step(&m);
+        int pos = m.pos;
+        if( pos >= tail )
+            continue;
+        p->step(p, lz, &m);
+        parsed++;
+        if( pos + p->max_mlen >= pre )
+            continue;
+        if( lz->bits[pos] - old->bits[pos] != db )
+        {
+            db = lz->bits[pos] - old->bits[pos];
+            same = 0;
+        }
+        if( ++same >= p->max_mlen && pos + p->max_mlen - 1 < pre )
+        {
+            for(int q=0; q<pos; q++)
+                lzop_copy(lz, q, old, q, db);
+            break;
+        }
+    }
+    mrun_free(&m);
+    return parsed;
+}
+
+// Frames of dictionary before the song
+static int lzss_prime(const struct lzss *p)
+{
+    return p->dict ? p->dict->size : 0;
+}
+
+void lzss_set_dict(struct codec *c, const struct dict *d)
+{
+    struct lzss *p = c->priv;
+    p->dict = d;
+}
+
+// Returns 1 if the coded stream from "start" would end in a match
+static int lzop_last_is_match(const struct lzss *p, const struct lzop * lz, int start)
+{
+    int last = 0;
+    for(int pos = start; pos < lz->size; )
+    {
+        int mlen = lz->mlen[pos];
+        if( mlen < p->min_mlen )
+        {
+            // Skip over one literal byte
+            last = 0;
+            pos ++;
+        }
+        else
+        {
+            // Skip over one match
+            pos = pos + mlen;
+            last = 1;
+        }
+    }
+    return last;
+}
+
+int lzop_encode(struct lzss *p, struct bf *b, const struct lzop *lz, int pos, int lpos)
+{
+    if( pos <= lpos )
+        return lpos;
+
+    int mlen = lz->mlen[pos];
+    int mpos = lz->mpos[pos];
+
+    // Encode best from filled table
+    if( mlen < p->min_mlen )
+    {
+        // No match, just encode the byte
+//        fprintf(stderr,"L: %02x\n", lz->data[pos]);
+        add_bit(b,1);
+        add_byte(b, lz->data[pos]);
+        p->stat_len[0] ++;
+        return pos;
+    }
+    else
+    {
+        int code_pos = (pos - mpos - (p->fmt_pos_start_zero ? 1 : 2)) & (p->max_off - 1);
+        int code_len = mlen - p->min_mlen;
+        int bits_moff = p->bits_moff;
+        // The longest length code is followed by the rest of the length
+        int ext = -1;
+        if( p->fmt_varlen && mlen > p->max_short )
+        {
+            ext = mlen - p->max_short - 1;
+            code_len = p->max_short + 1 - p->min_mlen;
+        }
+//        fprintf(stderr,"M: %02x : %02x  [%04x]\n", code_pos, code_len,
+//                       (code_pos << p->bits_mlen) + code_len);
+        add_bit(b,0);
+        if( p->bits_mlen + bits_moff <= 8 )
+            add_byte(b,(code_pos<<p->bits_mlen) + code_len);
+        else if( p->bits_mlen + bits_moff <= 12 )
+        {
+            add_byte(b,(code_pos<<(8-bits_moff)) + (code_len & ((1<<(8-bits_moff))-1)));
+            add_hbyte(b, code_len>>(8-bits_moff));
+        }
+        else
+        {
+            int mb = ((code_len+1) << bits_moff) + code_pos;
+            add_byte(b, mb & 0xFF);
+            add_byte(b, mb >> 8);
+        }
+        if( ext >= 0 )
+            add_byte(b, ext);
+
+        p->stat_len[mlen] ++;
+        p->stat_off[mpos] ++;
+        return pos + mlen - 1;
+    }
+}
+
+static void lzss_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN])
+{
+    struct lzss *p = c->priv;
+    struct lzop **lz = (struct lzop **)st;
+    int lpos[SAPR_MAX_CHN];
+    int prime = lzss_prime(p);
+    FILE *msg = c->msg ? c->msg : stderr;
+
+    memset(p->stat_len, 0, sizeof(int) * (p->max_mlen + 1));
+    memset(p->stat_off, 0, sizeof(int) * (p->max_off + 1));
+
+    // Store skipped channels
+    for(int i=s->nchn-1; i>=0; i--)
+    {
+        lpos[i] = -1;
+        if( chn_skip[i] )
+            add_bit(b,1);
+        else if( i )
+            add_bit(b,0);
+    }
+    bflush(b);
+    // Store the transform of each stream, high bit first
+    if( p->fmt_xform )
+    {
+        for(int i=s->nchn-1; i>=0; i--)
+            for(int j=XF_BITS-1; j>=0; j--)
+                add_bit(b, (s->xform[i] >> j) & 1);
+        bflush(b);
+    }
+    // Store the number of frames after the first one
+    int last = s->size;
+    if( p->fmt_frame_count )
+    {
+        int count = s->size - prime - 1;
+        if( count > LZSS_MAX_COUNT )
+        {
+            fprintf(msg,"WARNING: song too long for the frame count, only %d frames stored.\n",
+                    LZSS_MAX_COUNT + 1);
+            count = LZSS_MAX_COUNT;
+        }
+        add_byte(b, count & 0xFF);
+        add_byte(b, count >> 8);
+        last = prime + 1 + count;
+    }
+    // Now, we store initial values for all chanels:
+    for(int i=s->nchn-1; i>=0; i--)
+    {
+        // In version 1 we only store init byte for the skipped channels
+        if( p->fmt_literal_first || chn_skip[i] )
+            add_byte(b, s->data[i][prime]);
+    }
+    bflush(b);
+
+    // Detect if at least one of the streams end in a match, not needed if
+    // the decoder knows the number of frames:
+    int first = prime + (p->fmt_literal_first ? 1 : 0);
+    int end_not_ok = !p->fmt_frame_count;
+    for(int i=0; end_not_ok && i<s->nchn; i++)
+        if( !chn_skip[i] )
+            end_not_ok &= lzop_last_is_match(p, lz[i], first);
+
+    // If all streams end in a match, we need to fix at least one to end in
+    // a literal - just fix stream 0, as this is always encoded:
+    if( p->force_last_literal && end_not_ok )
+    {
+        fprintf(msg,"LZSS: fixing up stream #0 to end in a literal\n");
+        lzop_backfill(p, lz[0], 1);
+    }
+    else if( end_not_ok )
+    {
+        fprintf(msg,"WARNING: stream does not end in a literal.\n");
+        fprintf(msg,"WARNING: this can produce errors at the end of decoding.\n");
+    }
+
+    // Compress
+    for(int pos = first; pos < last; pos++)
+    {
+        if( p->fmt_frame_flags )
+            bflush_bits(b);
+        for(int i=s->nchn-1; i>=0; i--)
+            if( !chn_skip[i] )
+                lpos[i] = lzop_encode(p, b, lz[i], pos, lpos[i]);
+    }
+}
+
+long lzss_cycles(const struct lzss *p, const struct sapr *s,
+                 const int chn_skip[SAPR_MAX_CHN], struct lzop **lz, int *max)
+{
+    int lpos[SAPR_MAX_CHN];
+    int bits = 0;
+    long total = 0;
+    for(int i=0; i<s->nchn; i++)
+        lpos[i] = 0;
+    *max = 0;
+
+    // Cycles of the player of the format
+    int c8 = p->bits_moff + p->bits_mlen <= 8;
+    int cyc_frame = c8 ? CYC8_FRAME : CYC_FRAME;
+    int cyc_skip = c8 ? CYC8_SKIP : CYC_SKIP;
+    int cyc_copy = c8 ? CYC8_COPY : CYC_COPY;
+    int cyc_literal = c8 ? CYC8_LITERAL : CYC_LITERAL;
+    int cyc_match = c8 ? CYC8_MATCH : CYC_MATCH;
+    if( p->fmt_varlen )
+        cyc_match += CYC8_VAR;
+    if( p->fmt_frame_flags )
+        cyc_frame += CYC_FLAGS;
+
+    for(int pos = lzss_prime(p) + 1; pos < s->size; pos++)
+    {
+        int cyc = cyc_frame;
+        if( p->fmt_frame_flags )
+            bits = 0;
+        for(int i=s->nchn-1; i>=0; i--)
+        {
+            if( chn_skip[i] )
+                cyc += cyc_skip;
+            else if( pos <= lpos[i] )
+                cyc += cyc_copy;
+            else
+            {
+                int mlen = lz[i]->mlen[pos];
+                cyc += bits ? CYC_BIT : CYC_REFILL;
+                bits = bits ? bits - 1 : 7;
+                if( mlen < p->min_mlen )
+                {
+                    cyc += cyc_literal;
+                    lpos[i] = pos;
+                }
+                else
+                {
+                    cyc += cyc_match;
+                    if( p->fmt_varlen && mlen > p->max_short )
+                        cyc += CYC8_VAR_EXT;
+                    lpos[i] = pos + mlen - 1;
+                }
+            }
+        }
+        total += cyc;
+        if( cyc > *max )
+            *max = cyc;
+    }
+    return total;
+}
+
+static void lzss_stats(const struct codec *c, FILE *out, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total, int level)
+{
+    const struct lzss *p = c->priv;
+    int sz = s->size - lzss_prime(p);
+    fprintf(out,"LZSS: max offset= %d,\tmax len= %d,\tmatch bits= %d,\t",
+            p->max_off, p->max_mlen, p->bits_match - 1);
+    fprintf(out,"ratio: %5d / %d = %5.2f%%\n", total, s->nchn*sz,
+            (100.0*total) / (1.0*s->nchn*sz));
+    // The stream sizes would include the dictionary frames
+    if( level && !p->dict )
+        codec_stream_stats(c, out, s, chn_skip, st, total);
+
+    if( level )
+    {
+        int nmatch = 0;
+        for(int i=p->min_mlen; i<=p->max_mlen; i++)
+            nmatch += p->stat_len[i];
+        fprintf(out,"Tokens: %d literals, %d matches\n", p->stat_len[0], nmatch);
+    }
+    // Cycles of the 8 bit player
+    if( level && c->player && p->bits_moff == 4 && p->bits_mlen == 4 && sz > 1 )
+    {
+        int max0;
+        long cyc0 = lzss_cycles(p, s, chn_skip, (struct lzop **)st, &max0);
+        fprintf(out,"Player cycles per frame: %s %.1f (max %d)\n",
+                c->player, cyc0 / (sz - 1.0), max0);
+    }
+    // Compare the cycles of the two players for the 16 bit format
+    if( level && c->player && !p->fmt_xform && p->bits_moff == 8 &&
+        p->bits_mlen == 8 && sz > 1 )
+    {
+        int max0;
+        long cyc0 = lzss_cycles(p, s, chn_skip, (struct lzop **)st, &max0);
+        fprintf(out,"Player cycles per frame: %s %.1f (max %d), buffer RAM %d bytes\n",
+                p->dict ? "asm/playlzs16d.asm" : codec_player(c, s), cyc0 / (sz - 1.0),
+                max0, 256 * s->nchn);
+    }
+    // The same tokens with the flag bits shared between frames
+    if( level && p->fmt_frame_flags && p->bits_moff == 8 && p->bits_mlen == 8 && sz > 1 )
+    {
+        struct lzss q = *p;
+        int max1;
+        q.fmt_frame_flags = 0;
+        long cyc1 = lzss_cycles(&q, s, chn_skip, (struct lzop **)st, &max1);
+        fprintf(out,"Player cycles per frame: asm/playlzs16.asm %.1f (max %d), "
+                "with the flag bits shared between frames\n", cyc1 / (sz - 1.0), max1);
+    }
+
+    if( level>1 )
+    {
+        fprintf(out,"\nvalue\t  POS\t  LEN\n");
+        for(int i=0; i<=max(p->max_mlen,p->max_off); i++)
+        {
+            fprintf(out,"%2d\t%5d\t%5d\n", i,
+                    (i <= p->max_off) ? p->stat_off[i] : 0,
+                    (i <= p->max_mlen) ? p->stat_len[i] : 0);
+        }
+    }
+}
+
+// Decodes the song, following the same steps as the assembly players
+static int lzss_decode(const struct codec *c, struct sapr *s, const uint8_t *buf,
+                       int len, int nchn)
+{
+    const struct lzss *p = c->priv;
+    int chn_skip[SAPR_MAX_CHN];
+    int copy[SAPR_MAX_CHN];     // Remaining match length
+    int dist[SAPR_MAX_CHN];     // Match distance
+    struct br b;
+
+    br_init(&b, buf, len);
+    s->size = 0;
+    s->nchn = nchn;
+    s->arena = 0;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+        s->data[i] = i < nchn ? arena_alloc(0, SAPR_MAX_FRAMES) : 0;
+
+    // Read skipped channels, channel 0 is never skipped
+    for(int i=nchn-1; i>=0; i--)
+    {
+        chn_skip[i] = i ? get_bit(&b) : 0;
+        copy[i] = 0;
+        dist[i] = 0;
+    }
+    br_flush(&b);
+    // Read transforms
+    for(int i=nchn-1; i>=0; i--)
+    {
+        s->xform[i] = 0;
+        for(int j=0; p->fmt_xform && j<XF_BITS; j++)
+            s->xform[i] = (s->xform[i] << 1) | get_bit(&b);
+        if( s->xform[i] >= XF_COUNT )
+            return -1;
+    }
+    br_flush(&b);
+    // The dictionary is the history before the song
+    int prime = lzss_prime(p);
+    // Read the number of frames after the first one
+    int end = SAPR_MAX_FRAMES;
+    if( p->fmt_frame_count )
+    {
+        int count = get_byte(&b);
+        count |= get_byte(&b) << 8;
+        if( prime + 1 + count < end )
+            end = prime + 1 + count;
+    }
+    for(int i=0; prime && i<nchn; i++)
+        memcpy(s->data[i], p->dict->data[i], prime);
+    // Read initial values
+    for(int i=nchn-1; i>=0; i--)
+        if( p->fmt_literal_first || chn_skip[i] )
+            s->data[i][prime] = get_byte(&b);
+    br_flush(&b);
+
+    int pos = prime + (p->fmt_literal_first ? 1 : 0);
+
+    // Decode frames until the end of the input
+    for( ; (p->fmt_frame_count || !br_end(&b)) && pos < end; pos++)
+    {
+        if( p->fmt_frame_flags )
+            br_flush_bits(&b);
+        for(int i=nchn-1; i>=0; i--)
+        {
+            uint8_t *d = s->data[i];
+            if( chn_skip[i] )
+                d[pos] = d[prime];
+            else if( copy[i] )
+            {
+                d[pos] = d[pos - dist[i]];
+                copy[i]--;
+            }
+            else if( get_bit(&b) )
+                d[pos] = get_byte(&b);
+            else
+            {
+                int code_pos, code_len, bits_moff = p->bits_moff;
+                int x = get_byte(&b);
+                if( p->bits_mlen + bits_moff <= 8 )
+                {
+                    code_pos = x >> p->bits_mlen;
+                    code_len = x & ((1<<p->bits_mlen) - 1);
+                }
+                else if( p->bits_mlen + bits_moff <= 12 )
+                {
+                    code_pos = x >> (8 - bits_moff);
+                    code_len = (x & ((1<<(8-bits_moff))-1)) | (get_hbyte(&b) << (8-bits_moff));
+                }
+                else
+                {
+                    x |= get_byte(&b) << 8;
+                    code_pos = x & (p->max_off - 1);
+                    code_len = ((x >> bits_moff) - 1) & ((1<<p->bits_mlen) - 1);
+                }
+                if( p->fmt_varlen && code_len == (1<<p->bits_mlen) - 1 )
+                    code_len += get_byte(&b);
+                // The match position is relative to the buffer start
+                dist[i] = (pos - code_pos - (p->fmt_pos_start_zero ? 1 : 2)) & (p->max_off - 1);
+                if( !dist[i] )
+                    dist[i] = p->max_off;
+                copy[i] = code_len + p->min_mlen - 1;
+                if( dist[i] > pos )
+                    return -1;
+                d[pos] = d[pos - dist[i]];
+            }
+        }
+        if( b.err )
+            return -1;
+    }
+    s->size = pos - prime;
+    for(int i=0; prime && i<nchn; i++)
+        memmove(s->data[i], s->data[i] + prime, s->size);
+    xform_undo(s);
+    return 0;
+}
+
+static void lzss_free(struct codec *c)
+{
+    struct lzss *p = c->priv;
+    free(p->stat_len);
+    free(p->stat_off);
+    free(p);
+    free(c);
+}
+
+static const struct codec_ops lzss_ops = {
+    lzop_new,
+    lzop_parse_pos,
+    lzop_bits,
+    lzop_free,
+    lzop_parse_match,
+    lzop_parse_range,
+    lzss_encode,
+    lzss_stats,
+    lzss_decode,
+    lzss_player,
+    lzss_free
+};
+
+struct codec *lzss_new(int bits_moff, int bits_mlen, int min_mlen,
+                       int format_version, int force_last_literal)
+{
+    struct codec *c = calloc(1, sizeof(*c));
+    struct lzss *p = calloc(1, sizeof(*p));
+
+    p->bits_moff = bits_moff;
+    p->bits_mlen = bits_mlen;
+    p->min_mlen = min_mlen;
+    p->max_mlen = min_mlen + (1<<bits_mlen) - 1;
+    p->max_off = 1<<bits_moff;
+    p->bits_match = 1 + bits_moff + bits_mlen;
+    p->format_version = format_version;
+    p->force_last_literal = force_last_literal;
+
+    // Select the parse step
+    p->step = lzop_step;
+    p->match = lzop_match;
+
+    // Set format flags:
+    switch(format_version)
+    {
+        case 1:
+            p->fmt_literal_first  = 0;
+            p->fmt_pos_start_zero = 1;
+            break;
+        case 2:
+            p->fmt_literal_first  = 1;
+            p->fmt_pos_start_zero = 0;
+            p->fmt_xform = 1;
+            break;
+        case 3:
+            p->fmt_literal_first  = 1;
+            p->fmt_pos_start_zero = 0;
+            p->fmt_frame_count = 1;
+            break;
+        case 4:
+            p->fmt_literal_first  = 1;
+            p->fmt_pos_start_zero = 0;
+            p->fmt_varlen = 1;
+            break;
+        case 5:
+            p->fmt_literal_first  = 1;
+            p->fmt_pos_start_zero = 0;
+            p->fmt_frame_flags = 1;
+            break;
+        default:
+            p->fmt_literal_first  = 1;
+            p->fmt_pos_start_zero = 0;
+            break;
+    }
+
+    // The longest length code adds one byte with the rest of the length, the
+    // players keep the length in 7 bits.
+    if( p->fmt_varlen )
+    {
+        p->max_short = p->max_mlen - 1;
+        p->max_mlen = max(p->max_mlen, LZSS_VAR_MAX_MLEN);
+        p->step = lzop_step_v;
+        p->match = lzop_match_v;
+    }
+
+    // Alloc statistic arrays
+    p->stat_len = calloc(sizeof(int), p->max_mlen + 1);
+    p->stat_off = calloc(sizeof(int), p->max_off + 1);
+
+    c->ops = &lzss_ops;
+    c->max_off = p->max_off;
+    c->max_mlen = p->max_mlen;
+    c->xform = p->fmt_xform;
+    c->priv = p;
+    snprintf(c->name, sizeof(c->name), "lzss-%d/%d/%d%s", bits_moff, bits_mlen,
+             min_mlen, format_version == 1 ? "x" : format_version == 2 ? "t" :
+             format_version == 3 ? "n" : format_version == 4 ? "v" :
+             format_version == 5 ? "g" : "");
+
+    // Players for the standard presets
+    if( format_version == 0 && bits_moff == 4 && bits_mlen == 4 && min_mlen == 2 )
+        c->player = "asm/playlzs.asm";
+    else if( format_version == 0 && bits_moff == 7 && bits_mlen == 5 && min_mlen == 2 )
+        c->player = "asm/playlzs12.asm";
+    else if( format_version == 0 && bits_moff == 8 && bits_mlen == 8 && min_mlen == 1 )
+    {
+        c->player = "asm/playlzs16.asm";
+        c->player2 = "asm/playlzs16s.asm";
+    }
+    else if( format_version == 2 && bits_moff == 8 && bits_mlen == 8 && min_mlen == 1 )
+        c->player = "asm/playlzs16t.asm";
+    else if( format_version == 3 && bits_moff == 8 && bits_mlen == 8 && min_mlen == 1 )
+        c->player = "asm/playlzs16n.asm";
+    else if( format_version == 4 && bits_moff == 4 && bits_mlen == 4 && min_mlen == 2 )
+        c->player = "asm/playlzsv.asm";
+    else if( format_version == 5 && bits_moff == 8 && bits_mlen == 8 && min_mlen == 1 )
+        c->player = "asm/playlzs16g.asm";
+    return c;
+}
+
+///////////////////////////////////////////////////////
+// Command line options
+void lzss_opts_init(struct lzss_opts *o)
+{
+    o->bits_moff = 4;
+    o->bits_mlen = 4;
+    o->bits_mtotal = o->bits_moff + o->bits_mlen;
+    o->bits_set = 0;
+    o->min_mlen = 2;
+    o->force_last_literal = 1;
+    o->format_version = 0;
+    o->format_set = 0;
+}
+
+int lzss_opts_set(struct lzss_opts *o, int opt, const char *arg)
+{
+    switch(opt)
+    {
+        case '2':
+            o->bits_moff = 7;
+            o->bits_mlen = 5;
+            o->bits_mtotal = 12;
+            o->bits_set |= 8;
+            break;
+        case '8':
+            o->bits_moff = 4;
+            o->bits_mlen = 4;
+            o->bits_mtotal = 8;
+            o->bits_set |= 8;
+            break;
+        case '6':
+            o->bits_moff = 8;
+            o->bits_mlen = 8;
+            o->bits_mtotal = 16;
+            o->min_mlen = 1;
+            o->bits_set |= 8;
+            break;
+        case 'o':
+            o->bits_moff = atoi(arg);
+            o->bits_set |= 1;
+            break;
+        case 'l':
+            o->bits_mlen = atoi(arg);
+            o->bits_set |= 2;
+            break;
+        case 'b':
+            o->bits_mtotal = atoi(arg);
+            o->bits_set |= 4;
+            break;
+        case 'm':
+            o->min_mlen = atoi(arg);
+            break;
+        case 'e':
+            o->force_last_literal = 0;
+            break;
+        case 'x':
+            o->format_version = 1;
+            o->format_set++;
+            break;
+        case 'T':
+            o->format_version = 2;
+            o->format_set++;
+            break;
+        case 'n':
+            o->format_version = 3;
+            o->format_set++;
+            break;
+        case 'V':
+            o->format_version = 4;
+            o->format_set++;
+            break;
+        case 'g':
+            o->format_version = 5;
+            o->format_set++;
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+const char *lzss_opts_check(struct lzss_opts *o)
+{
+    if( o->bits_mtotal < 8 || o->bits_mtotal > 16 )
+        return "total match bits should be from 8 to 16";
+
+    // Calculate bits
+    switch(o->bits_set)
+    {
+        case 0:
+        case 1:
+        case 4:
+        case 5:
+            o->bits_mlen = o->bits_mtotal - o->bits_moff;
+            break;
+        case 2:
+        case 6:
+            o->bits_moff = o->bits_mtotal - o->bits_mlen;
+            break;
+        case 3:
+        case 8:
+            // OK
+            break;
+        default:
+            return "only two of OFFSET, LENGTH and TOTAL bits should be given";
+    }
+    // Check option values
+    if( o->bits_moff < 0 || o->bits_moff > 12 )
+        return "match offset bits should be from 0 to 12";
+    if( o->bits_mlen < 2 || o->bits_moff > 16 )
+        return "match length bits should be from 2 to 16";
+    if( o->min_mlen < 1 || o->min_mlen > 16 )
+        return "minimum match length should be from 1 to 16";
+    if( o->format_set > 1 )
+        return "only one of the format options -x, -T, -n, -V and -g can be given";
+    if( o->format_version == 4 && o->bits_moff + o->bits_mlen > 12 )
+        return "variable match lengths need 12 or less match bits";
+    return 0;
+}
+
+struct codec *lzss_opts_codec(const struct lzss_opts *o)
+{
+    return lzss_new(o->bits_moff, o->bits_mlen, o->min_mlen, o->format_version,
+                    o->force_last_literal);
+}
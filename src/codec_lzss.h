@@ -0,0 +1,120 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * LZSS codec internals, shared with the player generator.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+struct dict;
+struct lzss;
+struct lzop;
+// Maximum number of frames after the first one in the formats with the
+// number of frames in the header
+#define LZSS_MAX_COUNT 65535
+// Maximum match length in the formats with variable length matches, the
+// players keep the remaining length in 7 bits.
+#define LZSS_VAR_MAX_MLEN 127
+
+// Parse step, see lzss_step.h
+typedef void (*lzss_step_fn)(const struct lzss *p, struct lzop *lz, const struct mrun *m);
+
+struct lzss
+{
+    int bits_moff;          // Number of bits used for OFFSET
+    int bits_mlen;          // Number of bits used for MATCH
+    int min_mlen;           // Minimum match length
+    int max_mlen;           // Maximum match length
+    int max_off;            // Maximum offset
+    int bits_match;         // Bits for encoding a match
+    int format_version;     // Format version given to lzss_new()
+    int fmt_literal_first;  // Always include first literal in the output
+    int fmt_pos_start_zero; // Match positions start at 0, else start at max
+    int fmt_xform;          // Store the transform of each stream in the header
+    int fmt_frame_count;    // The header has the number of frames, so the
+                            // song does not need to end in a literal
+    int fmt_varlen;         // The longest match length code is followed by
+                            // a byte with the rest of the length
+    int fmt_frame_flags;    // The flag bits of the tokens of each frame are
+                            // one field, starting in a new byte
+    int max_short;          // Maximum match length without the extra byte
+    int force_last_literal; // Force a literal at the end of the song
+    const struct dict *dict;// History before the song, or NULL
+    lzss_step_fn step;      // Parse step of the format
+    lzss_step_fn match;     // Match search step, to parse in parts
+    // Statistics
+    int *stat_len;
+    int *stat_off;
+};
+
+// Struct for LZ optimal parsing
+struct lzop
+{
+    const uint8_t *data;// The data to compress
+    int size;           // Data size
+    int *bits;          // Number of bits needed to code from position
+    int *mlen;          // Best match length at position (0 == no match);
+    int *mpos;          // Best match offset at position
+    // Positions from "pos+min_mlen" to "pos+max_mlen" with increasing index
+    // and not increasing bits, the last is the best end for a match of maximum
+    // length. Used to skip checking all the lengths inside long runs.
+    int *win;
+    int win_first;
+    int win_count;
+    int win_size;
+    struct arena *arena;// Memory for the arrays
+};
+
+// Calculates the optimal parse of all the stream, if "last_literal" is 1 the
+// last byte is encoded as a literal.
+void lzop_backfill(const struct lzss *p, struct lzop *lz, int last_literal);
+// Parses the stream as lzop_backfill() without the forced last literal,
+// reusing the parse "old" of a previous version of the stream: only the
+// positions near the changed frames are parsed again. Returns the number of
+// positions parsed.
+int lzop_reparse(const struct lzss *p, struct lzop *lz, const struct lzop *old);
+// Writes the token at "pos" if it is after the last token written, that ends
+// at "lpos". Returns the position of the last byte of the written token.
+int lzop_encode(struct lzss *p, struct bf *b, const struct lzop *lz, int pos, int lpos);
+
+// Sets the dictionary used as the history before the song, see dict.h. The
+// song given to the parser and the encoder starts with the dictionary
+// frames, see dict_prime(); the decoder returns the song without them.
+void lzss_set_dict(struct codec *c, const struct dict *d);
+
+// Approximate 6502 cycles of each path of the loop in asm/playlzs16.asm
+#define CYC_FRAME    30     // Frame setup and end of song check
+#define CYC_SKIP     18     // Skipped channel
+#define CYC_COPY     59     // Copy one byte of a match
+#define CYC_LITERAL  56     // New literal, without the flag bit
+#define CYC_MATCH   108     // New match, without the flag bit
+#define CYC_BIT       8     // Read flag bit
+#define CYC_REFILL   36     // Read flag bit, reading a new byte
+#define CYC_FLAGS     5     // Start the flag field of the frame, in
+                            // asm/playlzs16g.asm
+
+// Approximate 6502 cycles of each path of the loop in asm/playlzs.asm, the
+// flag bits take the same cycles as above
+#define CYC8_FRAME   28     // Frame setup and end of song check
+#define CYC8_SKIP    17     // Skipped channel
+#define CYC8_COPY    56     // Copy one byte of a match
+#define CYC8_LITERAL 55     // New literal, without the flag bit
+#define CYC8_MATCH  108     // New match, without the flag bit
+#define CYC8_VAR      5     // Check of the match length in asm/playlzsv.asm
+#define CYC8_VAR_EXT 26     // Read the extra length byte in asm/playlzsv.asm
+
+// Returns the cycles of asm/playlzs16.asm for all frames, and the maximum of
+// one frame. The 8 bit formats use asm/playlzs.asm or asm/playlzsv.asm, and
+// the format with the flag field of each frame uses asm/playlzs16g.asm.
+long lzss_cycles(const struct lzss *p, const struct sapr *s,
+                 const int chn_skip[SAPR_MAX_CHN], struct lzop **lz, int *max);
+
+// Writes a player specialised for the song, see "write_player" in codec.h
+int lzss_player(const struct codec *c, FILE *f, const struct sapr *s,
+                const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN],
+                const char *song_file, FILE *out);
@@ -0,0 +1,400 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Change-mask codec: each frame stores one bit for each register, set if
+ * the value changed, followed by the new values. Optionally the resulting
+ * byte stream is compressed as one LZSS stream, so the player only needs one
+ * 256 byte buffer instead of one for each register.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec_lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Approximate 6502 cycles of each path of the loop in asm/playmask.asm and
+// asm/playmasklz.asm, without reading the bytes
+#define MCYC_FRAME     21   // Frame setup and end of song check
+#define MCYC_SKIP      13   // Skipped channel
+#define MCYC_KEEP      23   // Channel not changed
+#define MCYC_CHANGE    27   // Channel changed
+#define MCYC_REFILL     4   // Read a new mask byte
+#define MCYC_REFILL_LZ  6
+// Cycles of reading one byte, "get_byte"
+#define MCYC_BYTE      24   // From the stream, in asm/playmask.asm
+#define MCYC_COPY      48   // Copy one byte of a match, in asm/playmasklz.asm
+#define MCYC_LITERAL   65   // New literal, without the flag bit
+#define MCYC_MATCH    111   // New match, without the flag bit
+#define MCYC_FLAG      28   // Read a new flag byte
+
+struct mask
+{
+    int lz;                 // Compress the byte stream with LZSS
+    struct codec *lzss;     // LZSS codec for the byte stream
+    // Statistics of the last encoded song
+    int changes;            // Number of changed values
+    int stream_len;         // Length of the byte stream
+    long cycles;            // Player cycles of all frames
+    int max_cycles;         // Player cycles of the slowest frame
+};
+
+// The parse only counts the bits of each stream, to compare the streams
+// and for the transforms. Each frame starts a new mask byte, so the mask
+// bytes of the frame are shared by all the streams not skipped, and the bits
+// are counted in units of 1/nstreams bits.
+struct mask_st
+{
+    const uint8_t *data;
+    int size;
+    int nstreams;           // Units of each bit
+    int mask;               // Units of the mask of each frame
+    int *bits;              // Number of units from position to the end
+    struct arena *arena;
+};
+
+static void *mask_parse_new(const struct codec *c, const uint8_t *data, int size,
+                            struct arena *a)
+{
+    struct mask_st *m = arena_alloc(a, sizeof(*m));
+    m->data = data;
+    m->size = size;
+    m->nstreams = c->nstreams > 0 ? c->nstreams : 1;
+    m->mask = c->nstreams > 0 ? 8 * ((c->nstreams + 7) / 8) : 1;
+    m->bits = arena_calloc(a, sizeof(int) * (size + 1));
+    m->arena = a;
+    return m;
+}
+
+static void mask_parse_free(void *st)
+{
+    struct mask_st *m = st;
+    arena_release(m->arena, m->bits);
+    arena_release(m->arena, m);
+}
+
+static int mask_parse_bits(const void *st, int pos)
+{
+    const struct mask_st *m = st;
+    return pos < m->size ? (m->bits[pos] + m->nstreams / 2) / m->nstreams : 0;
+}
+
+// The share of the mask bytes of each frame and the value if changed, the
+// first value is always stored.
+static void mask_bits_at(struct mask_st *m, int pos)
+{
+    int b = 8 * m->nstreams;
+    if( pos )
+        b = m->data[pos] != m->data[pos-1] ? b + m->mask : m->mask;
+    m->bits[pos] = m->bits[pos+1] + b;
+}
+
+static void mask_parse_pos(const struct codec *c, void *st, const struct mrun *mr)
+{
+    mask_bits_at(st, mr->pos);
+}
+
+// No matches are needed, the parse is done in mask_parse_range()
+static void mask_parse_match(const struct codec *c, void *st, const struct mrun *mr)
+{
+}
+
+static void mask_parse_range(const struct codec *c, void *st, int start)
+{
+    struct mask_st *m = st;
+    for(int pos=m->size-1; pos>=start; pos--)
+        mask_bits_at(m, pos);
+}
+
+// Returns the cycles of "get_byte" of asm/playmasklz.asm for each byte of
+// the stream, from the LZSS parse.
+static int *lz_cycles(const struct lzss *p, const struct lzop *lz)
+{
+    int *cyc = calloc(sizeof(int), lz->size + 1);
+    int tokens = 0;
+    for(int pos = 1; pos < lz->size; )
+    {
+        int mlen = lz->mlen[pos];
+        cyc[pos] = (tokens++ & 7) ? 0 : MCYC_FLAG;
+        if( mlen < p->min_mlen )
+        {
+            cyc[pos++] += MCYC_LITERAL;
+            continue;
+        }
+        cyc[pos++] += MCYC_MATCH;
+        for(int i=1; i<mlen && pos<lz->size; i++)
+            cyc[pos++] = MCYC_COPY;
+    }
+    return cyc;
+}
+
+// Checks that the parsed size is the same as the encoded byte stream, without
+// the header and the initial values of the skipped streams. Each stream
+// rounds its share of the mask bytes, so the sum can differ by half a bit for
+// each stream.
+static void mask_check(const struct codec *c, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int len)
+{
+    int bits = 0, nact = 0;
+    for(int i=0; i<s->nchn; i++)
+        if( !chn_skip[i] )
+        {
+            bits += mask_parse_bits(st[i], 0);
+            nact++;
+        }
+    int enc = 8 * (len - (s->nchn + 6) / 8 - (s->nchn - nact));
+    if( 2 * abs(enc - bits) > nact )
+        fprintf(c->msg ? c->msg : stderr, "MASK: internal error, parsed %d bits but "
+                "encoded %d bits\n", bits, enc);
+}
+
+static void mask_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN])
+{
+    struct mask *p = c->priv;
+    struct bf r;
+    bf_init(&r);
+    int *fend = malloc(sizeof(int) * s->size);
+
+    // Skipped channels and initial values, as the LZSS format
+    for(int i=s->nchn-1; i>0; i--)
+        add_bit(&r, chn_skip[i]);
+    bflush(&r);
+    for(int i=s->nchn-1; i>=0; i--)
+        add_byte(&r, s->data[i][0]);
+    bflush(&r);
+    fend[0] = r.len;
+
+    // Each frame starts a new mask byte
+    p->changes = 0;
+    for(int pos=1; pos<s->size; pos++)
+    {
+        bflush_bits(&r);
+        for(int i=s->nchn-1; i>=0; i--)
+        {
+            if( chn_skip[i] )
+                continue;
+            int ch = s->data[i][pos] != s->data[i][pos-1];
+            add_bit(&r, ch);
+            if( ch )
+            {
+                add_byte(&r, s->data[i][pos]);
+                p->changes++;
+            }
+        }
+        fend[pos] = r.len;
+    }
+    bflush(&r);
+    p->stream_len = r.len;
+    mask_check(c, s, chn_skip, st, r.len);
+
+    // Compress the byte stream as a song with one stream
+    int *bcyc = 0;
+    if( p->lz )
+    {
+        struct sapr one;
+        int skip1[SAPR_MAX_CHN];
+        void *ls[SAPR_MAX_CHN];
+        memset(&one, 0, sizeof(one));
+        one.size = r.len;
+        one.nchn = 1;
+        one.data[0] = r.buf;
+        for(int i=0; i<SAPR_MAX_CHN; i++)
+            skip1[i] = i > 0;
+        codec_parse(&p->lzss, 1, &one, skip1, ls);
+        codec_encode(p->lzss, b, &one, skip1, ls);
+        bcyc = lz_cycles(p->lzss->priv, ls[0]);
+        codec_parse_free(&p->lzss, 1, ls);
+    }
+    else
+        for(int i=0; i<r.len; i++)
+            add_byte(b, r.buf[i]);
+
+    // Player cycles
+    p->cycles = 0;
+    p->max_cycles = 0;
+    for(int pos=1; pos<s->size; pos++)
+    {
+        int cyc = MCYC_FRAME, nact = 0;
+        for(int i=0; i<s->nchn; i++)
+        {
+            if( chn_skip[i] )
+                cyc += MCYC_SKIP;
+            else if( s->data[i][pos] != s->data[i][pos-1] )
+                cyc += MCYC_CHANGE;
+            else
+                cyc += MCYC_KEEP;
+            nact += !chn_skip[i];
+        }
+        cyc += ((nact + 7) / 8) * (p->lz ? MCYC_REFILL_LZ : MCYC_REFILL);
+        for(int q=fend[pos-1]; q<fend[pos]; q++)
+            cyc += bcyc ? bcyc[q] : MCYC_BYTE;
+        p->cycles += cyc;
+        if( cyc > p->max_cycles )
+            p->max_cycles = cyc;
+    }
+    free(bcyc);
+    free(fend);
+    bf_free(&r);
+}
+
+static void mask_stats(const struct codec *c, FILE *out, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total, int level)
+{
+    const struct mask *p = c->priv;
+    int sz = s->size;
+    fprintf(out,"MASK: changed values= %d (%.2f per frame),\tstream= %d,\t",
+            p->changes, sz > 1 ? p->changes / (sz - 1.0) : 0.0, p->stream_len);
+    fprintf(out,"ratio: %5d / %d = %5.2f%%\n", total, s->nchn*sz,
+            (100.0*total) / (1.0*s->nchn*sz));
+    // The players are only for one POKEY
+    if( level && sz > 1 && c->player == codec_player(c, s) )
+        fprintf(out,"Player cycles per frame: %s %.1f (max %d), buffer RAM %d bytes\n",
+                c->player, p->cycles / (sz - 1.0), p->max_cycles, p->lz ? 256 : 0);
+    if( level )
+        codec_stream_stats(c, out, s, chn_skip, st, total);
+}
+
+// Decodes the byte stream compressed as one LZSS stream, following the same
+// steps as asm/playmasklz.asm. Returns a new allocated buffer.
+static uint8_t *lz_decode(const struct lzss *p, const uint8_t *buf, int len, int *out_len)
+{
+    struct br b;
+    int n = 0, alloc = 4 * len + 256;
+    int copy = 0, dist = 0;
+    uint8_t *d = malloc(alloc);
+
+    br_init(&b, buf, len);
+    br_flush(&b);
+    d[n++] = get_byte(&b);
+    br_flush(&b);
+    while( !br_end(&b) && !b.err )
+    {
+        if( n == alloc )
+            d = realloc(d, alloc *= 2);
+        if( copy )
+        {
+            d[n] = d[n - dist];
+            copy--;
+        }
+        else if( get_bit(&b) )
+            d[n] = get_byte(&b);
+        else
+        {
+            int x = get_byte(&b);
+            x |= get_byte(&b) << 8;
+            int code_pos = x & (p->max_off - 1);
+            copy = ((x >> p->bits_moff) - 1) & ((1<<p->bits_mlen) - 1);
+            dist = (n - code_pos - 2) & (p->max_off - 1);
+            if( !dist )
+                dist = p->max_off;
+            if( dist > n )
+            {
+                free(d);
+                return 0;
+            }
+            d[n] = d[n - dist];
+        }
+        n++;
+    }
+    if( b.err )
+    {
+        free(d);
+        return 0;
+    }
+    *out_len = n;
+    return d;
+}
+
+// Decodes the song, following the same steps as the assembly players
+static int mask_decode(const struct codec *c, struct sapr *s, const uint8_t *buf,
+                       int len, int nchn)
+{
+    const struct mask *p = c->priv;
+    uint8_t *lzbuf = 0;
+    if( p->lz )
+    {
+        lzbuf = lz_decode(p->lzss->priv, buf, len, &len);
+        if( !lzbuf )
+            return -1;
+        buf = lzbuf;
+    }
+
+    int chn_skip[SAPR_MAX_CHN];
+    struct br b;
+    br_init(&b, buf, len);
+    s->size = 0;
+    s->nchn = nchn;
+    s->arena = 0;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        s->data[i] = i < nchn ? arena_alloc(0, SAPR_MAX_FRAMES) : 0;
+        s->xform[i] = 0;
+    }
+
+    // Skipped channels and initial values
+    for(int i=nchn-1; i>=0; i--)
+        chn_skip[i] = i ? get_bit(&b) : 0;
+    br_flush(&b);
+    for(int i=nchn-1; i>=0; i--)
+        s->data[i][0] = get_byte(&b);
+    br_flush(&b);
+
+    int pos;
+    for(pos = 1; !br_end(&b) && pos < SAPR_MAX_FRAMES; pos++)
+    {
+        br_flush_bits(&b);
+        for(int i=nchn-1; i>=0; i--)
+        {
+            uint8_t *d = s->data[i];
+            if( !chn_skip[i] && get_bit(&b) )
+                d[pos] = get_byte(&b);
+            else
+                d[pos] = d[pos-1];
+        }
+    }
+    s->size = pos;
+    free(lzbuf);
+    return b.err ? -1 : 0;
+}
+
+static void mask_free(struct codec *c)
+{
+    struct mask *p = c->priv;
+    codec_free(p->lzss);
+    free(p);
+    free(c);
+}
+
+static const struct codec_ops mask_ops = {
+    mask_parse_new,
+    mask_parse_pos,
+    mask_parse_bits,
+    mask_parse_free,
+    mask_parse_match,
+    mask_parse_range,
+    mask_encode,
+    mask_stats,
+    mask_decode,
+    0,
+    mask_free
+};
+
+struct codec *mask_new(int lz)
+{
+    struct codec *c = calloc(1, sizeof(*c));
+    struct mask *p = calloc(1, sizeof(*p));
+
+    p->lz = lz;
+    if( lz )
+        p->lzss = lzss_new(8, 8, 1, 0, 1);
+
+    c->ops = &mask_ops;
+    c->max_off = 1;
+    c->priv = p;
+    c->player = lz ? "asm/playmasklz.asm" : "asm/playmask.asm";
+    snprintf(c->name, sizeof(c->name), "%s", lz ? "mask-lz" : "mask");
+    return c;
+}
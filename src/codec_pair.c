@@ -0,0 +1,567 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Paired register codec: LZSS as the "-6" format, but selected pairs of
+ * registers are encoded as one stream of 16 bit symbols, so the changes to
+ * both registers in the same frame share the flag bit and the match token.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec_lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Pairs of registers that can be joined in each POKEY, bit "n" of the pair
+// mask in the header is set if the pair "n" is used: AUDF and AUDC of each
+// channel, and the AUDF of the channels that AUDCTL can join in 16 bits.
+#define NUM_PAIRS 6
+static const int pair_regs[NUM_PAIRS][2] = {
+    { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 0, 2 }, { 4, 6 }
+};
+
+// Approximate 6502 cycles added by asm/playpair.asm to each path of the
+// loop in asm/playlzs16.asm, for one register or for a pair. The second
+// register of a pair always copies the bytes stored by the first one.
+#define RCYC_LITERAL1   6
+#define RCYC_MATCH1    10
+#define RCYC_LITERAL2  82
+#define RCYC_MATCH2    23
+
+struct pair
+{
+    int bits_moff;          // Number of bits used for OFFSET
+    int bits_mlen;          // Number of bits used for MATCH
+    int min_mlen;           // Minimum match length
+    int max_mlen;           // Maximum match length
+    int max_off;            // Frames of history of each register
+    int bits_match;         // Bits for a match
+    struct codec *lzss;     // LZSS codec, for the parse before encoding
+    // Statistics of the last encoded song
+    int mask[SAPR_MAX_POKEY]; // Pairs used in each POKEY
+    int tokens;             // Number of tokens
+    int tokens_single;      // Number of tokens without pairs
+    long cycles;            // Player cycles of all frames
+    int max_cycles;         // Player cycles of the slowest frame
+};
+
+// Optimal parse of one stream, of one register or of a pair
+struct pair_parse
+{
+    int *bits;              // Number of bits from position to the end
+    int *mlen;              // Best match length at position (0 == no match)
+    int *mpos;              // Best match offset at position
+    int tokens;             // Number of tokens
+    long cycles;            // Player cycles of all frames, without the
+                            // refill of the flag bits
+};
+
+// Parse of one stream. The pairs are selected in pair_encode(), before the
+// stream is parsed with the LZSS codec, as an estimation.
+struct pair_st
+{
+    const uint8_t *data;
+    int size;
+    const struct codec *lzss;
+    void *lz;               // LZSS parse of the register alone
+    int parsed;             // The parse below is filled
+    int partner;            // Other register of the pair, -1 if none
+    int joined;             // This register is decoded with the other one
+    struct pair_parse pr;
+    struct arena *arena;
+};
+
+static void *pair_parse_new(const struct codec *c, const uint8_t *data, int size,
+                            struct arena *a)
+{
+    const struct pair *p = c->priv;
+    struct pair_st *m = arena_alloc(a, sizeof(*m));
+    memset(m, 0, sizeof(*m));
+    m->data = data;
+    m->size = size;
+    m->lzss = p->lzss;
+    m->lz = p->lzss->ops->parse_new(p->lzss, data, size, a);
+    m->partner = -1;
+    m->arena = a;
+    return m;
+}
+
+static void parse_release(struct pair_parse *pr)
+{
+    free(pr->bits);
+    free(pr->mlen);
+    free(pr->mpos);
+    memset(pr, 0, sizeof(*pr));
+}
+
+static void pair_parse_free(void *st)
+{
+    struct pair_st *m = st;
+    parse_release(&m->pr);
+    m->lzss->ops->parse_free(m->lz);
+    arena_release(m->arena, m);
+}
+
+static int pair_parse_bits(const void *st, int pos)
+{
+    const struct pair_st *m = st;
+    if( !m->parsed )
+        return m->lzss->ops->parse_bits(m->lz, pos);
+    if( m->joined )
+        return 0;
+    return pos < m->size ? m->pr.bits[pos] : 0;
+}
+
+static void pair_parse_pos(const struct codec *c, void *st, const struct mrun *mr)
+{
+    const struct pair *p = c->priv;
+    struct pair_st *m = st;
+    p->lzss->ops->parse_pos(p->lzss, m->lz, mr);
+}
+
+static void pair_parse_match(const struct codec *c, void *st, const struct mrun *mr)
+{
+    const struct pair *p = c->priv;
+    struct pair_st *m = st;
+    p->lzss->ops->parse_match(p->lzss, m->lz, mr);
+}
+
+static void pair_parse_range(const struct codec *c, void *st, int start)
+{
+    const struct pair *p = c->priv;
+    struct pair_st *m = st;
+    p->lzss->ops->parse_range(p->lzss, m->lz, start);
+}
+
+// Parses the stream of register "a", joined with register "b" if not NULL,
+// from the end. With "last_literal" the last symbol is encoded as a literal,
+// so the decoder can detect the end of the song.
+static void pair_parse(const struct pair *p, const uint8_t *a, const uint8_t *b, int size,
+                       int last_literal, struct pair_parse *pr)
+{
+    int *run = calloc(sizeof(int), p->max_off + 1);
+    int end = size - last_literal;
+    int bits_literal = 1 + (b ? 16 : 8);
+    // The player copies the match length to the second register without
+    // the wrap of the longest length to 0
+    int max_mlen = b ? p->max_mlen - 1 : p->max_mlen;
+    pr->bits = calloc(sizeof(int), size + 1);
+    pr->mlen = calloc(sizeof(int), size + 1);
+    pr->mpos = calloc(sizeof(int), size + 1);
+    if( !run || !pr->bits || !pr->mlen || !pr->mpos )
+    {
+        fprintf(stderr, "error: out of memory in match finder\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int pos=size-1; pos>0; pos--)
+    {
+        // Match length at each offset, keeping the longest
+        int ml = 0, mp = 0;
+        int mx = end - pos;
+        if( mx > max_mlen )
+            mx = max_mlen;
+        int omax = p->max_off < pos ? p->max_off : pos;
+        for(int off=omax; off>0; off--)
+        {
+            int eq = a[pos] == a[pos-off] && (!b || b[pos] == b[pos-off]);
+            run[off] = eq ? run[off] + 1 : 0;
+            int l = run[off] < mx ? run[off] : mx;
+            if( l > ml )
+            {
+                ml = l;
+                mp = off;
+            }
+        }
+
+        // Select the best encoding
+        int best = pr->bits[pos+1] + bits_literal;
+        pr->mlen[pos] = 0;
+        for(int l=p->min_mlen; l<=ml; l++)
+        {
+            if( pr->bits[pos+l] + p->bits_match < best )
+            {
+                best = pr->bits[pos+l] + p->bits_match;
+                pr->mlen[pos] = l;
+                pr->mpos[pos] = mp;
+            }
+        }
+        pr->bits[pos] = best;
+    }
+
+    // Count the tokens and the cycles, the other register of a pair copies
+    // each byte
+    pr->tokens = 0;
+    pr->cycles = 0;
+    for(int pos=1; pos<size; )
+    {
+        int mlen = pr->mlen[pos];
+        pr->tokens++;
+        pr->cycles += CYC_BIT + (b ? CYC_COPY : 0);
+        if( mlen < p->min_mlen )
+        {
+            pr->cycles += CYC_LITERAL + (b ? RCYC_LITERAL2 : RCYC_LITERAL1);
+            pos++;
+            continue;
+        }
+        pr->cycles += CYC_MATCH + (b ? RCYC_MATCH2 : RCYC_MATCH1);
+        pr->cycles += (mlen - 1L) * (b ? 2 : 1) * CYC_COPY;
+        pos += mlen;
+    }
+    free(run);
+}
+
+// Selects the pairs of the POKEY starting at register "r0" that give the
+// smallest size, without making the player slower than with the registers
+// alone. Returns the pair mask.
+static int pair_select(const struct pair *p, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], struct pair_st **m, int r0,
+                       struct pair_parse cand[NUM_PAIRS])
+{
+    int valid = 0;
+    for(int n=0; n<NUM_PAIRS; n++)
+    {
+        int a = r0 + pair_regs[n][0], b = r0 + pair_regs[n][1];
+        if( chn_skip[a] || chn_skip[b] )
+            continue;
+        pair_parse(p, s->data[b], s->data[a], s->size, a == 0, &cand[n]);
+        valid |= 1 << n;
+    }
+
+    int best_mask = 0;
+    long best = 0, max_cycles = 0;
+    for(int mask=0; mask < (1 << NUM_PAIRS); mask++)
+    {
+        if( (mask & valid) != mask )
+            continue;
+        // Each register in only one pair
+        int used = 0, ok = 1;
+        long bits = 0, cycles = 0;
+        for(int n=0; n<NUM_PAIRS && ok; n++)
+        {
+            if( !(mask & (1 << n)) )
+                continue;
+            int rm = (1 << pair_regs[n][0]) | (1 << pair_regs[n][1]);
+            ok = !(used & rm);
+            used |= rm;
+            bits += cand[n].bits[1];
+            cycles += cand[n].cycles;
+        }
+        if( !ok )
+            continue;
+        for(int i=0; i<9; i++)
+        {
+            if( !(used & (1 << i)) && !chn_skip[r0 + i] )
+            {
+                bits += m[r0 + i]->pr.bits[1];
+                cycles += m[r0 + i]->pr.cycles;
+            }
+        }
+        if( !mask )
+            max_cycles = cycles;
+        else if( cycles > max_cycles )
+            continue;
+        if( !mask || bits < best )
+        {
+            best = bits;
+            best_mask = mask;
+        }
+    }
+    return best_mask;
+}
+
+// Returns the cycles of reading "n" flag bits, "bits" is the number of bits
+// left in the flag byte
+static int bit_cycles(int *bits, int n)
+{
+    int cyc = 0;
+    for(int k=0; k<n; k++)
+    {
+        cyc += *bits ? CYC_BIT : CYC_REFILL;
+        *bits = *bits ? *bits - 1 : 7;
+    }
+    return cyc;
+}
+
+// Writes the token at "pos" if it is after the last token written, that ends
+// at "lpos". Returns the position of the last symbol of the written token.
+static int pair_token(const struct pair *p, struct bf *b, const struct sapr *s,
+                      const struct pair_st *m, int pos, int lpos)
+{
+    if( pos <= lpos )
+        return lpos;
+    int mlen = m->pr.mlen[pos];
+    if( mlen < p->min_mlen )
+    {
+        add_bit(b, 1);
+        add_byte(b, m->data[pos]);
+        if( m->partner >= 0 )
+            add_byte(b, s->data[m->partner][pos]);
+        return pos;
+    }
+    int code_pos = (pos - m->pr.mpos[pos] - 2) & (p->max_off - 1);
+    int mb = ((mlen - p->min_mlen + 1) << p->bits_moff) + code_pos;
+    add_bit(b, 0);
+    add_byte(b, mb & 0xFF);
+    add_byte(b, mb >> 8);
+    return pos + mlen - 1;
+}
+
+static void pair_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN])
+{
+    struct pair *p = c->priv;
+    struct pair_st **m = (struct pair_st **)st;
+    int lpos[SAPR_MAX_CHN];
+    int bits = 0;
+
+    // Parse each register alone, stream 0 is never skipped and ends in a
+    // literal
+    p->tokens_single = 0;
+    for(int i=0; i<s->nchn; i++)
+    {
+        if( chn_skip[i] )
+            continue;
+        parse_release(&m[i]->pr);
+        pair_parse(p, s->data[i], 0, s->size, i == 0, &m[i]->pr);
+        m[i]->partner = -1;
+        m[i]->joined = 0;
+        m[i]->parsed = 1;
+        p->tokens_single += m[i]->pr.tokens;
+    }
+
+    // Select the pairs, and replace the parse of the last register of each
+    // pair with the parse of the pair, as it is decoded first
+    for(int k=0; k<s->nchn/9; k++)
+    {
+        struct pair_parse cand[NUM_PAIRS];
+        memset(cand, 0, sizeof(cand));
+        p->mask[k] = pair_select(p, s, chn_skip, m, 9 * k, cand);
+        for(int n=0; n<NUM_PAIRS; n++)
+        {
+            if( p->mask[k] & (1 << n) )
+            {
+                struct pair_st *ma = m[9 * k + pair_regs[n][0]];
+                struct pair_st *mb = m[9 * k + pair_regs[n][1]];
+                parse_release(&mb->pr);
+                mb->pr = cand[n];
+                mb->partner = 9 * k + pair_regs[n][0];
+                ma->joined = 1;
+            }
+            else
+                parse_release(&cand[n]);
+        }
+    }
+
+    // Skipped channels, pairs and initial values
+    for(int i=s->nchn-1; i>0; i--)
+        add_bit(b, chn_skip[i]);
+    bflush(b);
+    for(int k=0; k<s->nchn/9; k++)
+        add_byte(b, p->mask[k]);
+    for(int i=s->nchn-1; i>=0; i--)
+        add_byte(b, s->data[i][0]);
+    bflush(b);
+
+    p->tokens = 0;
+    p->cycles = 0;
+    p->max_cycles = 0;
+    for(int i=0; i<s->nchn; i++)
+        lpos[i] = 0;
+    for(int pos=1; pos<s->size; pos++)
+    {
+        int cyc = CYC_FRAME;
+        for(int i=s->nchn-1; i>=0; i--)
+        {
+            int two = !chn_skip[i] && m[i]->partner >= 0;
+            if( chn_skip[i] )
+                cyc += CYC_SKIP;
+            else if( m[i]->joined || pos <= lpos[i] )
+                cyc += CYC_COPY;
+            else
+            {
+                lpos[i] = pair_token(p, b, s, m[i], pos, lpos[i]);
+                p->tokens++;
+                cyc += bit_cycles(&bits, 1);
+                if( m[i]->pr.mlen[pos] < p->min_mlen )
+                    cyc += CYC_LITERAL + (two ? RCYC_LITERAL2 : RCYC_LITERAL1);
+                else
+                    cyc += CYC_MATCH + (two ? RCYC_MATCH2 : RCYC_MATCH1);
+            }
+        }
+        p->cycles += cyc;
+        if( cyc > p->max_cycles )
+            p->max_cycles = cyc;
+    }
+}
+
+static void pair_stats(const struct codec *c, FILE *out, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total, int level)
+{
+    const struct pair *p = c->priv;
+    int sz = s->size;
+    fprintf(out,"PAIR: pairs=");
+    int np = 0;
+    for(int k=0; k<s->nchn/9; k++)
+        for(int n=0; n<NUM_PAIRS; n++)
+            if( p->mask[k] & (1 << n) )
+                fprintf(out,"%s%d+%d", np++ ? "," : " ",
+                        9 * k + pair_regs[n][1], 9 * k + pair_regs[n][0]);
+    fprintf(out,"%s,\ttokens= %d (%d without pairs),\t", np ? "" : " none",
+            p->tokens, p->tokens_single);
+    fprintf(out,"ratio: %5d / %d = %5.2f%%\n", total, s->nchn*sz,
+            (100.0*total) / (1.0*s->nchn*sz));
+    if( level && sz > 1 && c->player == codec_player(c, s) )
+        fprintf(out,"Player cycles per frame: %s %.1f (max %d), buffer RAM %d bytes\n",
+                c->player, p->cycles / (sz - 1.0), p->max_cycles, p->max_off * s->nchn);
+    if( level )
+        codec_stream_stats(c, out, s, chn_skip, st, total);
+}
+
+// Decodes the song, following the same steps as the assembly player
+static int pair_decode(const struct codec *c, struct sapr *s, const uint8_t *buf,
+                       int len, int nchn)
+{
+    const struct pair *p = c->priv;
+    int chn_skip[SAPR_MAX_CHN];
+    int partner[SAPR_MAX_CHN];  // Other register of the pair, -1 if none
+    int joined[SAPR_MAX_CHN];   // Decoded with the other register of the pair
+    int copy[SAPR_MAX_CHN];     // Remaining match length
+    int dist[SAPR_MAX_CHN];     // Match distance
+    struct br b;
+
+    br_init(&b, buf, len);
+    s->size = 0;
+    s->nchn = nchn;
+    s->arena = 0;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        s->data[i] = i < nchn ? arena_alloc(0, SAPR_MAX_FRAMES) : 0;
+        s->xform[i] = 0;
+    }
+
+    for(int i=nchn-1; i>=0; i--)
+    {
+        chn_skip[i] = i ? get_bit(&b) : 0;
+        partner[i] = -1;
+        joined[i] = 0;
+        copy[i] = 0;
+        dist[i] = 0;
+    }
+    br_flush(&b);
+    // The first register of each pair is decoded with the last one
+    for(int k=0; k<nchn/9; k++)
+    {
+        int mask = get_byte(&b), used = 0;
+        for(int n=0; n<NUM_PAIRS; n++)
+        {
+            if( !(mask & (1 << n)) )
+                continue;
+            int ra = 9 * k + pair_regs[n][0], rb = 9 * k + pair_regs[n][1];
+            int rm = (1 << pair_regs[n][0]) | (1 << pair_regs[n][1]);
+            if( (used & rm) || chn_skip[ra] || chn_skip[rb] )
+                return -1;
+            used |= rm;
+            partner[rb] = ra;
+            joined[ra] = 1;
+        }
+        if( mask >> NUM_PAIRS )
+            return -1;
+    }
+    for(int i=nchn-1; i>=0; i--)
+        s->data[i][0] = get_byte(&b);
+    br_flush(&b);
+
+    int pos;
+    for(pos = 1; !br_end(&b) && pos < SAPR_MAX_FRAMES; pos++)
+    {
+        for(int i=nchn-1; i>=0; i--)
+        {
+            uint8_t *d = s->data[i];
+            uint8_t *d2 = partner[i] >= 0 ? s->data[partner[i]] : 0;
+            if( chn_skip[i] )
+                d[pos] = d[0];
+            else if( joined[i] )
+                continue;
+            else if( copy[i] )
+            {
+                d[pos] = d[pos - dist[i]];
+                if( d2 )
+                    d2[pos] = d2[pos - dist[i]];
+                copy[i]--;
+            }
+            else if( get_bit(&b) )
+            {
+                d[pos] = get_byte(&b);
+                if( d2 )
+                    d2[pos] = get_byte(&b);
+            }
+            else
+            {
+                int x = get_byte(&b);
+                x |= get_byte(&b) << 8;
+                int code_pos = x & (p->max_off - 1);
+                copy[i] = ((x >> p->bits_moff) - 1) & ((1 << p->bits_mlen) - 1);
+                copy[i] += p->min_mlen - 1;
+                dist[i] = (pos - code_pos - 2) & (p->max_off - 1);
+                if( !dist[i] )
+                    dist[i] = p->max_off;
+                if( dist[i] > pos )
+                    return -1;
+                d[pos] = d[pos - dist[i]];
+                if( d2 )
+                    d2[pos] = d2[pos - dist[i]];
+            }
+        }
+        if( b.err )
+            return -1;
+    }
+    s->size = pos;
+    return 0;
+}
+
+static void pair_free(struct codec *c)
+{
+    struct pair *p = c->priv;
+    codec_free(p->lzss);
+    free(p);
+    free(c);
+}
+
+static const struct codec_ops pair_ops = {
+    pair_parse_new,
+    pair_parse_pos,
+    pair_parse_bits,
+    pair_parse_free,
+    pair_parse_match,
+    pair_parse_range,
+    pair_encode,
+    pair_stats,
+    pair_decode,
+    0,
+    pair_free
+};
+
+struct codec *pair_new(int bits_moff)
+{
+    struct codec *c = calloc(1, sizeof(*c));
+    struct pair *p = calloc(1, sizeof(*p));
+
+    p->bits_moff = bits_moff;
+    p->bits_mlen = 16 - bits_moff;
+    p->min_mlen = 1;
+    p->max_off = 1 << bits_moff;
+    p->max_mlen = (1 << p->bits_mlen) + p->min_mlen - 1;
+    p->bits_match = 1 + 16;
+    p->lzss = lzss_new(bits_moff, p->bits_mlen, p->min_mlen, 0, 1);
+
+    c->ops = &pair_ops;
+    c->max_off = p->max_off;
+    c->max_mlen = p->max_mlen;
+    c->priv = p;
+    c->player = bits_moff == 8 ? "asm/playpair.asm" : 0;
+    snprintf(c->name, sizeof(c->name), "pair-%d", bits_moff);
+    return c;
+}
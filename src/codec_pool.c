@@ -0,0 +1,454 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Shared pool codec: LZSS with one token stream for each register, as the
+ * "-6" format, but the history buffers of all the registers form one pool,
+ * so a match can copy from the history of any other register.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec_lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define bits_literal (1+8)      // Number of bits for encoding a literal
+
+// Approximate 6502 cycles of the extra paths of asm/playpool.asm, the other
+// paths are the same as asm/playlzs16.asm
+#define PCYC_COPY      7    // Load the page of the match source
+#define PCYC_SAME     25    // Match from the same register
+#define PCYC_OTHER   105    // Match from other register, without the bits
+
+struct pool
+{
+    int bits_moff;          // Number of bits used for OFFSET
+    int bits_mlen;          // Number of bits used for MATCH
+    int min_mlen;           // Minimum match length
+    int max_mlen;           // Maximum match length
+    int max_off;            // Frames of history of each register
+    int bits_chn;           // Bits for the source register
+    int bits_same;          // Bits for a match in the same register
+    int bits_other;         // Bits for a match in other register
+    struct codec *lzss;     // LZSS codec, for the parse before encoding
+    // Statistics of the last encoded song
+    int matches;            // Number of matches
+    int other;              // Number of matches from other registers
+    long cycles;            // Player cycles of all frames
+    int max_cycles;         // Player cycles of the slowest frame
+};
+
+// Parse of one stream. The matches can reference all the streams, so the
+// parse is done in pool_encode(), when all the streams are known. Before, the
+// stream is parsed with only the matches in the same stream, as an estimation.
+struct pool_st
+{
+    const uint8_t *data;
+    int size;
+    const struct codec *lzss;
+    void *lz;               // LZSS parse, with the matches in the same stream
+    int parsed;             // The arrays below are filled
+    int *bits;              // Number of bits from position to the end
+    int *mlen;              // Best match length at position (0 == no match)
+    int *mpos;              // Best match offset at position
+    int *msrc;              // Source stream of the best match
+    struct arena *arena;
+};
+
+static void *pool_parse_new(const struct codec *c, const uint8_t *data, int size,
+                            struct arena *a)
+{
+    const struct pool *p = c->priv;
+    struct pool_st *m = arena_alloc(a, sizeof(*m));
+    m->data = data;
+    m->size = size;
+    m->lzss = p->lzss;
+    m->lz = p->lzss->ops->parse_new(p->lzss, data, size, a);
+    m->parsed = 0;
+    m->bits = arena_calloc(a, sizeof(int) * (size + 1));
+    m->mlen = arena_calloc(a, sizeof(int) * (size + 1));
+    m->mpos = arena_calloc(a, sizeof(int) * (size + 1));
+    m->msrc = arena_calloc(a, sizeof(int) * (size + 1));
+    m->arena = a;
+    return m;
+}
+
+static void pool_parse_free(void *st)
+{
+    struct pool_st *m = st;
+    arena_release(m->arena, m->bits);
+    arena_release(m->arena, m->mlen);
+    arena_release(m->arena, m->mpos);
+    arena_release(m->arena, m->msrc);
+    m->lzss->ops->parse_free(m->lz);
+    arena_release(m->arena, m);
+}
+
+static int pool_parse_bits(const void *st, int pos)
+{
+    const struct pool_st *m = st;
+    if( !m->parsed )
+        return m->lzss->ops->parse_bits(m->lz, pos);
+    return pos < m->size ? m->bits[pos] : 0;
+}
+
+static void pool_parse_pos(const struct codec *c, void *st, const struct mrun *mr)
+{
+    const struct pool *p = c->priv;
+    struct pool_st *m = st;
+    p->lzss->ops->parse_pos(p->lzss, m->lz, mr);
+}
+
+static void pool_parse_match(const struct codec *c, void *st, const struct mrun *mr)
+{
+    const struct pool *p = c->priv;
+    struct pool_st *m = st;
+    p->lzss->ops->parse_match(p->lzss, m->lz, mr);
+}
+
+static void pool_parse_range(const struct codec *c, void *st, int start)
+{
+    const struct pool *p = c->priv;
+    struct pool_st *m = st;
+    p->lzss->ops->parse_range(p->lzss, m->lz, start);
+}
+
+// Bits for the source register, for songs with "nchn" streams
+static int src_bits(int nchn)
+{
+    return nchn > 9 ? 5 : 4;
+}
+
+// Returns 1 if stream "j" can be the source of a match at offset 0 for stream
+// "i", the streams are decoded from the last to the first in each frame.
+static int before(int j, int i)
+{
+    return j > i;
+}
+
+// Parses stream "i" from the end, with the matches from the history of all
+// the not skipped streams. With "last_literal" the last byte is encoded as a
+// literal, so the decoder can detect the end of the song.
+static void pool_parse(const struct pool *p, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], struct pool_st *m, int i,
+                       int last_literal)
+{
+    int nw = p->max_off + 1;
+    int *run = calloc(sizeof(int), nw * s->nchn);
+    const uint8_t *d = s->data[i];
+    int size = m->size, end = size - last_literal;
+    if( !run )
+    {
+        fprintf(stderr, "error: out of memory in match finder\n");
+        exit(EXIT_FAILURE);
+    }
+
+    m->bits[size] = 0;
+    for(int pos=size-1; pos>0; pos--)
+    {
+        // Match length at each offset of each source stream, keeping the
+        // longest in this stream and in the others.
+        int ls = 0, lo = 0, ps = 0, po = 0, so = 0;
+        int mx = end - pos;
+        if( mx > p->max_mlen )
+            mx = p->max_mlen;
+        for(int j=s->nchn-1; j>=0; j--)
+        {
+            if( chn_skip[j] )
+                continue;
+            const uint8_t *dj = s->data[j];
+            int *r = run + j * nw;
+            // The offsets are coded modulo the history size
+            int omin = before(j, i) ? 0 : 1;
+            int omax = p->max_off - 1 + omin;
+            if( omax > pos )
+                omax = pos;
+            for(int off=omax; off>=omin; off--)
+            {
+                r[off] = d[pos] == dj[pos-off] ? r[off] + 1 : 0;
+                int l = r[off] < mx ? r[off] : mx;
+                if( j == i && l > ls )
+                {
+                    ls = l;
+                    ps = off;
+                }
+                else if( j != i && l > lo )
+                {
+                    lo = l;
+                    po = off;
+                    so = j;
+                }
+            }
+        }
+
+        // Select the best encoding
+        int best = m->bits[pos+1] + bits_literal;
+        m->mlen[pos] = 0;
+        for(int l=p->min_mlen; l<=ls || l<=lo; l++)
+        {
+            if( l <= ls && m->bits[pos+l] + p->bits_same < best )
+            {
+                best = m->bits[pos+l] + p->bits_same;
+                m->mlen[pos] = l;
+                m->mpos[pos] = ps;
+                m->msrc[pos] = i;
+            }
+            if( l <= lo && m->bits[pos+l] + p->bits_other < best )
+            {
+                best = m->bits[pos+l] + p->bits_other;
+                m->mlen[pos] = l;
+                m->mpos[pos] = po;
+                m->msrc[pos] = so;
+            }
+        }
+        m->bits[pos] = best;
+    }
+    m->bits[0] = m->bits[1] + 8;
+    m->parsed = 1;
+    free(run);
+}
+
+// Returns the cycles of reading "n" flag bits, "bits" is the number of bits
+// left in the flag byte
+static int bit_cycles(int *bits, int n)
+{
+    int cyc = 0;
+    for(int k=0; k<n; k++)
+    {
+        cyc += *bits ? CYC_BIT : CYC_REFILL;
+        *bits = *bits ? *bits - 1 : 7;
+    }
+    return cyc;
+}
+
+// Writes the token at "pos" if it is after the last token written, that ends
+// at "lpos". Returns the position of the last byte of the written token.
+static int pool_token(struct pool *p, struct bf *b, const struct pool_st *m, int i,
+                      int pos, int lpos)
+{
+    if( pos <= lpos )
+        return lpos;
+    int mlen = m->mlen[pos];
+    if( mlen < p->min_mlen )
+    {
+        add_bit(b, 1);
+        add_byte(b, m->data[pos]);
+        return pos;
+    }
+    // The match as in the LZSS format, followed by the source register
+    int code_pos = (pos - m->mpos[pos] - 2) & (p->max_off - 1);
+    int mb = ((mlen - p->min_mlen + 1) << p->bits_moff) + code_pos;
+    add_bit(b, 0);
+    add_byte(b, mb & 0xFF);
+    add_byte(b, mb >> 8);
+    add_bit(b, m->msrc[pos] != i);
+    if( m->msrc[pos] != i )
+    {
+        for(int k=p->bits_chn-1; k>=0; k--)
+            add_bit(b, (m->msrc[pos] >> k) & 1);
+        p->other++;
+    }
+    p->matches++;
+    return pos + mlen - 1;
+}
+
+static void pool_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN])
+{
+    struct pool *p = c->priv;
+    struct pool_st **m = (struct pool_st **)st;
+    int lpos[SAPR_MAX_CHN];
+    int bits = 0;
+
+    // Stream 0 is never skipped, it ends in a literal
+    p->bits_chn = src_bits(s->nchn);
+    p->bits_other = p->bits_same + p->bits_chn;
+    for(int i=0; i<s->nchn; i++)
+        if( !chn_skip[i] )
+            pool_parse(p, s, chn_skip, m[i], i, i == 0);
+
+    // Skipped channels and initial values, as the LZSS format
+    for(int i=s->nchn-1; i>0; i--)
+        add_bit(b, chn_skip[i]);
+    bflush(b);
+    for(int i=s->nchn-1; i>=0; i--)
+        add_byte(b, s->data[i][0]);
+    bflush(b);
+
+    p->matches = 0;
+    p->other = 0;
+    p->cycles = 0;
+    p->max_cycles = 0;
+    for(int i=0; i<s->nchn; i++)
+        lpos[i] = 0;
+    for(int pos=1; pos<s->size; pos++)
+    {
+        int cyc = CYC_FRAME;
+        for(int i=s->nchn-1; i>=0; i--)
+        {
+            if( chn_skip[i] )
+                cyc += CYC_SKIP;
+            else if( pos <= lpos[i] )
+                cyc += CYC_COPY + PCYC_COPY;
+            else
+            {
+                lpos[i] = pool_token(p, b, m[i], i, pos, lpos[i]);
+                cyc += bit_cycles(&bits, 1);
+                if( m[i]->mlen[pos] < p->min_mlen )
+                    cyc += CYC_LITERAL;
+                else if( m[i]->msrc[pos] == i )
+                    cyc += CYC_MATCH + PCYC_COPY + PCYC_SAME + bit_cycles(&bits, 1);
+                else
+                    cyc += CYC_MATCH + PCYC_COPY + PCYC_OTHER +
+                           bit_cycles(&bits, 1 + p->bits_chn);
+            }
+        }
+        p->cycles += cyc;
+        if( cyc > p->max_cycles )
+            p->max_cycles = cyc;
+    }
+}
+
+static void pool_stats(const struct codec *c, FILE *out, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN], int total, int level)
+{
+    const struct pool *p = c->priv;
+    int sz = s->size;
+    fprintf(out,"POOL: history= %d x %d,\tmatches= %d (%d from other registers),\t",
+            s->nchn, p->max_off, p->matches, p->other);
+    fprintf(out,"ratio: %5d / %d = %5.2f%%\n", total, s->nchn*sz,
+            (100.0*total) / (1.0*s->nchn*sz));
+    if( level && sz > 1 && c->player == codec_player(c, s) )
+        fprintf(out,"Player cycles per frame: %s %.1f (max %d), buffer RAM %d bytes\n",
+                c->player, p->cycles / (sz - 1.0), p->max_cycles, p->max_off * s->nchn);
+    if( level )
+        codec_stream_stats(c, out, s, chn_skip, st, total);
+}
+
+// Decodes the song, following the same steps as the assembly player
+static int pool_decode(const struct codec *c, struct sapr *s, const uint8_t *buf,
+                       int len, int nchn)
+{
+    const struct pool *p = c->priv;
+    int chn_skip[SAPR_MAX_CHN];
+    int copy[SAPR_MAX_CHN];     // Remaining match length
+    int dist[SAPR_MAX_CHN];     // Match distance
+    int src[SAPR_MAX_CHN];      // Match source stream
+    struct br b;
+
+    br_init(&b, buf, len);
+    s->size = 0;
+    s->nchn = nchn;
+    s->arena = 0;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        s->data[i] = i < nchn ? arena_alloc(0, SAPR_MAX_FRAMES) : 0;
+        s->xform[i] = 0;
+    }
+
+    for(int i=nchn-1; i>=0; i--)
+    {
+        chn_skip[i] = i ? get_bit(&b) : 0;
+        copy[i] = 0;
+        dist[i] = 0;
+        src[i] = i;
+    }
+    br_flush(&b);
+    for(int i=nchn-1; i>=0; i--)
+        s->data[i][0] = get_byte(&b);
+    br_flush(&b);
+
+    int pos;
+    for(pos = 1; !br_end(&b) && pos < SAPR_MAX_FRAMES; pos++)
+    {
+        for(int i=nchn-1; i>=0; i--)
+        {
+            uint8_t *d = s->data[i];
+            if( chn_skip[i] )
+                d[pos] = d[0];
+            else if( copy[i] )
+            {
+                d[pos] = s->data[src[i]][pos - dist[i]];
+                copy[i]--;
+            }
+            else if( get_bit(&b) )
+                d[pos] = get_byte(&b);
+            else
+            {
+                int x = get_byte(&b);
+                x |= get_byte(&b) << 8;
+                int code_pos = x & (p->max_off - 1);
+                copy[i] = ((x >> p->bits_moff) - 1) & ((1 << p->bits_mlen) - 1);
+                copy[i] += p->min_mlen - 1;
+                src[i] = i;
+                if( get_bit(&b) )
+                {
+                    src[i] = 0;
+                    for(int k=0; k<src_bits(nchn); k++)
+                        src[i] = (src[i] << 1) | get_bit(&b);
+                }
+                // Offset 0 reads the source stream in the same frame if it
+                // is already decoded, else the oldest frame of the history.
+                dist[i] = (pos - code_pos - 2) & (p->max_off - 1);
+                if( !dist[i] && !before(src[i], i) )
+                    dist[i] = p->max_off;
+                if( src[i] >= nchn || chn_skip[src[i]] || (src[i] == i && !dist[i]) ||
+                    dist[i] > pos )
+                    return -1;
+                d[pos] = s->data[src[i]][pos - dist[i]];
+            }
+        }
+        if( b.err )
+            return -1;
+    }
+    s->size = pos;
+    return 0;
+}
+
+static void pool_free(struct codec *c)
+{
+    struct pool *p = c->priv;
+    codec_free(p->lzss);
+    free(p);
+    free(c);
+}
+
+static const struct codec_ops pool_ops = {
+    pool_parse_new,
+    pool_parse_pos,
+    pool_parse_bits,
+    pool_parse_free,
+    pool_parse_match,
+    pool_parse_range,
+    pool_encode,
+    pool_stats,
+    pool_decode,
+    0,
+    pool_free
+};
+
+struct codec *pool_new(int bits_moff)
+{
+    struct codec *c = calloc(1, sizeof(*c));
+    struct pool *p = calloc(1, sizeof(*p));
+
+    p->bits_moff = bits_moff;
+    p->bits_mlen = 16 - bits_moff;
+    p->min_mlen = 1;
+    p->max_off = 1 << bits_moff;
+    p->max_mlen = (1 << p->bits_mlen) + p->min_mlen - 1;
+    p->bits_chn = src_bits(SAPR_MAX_CHN / 2);
+    p->bits_same = 1 + 16 + 1;
+    p->bits_other = p->bits_same + p->bits_chn;
+    p->lzss = lzss_new(bits_moff, p->bits_mlen, p->min_mlen, 0, 1);
+
+    c->ops = &pool_ops;
+    c->max_off = p->max_off;
+    c->max_mlen = p->max_mlen;
+    c->priv = p;
+    c->player = bits_moff == 8 ? "asm/playpool.asm" : 0;
+    snprintf(c->name, sizeof(c->name), "pool-%d", bits_moff);
+    return c;
+}
@@ -0,0 +1,393 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Simple 6502 emulator, used to run the player code of SAP files.
+ *
+ * Only the documented instructions are implemented, without cycle timing,
+ * as the SAP-R data only depends on the values written to POKEY after each
+ * call to the player.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "cpu6502.h"
+#include <string.h>
+
+// Flags
+#define FC 0x01
+#define FZ 0x02
+#define FI 0x04
+#define FD 0x08
+#define FB 0x10
+#define FU 0x20
+#define FV 0x40
+#define FN 0x80
+
+// Return address used to detect the end of the called routine
+#define CALL_RET 0xFFFF
+
+static uint8_t rd(struct cpu6502 *c, uint16_t addr)
+{
+    if( (addr & 0xF800) == 0xD000 && c->io_read )
+        return c->io_read(c->ctx, addr);
+    return c->mem[addr];
+}
+
+static void wr(struct cpu6502 *c, uint16_t addr, uint8_t val)
+{
+    if( (addr & 0xF800) == 0xD000 && c->io_write )
+        c->io_write(c->ctx, addr, val);
+    c->mem[addr] = val;
+}
+
+static uint16_t rd16(struct cpu6502 *c, uint16_t addr)
+{
+    return rd(c, addr) | (rd(c, addr + 1) << 8);
+}
+
+// Reads a 16 bit pointer from zero page, wrapping at the page end
+static uint16_t rd16_zp(struct cpu6502 *c, uint8_t addr)
+{
+    return c->mem[addr] | (c->mem[(uint8_t)(addr + 1)] << 8);
+}
+
+static void push(struct cpu6502 *c, uint8_t val)
+{
+    c->mem[0x100 + c->s--] = val;
+}
+
+static uint8_t pull(struct cpu6502 *c)
+{
+    return c->mem[0x100 + ++c->s];
+}
+
+static uint8_t setnz(struct cpu6502 *c, uint8_t val)
+{
+    c->p = (c->p & ~(FN | FZ)) | (val & FN) | (val ? 0 : FZ);
+    return val;
+}
+
+static void adc(struct cpu6502 *c, uint8_t val)
+{
+    int carry = c->p & FC;
+    if( c->p & FD )
+    {
+        // NMOS decimal mode, N and V from the intermediate result
+        int lo = (c->a & 0x0F) + (val & 0x0F) + carry;
+        if( lo > 9 )
+            lo += 6;
+        int hi = (c->a >> 4) + (val >> 4) + (lo > 0x0F);
+        int z = ((c->a + val + carry) & 0xFF) == 0;
+        c->p &= ~(FN | FV | FZ | FC);
+        c->p |= (hi & 8) ? FN : 0;
+        c->p |= (~(c->a ^ val) & (c->a ^ (hi << 4)) & 0x80) ? FV : 0;
+        c->p |= z ? FZ : 0;
+        if( hi > 9 )
+            hi += 6;
+        c->p |= (hi > 0x0F) ? FC : 0;
+        c->a = ((hi & 0x0F) << 4) | (lo & 0x0F);
+    }
+    else
+    {
+        int r = c->a + val + carry;
+        c->p &= ~(FV | FC);
+        c->p |= (~(c->a ^ val) & (c->a ^ r) & 0x80) ? FV : 0;
+        c->p |= (r > 0xFF) ? FC : 0;
+        c->a = setnz(c, r);
+    }
+}
+
+static void sbc(struct cpu6502 *c, uint8_t val)
+{
+    int borrow = (c->p & FC) ? 0 : 1;
+    int r = c->a - val - borrow;
+    if( c->p & FD )
+    {
+        // NMOS decimal mode, the flags are from the binary result
+        int lo = (c->a & 0x0F) - (val & 0x0F) - borrow;
+        int hi = (c->a >> 4) - (val >> 4) - (lo < 0);
+        if( lo < 0 )
+            lo -= 6;
+        if( hi < 0 )
+            hi -= 6;
+        c->p &= ~(FV | FC);
+        c->p |= ((c->a ^ val) & (c->a ^ r) & 0x80) ? FV : 0;
+        c->p |= (r >= 0) ? FC : 0;
+        setnz(c, r);
+        c->a = ((hi & 0x0F) << 4) | (lo & 0x0F);
+    }
+    else
+    {
+        c->p &= ~(FV | FC);
+        c->p |= ((c->a ^ val) & (c->a ^ r) & 0x80) ? FV : 0;
+        c->p |= (r >= 0) ? FC : 0;
+        c->a = setnz(c, r);
+    }
+}
+
+static void cmp(struct cpu6502 *c, uint8_t reg, uint8_t val)
+{
+    int r = reg - val;
+    c->p = (c->p & ~FC) | (r >= 0 ? FC : 0);
+    setnz(c, r);
+}
+
+// Read-modify-write operations, "op" is bits 5-7 of the opcode
+static uint8_t rmw(struct cpu6502 *c, int op, uint8_t val)
+{
+    int r;
+    switch( op )
+    {
+        case 0: // ASL
+            c->p = (c->p & ~FC) | (val >> 7);
+            return setnz(c, val << 1);
+        case 1: // ROL
+            r = (val << 1) | (c->p & FC);
+            c->p = (c->p & ~FC) | (val >> 7);
+            return setnz(c, r);
+        case 2: // LSR
+            c->p = (c->p & ~FC) | (val & 1);
+            return setnz(c, val >> 1);
+        case 3: // ROR
+            r = (val >> 1) | ((c->p & FC) << 7);
+            c->p = (c->p & ~FC) | (val & 1);
+            return setnz(c, r);
+        case 6: // DEC
+            return setnz(c, val - 1);
+        default: // INC
+            return setnz(c, val + 1);
+    }
+}
+
+// Executes one instruction, returns -1 on invalid instructions
+static int step(struct cpu6502 *c)
+{
+    uint8_t op = rd(c, c->pc++);
+    uint16_t ea = 0;
+    int t;
+
+    // Instructions with irregular encoding
+    switch( op )
+    {
+        case 0x00: // BRK
+            c->pc++;
+            push(c, c->pc >> 8);
+            push(c, c->pc);
+            push(c, c->p | FB | FU);
+            c->p |= FI;
+            c->pc = rd16(c, 0xFFFE);
+            return 0;
+        case 0x20: // JSR
+            ea = rd16(c, c->pc);
+            c->pc++;
+            push(c, c->pc >> 8);
+            push(c, c->pc);
+            c->pc = ea;
+            return 0;
+        case 0x40: // RTI
+            c->p = pull(c) | FU;
+            c->pc = pull(c);
+            c->pc |= pull(c) << 8;
+            return 0;
+        case 0x60: // RTS
+            c->pc = pull(c);
+            c->pc |= pull(c) << 8;
+            c->pc++;
+            return 0;
+        case 0x4C: // JMP abs
+            c->pc = rd16(c, c->pc);
+            return 0;
+        case 0x6C: // JMP (ind), with the page wrap bug
+            ea = rd16(c, c->pc);
+            c->pc = rd(c, ea) | (rd(c, (ea & 0xFF00) | ((ea + 1) & 0xFF)) << 8);
+            return 0;
+        case 0x08: push(c, c->p | FB | FU); return 0;   // PHP
+        case 0x28: c->p = pull(c) | FU; return 0;       // PLP
+        case 0x48: push(c, c->a); return 0;             // PHA
+        case 0x68: c->a = setnz(c, pull(c)); return 0;  // PLA
+        case 0x18: c->p &= ~FC; return 0;               // CLC
+        case 0x38: c->p |= FC; return 0;                // SEC
+        case 0x58: c->p &= ~FI; return 0;               // CLI
+        case 0x78: c->p |= FI; return 0;                // SEI
+        case 0xB8: c->p &= ~FV; return 0;               // CLV
+        case 0xD8: c->p &= ~FD; return 0;               // CLD
+        case 0xF8: c->p |= FD; return 0;                // SED
+        case 0x88: c->y = setnz(c, c->y - 1); return 0; // DEY
+        case 0xC8: c->y = setnz(c, c->y + 1); return 0; // INY
+        case 0xCA: c->x = setnz(c, c->x - 1); return 0; // DEX
+        case 0xE8: c->x = setnz(c, c->x + 1); return 0; // INX
+        case 0x8A: c->a = setnz(c, c->x); return 0;     // TXA
+        case 0x98: c->a = setnz(c, c->y); return 0;     // TYA
+        case 0xAA: c->x = setnz(c, c->a); return 0;     // TAX
+        case 0xA8: c->y = setnz(c, c->a); return 0;     // TAY
+        case 0xBA: c->x = setnz(c, c->s); return 0;     // TSX
+        case 0x9A: c->s = c->x; return 0;               // TXS
+        case 0xEA: return 0;                            // NOP
+    }
+
+    // Branches
+    if( (op & 0x1F) == 0x10 )
+    {
+        static const uint8_t flag[4] = { FN, FV, FC, FZ };
+        int8_t off = rd(c, c->pc++);
+        int set = (c->p & flag[op >> 6]) != 0;
+        if( set == ((op >> 5) & 1) )
+            c->pc += off;
+        return 0;
+    }
+
+    // Addressing modes of the regular instructions
+    int cc = op & 3, bbb = (op >> 2) & 7, aaa = op >> 5;
+    int acc = 0;
+    // LDX and STX use Y instead of X
+    uint8_t ix = (cc == 2 && (aaa == 4 || aaa == 5)) ? c->y : c->x;
+    switch( bbb )
+    {
+        case 0:
+            if( cc == 1 )
+                ea = rd16_zp(c, rd(c, c->pc++) + c->x);
+            else
+                ea = c->pc++;
+            break;
+        case 1:
+            ea = rd(c, c->pc++);
+            break;
+        case 2:
+            if( cc == 1 )
+                ea = c->pc++;
+            else
+                acc = 1;
+            break;
+        case 3:
+            ea = rd16(c, c->pc);
+            c->pc += 2;
+            break;
+        case 4:
+            ea = rd16_zp(c, rd(c, c->pc++)) + c->y;
+            break;
+        case 5:
+            ea = (uint8_t)(rd(c, c->pc++) + ix);
+            break;
+        case 6:
+            ea = rd16(c, c->pc) + c->y;
+            c->pc += 2;
+            break;
+        case 7:
+            ea = rd16(c, c->pc) + (cc == 1 ? c->x : ix);
+            c->pc += 2;
+            break;
+    }
+
+    if( cc == 1 )
+    {
+        switch( aaa )
+        {
+            case 0: c->a = setnz(c, c->a | rd(c, ea)); return 0;   // ORA
+            case 1: c->a = setnz(c, c->a & rd(c, ea)); return 0;   // AND
+            case 2: c->a = setnz(c, c->a ^ rd(c, ea)); return 0;   // EOR
+            case 3: adc(c, rd(c, ea)); return 0;                   // ADC
+            case 4:                                                // STA
+                if( bbb == 2 )
+                    return -1;
+                wr(c, ea, c->a);
+                return 0;
+            case 5: c->a = setnz(c, rd(c, ea)); return 0;          // LDA
+            case 6: cmp(c, c->a, rd(c, ea)); return 0;             // CMP
+            default: sbc(c, rd(c, ea)); return 0;                  // SBC
+        }
+    }
+    else if( cc == 2 )
+    {
+        if( aaa == 4 )
+        {
+            // STX
+            if( bbb != 1 && bbb != 3 && bbb != 5 )
+                return -1;
+            wr(c, ea, c->x);
+            return 0;
+        }
+        else if( aaa == 5 )
+        {
+            // LDX
+            if( bbb == 2 || bbb == 4 || bbb == 6 )
+                return -1;
+            c->x = setnz(c, rd(c, ea));
+            return 0;
+        }
+        if( bbb == 0 || bbb == 4 || bbb == 6 || (acc && aaa >= 4) )
+            return -1;
+        if( acc )
+            c->a = rmw(c, aaa, c->a);
+        else
+        {
+            t = rd(c, ea);
+            wr(c, ea, rmw(c, aaa, t));
+        }
+        return 0;
+    }
+    else if( cc == 0 )
+    {
+        switch( aaa )
+        {
+            case 1: // BIT
+                if( bbb != 1 && bbb != 3 )
+                    return -1;
+                t = rd(c, ea);
+                c->p = (c->p & ~(FN | FV | FZ)) | (t & (FN | FV)) |
+                       ((t & c->a) ? 0 : FZ);
+                return 0;
+            case 4: // STY
+                if( bbb != 1 && bbb != 3 && bbb != 5 )
+                    return -1;
+                wr(c, ea, c->y);
+                return 0;
+            case 5: // LDY
+                if( bbb == 2 || bbb == 4 || bbb == 6 )
+                    return -1;
+                c->y = setnz(c, rd(c, ea));
+                return 0;
+            case 6: // CPY
+            case 7: // CPX
+                if( bbb != 0 && bbb != 1 && bbb != 3 )
+                    return -1;
+                cmp(c, aaa == 6 ? c->y : c->x, rd(c, ea));
+                return 0;
+        }
+    }
+    return -1;
+}
+
+void cpu_init(struct cpu6502 *c)
+{
+    memset(c->mem, 0, sizeof(c->mem));
+    c->a = c->x = c->y = 0;
+    c->s = 0xFF;
+    c->p = FU | FI;
+    c->pc = 0;
+    c->io_write = 0;
+    c->io_read = 0;
+    c->ctx = 0;
+}
+
+int cpu_call(struct cpu6502 *c, uint16_t addr, uint8_t a, uint8_t x, uint8_t y,
+             long max_ins)
+{
+    c->a = a;
+    c->x = x;
+    c->y = y;
+    c->p &= ~FD;
+    // Return to CALL_RET
+    push(c, (CALL_RET - 1) >> 8);
+    push(c, (CALL_RET - 1) & 0xFF);
+    c->pc = addr;
+    for(long i=0; i<max_ins; i++)
+    {
+        if( step(c) )
+            return -1;
+        if( c->pc == CALL_RET )
+            return 0;
+    }
+    return -1;
+}
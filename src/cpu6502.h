@@ -0,0 +1,32 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Simple 6502 emulator, used to run the player code of SAP files.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include <stdint.h>
+
+struct cpu6502
+{
+    uint8_t a, x, y, s, p;
+    uint16_t pc;
+    uint8_t mem[65536];
+    // Called for the reads and writes to the I/O area, $D000 to $D7FF. The
+    // writes are also stored in "mem", the reads return the memory if NULL.
+    void (*io_write)(void *ctx, uint16_t addr, uint8_t val);
+    uint8_t (*io_read)(void *ctx, uint16_t addr);
+    void *ctx;
+};
+
+void cpu_init(struct cpu6502 *c);
+
+// Calls the routine at "addr" with the given registers, until it returns.
+// Returns 0 on success, -1 if an invalid instruction is found or the routine
+// does not return after "max_ins" instructions.
+int cpu_call(struct cpu6502 *c, uint16_t addr, uint8_t a, uint8_t x, uint8_t y,
+             long max_ins);
@@ -0,0 +1,159 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Dictionaries for the song history, see dict.h.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "dict.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void dict_alloc(struct dict *d, int size, int nchn)
+{
+    d->size = size;
+    d->nchn = nchn;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        d->start[i] = 0;
+        d->data[i] = i < nchn ? calloc(1, size) : 0;
+    }
+}
+
+// Fills the dictionary of one stream with the frames of the base stream from
+// "start", the last frame just before the song. If the base stream is
+// shorter, the first frames repeat the value at "start".
+static void fill_stream(uint8_t *data, int size, const uint8_t *base, int base_size,
+                        int start)
+{
+    int len = base_size - start;
+    if( len > size - 1 )
+        len = size - 1;
+    for(int j=1; j<size; j++)
+    {
+        int b = start + j - (size - len);
+        data[j] = base[b < start ? start : b];
+    }
+    data[0] = data[1];
+}
+
+static int clamp_start(const struct sapr *base, int start)
+{
+    if( start >= base->size )
+        start = base->size - 1;
+    return start < 0 ? 0 : start;
+}
+
+void dict_from_song(struct dict *d, const struct codec *c, const struct sapr *base,
+                    int start)
+{
+    dict_alloc(d, c->max_off, base->nchn);
+    start = clamp_start(base, start);
+    for(int i=0; i<base->nchn; i++)
+    {
+        d->start[i] = start;
+        fill_stream(d->data[i], d->size, base->data[i], base->size, start);
+    }
+}
+
+void dict_train(struct dict *d, struct codec *c, const struct sapr *base,
+                const struct sapr *s, const int chn_skip[SAPR_MAX_CHN])
+{
+    int best[SAPR_MAX_CHN];
+    void *st[SAPR_MAX_CHN];
+    int size = c->max_off;
+    int len = s->size < DICT_TRAIN_LEN * size ? s->size : DICT_TRAIN_LEN * size;
+    int step = size / DICT_TRAIN_STEP > 0 ? size / DICT_TRAIN_STEP : 1;
+
+    dict_alloc(d, size, s->nchn);
+    for(int i=0; i<s->nchn; i++)
+        best[i] = -1;
+
+    // Compress the first frames of the song after the frames of the base
+    // song from each position.
+    struct sapr t;
+    memset(&t, 0, sizeof(t));
+    t.size = size + len;
+    t.nchn = s->nchn;
+    for(int i=0; i<s->nchn; i++)
+    {
+        t.data[i] = malloc(t.size);
+        memcpy(t.data[i] + size, s->data[i], len);
+    }
+    for(int start=0; start<base->size; start += step)
+    {
+        for(int i=0; i<s->nchn; i++)
+            fill_stream(t.data[i], size, base->data[i], base->size, start);
+        codec_parse(&c, 1, &t, chn_skip, st);
+        for(int i=0; i<s->nchn; i++)
+        {
+            if( chn_skip[i] )
+                continue;
+            int bits = c->ops->parse_bits(st[i], size + 1);
+            if( best[i] < 0 || bits < best[i] )
+            {
+                best[i] = bits;
+                d->start[i] = start;
+            }
+        }
+        codec_parse_free(&c, 1, st);
+    }
+    for(int i=0; i<s->nchn; i++)
+    {
+        free(t.data[i]);
+        fill_stream(d->data[i], size, base->data[i], base->size,
+                    clamp_start(base, d->start[i]));
+    }
+}
+
+void dict_prime(const struct dict *d, struct sapr *s)
+{
+    for(int i=0; i<s->nchn; i++)
+    {
+        uint8_t *data = arena_alloc(s->arena, s->size + d->size);
+        memcpy(data, d->data[i], d->size);
+        memcpy(data + d->size, s->data[i], s->size);
+        arena_release(s->arena, s->data[i]);
+        s->data[i] = data;
+    }
+    s->size += d->size;
+}
+
+int dict_write(const struct dict *d, FILE *f)
+{
+    for(int i=d->nchn-1; i>=0; i--)
+        for(int k=0; k<d->size; k++)
+            if( EOF == putc(d->data[i][(k + 1) % d->size], f) )
+                return -1;
+    return 0;
+}
+
+int dict_read(struct dict *d, const struct codec *c, int nchn, FILE *f)
+{
+    dict_alloc(d, c->max_off, nchn);
+    for(int i=nchn-1; i>=0; i--)
+        for(int k=0; k<d->size; k++)
+        {
+            int x = getc(f);
+            if( x == EOF )
+            {
+                dict_free(d);
+                return -1;
+            }
+            d->data[i][(k + 1) % d->size] = x;
+        }
+    return 0;
+}
+
+void dict_free(struct dict *d)
+{
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        free(d->data[i]);
+        d->data[i] = 0;
+    }
+    d->size = 0;
+}
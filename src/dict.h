@@ -0,0 +1,52 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Dictionaries: the history of each stream is filled with frames of a base
+ * song before the song starts, so variants of the same tune can use matches
+ * from the first frame.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// The dictionary has "max_off" frames of each stream, the match window of the
+// codec. The player loads them in the buffers and then stores the initial
+// value of the song over the first one, so only the last "max_off - 1" frames
+// can be matched. The dictionary file has the buffers of the player, one of
+// "max_off" bytes for each stream, from the last stream.
+
+// Distance between the positions of the base song tried by dict_train(), in
+// fractions of the match window.
+#define DICT_TRAIN_STEP 16
+// Frames of the song compressed to compare the positions, in match windows.
+// Only the first window can match the dictionary.
+#define DICT_TRAIN_LEN  3
+
+struct dict
+{
+    int size;                       // Frames of each stream
+    int nchn;                       // Number of streams
+    int start[SAPR_MAX_CHN];        // First frame from the base song
+    uint8_t *data[SAPR_MAX_CHN];
+};
+
+// Uses the frames of the base song from "start" as the dictionary of all the
+// streams, for the codec "c".
+void dict_from_song(struct dict *d, const struct codec *c, const struct sapr *base,
+                    int start);
+// Selects for each stream of the song the frames of the base song that give
+// the smallest compressed size of the first frames.
+void dict_train(struct dict *d, struct codec *c, const struct sapr *base,
+                const struct sapr *s, const int chn_skip[SAPR_MAX_CHN]);
+// Adds the dictionary frames before the song, see lzss_set_dict().
+void dict_prime(const struct dict *d, struct sapr *s);
+// Writes the dictionary file, returns 0 on success.
+int dict_write(const struct dict *d, FILE *f);
+// Reads a dictionary file of "nchn" streams for the codec "c", returns 0 on
+// success.
+int dict_read(struct dict *d, const struct codec *c, int nchn, FILE *f);
+void dict_free(struct dict *d);
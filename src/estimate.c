@@ -0,0 +1,123 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Fast compressed size estimation by sampling.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "estimate.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define EST_WINDOW 512      // Frames in each sampled window
+#define EST_MIN_WINDOW 256  // Shortest window, for short songs
+#define EST_MIN_WINDOWS 4   // Minimum number of sampled windows
+#define EST_ZSCORE 2.0      // Width of the bounds, in standard deviations
+
+// Returns the header size of each codec, by encoding only the first frame.
+// This overestimates the size by at most one token per stream.
+static void header_size(struct codec **c, int nc, const struct sapr *s,
+                        const int chn_skip[SAPR_MAX_CHN], int *hdr)
+{
+    struct sapr one = *s;
+    void **st = calloc(sizeof(void *), SAPR_MAX_CHN * nc);
+
+    one.size = s->size ? 1 : 0;
+    codec_parse(c, nc, &one, chn_skip, st);
+    for(int n=0; n<nc; n++)
+    {
+        struct bf b;
+        bf_init(&b);
+        hdr[n] = codec_encode(c[n], &b, &one, chn_skip, st + SAPR_MAX_CHN*n);
+        bf_free(&b);
+    }
+    codec_parse_free(c, nc, st);
+    free(st);
+}
+
+void codec_estimate(struct codec **c, int nc, const struct sapr *s,
+                    const int chn_skip[SAPR_MAX_CHN], int sample_pct, struct estimate *est)
+{
+    int sz = s->size;
+    int *hdr = calloc(sizeof(int), nc);
+    void **st = calloc(sizeof(void *), SAPR_MAX_CHN * nc);
+
+    header_size(c, nc, s, chn_skip, hdr);
+
+    // The windows are shorter in short songs, so the minimum sample is a
+    // fraction of the song.
+    int win = (int)(((double)sz * sample_pct) / (100.0 * EST_MIN_WINDOWS));
+    if( win > EST_WINDOW )
+        win = EST_WINDOW;
+    if( win < EST_MIN_WINDOW )
+        win = EST_MIN_WINDOW;
+    int nwin = (int)(((double)sz * sample_pct) / (100.0 * win));
+    if( nwin < EST_MIN_WINDOWS )
+        nwin = EST_MIN_WINDOWS;
+
+    if( (double)nwin * win >= sz )
+    {
+        // Song too short, parse all the song
+        codec_parse(c, nc, s, chn_skip, st);
+        for(int n=0; n<nc; n++)
+        {
+            int bits = 0;
+            for(int i=0; i<s->nchn; i++)
+                if( st[n*SAPR_MAX_CHN+i] )
+                    bits += c[n]->ops->parse_bits(st[n*SAPR_MAX_CHN+i], 0);
+            est[n].bytes = est[n].low = est[n].high = hdr[n] + (bits + 7) / 8;
+            est[n].exact = 1;
+        }
+        codec_parse_free(c, nc, st);
+        free(st);
+        free(hdr);
+        return;
+    }
+
+    // Sum and sum of squares of the bits per frame of each window
+    double *sum = calloc(sizeof(double), nc);
+    double *sum2 = calloc(sizeof(double), nc);
+    for(int k=0; k<nwin; k++)
+    {
+        // Windows are evenly spaced, including the start and end of the song
+        int start = (int)(((double)k * (sz - win)) / (nwin - 1));
+        int pos = codec_parse_range(c, nc, s, chn_skip, start, win, st);
+        for(int n=0; n<nc; n++)
+        {
+            int bits = 0;
+            for(int i=0; i<s->nchn; i++)
+                if( st[n*SAPR_MAX_CHN+i] )
+                    bits += c[n]->ops->parse_bits(st[n*SAPR_MAX_CHN+i], pos);
+            double r = (double)bits / win;
+            sum[n] += r;
+            sum2[n] += r * r;
+        }
+        codec_parse_free(c, nc, st);
+    }
+
+    for(int n=0; n<nc; n++)
+    {
+        double mean = sum[n] / nwin;
+        double var = (sum2[n] - nwin * mean * mean) / (nwin - 1);
+        if( var < 0 )
+            var = 0;
+        // Standard error of the mean, with finite population correction
+        double fpc = 1.0 - ((double)nwin * win) / sz;
+        double se = sqrt(var / nwin * fpc);
+        double bytes = mean * sz / 8.0;
+        double delta = EST_ZSCORE * se * sz / 8.0;
+        est[n].bytes = hdr[n] + (int)(bytes + 0.5);
+        est[n].low = hdr[n] + (int)(bytes - delta);
+        est[n].high = hdr[n] + (int)(bytes + delta + 0.999);
+        est[n].exact = 0;
+        if( est[n].low < hdr[n] )
+            est[n].low = hdr[n];
+    }
+    free(sum);
+    free(sum2);
+    free(st);
+    free(hdr);
+}
@@ -0,0 +1,28 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Fast compressed size estimation by sampling.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// Estimated compressed size, in bytes
+struct estimate
+{
+    int bytes;  // Estimated size
+    int low;    // Lower bound of the estimation
+    int high;   // Upper bound of the estimation
+    int exact;  // The song was fully parsed, so the size is exact
+};
+
+// Estimates the compressed size of the song for each of the codecs, parsing
+// only windows of the song that sum about "sample_pct" percent of the frames.
+// The bounds are calculated from the variance of the compression ratio of
+// the sampled windows.
+void codec_estimate(struct codec **c, int nc, const struct sapr *s,
+                    const int chn_skip[SAPR_MAX_CHN], int sample_pct, struct estimate *est);
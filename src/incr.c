@@ -0,0 +1,193 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Incremental parse: keeps the LZSS parse of the song in a file, so the next
+ * run only parses again the frames near the changes.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "incr.h"
+#include "codec_lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The parse file, all values little-endian:
+//  - "LZPS" and the version of the file, 2,
+//  - LZSS parameters: format version, offset bits, length bits and minimum
+//    match length, one byte each, and maximum match length, 16 bit,
+//  - the number of streams, one byte,
+//  - the size of each stream, 32 bit, 0 for the skipped streams,
+//  - for each stream, the data and then the match length, 16 bit, match
+//    offset, 16 bit, and number of bits, 32 bit, of each position.
+#define INCR_HDR_SIZE 12
+#define INCR_POS_SIZE 8
+
+static int get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static int get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static void add16(struct bf *b, int x)
+{
+    add_byte(b, x & 0xFF);
+    add_byte(b, (x >> 8) & 0xFF);
+}
+
+static void add32(struct bf *b, int x)
+{
+    add16(b, x & 0xFFFF);
+    add16(b, (x >> 16) & 0xFFFF);
+}
+
+// Reads all the file to memory, NULL if it can't be read
+static uint8_t *read_all(const char *fname, long *len)
+{
+    FILE *f = fopen(fname, "rb");
+    if( !f )
+        return 0;
+    size_t l = 0, alloc = 65536, n;
+    uint8_t *data = malloc(alloc);
+    while( data && 0 < (n = fread(data + l, 1, alloc - l, f)) )
+    {
+        l += n;
+        if( l == alloc )
+            data = realloc(data, alloc *= 2);
+    }
+    fclose(f);
+    *len = l;
+    return data;
+}
+
+// Loads the old parse of each stream from the file image, returns 0 if the
+// file is valid for the codec parameters and the song. The bits of each
+// position depend on all the parameters, so any change parses again.
+static int load_parse(const struct lzss *p, const struct sapr *s, const uint8_t *img,
+                      long len, struct lzop old[SAPR_MAX_CHN])
+{
+    if( len < INCR_HDR_SIZE || memcmp(img, "LZPS", 4) || img[4] != 2 ||
+        img[5] != p->format_version || img[6] != p->bits_moff ||
+        img[7] != p->bits_mlen || img[8] != p->min_mlen ||
+        get16(img + 9) != p->max_mlen || img[11] != s->nchn ||
+        len < INCR_HDR_SIZE + 4 * s->nchn )
+        return -1;
+    long pos = INCR_HDR_SIZE + 4 * s->nchn;
+    for(int i=0; i<s->nchn; i++)
+    {
+        struct lzop *lz = &old[i];
+        lz->size = get32(img + INCR_HDR_SIZE + 4 * i);
+        if( lz->size < 0 || lz->size > SAPR_MAX_FRAMES ||
+            len - pos < (long)lz->size * (1 + INCR_POS_SIZE) )
+            return -1;
+        lz->data = img + pos;
+        pos += lz->size;
+        lz->bits = malloc(sizeof(int) * (lz->size + 1));
+        lz->mlen = malloc(sizeof(int) * (lz->size + 1));
+        lz->mpos = malloc(sizeof(int) * (lz->size + 1));
+        if( !lz->bits || !lz->mlen || !lz->mpos )
+        {
+            fprintf(stderr, "error: out of memory reading parse file\n");
+            exit(EXIT_FAILURE);
+        }
+        for(int j=0; j<lz->size; j++, pos += INCR_POS_SIZE)
+        {
+            lz->mlen[j] = get16(img + pos);
+            lz->mpos[j] = get16(img + pos + 2);
+            lz->bits[j] = get32(img + pos + 4);
+        }
+    }
+    return pos == len ? 0 : -1;
+}
+
+static int store_parse(const struct lzss *p, const struct sapr *s,
+                       const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN],
+                       const char *fname)
+{
+    struct bf b;
+    bf_init(&b);
+    for(int i=0; i<4; i++)
+        add_byte(&b, "LZPS"[i]);
+    add_byte(&b, 2);
+    add_byte(&b, p->format_version);
+    add_byte(&b, p->bits_moff);
+    add_byte(&b, p->bits_mlen);
+    add_byte(&b, p->min_mlen);
+    add16(&b, p->max_mlen);
+    add_byte(&b, s->nchn);
+    for(int i=0; i<s->nchn; i++)
+        add32(&b, chn_skip[i] ? 0 : s->size);
+    for(int i=0; i<s->nchn; i++)
+    {
+        const struct lzop *lz = st[i];
+        if( chn_skip[i] )
+            continue;
+        for(int j=0; j<lz->size; j++)
+            add_byte(&b, lz->data[j]);
+        for(int j=0; j<lz->size; j++)
+        {
+            add16(&b, lz->mlen[j]);
+            add16(&b, lz->mpos[j]);
+            add32(&b, lz->bits[j]);
+        }
+    }
+    FILE *f = fopen(fname, "wb");
+    int err = !f || bf_write(&b, f);
+    if( f && fclose(f) )
+        err = 1;
+    bf_free(&b);
+    return err ? -1 : 0;
+}
+
+int incr_parse(struct codec *c, const struct sapr *s, const int chn_skip[SAPR_MAX_CHN],
+               void *st[SAPR_MAX_CHN], const char *fname, FILE *out)
+{
+    const struct lzss *p = c->priv;
+    struct lzop old[SAPR_MAX_CHN];
+    long len = 0;
+    uint8_t *img = read_all(fname, &len);
+    memset(old, 0, sizeof(old));
+    int valid = img && !load_parse(p, s, img, len, old);
+
+    int parsed = 0, total = 0;
+    if( !valid )
+    {
+        if( img && out )
+            fprintf(out, "Incremental: parse file '%s' not valid for this song "
+                    "and options, parsing again\n", fname);
+        codec_parse(&c, 1, s, chn_skip, st);
+    }
+    else
+    {
+        for(int i=0; i<SAPR_MAX_CHN; i++)
+        {
+            st[i] = 0;
+            if( i >= s->nchn || chn_skip[i] )
+                continue;
+            st[i] = c->ops->parse_new(c, s->data[i], s->size, s->arena);
+            parsed += lzop_reparse(p, st[i], &old[i]);
+        }
+    }
+    for(int i=0; i<s->nchn; i++)
+        if( !chn_skip[i] )
+            total += s->size;
+    if( !valid )
+        parsed = total;
+    if( out )
+        fprintf(out, "Incremental: parsed %d of %d positions\n", parsed, total);
+
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        free(old[i].bits);
+        free(old[i].mlen);
+        free(old[i].mpos);
+    }
+    free(img);
+    return store_parse(p, s, chn_skip, st, fname);
+}
@@ -0,0 +1,21 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Incremental parse: keeps the LZSS parse of the song in a file, so the next
+ * run only parses again the frames near the changes.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// Parses the song with the LZSS codec "c", the same as codec_parse(), reusing
+// the parse stored in "fname" by a previous run. A missing file, or one with
+// other parameters, parses all the song. Then stores the new parse in the
+// file, and shows the number of positions parsed if "out" is not NULL.
+// Returns 0 on success, -1 on error writing the file.
+int incr_parse(struct codec *c, const struct sapr *s, const int chn_skip[SAPR_MAX_CHN],
+               void *st[SAPR_MAX_CHN], const char *fname, FILE *out);
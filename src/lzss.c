@@ -10,6 +10,16 @@
  * Code under MIT license, see LICENSE file.
  */
 
+#include "bank.h"
+#include "canon.h"
+#include "codec_lzss.h"
+#include "dict.h"
+#include "incr.h"
+#include "overlay.h"
+#include "pattern.h"
+#include "rate.h"
+#include "stream.h"
+#include "xform.h"
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -17,471 +27,283 @@
 #include <string.h>
 #include <unistd.h>
 
-
-#ifdef _WIN32
-#include <io.h>
-#include <fcntl.h>
-void set_binary(void)
-{
-  setmode(fileno(stdout),O_BINARY);
-  setmode(fileno(stdin),O_BINARY);
-}
-#else
-void set_binary(void)
-{
-}
-#endif
-
-
-///////////////////////////////////////////////////////
-// Bit encoding functions
-struct bf
-{
-    int len;
-    uint8_t buf[65536];
-    int bnum;
-    int bpos;
-    int hpos;
-    int total;
-    FILE *out;
-};
-
-static void init(struct bf *x)
-{
-    x->total = 0;
-    x->len = 0;
-    x->bnum = 0;
-    x->bpos = -1;
-    x->hpos = -1;
-}
-
-static void bflush(struct bf *x)
-{
-    if( x->len )
-        fwrite(x->buf, x->len, 1, x->out);
-    x->total += x->len;
-    x->len = 0;
-    x->bnum = 0;
-    x->bpos = -1;
-    x->hpos = -1;
-}
-
-
-static void add_bit(struct bf *x, int bit)
-{
-    if( x->bpos < 0 )
-    {
-        // Adds a new byte holding bits
-        x->bpos = x->len;
-        x->bnum = 0;
-        x->len++;
-        x->buf[x->bpos] = 0;
-    }
-    if( bit )
-        x->buf[x->bpos] |= 1 << x->bnum;
-    x->bnum++;
-    if( x->bnum == 8 )
-    {
-        x->bpos = -1;
-        x->bnum = 0;
-    }
-}
-
-static void add_byte(struct bf *x, int byte)
-{
-    x->buf[x->len] = byte;
-    x->len ++;
-}
-
-static void add_hbyte(struct bf *x, int hbyte)
-{
-    if( x->hpos < 0 )
-    {
-        // Adds a new byte holding half-bytes
-        x->hpos = x->len;
-        x->len++;
-        x->buf[x->hpos] = hbyte & 0x0F;
-    }
-    else
-    {
-        // Fixes last h-byte
-        x->buf[x->hpos] |= hbyte << 4;
-        x->hpos = -1;
-    }
-}
-
 ///////////////////////////////////////////////////////
-// LZSS compression functions
-static int max(int a, int b)
-{
-    return a>b ? a : b;
-}
-
-static int get_mlen(const uint8_t *a, const uint8_t *b, int max)
-{
-    for(int i=0; i<max; i++)
-        if( a[i] != b[i] )
-            return i;
-    return max;
-}
-
-int hsh(const uint8_t *p)
-{
-    size_t x = (size_t)p;
-    return 0xFF & (x ^ (x>>8) ^ (x>>16) ^ (x>>24));
-}
-
-static int bits_moff = 4;       // Number of bits used for OFFSET
-static int bits_mlen = 4;       // Number of bits used for MATCH
-static int min_mlen = 2;        // Minimum match length
-static int fmt_literal_first  = 0; // Always include first literal in the output
-static int fmt_pos_start_zero = 0; // Match positions start at 0, else start at max
-
-#define bits_literal (1+8)      // Number of bits for encoding a literal
-#define bits_match (1 + bits_moff + bits_mlen)  // Bits for encoding a match
-
-#define max_mlen (min_mlen + (1<<bits_mlen) -1) // Maximum match length
-#define max_off (1<<bits_moff)  // Maximum offset
-
-// Statistics
-static int *stat_len;
-static int *stat_off;
-
-
-// Struct for LZ optimal parsing
-struct lzop
-{
-    const uint8_t *data;// The data to compress
-    int size;           // Data size
-    int *bits;          // Number of bits needed to code from position
-    int *mlen;          // Best match length at position (0 == no match);
-    int *mpos;          // Best match offset at position
-};
-
-static void lzop_init(struct lzop *lz, const uint8_t *data, int size)
-{
-    lz->data = data;
-    lz->size = size;
-    lz->bits = calloc(sizeof(int), size);
-    lz->mlen = calloc(sizeof(int), size);
-    lz->mpos = calloc(sizeof(int), size);
-}
-
-static void lzop_free(struct lzop *lz)
+static const char *prog_name;
+static void cmd_error(const char *msg)
 {
-    free(lz->bits);
-    free(lz->mlen);
-    free(lz->mpos);
+    fprintf(stderr,"%s: error, %s\n"
+            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
+    exit(1);
 }
 
-// Returns maximal match length (and match position) at pos.
-static int match(const uint8_t *data, int pos, int size, int *mpos)
+// Opens the output file, or standard output if not given
+static FILE *open_output(int argc, char **argv)
 {
-    int mxlen = -max(-max_mlen, pos - size);
-    int mlen = 0;
-    for(int i=max(pos-max_off,0); i<pos; i++)
+    FILE *output_file = stdout;
+    if( optind < argc-1 )
     {
-        int ml = get_mlen(data + pos, data + i, mxlen);
-        if( ml > mlen )
+        output_file = fopen(argv[optind+1], "wb");
+        if( !output_file )
         {
-            mlen = ml;
-            *mpos = pos - i;
+            fprintf(stderr, "%s: can't open output file '%s': %s\n",
+                    prog_name, argv[optind+1], strerror(errno));
+            exit(EXIT_FAILURE);
         }
     }
-    return mlen;
+    return output_file;
 }
 
-// Calculate optimal encoding from the end of stream.
-// if last_literal is 1, we force the last byte to be encoded as a literal.
-static void lzop_backfill(struct lzop *lz, int last_literal)
+// Streaming mode: compresses each frame as it is read
+static int stream_song(const struct lzss_opts *lo, FILE *input_file, int argc, char **argv,
+                       int pokeys, int lookahead, int show_stats)
 {
-    // If no bytes, nothing to do
-    if(!lz->size)
-        return;
-
-    if(last_literal)
+    int nchn = sapr_read_header(input_file, pokeys);
+    if( nchn < 0 )
     {
-        // Forced last literal - process one byte less
-        lz->mlen[lz->size-1] = 0;
-        lz->size --;
-        if( !lz->size )
-            return;
+        fprintf(stderr, "%s: invalid SAP-R header, streaming needs a type R file\n", prog_name);
+        exit(EXIT_FAILURE);
     }
-
-    // Init last bits
-    lz->bits[lz->size-1] = bits_literal;
-
-    // Go backwards in file storing best parsing
-    for(int pos = lz->size - 2; pos>=0; pos--)
+    FILE *output_file = open_output(argc, argv);
+    struct codec *lzss = lzss_opts_codec(lo);
+    struct lzss_stream *z = lzss_stream_new(lzss, nchn, lookahead, output_file);
+    uint8_t regs[SAPR_MAX_CHN];
+    long frames = 0;
+    while( frames < SAPR_MAX_FRAMES && 1 == fread(regs, nchn, 1, input_file) )
     {
-        // Get best match at this position
-        int mp = 0;
-        int ml = match(lz->data , pos, lz->size, &mp);
-
-        // Init "no-match" case
-        int best = lz->bits[pos+1] + bits_literal;
-
-        // Check all posible match lengths, store best
-        lz->bits[pos] = best;
-        lz->mpos[pos] = mp;
-        for(int l=ml; l>=min_mlen; l--)
+        if( lzss_stream_frame(z, regs) )
         {
-            int b;
-            if( pos+l < lz->size )
-                b = lz->bits[pos+l] + bits_match;
-            else
-                b = 0;
-            if( b < best )
-            {
-                best = b;
-                lz->bits[pos] = best;
-                lz->mlen[pos] = l;
-                lz->mpos[pos] = mp;
-            }
+            fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+            exit(EXIT_FAILURE);
         }
+        frames++;
     }
-    // Fixup size again
-    if( last_literal )
-        lz->size ++;
-}
-
-// Returns 1 if the coded stream would end in a match
-static int lzop_last_is_match(const struct lzop * lz)
-{
-    int last = 0;
-    for(int pos = 0; pos < lz->size; )
+    long total = lzss_stream_end(z);
+    if( total < 0 )
     {
-        int mlen = lz->mlen[pos];
-        if( mlen < min_mlen )
-        {
-            // Skip over one literal byte
-            last = 0;
-            pos ++;
-        }
-        else
-        {
-            // Skip over one match
-            pos = pos + mlen;
-            last = 1;
-        }
+        fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
     }
-    return last;
+    if( input_file != stdin )
+        fclose(input_file);
+    if( output_file != stdout )
+        fclose(output_file);
+    if( show_stats )
+        fprintf(stderr,"Streamed %ld frames, %ld bytes, lookahead %d frames\n",
+                frames, total, lookahead);
+    codec_free(lzss);
+    return 0;
 }
 
-static int lzop_encode(struct bf *b, const struct lzop *lz, int pos, int lpos)
+// Compresses a sound effect with only the registers in "mask"
+static int effect_song(struct codec *lzss, const struct sapr *song, int mask,
+                       FILE *output_file, int show_stats)
 {
-    if( pos <= lpos )
-        return lpos;
-
-    int mlen = lz->mlen[pos];
-    int mpos = lz->mpos[pos];
-
-    // Encode best from filled table
-    if( mlen < min_mlen )
+    const struct lzss *p = lzss->priv;
+    struct overlay_stats os;
+    struct bf b;
+    bf_init(&b);
+    if( overlay_encode(lzss, &b, song, mask, &os) )
+        cmd_error("effect registers should be less than the number of streams");
+    if( bf_write(&b, output_file) )
     {
-        // No match, just encode the byte
-//        fprintf(stderr,"L: %02x\n", lz->data[pos]);
-        add_bit(b,1);
-        add_byte(b, lz->data[pos]);
-        stat_len[0] ++;
-        return pos;
+        fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
     }
+    if( output_file != stdout )
+        fclose(output_file);
     else
-    {
-        int code_pos = (pos - mpos - (fmt_pos_start_zero ? 1 : 2)) & (max_off - 1);
-        int code_len = mlen - min_mlen;
-//        fprintf(stderr,"M: %02x : %02x  [%04x]\n", code_pos, code_len,
-//                       (code_pos << bits_mlen) + code_len);
-        add_bit(b,0);
-        if( bits_mlen + bits_moff <= 8 )
-            add_byte(b,(code_pos<<bits_mlen) + code_len);
-        else if( bits_mlen + bits_moff <= 12 )
-        {
-            add_byte(b,(code_pos<<(8-bits_moff)) + (code_len & ((1<<(8-bits_moff))-1)));
-            add_hbyte(b, code_len>>(8-bits_moff));
-        }
-        else
-        {
-            int mb = ((code_len+1) << bits_moff) + code_pos;
-            add_byte(b, mb & 0xFF);
-            add_byte(b, mb >> 8);
-        }
+        fflush(stdout);
 
-        stat_len[mlen] ++;
-        stat_off[mpos] ++;
-        return pos + mlen - 1;
+    if( show_stats )
+    {
+        fprintf(stderr,"Effect: %d registers, %d frames, %d bytes\n", os.nreg, song->size, b.len);
+        // The players are only for the 16 bit format
+        if( p->bits_moff == 8 && p->bits_mlen == 8 && song->size > 1 )
+            fprintf(stderr,"Effect player cycles per frame: playfx %.1f (max %d, "
+                    "at most %d with %d registers)\n", os.cycles / (double)song->size,
+                    os.max_cycles, os.max_bound, os.nreg);
     }
+    bf_free(&b);
+    return 0;
 }
 
-///////////////////////////////////////////////////////
-int sap_trim(uint8_t *data[9], int sz, const char *name)
+// Shows the size and player cycles saved by storing one frame for each
+// update, compressing the song at the full rate.
+static void rate_stats(struct codec *lzss, const struct sapr *s, const int chn_skip[SAPR_MAX_CHN],
+                       const struct rate *rt)
 {
-    if( !sz )
-        return sz;
-
-    // Detect silence at the end:
-    int start;
-    for(start = 0; sz > 0; start++)
-    {
-        int v0 = data[1][sz - 1] & 0x0F;
-        int v1 = data[3][sz - 1] & 0x0F;
-        int v2 = data[5][sz - 1] & 0x0F;
-        int v3 = data[7][sz - 1] & 0x0F;
-        if( v0 || v1 || v2 || v3 )
-            break;
-        sz--;
-    }
-    if( sz <= 0 )
-    {
-        fprintf(stderr, "%s: song is completely silent, skipping.", name);
-        return 0;
-    }
-    if( start )
-        fprintf(stderr, "%s: skipping %d frames from the end.", name, start);
-
-    // Detect silence at the start:
-    for(start=0; start<sz; start++)
-    {
-        int v0 = data[1][start] & 0x0F;
-        int v1 = data[3][start] & 0x0F;
-        int v2 = data[5][start] & 0x0F;
-        int v3 = data[7][start] & 0x0F;
-        if( v0 || v1 || v2 || v3 )
-            break;
-    }
-
-    if( start >= sz )
-    {
-        fprintf(stderr, "%s: song is completely silent, skipping.", name);
-        return 0;
-    }
+    const struct lzss *p = lzss->priv;
+    void *st[SAPR_MAX_CHN];
+    struct bf b;
+    int mx;
+    bf_init(&b);
+    codec_parse(&lzss, 1, s, chn_skip, st);
+    codec_encode(lzss, &b, s, chn_skip, st);
+    long cyc = lzss_cycles(p, s, chn_skip, (struct lzop **)st, &mx);
+    codec_parse_free(&lzss, 1, st);
+    int full_len = b.len;
+    bf_free(&b);
+
+    struct sapr r = *s;
+    for(int i=0; i<s->nchn; i++)
+    {
+        r.data[i] = malloc(s->size);
+        memcpy(r.data[i], s->data[i], s->size);
+    }
+    rate_reduce(&r, rt);
+    struct bf rb;
+    bf_init(&rb);
+    codec_parse(&lzss, 1, &r, chn_skip, st);
+    codec_encode(lzss, &rb, &r, chn_skip, st);
+    long rcyc = lzss_cycles(p, &r, chn_skip, (struct lzop **)st, &mx);
+    codec_parse_free(&lzss, 1, st);
+    rcyc += (long)RATE_CYC_WAIT * (s->size - r.size) + (long)RATE_CYC_UPDATE * (r.size - 1);
+
+    fprintf(stderr,"Update rate: every %d frames, %d of %d frames stored, %d bytes saved\n",
+            rt->rate, r.size, s->size, full_len - rb.len - RATE_HDR_SIZE);
+    // The players are only for the 16 bit format
+    if( p->bits_moff == 8 && p->bits_mlen == 8 && !p->fmt_xform && !p->fmt_frame_flags &&
+        s->size > 1 )
+        fprintf(stderr,"Player cycles per frame: playlzs16 %.1f, playlzs16u %.1f\n",
+                cyc / (s->size - 1.0), rcyc / (s->size - 1.0));
+    bf_free(&rb);
+    for(int i=0; i<s->nchn; i++)
+        free(r.data[i]);
+}
 
-    // Move song data skipping the blank segment
-    if( start )
-    {
-        fprintf(stderr, "%s: skipping %d frames from the start.", name, start);
-        sz = sz - start;
-        for(int i=0; i<9; i++)
-            memmove(data[i], data[i] + start, sz);
-    }
+// Fills the history before the song with a dictionary from the base song,
+// from the frame "start" or trained if negative. Returns the compressed size
+// without the dictionary if "show_stats" is set.
+static int dict_song(struct codec *lzss, struct sapr *song, const int chn_skip[SAPR_MAX_CHN],
+                     const char *base_file, int start, const char *dict_file, int do_canon,
+                     struct dict *d, int show_stats)
+{
+    FILE *f = fopen(base_file, "rb");
+    if( !f )
+    {
+        fprintf(stderr, "%s: can't open dictionary song '%s': %s\n",
+                prog_name, base_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct sapr base;
+    if( sapr_read(&base, f, song->nchn / 9) )
+    {
+        fprintf(stderr, "%s: invalid dictionary song\n", prog_name);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    if( !base.size )
+        cmd_error("dictionary song is empty");
+    if( do_canon && canon_song(lzss, &base, stderr, 0) )
+        exit(EXIT_FAILURE);
+    if( start >= 0 )
+        dict_from_song(d, lzss, &base, start);
+    else
+        dict_train(d, lzss, &base, song, chn_skip);
+    sapr_free(&base);
 
-    // For loop-detecting, clean silent channels:
-    uint8_t *buf = malloc(9 * sz);
-    if( !buf )
-    {
-        fprintf(stderr, "%s: can't detect loop - out of memory.", name);
-        return sz;
-    }
-    for(int i = 0; i < sz; i++)
+    int plain = 0;
+    if( show_stats )
     {
-        uint8_t *p = buf + i * 9;
-        p[8] = 0;
-        for(int j = 0; j < 8; j += 2)
-        {
-            if( 0 != (data[j + 1][i] & 0x0F) )
-            {
-                p[j + 0] = data[j + 0][i];
-                p[j + 1] = data[j + 1][i];
-                p[8] = data[8][i];
-            }
-            else
-            {
-                p[j] = p[j + 1] = 0;
-            }
-        }
+        void *st[SAPR_MAX_CHN];
+        struct bf b;
+        bf_init(&b);
+        codec_parse(&lzss, 1, song, chn_skip, st);
+        codec_encode(lzss, &b, song, chn_skip, st);
+        codec_parse_free(&lzss, 1, st);
+        plain = b.len;
+        bf_free(&b);
+        fprintf(stderr,"Dictionary: %d frames of each stream from '%s', first frames:",
+                d->size - 1, base_file);
+        for(int i=0; i<song->nchn; i++)
+            if( !chn_skip[i] )
+                fprintf(stderr," %d", d->start[i]);
+        fprintf(stderr,"\n");
     }
 
-    // Detect loops of at least one second at the end of the song
-    const int one_sec = 50;
-    if( sz < 2 * one_sec )
-        return sz;
-
-    for(start = 0; start < sz - 2 * one_sec; start++)
+    if( dict_file )
     {
-        int top = sz - one_sec;
-        for(int i = start + 1; i < top; i++)
+        f = fopen(dict_file, "wb");
+        if( !f || dict_write(d, f) || fclose(f) )
         {
-            if( 0 != memcmp(buf + 9 * start, buf + 9 * i, 9 * (sz - i)) )
-                continue;
-
-            // Detected a loop
-            fprintf(stderr, "%s: loop detected from frame %d to %d (of %d)\n",
-                    name, i, start, sz);
-            // Simply return the shortened song
-            free(buf);
-            return i;
+            fprintf(stderr, "%s: error writing dictionary file '%s': %s\n",
+                    prog_name, dict_file, strerror(errno));
+            exit(EXIT_FAILURE);
         }
     }
-
-    free(buf);
-    return sz;
-}
-
-///////////////////////////////////////////////////////
-static const char *prog_name;
-static void cmd_error(const char *msg)
-{
-    fprintf(stderr,"%s: error, %s\n"
-            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
-    exit(1);
+    dict_prime(d, song);
+    lzss_set_dict(lzss, d);
+    return plain;
 }
 
 ///////////////////////////////////////////////////////
 int main(int argc, char **argv)
 {
-    struct bf b;
-    uint8_t buf[9], *data[9];
-    char header_line[128];
-    int lpos[9];
     int do_trim = 0;
+    int pokeys = 0;
     int show_stats = 1;
-    int bits_mtotal = bits_moff + bits_mlen;
-    int bits_set = 0;
-    int force_last_literal = 1;
-    int format_version = 0;  // LZSS format version - 0 means last version
-
+    int bank_size = 0;
+    int repeat_len = 0;
+    int lookahead = 0;
+    int do_canon = 0;
+    int do_rate = 0;
+    int fx_mask = 0;
+    int dict_start = -1;
+    const char *player_file = 0;
+    const char *parse_file = 0;
+    const char *dict_base = 0;
+    const char *dict_file = 0;
+    struct lzss_opts lo;
+
+    lzss_opts_init(&lo);
     prog_name = argv[0];
     int opt;
-    while( -1 != (opt = getopt(argc, argv, "hqvo:l:m:b:826ext")) )
+    while( -1 != (opt = getopt(argc, argv, "hqvtcRp:P:B:r:s:I:E:D:d:w:" LZSS_OPTS)) )
     {
+        if( lzss_opts_set(&lo, opt, optarg) )
+            continue;
         switch(opt)
         {
-            case '2':
-                bits_moff = 7;
-                bits_mlen = 5;
-                bits_mtotal = 12;
-                bits_set |= 8;
+            case 't':
+                do_trim = 1;
                 break;
-            case '8':
-                bits_moff = 4;
-                bits_mlen = 4;
-                bits_mtotal = 8;
-                bits_set |= 8;
+            case 'c':
+                do_canon = 1;
                 break;
-            case '6':
-                bits_moff = 8;
-                bits_mlen = 8;
-                bits_mtotal = 16;
-                min_mlen = 1;
-                bits_set |= 8;
+            case 'R':
+                do_rate = 1;
                 break;
-            case 't':
-                do_trim = 1;
+            case 'p':
+                pokeys = atoi(optarg);
+                break;
+            case 'r':
+                repeat_len = atoi(optarg);
+                break;
+            case 's':
+                lookahead = atoi(optarg);
+                break;
+            case 'B':
+                bank_size = atoi(optarg) * 1024;
+                break;
+            case 'P':
+                player_file = optarg;
+                break;
+            case 'I':
+                parse_file = optarg;
                 break;
-            case 'o':
-                bits_moff = atoi(optarg);
-                bits_set |= 1;
+            case 'E':
+                fx_mask = overlay_parse_regs(optarg);
                 break;
-            case 'l':
-                bits_mlen = atoi(optarg);
-                bits_set |= 2;
+            case 'D':
+                dict_base = optarg;
                 break;
-            case 'b':
-                bits_mtotal = atoi(optarg);
-                bits_set |= 4;
+            case 'd':
+                dict_start = atoi(optarg);
+                if( dict_start < 0 )
+                    cmd_error("dictionary start frame should be positive");
                 break;
-            case 'm':
-                min_mlen = atoi(optarg);
+            case 'w':
+                dict_file = optarg;
                 break;
             case 'v':
                 show_stats = 2;
@@ -489,12 +311,6 @@ int main(int argc, char **argv)
             case 'q':
                 show_stats = 0;
                 break;
-            case 'e':
-                force_last_literal = 0;
-                break;
-            case 'x':
-                format_version = 1;
-                break;
             case 'h':
             default:
                 fprintf(stderr,
@@ -507,6 +323,10 @@ int main(int argc, char **argv)
                        "\n"
                        "Options:\n"
                        "  -t       Tries to trim SAP-R file before compressing.\n"
+                       "  -c       Replaces the register values that can't be heard.\n"
+                       "  -R       Detects the update rate of the song and stores one frame\n"
+                       "           for each update, with the rate in the header.\n"
+                       "  -p NUM   Number of POKEY chips, 1 or 2 (default = from SAP header).\n"
                        "  -8       Sets default 8 bit match size.\n"
                        "  -2       Sets default 12 bit match size.\n"
                        "  -6       Sets default 16 bit match size.\n"
@@ -516,58 +336,65 @@ int main(int argc, char **argv)
                        "  -m NUM   Sets minimum match length (default = %d).\n"
                        "  -e       Don't force a literal at end of stream.\n"
                        "  -x       Old format with initial data only for skipped channels.\n"
+                       "  -T       Format with a reversible transform for each stream.\n"
+                       "  -n       Format with the number of frames in the header, the\n"
+                       "           song does not need to end in a literal.\n"
+                       "  -V       Format with variable length matches, the longest\n"
+                       "           length code adds a byte with the rest of the length.\n"
+                       "  -g       Format with the flag bits of each frame in one field.\n"
+                       "  -P FILE  Writes a player specialised for the song to FILE.\n"
+                       "  -r NUM   Writes repeated sections of NUM or more frames only once,\n"
+                       "           with a play order of the blocks.\n"
+                       "  -B KB    Splits the output in cartridge banks of 8 or 16 KB.\n"
+                       "  -s NUM   Streaming mode, writes the output while reading the\n"
+                       "           input, with a lookahead of NUM frames.\n"
+                       "  -I FILE  Keeps the parse of the song in FILE, the next run only\n"
+                       "           parses again the frames near the changes.\n"
+                       "  -E LIST  Compresses a sound effect with only the registers in\n"
+                       "           LIST, separated by commas, to play over the music.\n"
+                       "  -D FILE  Fills the history before the song with frames of the\n"
+                       "           song FILE, trained for each stream.\n"
+                       "  -d NUM   Takes the history from frame NUM of the -D song instead.\n"
+                       "  -w FILE  Writes the history buffers for the player to FILE.\n"
                        "  -v       Shows match length/offset statistics.\n"
                        "  -q       Don't show per stream compression.\n"
                        "  -h       Shows this help.\n",
-                       prog_name, bits_moff, bits_mlen, bits_mtotal, min_mlen);
+                       prog_name, lo.bits_moff, lo.bits_mlen, lo.bits_mtotal, lo.min_mlen);
                 exit(EXIT_FAILURE);
         }
     }
 
-    // Set format flags:
-    switch(format_version)
-    {
-        case 1:
-            fmt_literal_first  = 0;
-            fmt_pos_start_zero = 1;
-            break;
-        default:
-            fmt_literal_first  = 1;
-            fmt_pos_start_zero = 0;
-            break;
-    }
-
-    if( bits_mtotal < 8 || bits_mtotal > 16 )
-        cmd_error("total match bits should be from 8 to 16");
-
-    // Calculate bits
-    switch(bits_set)
-    {
-        case 0:
-        case 1:
-        case 4:
-        case 5:
-            bits_mlen = bits_mtotal - bits_moff;
-            break;
-        case 2:
-        case 6:
-            bits_moff = bits_mtotal - bits_mlen;
-            break;
-        case 3:
-        case 8:
-            // OK
-            break;
-        default:
-            cmd_error("only two of OFFSET, LENGTH and TOTAL bits should be given");
-            break;
-    }
-    // Check option values
-    if( bits_moff < 0 || bits_moff > 12 )
-        cmd_error("match offset bits should be from 0 to 12");
-    if( bits_mlen < 2 || bits_moff > 16 )
-        cmd_error("match length bits should be from 2 to 16");
-    if( min_mlen < 1 || min_mlen > 16 )
-        cmd_error("minimum match length should be from 1 to 16");
+    const char *err = lzss_opts_check(&lo);
+    if( err )
+        cmd_error(err);
+    if( pokeys < 0 || pokeys > SAPR_MAX_POKEY )
+        cmd_error("number of POKEY chips should be 1 or 2");
+    if( bank_size && bank_size != 8192 && bank_size != 16384 )
+        cmd_error("bank size should be 8 or 16");
+    if( repeat_len < 0 )
+        cmd_error("repeated section length should be positive");
+    if( repeat_len && (player_file || lo.format_version == 2) )
+        cmd_error("repeated sections can't be used with -P or -T");
+    if( do_rate && (repeat_len || bank_size || player_file) )
+        cmd_error("update rate can't be used with -r, -B or -P");
+    if( fx_mask < 0 )
+        cmd_error("effect registers should be a list of numbers from 0 to 17");
+    if( fx_mask && (do_rate || repeat_len || bank_size || player_file || parse_file) )
+        cmd_error("effects can't be used with -R, -r, -B, -P or -I");
+    if( fx_mask && (lo.format_version || !lo.force_last_literal) )
+        cmd_error("effects only use the current format, -e, -x, -T, -n, -V and -g can't be used");
+    if( (dict_start >= 0 || dict_file) && !dict_base )
+        cmd_error("options -d and -w need a dictionary song given with -D");
+    if( dict_base && (do_rate || fx_mask || repeat_len || bank_size || player_file || parse_file) )
+        cmd_error("dictionaries can't be used with -R, -E, -r, -B, -P or -I");
+    if( dict_base && lo.format_version )
+        cmd_error("dictionaries only use the current format, -x, -T, -n, -V and -g can't be used");
+    if( lookahead && lookahead < 2 )
+        cmd_error("streaming lookahead should be at least 2 frames");
+    if( lookahead && (do_trim || do_canon || do_rate || fx_mask || dict_base || repeat_len ||
+                      bank_size || player_file || parse_file || lo.format_version == 2 ||
+                      lo.format_version == 3) )
+        cmd_error("streaming mode can't be used with -t, -c, -R, -E, -D, -r, -B, -P, -I, -T or -n");
 
     if( optind < argc-2 )
         cmd_error("too many arguments: one input file and one output file expected");
@@ -585,50 +412,15 @@ int main(int argc, char **argv)
     // Set stdin and stdout as binary files
     set_binary();
 
-    // Alloc statistic arrays
-    stat_len = calloc(sizeof(int), max_mlen + 1);
-    stat_off = calloc(sizeof(int), max_off + 1);
+    if( lookahead )
+        return stream_song(&lo, input_file, argc, argv, pokeys, lookahead, show_stats);
 
-    // Max size of each bufer: 128k
-    for(int i=0; i<9; i++)
+    // Read input file
+    struct sapr song;
+    if( sapr_read(&song, input_file, pokeys) )
     {
-        data[i] = malloc(128*1024); // calloc(128,1024);
-        lpos[i] = -1;
-    }
-
-    // Skip SAP header
-    long pos = ftell(input_file);
-    while( 0 != fgets(header_line, 80, input_file) )
-    {
-        size_t ln = strlen(header_line);
-        if( ln < 1 || header_line[ln-1] != '\n' )
-            break;
-        pos = ftell(input_file);
-        if( (ln == 2 && header_line[ln-2] == '\r') || (ln == 1) )
-            break;
-    }
-
-    fseek(input_file, pos, SEEK_SET);
-    // Read all data
-    int sz;
-    for( sz = 0;  1 == fread(buf, 9, 1, input_file) && sz < (128*1024); sz++ )
-    {
-        for(int i=0; i<9; i++)
-        {
-            // Simplify patterns - rewrite silence as 0
-            if( (i & 1) == 1 )
-            {
-                int vol  = buf[i] & 0x0F;
-                int dist = buf[i] & 0xF0;
-                if( vol == 0 )
-                    buf[i] = 0;
-                else if( dist & 0x10 )
-                    buf[i] &= 0x1F;     // volume-only, ignore other bits
-                else if( dist & 0x20 )
-                    buf[i] &= 0xBF;     // no noise, ignore noise type bit
-            }
-            data[i][sz] = buf[i];
-        }
+        fprintf(stderr, "%s: invalid input file\n", prog_name);
+        exit(EXIT_FAILURE);
     }
     // Close file
     if( input_file != stdin )
@@ -636,98 +428,118 @@ int main(int argc, char **argv)
 
     // Perform trimming of the data:
     if( do_trim )
-        sz = sap_trim(data, sz, prog_name);
+        sap_trim(&song, prog_name);
 
     // Open output file if needed
-    FILE *output_file = stdout;
-    if( optind < argc-1 )
-    {
-        output_file = fopen(argv[optind+1], "wb");
-        if( !output_file )
-        {
-            fprintf(stderr, "%s: can't open output file '%s': %s\n",
-                    prog_name, argv[optind+1], strerror(errno));
-            exit(EXIT_FAILURE);
-        }
+    FILE *output_file = open_output(argc, argv);
+    // Replace inaudible values, can make more constant streams
+    struct codec *lzss = lzss_opts_codec(&lo);
+    if( do_canon && canon_song(lzss, &song, stderr, show_stats) )
+        exit(EXIT_FAILURE);
+    if( fx_mask )
+    {
+        effect_song(lzss, &song, fx_mask, output_file, show_stats);
+        codec_free(lzss);
+        sapr_free(&song);
+        return 0;
     }
-    b.out = output_file;
+
     // Check for empty streams and warn
-    int chn_skip[9];;
-    init(&b);
-    for(int i=8; i>=0; i--)
+    int chn_skip[SAPR_MAX_CHN];
+    sapr_skip_channels(&song, chn_skip, show_stats);
+
+    // Add the dictionary before the song
+    struct dict dict;
+    int plain_len = 0;
+    if( dict_base )
+        plain_len = dict_song(lzss, &song, chn_skip, dict_base, dict_start, dict_file,
+                              do_canon, &dict, show_stats);
+
+    // Parse and compress
+    void *st[SAPR_MAX_CHN];
+    struct bf b;
+    bf_init(&b);
+    if( do_rate )
     {
-        const uint8_t *p = data[i], s = *p;
-        int n = 0;
-        for(int j=0; j<sz; j++)
-            if( *p++ != s )
-                n++;
-        if( i != 0 && !n )
+        // Store one frame for each update, the header has the rate
+        struct rate rt;
+        uint8_t hdr[RATE_HDR_SIZE];
+        if( rate_detect(&song, &rt) > 1 )
         {
             if( show_stats )
-                fprintf(stderr,"Skipping channel #%d, set with $%02x.\n", i, s);
-            add_bit(&b,1);
-            chn_skip[i] = 1;
+                rate_stats(lzss, &song, chn_skip, &rt);
+            rate_reduce(&song, &rt);
         }
-        else
+        else if( show_stats )
         {
-            if( i )
-                add_bit(&b,0);
-            chn_skip[i] = 0;
-            if( !n )
-            {
-                fprintf(stderr,"WARNING: stream #%d ", i);
-                if( s == 0 )
-                    fprintf(stderr,"is empty");
-                else
-                    fprintf(stderr,"contains only $%02X", s);
-                fprintf(stderr, ", should not be included in output!\n");
-            }
+            fprintf(stderr,"Update rate: the song changes at any frame\n");
+            rate_sections(&song, stderr);
         }
-    }
-    bflush(&b);
-    // Now, we store initial values for all chanels:
-    for(int i=8; i>=0; i--)
-    {
-        // In version 1 we only store init byte for the skipped channels
-        if( fmt_literal_first || chn_skip[i] )
-            add_byte(&b, *data[i]);
-    }
-    bflush(&b);
-
-    // Init LZ states
-    struct lzop lz[9];
-    for(int i=0; i<9; i++)
-        if( !chn_skip[i] )
+        rate_write(&rt, hdr);
+        for(int i=0; i<RATE_HDR_SIZE; i++)
+            add_byte(&b, hdr[i]);
+    }
+    if( lo.format_version == 3 && (song.size < 2 || song.size > LZSS_MAX_COUNT + 1) )
+    {
+        fprintf(stderr, "%s: the number of frames should be from 2 to %d with -n\n",
+                prog_name, LZSS_MAX_COUNT + 1);
+        exit(EXIT_FAILURE);
+    }
+    if( lzss->xform )
+        xform_select(lzss, &song, chn_skip, stderr, show_stats);
+    if( !parse_file )
+        codec_parse(&lzss, 1, &song, chn_skip, st);
+    else if( incr_parse(lzss, &song, chn_skip, st, parse_file, show_stats ? stderr : 0) )
+    {
+        fprintf(stderr, "%s: error writing parse file '%s': %s\n",
+                prog_name, parse_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    codec_encode(lzss, &b, &song, chn_skip, st);
+    int total = b.len;
+    if( repeat_len )
+    {
+        // Replace the output with the blocks and play order
+        struct pattern pat;
+        int err;
+        while( (err = pattern_find(&song, repeat_len, &pat)) > 0 && repeat_len < song.size )
         {
-            lzop_init(&lz[i], data[i], sz);
-            lzop_backfill(&lz[i], 0);
+            pattern_free(&pat);
+            repeat_len *= 2;
         }
-
-    // Detect if at least one of the streams end in a match:
-    int end_not_ok = 1;
-    for(int i=0; i<9; i++)
-        if( !chn_skip[i] )
-            end_not_ok &= lzop_last_is_match(&lz[i]);
-
-    // If all streams end in a match, we need to fix at least one to end in
-    // a literal - just fix stream 0, as this is always encoded:
-    if( force_last_literal && end_not_ok )
+        if( err )
+        {
+            fprintf(stderr, "%s: can't find the repeated sections of the song\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        bf_reset(&b);
+        if( pattern_encode(lzss, &b, &song, chn_skip, &pat) )
+        {
+            fprintf(stderr, "%s: song too big for the repeated sections format\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        if( show_stats )
+        {
+            int frames = 0;
+            for(int i=0; i<pat.nblk; i++)
+                frames += pat.len[i];
+            fprintf(stderr,"Sections: %d blocks of %d frames, %d steps of at least %d frames, "
+                    "size %d bytes, saved %d bytes\n", pat.nblk, frames, pat.norder,
+                    repeat_len, b.len, total - b.len);
+        }
+        pattern_free(&pat);
+    }
+    int e = bank_size ? bank_write(&b, bank_size, output_file) : bf_write(&b, output_file);
+    if( e == -2 )
     {
-        fprintf(stderr,"LZSS: fixing up stream #0 to end in a literal\n");
-        lzop_backfill(&lz[0], 1);
+        fprintf(stderr, "%s: song needs more than %d banks\n", prog_name, BANK_MAX);
+        exit(EXIT_FAILURE);
     }
-    else if( end_not_ok )
+    else if( e )
     {
-        fprintf(stderr,"WARNING: stream does not end in a literal.\n");
-        fprintf(stderr,"WARNING: this can produce errors at the end of decoding.\n");
+        fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
     }
-
-    // Compress
-    for(int pos = fmt_literal_first ? 1 : 0; pos < sz; pos++)
-        for(int i=8; i>=0; i--)
-            if( !chn_skip[i] )
-                lpos[i] = lzop_encode(&b, &lz[i], pos, lpos[i]);
-    bflush(&b);
     // Close file
     if( output_file != stdout )
         fclose(output_file);
@@ -735,36 +547,46 @@ int main(int argc, char **argv)
         fflush(stdout);
 
     // Show stats
-    fprintf(stderr,"LZSS: max offset= %d,\tmax len= %d,\tmatch bits= %d,\t",
-            max_off, max_mlen, bits_match - 1);
-    fprintf(stderr,"ratio: %5d / %d = %5.2f%%\n", b.total, 9*sz, (100.0*b.total) / (9.0*sz));
-    if( show_stats )
-        for(int i=0; i<9; i++)
-            if( !chn_skip[i] )
-                fprintf(stderr," Stream #%d: %d bits,\t%5.2f%%,\t%5.2f%% of output\n", i,
-                        lz[i].bits[0], (100.0*lz[i].bits[0]) / (8.0*sz),
-                        (100.0*lz[i].bits[0])/(8.0*b.total) );
+    lzss->ops->stats(lzss, stderr, &song, chn_skip, st, total, show_stats);
+    if( dict_base && show_stats )
+        fprintf(stderr,"Dictionary: %d bytes saved, %d bytes without dictionary\n",
+                plain_len - total, plain_len);
+    if( bank_size && show_stats )
+    {
+        int n = bank_count(b.len, bank_size);
+        fprintf(stderr,"Banks: %d of %d bytes, table %d bytes, %d bytes free in last bank\n",
+                n, bank_size, 1 + 2 * n, n * bank_size - b.len - 1 - 2 * n);
+    }
 
-    if( show_stats>1 )
+    // Write the specialised player
+    if( player_file )
     {
-        fprintf(stderr,"\nvalue\t  POS\t  LEN\n");
-        for(int i=0; i<=max(max_mlen,max_off); i++)
+        FILE *f = fopen(player_file, "w");
+        if( !f )
+        {
+            fprintf(stderr, "%s: can't open player file '%s': %s\n",
+                    prog_name, player_file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        const char *song_file = optind < argc-1 ? argv[optind+1] : "test.lz16";
+        if( !lzss->ops->write_player ||
+            lzss->ops->write_player(lzss, f, &song, chn_skip, st, song_file,
+                                    show_stats ? stderr : 0) )
+            cmd_error("player generator only supports the -6 format");
+        if( ferror(f) )
         {
-            fprintf(stderr,"%2d\t%5d\t%5d\n", i,
-                    (i <= max_off) ? stat_off[i] : 0,
-                    (i <= max_mlen) ? stat_len[i] : 0);
+            fprintf(stderr, "%s: error writing player: %s\n", prog_name, strerror(errno));
+            exit(EXIT_FAILURE);
         }
+        fclose(f);
     }
 
     // Free memory
-    for(int i=0; i<9; i++)
-    {
-        free(data[i]);
-        if( !chn_skip[i] )
-            lzop_free(&lz[i]);
-    }
-    free(stat_len);
-    free(stat_off);
+    codec_parse_free(&lzss, 1, st);
+    codec_free(lzss);
+    if( dict_base )
+        dict_free(&dict);
+    bf_free(&b);
+    sapr_free(&song);
     return 0;
 }
-
@@ -0,0 +1,68 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Optimal parse step of the LZSS codec, included from codec_lzss.c once for
+ * each way of selecting the encoding.
+ *
+ * Define before including:
+ *  LZS_NAME       Name of the function.
+ *  LZS_MATCH      Name of the function storing only the match, to parse the
+ *                 stream in parts.
+ *  LZS_MAX_OFF    Maximum offset.
+ *  LZS_MAX_MLEN   Maximum match length.
+ *  LZS_MIN_MLEN   Minimum match length.
+ *  LZS_BITS_MATCH Bits for encoding a match.
+ *  LZS_CHOOSE     Optional, selects the encoding with the arguments of
+ *                 lzop_choose(), the default.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#ifndef LZS_CHOOSE
+#define LZS_CHOOSE lzop_choose
+#endif
+
+// Calculate optimal encoding at the match finder position, must be called
+// for all positions from the end of stream.
+static void LZS_NAME(const struct lzss *p, struct lzop *lz, const struct mrun *m)
+{
+    int pos = m->pos;
+    lz->mlen[pos] = 0;
+    (void)p;
+
+    // Init last bits
+    if( pos == lz->size - 1 )
+    {
+        lz->bits[pos] = bits_literal;
+        lz->win_count = 0;
+        return;
+    }
+
+    // Get best match at this position
+    int mp = 0;
+    int ml = mrun_match(m, LZS_MAX_OFF, LZS_MAX_MLEN, lz->size, &mp);
+    LZS_CHOOSE(lz, pos, ml, mp, LZS_MIN_MLEN, LZS_MAX_MLEN, LZS_BITS_MATCH);
+}
+
+// Stores the best match at the match finder position, the parse is done later
+// with lzop_parse_range().
+static void LZS_MATCH(const struct lzss *p, struct lzop *lz, const struct mrun *m)
+{
+    int pos = m->pos;
+    (void)p;
+    if( pos == lz->size - 1 )
+        return;
+    int mp = 0;
+    lz->mlen[pos] = mrun_match(m, LZS_MAX_OFF, LZS_MAX_MLEN, lz->size, &mp);
+    lz->mpos[pos] = mp;
+}
+
+#undef LZS_NAME
+#undef LZS_MATCH
+#undef LZS_MAX_OFF
+#undef LZS_MAX_MLEN
+#undef LZS_MIN_MLEN
+#undef LZS_BITS_MATCH
+#undef LZS_CHOOSE
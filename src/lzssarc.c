@@ -0,0 +1,244 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Builds a song archive from many SAP-R files, with an index to start any
+ * song and the repeated register streams stored only once. Use "unlzss -a"
+ * to decode one song of the archive.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "archive.h"
+#include "canon.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////
+static const char *prog_name;
+static void cmd_error(const char *msg)
+{
+    fprintf(stderr,"%s: error, %s\n"
+            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
+    exit(1);
+}
+
+// Reads one song, exits on error
+static void read_song(const char *fname, struct sapr *song, int pokeys)
+{
+    FILE *input_file = fopen(fname, "rb");
+    if( !input_file )
+    {
+        fprintf(stderr, "%s: can't open input file '%s': %s\n",
+                prog_name, fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if( sapr_read(song, input_file, pokeys) )
+    {
+        fprintf(stderr, "%s: invalid input file '%s'\n", prog_name, fname);
+        exit(EXIT_FAILURE);
+    }
+    fclose(input_file);
+}
+
+// Reads all the file to memory
+static uint8_t *read_file(FILE *f, int *len)
+{
+    size_t l = 0, alloc = 65536;
+    uint8_t *data = malloc(alloc);
+    size_t n;
+    while( data && 0 < (n = fread(data + l, 1, alloc - l, f)) )
+    {
+        l += n;
+        if( l == alloc )
+            data = realloc(data, alloc *= 2);
+    }
+    *len = l;
+    return data;
+}
+
+// Shows the index of an archive
+static int list_archive(const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
+    if( !f )
+    {
+        fprintf(stderr, "%s: can't open archive '%s': %s\n",
+                prog_name, fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int len;
+    uint8_t *img = read_file(f, &len);
+    if( !img )
+    {
+        fprintf(stderr, "%s: out of memory reading '%s'\n", prog_name, fname);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    int n = archive_count(img, len);
+    if( n < 0 )
+    {
+        fprintf(stderr, "%s: '%s' is not a valid archive\n", prog_name, fname);
+        exit(EXIT_FAILURE);
+    }
+    printf("%d songs, %d bytes, %d stored streams, match bits %d/%d, min length %d\n",
+           n, len, img[6] | (img[7] << 8), img[1], img[2], img[3]);
+    printf("%4s %7s %7s  %s\n", "song", "frames", "streams", "stored stream of each register");
+    for(int i=0; i<n; i++)
+    {
+        struct archive_song as;
+        if( archive_index(img, len, i, &as) )
+        {
+            fprintf(stderr, "%s: invalid index for song %d\n", prog_name, i);
+            exit(EXIT_FAILURE);
+        }
+        printf("%4d %7d %7d ", i, as.frames, as.nchn);
+        for(int j=0; j<as.nchn; j++)
+        {
+            if( as.stream[j] < 0 )
+                printf(" =%02x", as.value[j]);
+            else
+                printf(" %3d", as.stream[j]);
+        }
+        printf("\n");
+    }
+    free(img);
+    return 0;
+}
+
+///////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int do_trim = 0;
+    int do_canon = 0;
+    int pokeys = 0;
+    int show_stats = 1;
+    int list = 0;
+    struct lzss_opts lo;
+
+    lzss_opts_init(&lo);
+    prog_name = argv[0];
+    int opt;
+    while( -1 != (opt = getopt(argc, argv, "hqitcp:" LZSS_OPTS)) )
+    {
+        if( lzss_opts_set(&lo, opt, optarg) )
+            continue;
+        switch(opt)
+        {
+            case 't':
+                do_trim = 1;
+                break;
+            case 'c':
+                do_canon = 1;
+                break;
+            case 'p':
+                pokeys = atoi(optarg);
+                break;
+            case 'i':
+                list = 1;
+                break;
+            case 'q':
+                show_stats = 0;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr,
+                       "SAP Type-R song archive builder - by dmsc.\n"
+                       "\n"
+                       "Usage: %s [options] <output_file> <input_files...>\n"
+                       "       %s -i <archive_file>\n"
+                       "\n"
+                       "Compresses all the input files in one archive, with an index\n"
+                       "of the songs. Each register stream is compressed alone, and\n"
+                       "the streams that are the same in many songs are stored once.\n"
+                       "Decode one song with 'unlzss -a NUM'.\n"
+                       "\n"
+                       "Options:\n"
+                       "  -8, -2, -6, -o, -l, -b, -m\n"
+                       "           Match options, see 'lzss -h'.\n"
+                       "  -t       Trim song repetitions of each song.\n"
+                       "  -c       Replace the inaudible register values, see 'lzss -h'.\n"
+                       "  -p NUM   Number of POKEY chips, 1 or 2 (default = from the file).\n"
+                       "  -i       Shows the index of an archive.\n"
+                       "  -q       Don't show statistics.\n"
+                       "  -h       Shows this help.\n",
+                       prog_name, prog_name);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if( list )
+    {
+        if( optind != argc-1 )
+            cmd_error("one archive file expected");
+        return list_archive(argv[optind]);
+    }
+
+    const char *err = lzss_opts_check(&lo);
+    if( err )
+        cmd_error(err);
+    if( lo.format_version || !lo.force_last_literal )
+        cmd_error("archives only use the current format, -e, -x, -T, -n, -V and -g can't be used");
+    if( pokeys < 0 || pokeys > SAPR_MAX_POKEY )
+        cmd_error("number of POKEY chips should be 1 or 2");
+    if( optind > argc-2 )
+        cmd_error("one output file and at least one input file expected");
+    int nsongs = argc - optind - 1;
+    if( nsongs > ARCHIVE_MAX_SONGS )
+        cmd_error("too many input files");
+
+    struct codec *lzss = lzss_opts_codec(&lo);
+    struct sapr *songs = calloc(sizeof(struct sapr), nsongs);
+    long frames = 0;
+    for(int f=0; f<nsongs; f++)
+    {
+        read_song(argv[optind+1+f], &songs[f], pokeys);
+        if( do_trim )
+            sap_trim(&songs[f], prog_name);
+        if( do_canon && canon_song(lzss, &songs[f], stderr, 0) )
+            exit(EXIT_FAILURE);
+        frames += songs[f].size;
+    }
+
+    struct bf b;
+    struct archive_stats st;
+    bf_init(&b);
+    if( archive_build(lzss, songs, nsongs, &b, &st) )
+    {
+        fprintf(stderr, "%s: songs too long for the archive index\n", prog_name);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *output_file = fopen(argv[optind], "wb");
+    if( !output_file )
+    {
+        fprintf(stderr, "%s: can't open output file '%s': %s\n",
+                prog_name, argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if( bf_write(&b, output_file) || fclose(output_file) )
+    {
+        fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if( show_stats )
+    {
+        fprintf(stderr, "Archive: %d songs, %ld frames, %d bytes\n", nsongs, frames, b.len);
+        fprintf(stderr, "Streams: %d compressed, %d stored, %d repeated (%ld bytes saved), "
+                "%d constant\n", st.streams, st.stored, st.streams - st.stored, st.saved,
+                st.constant);
+    }
+
+    bf_free(&b);
+    for(int f=0; f<nsongs; f++)
+        sapr_free(&songs[f]);
+    free(songs);
+    codec_free(lzss);
+    return 0;
+}
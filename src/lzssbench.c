@@ -0,0 +1,263 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * This program measures the speed of the LZSS parser with the standard
+ * presets, parsing each stream in one part and in parts in many threads. Checks that the compressed
+ * output is always the same, and shows the size cost of the streaming
+ * encoder.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "stream.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////
+static const char *prog_name;
+static void cmd_error(const char *msg)
+{
+    fprintf(stderr,"%s: error, %s\n"
+            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
+    exit(1);
+}
+
+// Reads one song, exits on error
+static void read_song(const char *fname, struct sapr *song)
+{
+    FILE *input_file = fopen(fname, "rb");
+    if( !input_file )
+    {
+        fprintf(stderr, "%s: can't open input file '%s': %s\n",
+                prog_name, fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if( sapr_read(song, input_file, 0) )
+    {
+        fprintf(stderr, "%s: invalid input file '%s'\n", prog_name, fname);
+        exit(EXIT_FAILURE);
+    }
+    fclose(input_file);
+}
+
+static double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Compresses all the songs "repeat" times, returns the time in seconds and
+// stores the compressed output of each song.
+static double run_codec(const char *name, int nsplit,
+                        struct sapr *songs, int nsongs, int repeat, struct bf *out)
+{
+    codec_set_split(nsplit);
+    struct codec *c = codec_preset(name, 0, 1);
+    double t = 0;
+    for(int f=0; f<nsongs; f++)
+    {
+        int chn_skip[SAPR_MAX_CHN];
+        sapr_skip_channels(&songs[f], chn_skip, 0);
+        for(int r=0; r<repeat; r++)
+        {
+            void *st[SAPR_MAX_CHN];
+            memset(st, 0, sizeof(st));
+            double t0 = wall_time();
+            codec_parse(&c, 1, &songs[f], chn_skip, st);
+            t += wall_time() - t0;
+            if( !r )
+            {
+                bf_init(&out[f]);
+                codec_encode(c, &out[f], &songs[f], chn_skip, st);
+            }
+            codec_parse_free(&c, 1, st);
+        }
+    }
+    codec_free(c);
+    return t;
+}
+
+// Compares the outputs and frees the second one, returns 1 if all are equal
+static int same_output(struct bf *a, struct bf *b, int nsongs)
+{
+    int same = 1;
+    for(int f=0; f<nsongs; f++)
+    {
+        if( a[f].len != b[f].len || memcmp(a[f].buf, b[f].buf, a[f].len) )
+            same = 0;
+        bf_free(&b[f]);
+    }
+    return same;
+}
+
+// Compresses all the songs with the streaming encoder, returns the total size
+static long stream_size(const char *name, struct sapr *songs, int nsongs, int lookahead)
+{
+    struct codec *c = codec_preset(name, 0, 1);
+    long total = 0;
+    for(int f=0; f<nsongs; f++)
+    {
+        FILE *out = tmpfile();
+        if( !out )
+        {
+            fprintf(stderr, "%s: can't create temporary file: %s\n", prog_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        struct lzss_stream *z = lzss_stream_new(c, songs[f].nchn, lookahead, out);
+        for(int j=0; j<songs[f].size; j++)
+        {
+            uint8_t regs[SAPR_MAX_CHN];
+            for(int i=0; i<songs[f].nchn; i++)
+                regs[i] = songs[f].data[i][j];
+            lzss_stream_frame(z, regs);
+        }
+        total += lzss_stream_end(z);
+        fclose(out);
+    }
+    codec_free(c);
+    return total;
+}
+
+// Shows the size of the streaming encoder against the optimal parse
+static void stream_report(const char *const *presets, int npresets, const char *list,
+                          struct sapr *songs, int nsongs)
+{
+    printf("\n%-8s %9s %9s %9s %8s\n", "codec", "lookahead", "optimal", "stream", "cost");
+    for(int p=0; p<npresets; p++)
+    {
+        // Optimal size, using the same format without skipped channels
+        codec_set_split(0);
+        struct codec *c = codec_preset(presets[p], 0, 1);
+        long opt = 0;
+        for(int f=0; f<nsongs; f++)
+        {
+            int chn_skip[SAPR_MAX_CHN];
+            for(int i=0; i<SAPR_MAX_CHN; i++)
+                chn_skip[i] = i >= songs[f].nchn;
+            void *st[SAPR_MAX_CHN];
+            struct bf b;
+            bf_init(&b);
+            codec_parse(&c, 1, &songs[f], chn_skip, st);
+            opt += codec_encode(c, &b, &songs[f], chn_skip, st);
+            codec_parse_free(&c, 1, st);
+            bf_free(&b);
+        }
+        codec_free(c);
+
+        for(const char *l = list; *l; )
+        {
+            char *end;
+            int lookahead = strtol(l, &end, 10);
+            if( end == l || lookahead < 2 )
+                cmd_error("invalid lookahead list");
+            long sz = stream_size(presets[p], songs, nsongs, lookahead);
+            printf("%-8s %9d %9ld %9ld %+7.2f%%\n", presets[p], lookahead, opt, sz,
+                   (100.0 * (sz - opt)) / opt);
+            l = *end == ',' ? end + 1 : end;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    static const char *presets[] = { "lzss-8", "lzss-2", "lzss-6" };
+    int repeat = 3;
+    int nsplit = sysconf(_SC_NPROCESSORS_ONLN);
+    if( nsplit < 2 )
+        nsplit = 2;
+    const char *stream_list = 0;
+
+    prog_name = argv[0];
+    int opt;
+    while( -1 != (opt = getopt(argc, argv, "hn:j:s:")) )
+    {
+        switch(opt)
+        {
+            case 'n':
+                repeat = atoi(optarg);
+                break;
+            case 'j':
+                nsplit = atoi(optarg);
+                break;
+            case 's':
+                stream_list = optarg;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr,
+                       "SAP Type-R LZSS parser benchmark - by dmsc.\n"
+                       "\n"
+                       "Usage: %s [options] <input_files...>\n"
+                       "\n"
+                       "Compresses the input files with the standard LZSS presets,\n"
+                       "parsing each stream in one part and in parts with many\n"
+                       "threads. Shows the time of each one.\n"
+                       "\n"
+                       "Options:\n"
+                       "  -n NUM   Number of times to parse each file (default = %d).\n"
+                       "  -j NUM   Number of threads to parse in parts (default = %d).\n"
+                       "  -s LIST  Comma separated list of lookahead frames, shows the\n"
+                       "           size of the streaming encoder against the optimal parse.\n"
+                       "  -h       Shows this help.\n",
+                       prog_name, repeat, nsplit);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if( repeat < 1 )
+        cmd_error("number of repetitions should be positive");
+    if( nsplit < 2 )
+        cmd_error("number of threads should be at least 2");
+    if( optind >= argc )
+        cmd_error("no input files");
+
+    int nsongs = argc - optind;
+    struct sapr *songs = calloc(sizeof(struct sapr), nsongs);
+    long frames = 0;
+    for(int f=0; f<nsongs; f++)
+    {
+        read_song(argv[optind+f], &songs[f]);
+        frames += songs[f].size;
+    }
+
+    // Measure in one thread, so the time is not shared between streams
+    codec_set_threads(0);
+
+    struct bf *one = calloc(sizeof(struct bf), nsongs);
+    struct bf *prt = calloc(sizeof(struct bf), nsongs);
+    int errors = 0;
+    printf("%d files, %ld frames, %d repetitions, %d threads\n", nsongs, frames,
+           repeat, nsplit);
+    printf("%-8s %10s %10s %8s %10s\n", "codec", "one part", "parts", "speedup", "output");
+    for(unsigned p=0; p<sizeof(presets)/sizeof(presets[0]); p++)
+    {
+        double t1 = run_codec(presets[p], 1, songs, nsongs, repeat, one);
+        double tp = run_codec(presets[p], nsplit, songs, nsongs, repeat, prt);
+        int same = same_output(one, prt, nsongs);
+        for(int f=0; f<nsongs; f++)
+            bf_free(&one[f]);
+        printf("%-8s %9.3fs %9.3fs %7.2fx %10s\n", presets[p], t1, tp,
+               tp > 0 ? t1 / tp : 0.0, same ? "same" : "DIFFERENT");
+        errors += !same;
+    }
+    codec_set_split(0);
+
+    if( stream_list )
+        stream_report(presets, sizeof(presets)/sizeof(presets[0]), stream_list,
+                      songs, nsongs);
+
+    for(int f=0; f<nsongs; f++)
+        sapr_free(&songs[f]);
+    free(songs);
+    free(one);
+    free(prt);
+    return errors ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,373 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Client for the compression server, and stress test.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "xform.h"
+#include "proto.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////
+static const char *prog_name;
+static void cmd_error(const char *msg)
+{
+    fprintf(stderr,"%s: error, %s\n"
+            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
+    exit(1);
+}
+
+static int connect_server(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if( strlen(path) >= sizeof(addr.sun_path) )
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( fd < 0 )
+        return -1;
+    if( connect(fd, (struct sockaddr *)&addr, sizeof(addr)) )
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// One response from the server
+struct response
+{
+    uint32_t status;
+    uint8_t *out;
+    size_t out_alloc;
+    uint32_t out_len;
+    uint8_t *msg;
+    size_t msg_alloc;
+    uint32_t msg_len;
+};
+
+// Sends one request and reads the response, returns 0 on success
+static int request(int fd, const char *opts, const uint8_t *data, size_t len,
+                   struct response *r)
+{
+    char magic[4];
+    if( proto_write(fd, PROTO_REQUEST, 4) ||
+        proto_write_block(fd, opts, strlen(opts)) ||
+        proto_write_block(fd, data, len) )
+        return -1;
+    if( proto_read(fd, magic, 4) || memcmp(magic, PROTO_RESPONSE, 4) ||
+        proto_read_u32(fd, &r->status) ||
+        proto_read_block(fd, &r->out, &r->out_alloc, &r->out_len) ||
+        proto_read_block(fd, &r->msg, &r->msg_alloc, &r->msg_len) )
+        return -1;
+    return 0;
+}
+
+static void free_response(struct response *r)
+{
+    free(r->out);
+    free(r->msg);
+    memset(r, 0, sizeof(*r));
+}
+
+///////////////////////////////////////////////////////
+// Stress test: many threads sending the same request, all responses are
+// compared with the expected output.
+struct stress
+{
+    const char *path;
+    const char *opts;
+    const uint8_t *data;
+    size_t len;
+    const uint8_t *expect;
+    uint32_t expect_len;
+    int count;          // Requests to send
+    int errors;         // Requests that failed
+    int conn_reuse;     // Send all requests in one connection
+};
+
+static void *stress_thread(void *arg)
+{
+    struct stress *s = arg;
+    struct response r;
+    int fd = -1;
+    memset(&r, 0, sizeof(r));
+    for(int i=0; i<s->count; i++)
+    {
+        if( fd < 0 && (fd = connect_server(s->path)) < 0 )
+        {
+            s->errors++;
+            continue;
+        }
+        if( request(fd, s->opts, s->data, s->len, &r) || r.status ||
+            r.out_len != s->expect_len || memcmp(r.out, s->expect, r.out_len) )
+        {
+            s->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if( !s->conn_reuse )
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if( fd >= 0 )
+        close(fd);
+    free_response(&r);
+    return 0;
+}
+
+// Compresses in this process, used to check the server output
+static void compress_local(const char *opts, const uint8_t *data, size_t len,
+                           struct lzss_opts *lo, const char *codec_name,
+                           int do_trim, int pokeys, struct bf *b)
+{
+    struct sapr song;
+    int chn_skip[SAPR_MAX_CHN];
+    void *st[SAPR_MAX_CHN];
+    struct codec *c = codec_name ? codec_preset(codec_name, lo->format_version,
+                                                lo->force_last_literal)
+                                 : lzss_opts_codec(lo);
+    if( !c )
+        cmd_error("invalid codec name");
+    if( sapr_load(&song, data, len, pokeys, 0) )
+        cmd_error("invalid SAP file");
+    if( do_trim )
+        sap_trim(&song, prog_name);
+    sapr_skip_channels(&song, chn_skip, 0);
+    if( c->xform )
+        xform_select(c, &song, chn_skip, stderr, 0);
+    codec_parse(&c, 1, &song, chn_skip, st);
+    codec_encode(c, b, &song, chn_skip, st);
+    codec_parse_free(&c, 1, st);
+    codec_free(c);
+    sapr_free(&song);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+///////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    const char *path = proto_socket_path();
+    const char *codec_name = 0;
+    char opts[256] = "";
+    int stress_count = 0;
+    int stress_threads = 4;
+    int conn_reuse = 0;
+    int do_trim = 0;
+    int pokeys = 0;
+    struct lzss_opts lo;
+
+    lzss_opts_init(&lo);
+    prog_name = argv[0];
+    int opt;
+    while( -1 != (opt = getopt(argc, argv, "hqvtrs:c:p:S:j:" LZSS_OPTS)) )
+    {
+        // Options passed to the server
+        if( strchr("qvt" LZSS_OPTS, opt) || opt == 'c' || opt == 'p' )
+        {
+            size_t l = strlen(opts);
+            snprintf(opts + l, sizeof(opts) - l, "%s-%c%s%s", l ? " " : "", opt,
+                     optarg ? " " : "", optarg ? optarg : "");
+        }
+        if( lzss_opts_set(&lo, opt, optarg) )
+            continue;
+        switch(opt)
+        {
+            case 's':
+                path = optarg;
+                break;
+            case 'c':
+                codec_name = optarg;
+                break;
+            case 't':
+                do_trim = 1;
+                break;
+            case 'p':
+                pokeys = atoi(optarg);
+                break;
+            case 'S':
+                stress_count = atoi(optarg);
+                break;
+            case 'j':
+                stress_threads = atoi(optarg);
+                break;
+            case 'r':
+                conn_reuse = 1;
+                break;
+            case 'q':
+            case 'v':
+                break;
+            case 'h':
+            default:
+                fprintf(stderr,
+                       "LZSS SAP Type-R compression client - by dmsc.\n"
+                       "\n"
+                       "Usage: %s [options] <input_file> <output_file>\n"
+                       "\n"
+                       "Sends the file to the compression server 'lzssd'. Accepts all\n"
+                       "the options of 'lzss', plus:\n"
+                       "\n"
+                       "  -s PATH  Socket path (default = %s).\n"
+                       "  -c NAME  Use a codec preset, one of %s.\n"
+                       "  -p NUM   Number of POKEY chips, 1 or 2 (default = from SAP header).\n"
+                       "  -S NUM   Stress test, sends NUM requests and checks that all\n"
+                       "           the results are the same as compressing locally.\n"
+                       "  -j NUM   Number of threads for the stress test (default = %d).\n"
+                       "  -r       Reuse the connection for all requests in the stress test.\n"
+                       "  -h       Shows this help.\n",
+                       prog_name, proto_socket_path(), codec_preset_names, stress_threads);
+                exit(EXIT_FAILURE);
+        }
+    }
+    const char *err = lzss_opts_check(&lo);
+    if( err )
+        cmd_error(err);
+    if( pokeys < 0 || pokeys > SAPR_MAX_POKEY )
+        cmd_error("number of POKEY chips should be 1 or 2");
+    if( stress_count < 0 || stress_threads < 1 || stress_threads > 256 )
+        cmd_error("invalid stress test parameters");
+    if( optind < argc-2 )
+        cmd_error("too many arguments: one input file and one output file expected");
+
+    // Read input file
+    FILE *input_file = stdin;
+    if( optind < argc )
+    {
+        input_file = fopen(argv[optind], "rb");
+        if( !input_file )
+        {
+            fprintf(stderr, "%s: can't open input file '%s': %s\n",
+                    prog_name, argv[optind], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    set_binary();
+    size_t len = 0, alloc = 65536;
+    uint8_t *data = malloc(alloc);
+    size_t n;
+    while( data && 0 < (n = fread(data + len, 1, alloc - len, input_file)) )
+    {
+        len += n;
+        if( len == alloc )
+            data = realloc(data, alloc *= 2);
+    }
+    if( !data || len > PROTO_MAX_LEN )
+        cmd_error("input file too big");
+    if( input_file != stdin )
+        fclose(input_file);
+
+    int fd = connect_server(path);
+    if( fd < 0 )
+    {
+        fprintf(stderr, "%s: can't connect to server at '%s': %s\n",
+                prog_name, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct response r;
+    memset(&r, 0, sizeof(r));
+    if( request(fd, opts, data, len, &r) )
+    {
+        fprintf(stderr, "%s: communication error with server\n", prog_name);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    if( r.status )
+    {
+        fprintf(stderr, "%s: server error, %s\n", prog_name, (char *)r.msg);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(r.msg, r.msg_len, 1, stderr);
+
+    if( stress_count )
+    {
+        // Check against local compression first
+        struct bf b;
+        bf_init(&b);
+        compress_local(opts, data, len, &lo, codec_name, do_trim, pokeys, &b);
+        if( b.len != r.out_len || memcmp(b.buf, r.out, b.len) )
+        {
+            fprintf(stderr, "%s: server output differs from local compression\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        bf_free(&b);
+
+        struct stress *s = calloc(sizeof(struct stress), stress_threads);
+        pthread_t *th = calloc(sizeof(pthread_t), stress_threads);
+        double t0 = now();
+        for(int i=0; i<stress_threads; i++)
+        {
+            s[i].path = path;
+            s[i].opts = opts;
+            s[i].data = data;
+            s[i].len = len;
+            s[i].expect = r.out;
+            s[i].expect_len = r.out_len;
+            s[i].count = stress_count / stress_threads + (i < stress_count % stress_threads);
+            s[i].conn_reuse = conn_reuse;
+            if( pthread_create(&th[i], 0, stress_thread, &s[i]) )
+                cmd_error("can't create thread");
+        }
+        int errors = 0;
+        for(int i=0; i<stress_threads; i++)
+        {
+            pthread_join(th[i], 0);
+            errors += s[i].errors;
+        }
+        double t = now() - t0;
+        fprintf(stderr, "%s: stress test, %d requests in %d threads, %.3fs, %.1f req/s, "
+                "%d errors\n", prog_name, stress_count, stress_threads, t,
+                t > 0 ? stress_count / t : 0, errors);
+        free(s);
+        free(th);
+        if( errors )
+            exit(EXIT_FAILURE);
+    }
+
+    // Write output
+    FILE *output_file = stdout;
+    if( optind < argc-1 )
+    {
+        output_file = fopen(argv[optind+1], "wb");
+        if( !output_file )
+        {
+            fprintf(stderr, "%s: can't open output file '%s': %s\n",
+                    prog_name, argv[optind+1], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if( r.out_len && 1 != fwrite(r.out, r.out_len, 1, output_file) )
+    {
+        fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if( output_file != stdout )
+        fclose(output_file);
+    free_response(&r);
+    free(data);
+    return 0;
+}
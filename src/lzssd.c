@@ -0,0 +1,325 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Compression server, listens on a local socket and compresses the SAP-R
+ * files sent by the clients, see "proto.h" for the protocol.
+ *
+ * The worker threads and the parsing memory are kept between requests, so
+ * each request only pays the compression time.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "xform.h"
+#include "proto.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////
+static const char *prog_name;
+static const char *socket_path;
+static int verbose = 1;
+
+static void cmd_error(const char *msg)
+{
+    fprintf(stderr,"%s: error, %s\n"
+            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
+    exit(1);
+}
+
+static void on_signal(int sig)
+{
+    unlink(socket_path);
+    _exit(0);
+}
+
+///////////////////////////////////////////////////////
+// Options for one request
+struct req_opts
+{
+    struct lzss_opts lo;
+    const char *codec;  // Codec preset, NULL for LZSS with the options
+    int do_trim;
+    int pokeys;         // Number of POKEY chips, 0 to read from the SAP header
+    int show_stats;
+};
+
+// Parses the option string of the request, returns an error message or NULL
+static const char *parse_opts(char *str, struct req_opts *o)
+{
+    lzss_opts_init(&o->lo);
+    o->codec = 0;
+    o->do_trim = 0;
+    o->pokeys = 0;
+    o->show_stats = 1;
+
+    char *save = 0;
+    for(char *tok = strtok_r(str, " ", &save); tok; tok = strtok_r(0, " ", &save))
+    {
+        if( tok[0] != '-' || !tok[1] )
+            return "invalid option";
+        int opt = tok[1];
+        const char *arg = 0;
+        if( strchr("olmbcp", opt) )
+        {
+            // Option argument is the rest of the token or the next token
+            arg = tok[2] ? tok + 2 : strtok_r(0, " ", &save);
+            if( !arg )
+                return "option requires an argument";
+        }
+        else if( tok[2] )
+            return "invalid option";
+
+        if( opt != 'c' && strchr(LZSS_OPTS, opt) && lzss_opts_set(&o->lo, opt, arg) )
+            continue;
+        switch(opt)
+        {
+            case 'c':
+                o->codec = arg;
+                break;
+            case 'p':
+                o->pokeys = atoi(arg);
+                if( o->pokeys < 0 || o->pokeys > SAPR_MAX_POKEY )
+                    return "number of POKEY chips should be 1 or 2";
+                break;
+            case 't':
+                o->do_trim = 1;
+                break;
+            case 'v':
+                o->show_stats = 2;
+                break;
+            case 'q':
+                o->show_stats = 0;
+                break;
+            default:
+                return "invalid option";
+        }
+    }
+    return lzss_opts_check(&o->lo);
+}
+
+///////////////////////////////////////////////////////
+// Worker thread state, reused between requests
+struct worker
+{
+    int lsock;          // Listening socket
+    struct arena arena; // Memory for the song and the parsing
+    struct bf out;      // Compressed output
+    uint8_t *opts;      // Request options
+    size_t opts_alloc;
+    uint8_t *data;      // Request data
+    size_t data_alloc;
+    char *msg;          // Response message
+    size_t msg_len;
+};
+
+static int send_response(int fd, int status, const struct bf *out,
+                         const char *msg, size_t msg_len)
+{
+    if( proto_write(fd, PROTO_RESPONSE, 4) || proto_write_u32(fd, status) )
+        return -1;
+    if( proto_write_block(fd, out ? out->buf : 0, out ? out->len : 0) )
+        return -1;
+    return proto_write_block(fd, msg, msg_len);
+}
+
+// Process one request, returns 0 if the connection can continue
+static int handle_request(struct worker *w, int fd)
+{
+    char magic[4];
+    uint32_t opts_len, data_len;
+
+    if( proto_read(fd, magic, 4) || memcmp(magic, PROTO_REQUEST, 4) )
+        return -1;
+    if( proto_read_block(fd, &w->opts, &w->opts_alloc, &opts_len) ||
+        proto_read_block(fd, &w->data, &w->data_alloc, &data_len) )
+        return -1;
+
+    struct req_opts o;
+    const char *err = parse_opts((char *)w->opts, &o);
+    struct codec *c = 0;
+    if( !err )
+    {
+        c = o.codec ? codec_preset(o.codec, o.lo.format_version, o.lo.force_last_literal)
+                    : lzss_opts_codec(&o.lo);
+        if( !c )
+            err = "invalid codec name";
+    }
+    if( err )
+        return send_response(fd, 1, 0, err, strlen(err));
+
+    // Load the song in the arena, all the parsing memory is allocated there
+    struct sapr song;
+    int chn_skip[SAPR_MAX_CHN];
+    void *st[SAPR_MAX_CHN];
+    if( sapr_load(&song, w->data, data_len, o.pokeys, &w->arena) )
+    {
+        codec_free(c);
+        arena_reset(&w->arena);
+        err = "invalid SAP file";
+        return send_response(fd, 1, 0, err, strlen(err));
+    }
+    if( o.do_trim )
+        sap_trim(&song, prog_name);
+    sapr_skip_channels(&song, chn_skip, 0);
+
+    // Statistics and warnings are written to the message
+    FILE *mf = open_memstream(&w->msg, &w->msg_len);
+    c->msg = mf;
+    if( c->xform )
+        xform_select(c, &song, chn_skip, mf ? mf : stderr, mf ? o.show_stats : 0);
+
+    // The parallelism is given by the worker threads
+    bf_reset(&w->out);
+    codec_parse(&c, 1, &song, chn_skip, st);
+    codec_encode(c, &w->out, &song, chn_skip, st);
+
+    if( mf )
+    {
+        c->ops->stats(c, mf, &song, chn_skip, st, w->out.len, o.show_stats);
+        fclose(mf);
+    }
+
+    int e = send_response(fd, 0, &w->out, mf ? w->msg : "", mf ? w->msg_len : 0);
+
+    if( verbose > 1 )
+        fprintf(stderr, "%s: %s, %d frames -> %d bytes, arena %zu bytes\n",
+                prog_name, c->name, song.size, w->out.len, w->arena.total);
+
+    free(w->msg);
+    w->msg = 0;
+    codec_parse_free(&c, 1, st);
+    codec_free(c);
+    arena_reset(&w->arena);
+    return e;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    for(;;)
+    {
+        int fd = accept(w->lsock, 0, 0);
+        if( fd < 0 )
+        {
+            if( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            fprintf(stderr, "%s: accept: %s\n", prog_name, strerror(errno));
+            break;
+        }
+        while( 0 == handle_request(w, fd) )
+            ;
+        close(fd);
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    prog_name = argv[0];
+    socket_path = proto_socket_path();
+    int opt;
+    while( -1 != (opt = getopt(argc, argv, "hqvs:j:")) )
+    {
+        switch(opt)
+        {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 2;
+                break;
+            case 'q':
+                verbose = 0;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr,
+                       "LZSS SAP Type-R compression server - by dmsc.\n"
+                       "\n"
+                       "Usage: %s [options]\n"
+                       "\n"
+                       "Listens on a local socket for compression requests,\n"
+                       "use 'lzssc' to send files to the server.\n"
+                       "\n"
+                       "Options:\n"
+                       "  -s PATH  Socket path (default = %s).\n"
+                       "  -j NUM   Number of worker threads (default = %d).\n"
+                       "  -v       Shows each request.\n"
+                       "  -q       Don't show messages.\n"
+                       "  -h       Shows this help.\n",
+                       prog_name, proto_socket_path(), nthreads);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if( optind < argc )
+        cmd_error("too many arguments");
+    if( nthreads < 1 || nthreads > 256 )
+        cmd_error("number of threads should be from 1 to 256");
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if( strlen(socket_path) >= sizeof(addr.sun_path) )
+        cmd_error("socket path too long");
+    strcpy(addr.sun_path, socket_path);
+
+    int lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( lsock < 0 )
+    {
+        fprintf(stderr, "%s: can't create socket: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    unlink(socket_path);
+    if( bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) || listen(lsock, 64) )
+    {
+        fprintf(stderr, "%s: can't listen on '%s': %s\n", prog_name, socket_path,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    // Parse streams in the calling thread, the workers already run in parallel
+    codec_set_threads(0);
+
+    struct worker *w = calloc(sizeof(struct worker), nthreads);
+    pthread_t th;
+    for(int i=0; i<nthreads; i++)
+    {
+        w[i].lsock = lsock;
+        arena_init(&w[i].arena);
+        bf_init(&w[i].out);
+        if( i && pthread_create(&th, 0, worker_thread, &w[i]) )
+        {
+            fprintf(stderr, "%s: can't create thread: %s\n", prog_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if( verbose )
+        fprintf(stderr, "%s: listening on '%s' with %d threads.\n", prog_name,
+                socket_path, nthreads);
+
+    // Use main thread as the first worker
+    worker_thread(&w[0]);
+    unlink(socket_path);
+    return 1;
+}
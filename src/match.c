@@ -0,0 +1,71 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Incremental match finder, shared by all the codecs.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "match.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void mrun_init(struct mrun *m, const uint8_t *data, int size, int max_off)
+{
+    m->data = data;
+    m->size = size;
+    m->max_off = max_off;
+    m->pos = size;
+    m->bias = 0;
+    m->rstart = size;
+    m->run = calloc(sizeof(int), max_off + 1);
+    if( !m->run )
+    {
+        fprintf(stderr, "error: out of memory in match finder\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void mrun_free(struct mrun *m)
+{
+    free(m->run);
+    m->run = 0;
+}
+
+// Updates the run lengths of "mx" offsets
+static inline void mrun_update(struct mrun *m, int pos, int mx)
+{
+    const uint8_t *p = m->data + pos, c = *p;
+    int *run = m->run, zero = -m->bias;
+    // The match at each offset is one more than the match at the next
+    // position, or zero if the current byte is different.
+    for(int off=1; off<=mx; off++)
+        run[off] = (c == p[-off]) ? run[off] + 1 : zero;
+}
+
+void mrun_step(struct mrun *m)
+{
+    int pos = --m->pos;
+    int mx = m->max_off < pos ? m->max_off : pos;
+
+    // Find the start of the run of equal bytes, if "pos" is not in the last
+    // one. Each byte is visited once for each run, so this is linear.
+    if( m->rstart > pos )
+    {
+        int r = pos;
+        while( r > 0 && m->data[r-1] == m->data[pos] )
+            r--;
+        m->rstart = r;
+    }
+    // If all the window is equal to the current byte, all the matches are one
+    // byte longer
+    if( pos - m->rstart >= m->max_off )
+    {
+        m->bias++;
+        return;
+    }
+
+    mrun_update(m, pos, mx);
+}
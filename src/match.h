@@ -0,0 +1,69 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Incremental match finder, shared by all the codecs.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include <stdint.h>
+
+// The match finder visits the stream from the end to the start, as needed
+// by the optimal parsers, keeping the match length at each offset of the
+// window. Each step needs only one compare per offset, and the state can be
+// shared by all codecs parsing the same stream.
+struct mrun
+{
+    const uint8_t *data;    // The stream data
+    int size;               // Stream size
+    int max_off;            // Window size
+    int pos;                // Current position
+    int *run;               // Match length at current position for each
+                            // offset, minus "bias"
+    int bias;               // Added to all the match lengths, so a step inside
+                            // a run of equal bytes only increments this
+    int rstart;             // Start of the run of equal bytes with "pos"
+};
+
+void mrun_init(struct mrun *m, const uint8_t *data, int size, int max_off);
+void mrun_free(struct mrun *m);
+
+// Moves to the previous position in the stream, the first call moves to the
+// last byte. Inside runs of equal bytes longer than the window this takes
+// constant time.
+void mrun_step(struct mrun *m);
+
+// Returns maximal match length (and match offset) at current position, using
+// a window of "max_off" bytes, "max_len" maximum length, and considering only
+// "size" bytes of the stream. From the matches of the same length, returns
+// the one with the largest offset.
+// This is inline, so the loop is optimized when called with constant values.
+static inline int mrun_match(const struct mrun *m, int max_off, int max_len,
+                             int size, int *mpos)
+{
+    int mxlen = size - m->pos;
+    if( mxlen > max_len )
+        mxlen = max_len;
+    if( mxlen <= 0 )
+        return 0;
+    if( max_off > m->pos )
+        max_off = m->pos;
+    int mlen = 0;
+    const int *run = m->run;
+    int bias = m->bias;
+    for(int off=max_off; off>0; off--)
+    {
+        int ml = run[off] + bias;
+        if( ml > mlen )
+        {
+            mlen = ml;
+            *mpos = off;
+            if( mlen >= mxlen )
+                return mxlen;
+        }
+    }
+    return mlen;
+}
@@ -0,0 +1,146 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Sound effect overlays, see overlay.h.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "overlay.h"
+#include "codec_lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+int overlay_parse_regs(const char *list)
+{
+    int mask = 0;
+    while( *list )
+    {
+        char *end;
+        long r = strtol(list, &end, 10);
+        if( end == list || r < 0 || r >= SAPR_MAX_CHN || (*end && *end != ',') )
+            return -1;
+        mask |= 1 << r;
+        list = *end ? end + 1 : end;
+    }
+    return mask ? mask : -1;
+}
+
+// Builds a song with only the registers in "mask", from the lowest, so the
+// lowest register is stream 0.
+static void sub_song(const struct sapr *s, int mask, struct sapr *sub,
+                     int chn_skip[SAPR_MAX_CHN])
+{
+    memset(sub, 0, sizeof(*sub));
+    sub->size = s->size;
+    for(int i=0; i<s->nchn; i++)
+        if( mask & (1 << i) )
+            sub->data[sub->nchn++] = s->data[i];
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+        chn_skip[i] = i >= sub->nchn;
+}
+
+// Bytes of skipped channel bits in the LZSS format of "nchn" streams
+static int skip_bytes(int nchn)
+{
+    return (nchn + 6) / 8;
+}
+
+int overlay_encode(struct codec *lzss, struct bf *b, const struct sapr *s, int mask,
+                   struct overlay_stats *st)
+{
+    const struct lzss *p = lzss->priv;
+    struct sapr sub;
+    int chn_skip[SAPR_MAX_CHN];
+    void *ps[SAPR_MAX_CHN];
+    struct bf t;
+
+    if( mask & ~((1 << s->nchn) - 1) )
+        return -1;
+    sub_song(s, mask, &sub, chn_skip);
+    if( !sub.nchn )
+        return -1;
+    bf_init(&t);
+    codec_parse(&lzss, 1, &sub, chn_skip, ps);
+    codec_encode(lzss, &t, &sub, chn_skip, ps);
+
+    // The effect player only loops over the effect registers
+    int mx;
+    int ncyc = sub.nchn * OVL_CYC_CHN + OVL_CYC_FRAME;
+    int rcyc = sub.nchn * OVL_CYC_RESTORE_CHN + OVL_CYC_RESTORE;
+    st->nreg = sub.nchn;
+    st->cycles = lzss_cycles(p, &sub, chn_skip, (struct lzop **)ps, &mx);
+    st->cycles += (s->size - 1L) * ncyc + rcyc;
+    st->max_cycles = mx + ncyc;
+    if( st->max_cycles < rcyc )
+        st->max_cycles = rcyc;
+    st->max_bound = CYC_FRAME + ncyc + sub.nchn * (CYC_MATCH + CYC_REFILL);
+    if( st->max_bound < rcyc )
+        st->max_bound = rcyc;
+    codec_parse_free(&lzss, 1, ps);
+
+    // Bits of all the streams, followed by the song without its skip bits
+    for(int i=s->nchn-1; i>=0; i--)
+        add_bit(b, !(mask & (1 << i)));
+    bflush(b);
+    for(int i=skip_bytes(sub.nchn); i<t.len; i++)
+        add_byte(b, t.buf[i]);
+    bf_free(&t);
+    return 0;
+}
+
+int overlay_decode(const struct codec *lzss, struct sapr *fx, int *mask,
+                   const uint8_t *buf, int len, int nchn)
+{
+    struct br b;
+    int m = 0, k = 0;
+    br_init(&b, buf, len);
+    for(int i=nchn-1; i>=0; i--)
+    {
+        if( !get_bit(&b) )
+        {
+            m |= 1 << i;
+            k++;
+        }
+    }
+    br_flush(&b);
+    int hdr = (nchn + 7) / 8;
+    if( b.err || !k || len < hdr )
+        return -1;
+
+    // Decode as a song with only the effect registers
+    int sb = skip_bytes(k);
+    uint8_t *t = calloc(1, len - hdr + sb + 1);
+    struct sapr sub;
+    memcpy(t + sb, buf + hdr, len - hdr);
+    int e = lzss->ops->decode(lzss, &sub, t, len - hdr + sb, k);
+    free(t);
+    if( e )
+        return -1;
+
+    memset(fx, 0, sizeof(*fx));
+    fx->size = sub.size;
+    fx->nchn = nchn;
+    for(int i=0, j=0; i<nchn; i++)
+    {
+        if( m & (1 << i) )
+            fx->data[i] = sub.data[j++];
+        else
+            fx->data[i] = arena_calloc(0, sub.size);
+    }
+    *mask = m;
+    return 0;
+}
+
+void overlay_mix(struct sapr *s, const struct sapr *fx, int mask, int start)
+{
+    for(int i=0; i<s->nchn && i<fx->nchn; i++)
+    {
+        if( !(mask & (1 << i)) )
+            continue;
+        for(int f=start; f<s->size && f-start<fx->size; f++)
+            s->data[i][f] = fx->data[i][f-start];
+    }
+}
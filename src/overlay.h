@@ -0,0 +1,52 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Sound effect overlays: an effect is compressed with only the registers it
+ * writes, and is played over the music, replacing those registers.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// The effect is in the LZSS format, but the skipped channel bits are written
+// for all the streams, including stream 0, and are set for the registers not
+// in the effect. Only the effect registers have an initial value and tokens,
+// and the lowest effect register ends in a literal, to detect the end.
+
+// Approximate 6502 cycles added by asm/playfx.asm to the cycles of the same
+// streams in asm/playlzs16.asm
+#define OVL_CYC_FRAME       14  // Call and end of effect check
+#define OVL_CYC_CHN          7  // Register and buffer of each effect register
+#define OVL_CYC_RESTORE     45  // Frame after the end, restores the music...
+#define OVL_CYC_RESTORE_CHN 50  // ... of each effect register
+
+struct overlay_stats
+{
+    int nreg;           // Number of effect registers
+    long cycles;        // Player cycles of all frames
+    int max_cycles;     // Player cycles of the slowest frame
+    int max_bound;      // Maximum cycles of any frame with these registers
+};
+
+// Parses a list of register numbers separated by commas, returns the mask of
+// registers or -1 if not valid.
+int overlay_parse_regs(const char *list);
+
+// Compresses the registers in "mask" of the song as an effect, with an LZSS
+// codec. The cycles are of the "-6" player. Returns 0 on success, -1 if the
+// mask is empty or has registers not in the song.
+int overlay_encode(struct codec *lzss, struct bf *b, const struct sapr *s, int mask,
+                   struct overlay_stats *st);
+
+// Decodes an effect for a song of "nchn" streams, the registers not in the
+// effect are 0. Returns 0 on success.
+int overlay_decode(const struct codec *lzss, struct sapr *fx, int *mask,
+                   const uint8_t *buf, int len, int nchn);
+
+// Writes the effect registers over the song from frame "start", as the
+// player does, until the end of the effect or of the song.
+void overlay_mix(struct sapr *s, const struct sapr *fx, int mask, int start);
@@ -0,0 +1,338 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Song structure: finds repeated sections of the song, and writes the song
+ * as a list of unique blocks, each one compressed, and a play order.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "pattern.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Number of frames hashed to find the repeated sections
+#define PATTERN_HASH_LEN 16
+// Maximum number of previous positions tested for each frame
+#define PATTERN_MAX_CHAIN 256
+
+static unsigned frame_hash(const struct sapr *s, int pos)
+{
+    unsigned h = 2166136261u;
+    for(int i=0; i<s->nchn; i++)
+        h = (h ^ s->data[i][pos]) * 16777619u;
+    return h;
+}
+
+static int frame_equal(const struct sapr *s, int a, int b)
+{
+    for(int i=0; i<s->nchn; i++)
+        if( s->data[i][a] != s->data[i][b] )
+            return 0;
+    return 1;
+}
+
+static unsigned ids_hash(const int *id, int pos, int len)
+{
+    unsigned h = 2166136261u;
+    for(int i=0; i<len; i++)
+        h = (h ^ id[pos + i]) * 16777619u;
+    return h;
+}
+
+void pattern_free(struct pattern *p)
+{
+    free(p->start);
+    free(p->len);
+    free(p->order);
+    memset(p, 0, sizeof(*p));
+}
+
+int pattern_find(const struct sapr *s, int min_len, struct pattern *p)
+{
+    int sz = s->size;
+    memset(p, 0, sizeof(*p));
+    if( sz < 1 || min_len < 1 )
+        return -1;
+
+    int hsize = 1;
+    while( hsize < 2 * sz )
+        hsize <<= 1;
+
+    int *id = malloc(sizeof(int) * sz);         // Id of each frame of the song
+    int *uf = malloc(sizeof(int) * sz);         // Frames of the unique stream
+    int *uid = malloc(sizeof(int) * sz);        // Ids of the unique stream
+    int *prev = malloc(sizeof(int) * sz);       // Hash chains of the unique stream
+    int *head = malloc(sizeof(int) * hsize);
+    int *rs = malloc(sizeof(int) * sz);         // Play order as ranges of the
+    int *rl = malloc(sizeof(int) * sz);         // unique stream
+    char *cut = calloc(sz + 1, 1);              // Block starts in the unique stream
+    int *bid = malloc(sizeof(int) * (sz + 1));  // Block of each unique frame
+    int *cnt = calloc(sz + 1, sizeof(int));
+    int *follow = calloc(sz + 1, sizeof(int));
+    p->start = malloc(sizeof(int) * sz);
+    p->len = malloc(sizeof(int) * sz);
+    p->order = malloc(sizeof(int) * sz);
+    if( !id || !uf || !uid || !prev || !head || !rs || !rl || !cut || !bid ||
+        !cnt || !follow || !p->start || !p->len || !p->order )
+    {
+        fprintf(stderr, "error: out of memory finding song structure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Assign the same id to equal frames
+    for(int i=0; i<hsize; i++)
+        head[i] = -1;
+    for(int i=0; i<sz; i++)
+    {
+        unsigned h = frame_hash(s, i) & (hsize - 1);
+        while( head[h] >= 0 && !frame_equal(s, head[h], i) )
+            h = (h + 1) & (hsize - 1);
+        if( head[h] < 0 )
+            head[h] = i;
+        id[i] = head[h];
+    }
+
+    // Greedy parse of the song, each part is a repeat of a range of frames
+    // already in the unique stream or new frames added to the stream.
+    int k = min_len < PATTERN_HASH_LEN ? min_len : PATTERN_HASH_LEN;
+    int ulen = 0, nr = 0, lit = 0;
+    for(int i=0; i<hsize; i++)
+        head[i] = -1;
+    for(int i=0; i<sz; )
+    {
+        int bl = 0, bj = 0;
+        if( i + k <= sz && ulen >= k )
+        {
+            int n = 0;
+            for(int j = head[ids_hash(id, i, k) & (hsize - 1)];
+                j >= 0 && n < PATTERN_MAX_CHAIN; j = prev[j], n++)
+            {
+                int l = 0;
+                while( i + l < sz && j + l < ulen && uid[j + l] == id[i + l] )
+                    l++;
+                if( l > bl )
+                {
+                    bl = l;
+                    bj = j;
+                }
+            }
+        }
+        if( bl >= min_len )
+        {
+            rs[nr] = bj;
+            rl[nr] = bl;
+            nr++;
+            lit = 0;
+            i += bl;
+        }
+        else
+        {
+            if( lit )
+                rl[nr-1]++;
+            else
+            {
+                rs[nr] = ulen;
+                rl[nr] = 1;
+                nr++;
+                lit = 1;
+            }
+            uf[ulen] = i;
+            uid[ulen] = id[i];
+            ulen++;
+            if( ulen >= k )
+            {
+                unsigned h = ids_hash(uid, ulen - k, k) & (hsize - 1);
+                prev[ulen - k] = head[h];
+                head[h] = ulen - k;
+            }
+            i++;
+        }
+    }
+
+    // Split the unique stream in blocks at the start and end of each range,
+    // and where the frames are not consecutive in the song.
+    cut[0] = 1;
+    for(int r=0; r<nr; r++)
+        cut[rs[r]] = cut[rs[r] + rl[r]] = 1;
+    for(int i=1; i<ulen; i++)
+        if( uf[i] != uf[i-1] + 1 )
+            cut[i] = 1;
+    int nb = -1;
+    for(int i=0; i<ulen; i++)
+    {
+        if( cut[i] )
+        {
+            nb++;
+            p->start[nb] = uf[i];
+            p->len[nb] = 0;
+        }
+        bid[i] = nb;
+        p->len[nb]++;
+    }
+    nb++;
+    int no = 0;
+    for(int r=0; r<nr; r++)
+        for(int i = rs[r]; i < rs[r] + rl[r]; i += p->len[bid[i]])
+            p->order[no++] = bid[i];
+
+    // Join the blocks that are always played one after the other
+    for(int i=0; i<no; i++)
+    {
+        cnt[p->order[i]]++;
+        if( i + 1 < no && p->order[i+1] == p->order[i] + 1 )
+            follow[p->order[i]]++;
+    }
+    int nblk = 0;
+    for(int b=0; b<nb; b++)
+    {
+        if( b && follow[b-1] == cnt[b-1] && follow[b-1] == cnt[b] &&
+            p->start[b-1] + p->len[b-1] == p->start[b] )
+        {
+            // Merge into the previous
+            p->len[nblk-1] += p->len[b];
+            bid[b] = -1;
+        }
+        else
+        {
+            p->start[nblk] = p->start[b];
+            p->len[nblk] = p->len[b];
+            bid[b] = nblk++;
+        }
+    }
+    p->nblk = nblk;
+    p->norder = 0;
+    for(int i=0; i<no; i++)
+        if( bid[p->order[i]] >= 0 )
+            p->order[p->norder++] = bid[p->order[i]];
+
+    free(id);
+    free(uf);
+    free(uid);
+    free(prev);
+    free(head);
+    free(rs);
+    free(rl);
+    free(cut);
+    free(bid);
+    free(cnt);
+    free(follow);
+    return p->nblk > PATTERN_MAX_BLOCKS ? 1 : 0;
+}
+
+int pattern_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                   const int chn_skip[SAPR_MAX_CHN], const struct pattern *p)
+{
+    // Header, the offsets are written after compressing each block
+    int hdr = b->len;
+    add_byte(b, p->nblk);
+    add_byte(b, p->norder & 0xFF);
+    add_byte(b, p->norder >> 8);
+    for(int i=0; i<p->nblk; i++)
+    {
+        add_byte(b, 0);
+        add_byte(b, 0);
+        add_byte(b, p->len[i] & 0xFF);
+        add_byte(b, p->len[i] >> 8);
+    }
+    for(int i=0; i<p->norder; i++)
+        add_byte(b, p->order[i]);
+
+    // Compress each block as a song
+    struct bf blk;
+    bf_init(&blk);
+    for(int i=0; i<p->nblk; i++)
+    {
+        void *st[SAPR_MAX_CHN];
+        struct sapr v = *s;
+        for(int j=0; j<s->nchn; j++)
+            v.data[j] = s->data[j] + p->start[i];
+        v.size = p->len[i];
+        bf_reset(&blk);
+        codec_parse(&c, 1, &v, chn_skip, st);
+        codec_encode(c, &blk, &v, chn_skip, st);
+        codec_parse_free(&c, 1, st);
+
+        int off = b->len - hdr;
+        b->buf[hdr + 3 + 4 * i] = off & 0xFF;
+        b->buf[hdr + 4 + 4 * i] = off >> 8;
+        for(int j=0; j<blk.len; j++)
+            add_byte(b, blk.buf[j]);
+        if( off > 0xFFFF || p->len[i] > 0xFFFF )
+        {
+            bf_free(&blk);
+            return -1;
+        }
+    }
+    bf_free(&blk);
+    return p->norder > 0xFFFF ? -1 : 0;
+}
+
+int pattern_decode(const struct codec *c, struct sapr *s, const uint8_t *buf,
+                   int len, int nchn)
+{
+    if( len < 3 )
+        return -1;
+    int nblk = buf[0];
+    int norder = buf[1] | (buf[2] << 8);
+    int hdr = 3 + 4 * nblk + norder;
+    if( len < hdr )
+        return -1;
+    const uint8_t *order = buf + 3 + 4 * nblk;
+
+    // Get the position of each step of the play order
+    int *pos = malloc(sizeof(int) * (norder + 1));
+    if( !pos )
+        return -1;
+    pos[0] = 0;
+    for(int i=0; i<norder; i++)
+    {
+        if( order[i] >= nblk )
+        {
+            free(pos);
+            return -1;
+        }
+        pos[i+1] = pos[i] + (buf[5 + 4 * order[i]] | (buf[6 + 4 * order[i]] << 8));
+    }
+    if( pos[norder] > SAPR_MAX_FRAMES )
+    {
+        free(pos);
+        return -1;
+    }
+
+    s->size = pos[norder];
+    s->nchn = nchn;
+    s->arena = 0;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        s->data[i] = i < nchn ? arena_alloc(0, s->size ? s->size : 1) : 0;
+        s->xform[i] = 0;
+    }
+
+    // Decode each block and copy to each step that plays it
+    int err = 0;
+    for(int b=0; b<nblk && !err; b++)
+    {
+        int start = buf[3 + 4 * b] | (buf[4 + 4 * b] << 8);
+        int end = b + 1 < nblk ? buf[7 + 4 * b] | (buf[8 + 4 * b] << 8) : len;
+        int frames = buf[5 + 4 * b] | (buf[6 + 4 * b] << 8);
+        struct sapr bs;
+        if( start < hdr || end < start || end > len ||
+            c->ops->decode(c, &bs, buf + start, end - start, nchn) )
+        {
+            err = -1;
+            break;
+        }
+        if( bs.size < frames )
+            err = -1;
+        for(int i=0; i<norder && !err; i++)
+            if( order[i] == b )
+                for(int j=0; j<nchn; j++)
+                    memcpy(s->data[j] + pos[i], bs.data[j], frames);
+        sapr_free(&bs);
+    }
+    free(pos);
+    return err;
+}
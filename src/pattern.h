@@ -0,0 +1,47 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Song structure: finds repeated sections of the song, and writes the song
+ * as a list of unique blocks, each one compressed, and a play order.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// Maximum number of blocks, the play order uses one byte for each block
+#define PATTERN_MAX_BLOCKS 255
+
+// Song structure, the song is the concatenation of the blocks in "order"
+struct pattern
+{
+    int nblk;           // Number of unique blocks
+    int *start;         // First frame of each block in the song
+    int *len;           // Number of frames of each block
+    int norder;         // Length of the play order
+    int *order;         // Block played in each step
+};
+
+// Finds repeated sections of at least "min_len" frames, returns 0 on success,
+// 1 if there are more than PATTERN_MAX_BLOCKS blocks, so a longer "min_len"
+// could work, and -1 on other errors.
+int pattern_find(const struct sapr *s, int min_len, struct pattern *p);
+void pattern_free(struct pattern *p);
+
+// Compresses each block with the codec and writes the pattern file:
+//  - number of blocks, one byte,
+//  - length of the play order, 16 bit little-endian,
+//  - for each block, the offset of the compressed data from the start of
+//    the file and the number of frames, 16 bit little-endian,
+//  - the play order, one byte for each step,
+//  - the compressed blocks.
+// Returns 0 on success, -1 if the file is too big for the 16 bit offsets.
+int pattern_encode(struct codec *c, struct bf *b, const struct sapr *s,
+                   const int chn_skip[SAPR_MAX_CHN], const struct pattern *p);
+
+// Decodes a pattern file, returns 0 on success.
+int pattern_decode(const struct codec *c, struct sapr *s, const uint8_t *buf,
+                   int len, int nchn);
@@ -0,0 +1,327 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Generates an LZSS player specialised for one song: the loop over the
+ * channels is unrolled, the skipped channels are only written at init and
+ * each channel has a buffer of the size needed by the matches in the song.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec_lzss.h"
+#include <stdlib.h>
+
+// Approximate 6502 cycles of each path of the generated code
+#define GEN_FRAME    16     // End of frame and end of song check
+#define GEN_MASK      8     // Calculate one masked buffer position
+#define GEN_COPY     35     // Copy one byte of a match
+#define GEN_LITERAL  44     // New literal, without the flag bit
+#define GEN_MATCH    90     // New match, without the flag bit
+#define GEN_NOBUF    28     // Literal in a channel without matches
+#define GEN_MASKED    4     // Extra cycles reading a buffer of less than 256 bytes
+
+// Returns the name of the register of the channel
+static const char *reg_name(int chn)
+{
+    static char buf[32];
+    snprintf(buf, sizeof(buf), "%s+%d", chn < 9 ? "POKEY" : "POKEY2", chn % 9);
+    return buf;
+}
+
+// Writes the player code
+static void write_asm(FILE *f, const struct sapr *s, const int chn_skip[SAPR_MAX_CHN],
+                      const int bsize[SAPR_MAX_CHN], const char *song_file)
+{
+    int hdr = (s->nchn + 6) / 8;
+    int ram = 0;
+    for(int i=0; i<s->nchn; i++)
+        ram += bsize[i];
+
+    fprintf(f,
+            ";\n"
+            "; LZSS Compressed SAP player for 16 match bits, specialised for one song\n"
+            "; ----------------------------------------------------------------------\n"
+            ";\n"
+            "; (c) 2020 DMSC\n"
+            "; Code under MIT license, see LICENSE file.\n"
+            ";\n"
+            "; This file was generated by the compressor, and can only play the song\n"
+            "; in the file `%s`, compressed with the same options.\n"
+            ";\n"
+            "; The player needs %d bytes of buffer.\n"
+            ";\n"
+            "    org $80\n"
+            "\n"
+            "cur_pos     .ds     1\n", song_file, ram);
+
+    // Zero page variables
+    for(int m=1; m<256; m<<=1)
+        for(int i=0; i<s->nchn; i++)
+            if( bsize[i] == m )
+            {
+                fprintf(f, "cur_m%-7d.ds     1\n", m);
+                break;
+            }
+    for(int i=s->nchn-1; i>=0; i--)
+        if( bsize[i] )
+            fprintf(f, "cpy_%-8d.ds     1\n"
+                       "pos_%-8d.ds     1\n", i, i);
+
+    fprintf(f,
+            "\n"
+            "bit_data    .byte   1\n"
+            "\n"
+            ".proc get_byte\n"
+            "    lda song_data+%d\n"
+            "    inc song_ptr\n"
+            "    bne skip\n"
+            "    inc song_ptr+1\n"
+            "skip\n"
+            "    rts\n"
+            ".endp\n"
+            "song_ptr = get_byte + 1\n"
+            "\n"
+            "\n"
+            "POKEY = $D200\n"
+            "POKEY2 = $D210\n"
+            "\n"
+            "    org $2000\n", hdr);
+
+    // Buffers
+    for(int i=s->nchn-1; i>=0; i--)
+        if( bsize[i] )
+            fprintf(f, "buf_%d\n    .ds %d\n", i, bsize[i]);
+
+    fprintf(f,
+            "\n"
+            "song_data\n"
+            "        ins     '%s'\n"
+            "song_end\n"
+            "\n"
+            "\n"
+            "start\n"
+            "\n"
+            ";;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;\n"
+            "; Song Initialization - this runs in the first tick:\n"
+            ";\n"
+            ".proc init_song\n"
+            "    ldy #0\n", song_file);
+    for(int i=s->nchn-1; i>=0; i--)
+    {
+        fprintf(f, "    jsr get_byte\n"
+                   "    sta %s\n", reg_name(i));
+        if( bsize[i] )
+            fprintf(f, "    sta buf_%d + %d\n"
+                       "    sty cpy_%d\n", i, bsize[i] - 1, i);
+        else if( chn_skip[i] )
+            fprintf(f, "    ; channel %d is always $%02x\n", i, s->data[i][0]);
+    }
+    fprintf(f,
+            "    sty cur_pos\n"
+            ".endp\n"
+            "\n"
+            ";;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;\n"
+            "; Wait for next frame\n"
+            ";\n"
+            ".proc wait_frame\n"
+            "\n"
+            "    lda 20\n"
+            "delay\n"
+            "    cmp 20\n"
+            "    beq delay\n"
+            ".endp\n"
+            "\n"
+            ";;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;\n"
+            "; Play one frame of the song\n"
+            ";\n"
+            ".proc play_frame\n");
+
+    // Buffer positions for the smaller buffers
+    for(int m=1; m<256; m<<=1)
+        for(int i=0; i<s->nchn; i++)
+            if( bsize[i] == m )
+            {
+                fprintf(f, "    lda cur_pos\n"
+                           "    and #$%02x\n"
+                           "    sta cur_m%d\n", m - 1, m);
+                break;
+            }
+
+    for(int i=s->nchn-1; i>=0; i--)
+    {
+        if( chn_skip[i] )
+            continue;
+        fprintf(f, "\n    ; Channel %d\n", i);
+        if( bsize[i] )
+            fprintf(f, "    lda cpy_%d\n"
+                       "    bne copy_%d\n", i, i);
+        fprintf(f, "    lsr bit_data\n"
+                   "    bne bit_%d\n"
+                   "    jsr get_byte\n"
+                   "    ror\n"
+                   "    sta bit_data\n"
+                   "bit_%d\n"
+                   "    jsr get_byte\n", i, i);
+        if( !bsize[i] )
+        {
+            // Only literals in this channel
+            fprintf(f, "    sta %s\n", reg_name(i));
+            continue;
+        }
+        fprintf(f, "    bcs store_%d\n"
+                   "    sta pos_%d\n"
+                   "    jsr get_byte\n"
+                   "    sta cpy_%d\n"
+                   "copy_%d\n"
+                   "    dec cpy_%d\n"
+                   "    inc pos_%d\n", i, i, i, i, i, i);
+        if( bsize[i] < 256 )
+            fprintf(f, "    lda pos_%d\n"
+                       "    and #$%02x\n"
+                       "    tay\n", i, bsize[i] - 1);
+        else
+            fprintf(f, "    ldy pos_%d\n", i);
+        fprintf(f, "    lda buf_%d, y\n"
+                   "store_%d\n"
+                   "    sta %s\n", i, i, reg_name(i));
+        if( bsize[i] < 256 )
+            fprintf(f, "    ldy cur_m%d\n", bsize[i]);
+        else
+            fprintf(f, "    ldy cur_pos\n");
+        fprintf(f, "    sta buf_%d, y\n", i);
+    }
+
+    fprintf(f,
+            "\n"
+            "    inc cur_pos\n"
+            ".endp\n"
+            "\n"
+            ";;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;\n"
+            "; Check for ending of song and jump to the next frame\n"
+            ";\n"
+            ".proc check_end_song\n"
+            "    lda song_ptr + 1\n"
+            "    cmp #>song_end\n"
+            "    bne wait_frame\n"
+            "    lda song_ptr\n"
+            "    cmp #<song_end\n"
+            "    bne wait_frame\n"
+            ".endp\n"
+            "\n"
+            "end_loop\n"
+            "    rts\n"
+            "\n"
+            "\n"
+            "    run start\n"
+            "\n");
+}
+
+int lzss_player(const struct codec *c, FILE *f, const struct sapr *s,
+                const int chn_skip[SAPR_MAX_CHN], void *st[SAPR_MAX_CHN],
+                const char *song_file, FILE *out)
+{
+    const struct lzss *p = c->priv;
+    struct lzop **lz = (struct lzop **)st;
+    int bsize[SAPR_MAX_CHN], lpos[SAPR_MAX_CHN];
+
+    // Only the format of asm/playlzs16.asm is supported
+    if( p->bits_moff != 8 || p->bits_mlen != 8 || p->min_mlen != 1 ||
+        !p->fmt_literal_first || p->fmt_pos_start_zero || p->fmt_xform ||
+        p->fmt_frame_count || p->fmt_frame_flags )
+        return -1;
+
+    // Get the maximum offset used in each channel, the buffer is the next
+    // power of two so the position can be masked.
+    for(int i=0; i<s->nchn; i++)
+    {
+        int moff = 0;
+        for(int pos = 1; !chn_skip[i] && pos < s->size; )
+        {
+            int mlen = lz[i]->mlen[pos];
+            if( mlen < p->min_mlen )
+                pos++;
+            else
+            {
+                if( lz[i]->mpos[pos] > moff )
+                    moff = lz[i]->mpos[pos];
+                pos += mlen;
+            }
+        }
+        bsize[i] = 0;
+        if( moff )
+            for(bsize[i] = 1; bsize[i] < moff; bsize[i] <<= 1)
+                ;
+        lpos[i] = 0;
+    }
+
+    // Count the cycles of the generated player
+    int nmask = 0;
+    for(int m=1; m<256; m<<=1)
+        for(int i=0; i<s->nchn; i++)
+            if( bsize[i] == m )
+            {
+                nmask++;
+                break;
+            }
+    long total = 0;
+    int max = 0, bits = 0;
+    for(int pos = 1; pos < s->size; pos++)
+    {
+        int cyc = GEN_FRAME + GEN_MASK * nmask;
+        for(int i=s->nchn-1; i>=0; i--)
+        {
+            int masked = bsize[i] < 256 ? GEN_MASKED : 0;
+            if( chn_skip[i] )
+                continue;
+            else if( pos <= lpos[i] )
+                cyc += GEN_COPY + masked;
+            else
+            {
+                int mlen = lz[i]->mlen[pos];
+                cyc += bits ? CYC_BIT : CYC_REFILL;
+                bits = bits ? bits - 1 : 7;
+                if( !bsize[i] )
+                    cyc += GEN_NOBUF;
+                else if( mlen < p->min_mlen )
+                    cyc += GEN_LITERAL;
+                else
+                    cyc += GEN_MATCH + masked;
+                lpos[i] = mlen < p->min_mlen ? pos : pos + mlen - 1;
+            }
+        }
+        total += cyc;
+        if( cyc > max )
+            max = cyc;
+    }
+
+    write_asm(f, s, chn_skip, bsize, song_file);
+
+    // Compare with the generic player
+    if( out && s->size > 1 )
+    {
+        int gmax, ram = 0, zp = 2;
+        long gtotal = lzss_cycles(p, s, chn_skip, lz, &gmax);
+        for(int i=0; i<s->nchn; i++)
+        {
+            ram += bsize[i];
+            zp += bsize[i] ? 2 : 0;
+        }
+        for(int m=1; m<256; m<<=1)
+            for(int i=0; i<s->nchn; i++)
+                if( bsize[i] == m )
+                {
+                    zp++;
+                    break;
+                }
+        int gram = 256 * s->nchn;
+        int gzp = 2 * s->nchn + 4 + (s->nchn > 9 ? 3 : 1);
+        fprintf(out,"Player: cycles per frame %.1f (max %d), generic %.1f (max %d), "
+                "saved %.1f\n", total / (s->size - 1.0), max,
+                gtotal / (s->size - 1.0), gmax, (gtotal - total) / (s->size - 1.0));
+        fprintf(out,"Player: buffer %d bytes, zero page %d bytes, generic %d + %d, "
+                "saved %d bytes\n", ram, zp, gram, gzp, gram + gzp - ram - zp);
+    }
+    return 0;
+}
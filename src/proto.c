@@ -0,0 +1,93 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Protocol used between the compression server and the client.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "proto.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const char *proto_socket_path(void)
+{
+    const char *p = getenv("LZSSD_SOCKET");
+    return (p && *p) ? p : PROTO_SOCKET;
+}
+
+int proto_read(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while( len )
+    {
+        ssize_t n = read(fd, p, len);
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int proto_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while( len )
+    {
+        ssize_t n = write(fd, p, len);
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int proto_read_u32(int fd, uint32_t *v)
+{
+    uint8_t b[4];
+    if( proto_read(fd, b, 4) )
+        return -1;
+    *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    return 0;
+}
+
+int proto_write_u32(int fd, uint32_t v)
+{
+    uint8_t b[4] = { v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24 };
+    return proto_write(fd, b, 4);
+}
+
+int proto_read_block(int fd, uint8_t **buf, size_t *alloc, uint32_t *len)
+{
+    if( proto_read_u32(fd, len) || *len > PROTO_MAX_LEN )
+        return -1;
+    // Allocate one more byte, so strings can be terminated
+    if( *len + 1 > *alloc )
+    {
+        uint8_t *nbuf = realloc(*buf, *len + 1);
+        if( !nbuf )
+            return -1;
+        *buf = nbuf;
+        *alloc = *len + 1;
+    }
+    if( proto_read(fd, *buf, *len) )
+        return -1;
+    (*buf)[*len] = 0;
+    return 0;
+}
+
+int proto_write_block(int fd, const void *buf, uint32_t len)
+{
+    if( proto_write_u32(fd, len) )
+        return -1;
+    return proto_write(fd, buf, len);
+}
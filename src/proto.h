@@ -0,0 +1,46 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Protocol used between the compression server and the client.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Request:
+//  "LZSQ"
+//  u32 length of options, options as given in the command line of "lzss",
+//  separated by spaces, plus "-c NAME" to select a codec preset.
+//  u32 length of data, SAP-R file data
+//
+// Response:
+//  "LZSA"
+//  u32 status, 0 on success
+//  u32 length of output, compressed data
+//  u32 length of message, compression statistics or error message
+//
+// All numbers are in little endian. Many requests can be sent in the same
+// connection.
+#define PROTO_REQUEST  "LZSQ"
+#define PROTO_RESPONSE "LZSA"
+#define PROTO_MAX_LEN  (16*1024*1024)
+
+// Default socket path, can be changed with the LZSSD_SOCKET environment var.
+#define PROTO_SOCKET   "/tmp/lzssd.sock"
+
+// Returns socket path to use
+const char *proto_socket_path(void);
+
+// Reads/writes all the bytes, returns 0 on success
+int proto_read(int fd, void *buf, size_t len);
+int proto_write(int fd, const void *buf, size_t len);
+int proto_read_u32(int fd, uint32_t *v);
+int proto_write_u32(int fd, uint32_t v);
+// Reads a length and a block of data into a growable buffer
+int proto_read_block(int fd, uint8_t **buf, size_t *alloc, uint32_t *len);
+int proto_write_block(int fd, const void *buf, uint32_t len);
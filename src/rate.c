@@ -0,0 +1,144 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Detection of the update rate: songs that only write the POKEY registers
+ * every N frames are stored with one frame for each update.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "rate.h"
+#include <string.h>
+
+// Minimum length of the sections shown by rate_sections()
+#define RATE_MIN_SECTION 64
+
+static int gcd(int a, int b)
+{
+    while( b )
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Returns 1 if any register changes at "frame"
+static int frame_changes(const struct sapr *s, int frame)
+{
+    for(int i=0; i<s->nchn; i++)
+        if( s->data[i][frame] != s->data[i][frame-1] )
+            return 1;
+    return 0;
+}
+
+int rate_detect(const struct sapr *s, struct rate *r)
+{
+    int g = 0, first = 0, last = 0;
+    r->rate = r->first = r->last = 1;
+    for(int f=1; f<s->size; f++)
+        if( frame_changes(s, f) )
+        {
+            if( first )
+                g = gcd(g, f - last);
+            else
+                first = f;
+            last = f;
+        }
+    // Use the largest rate that divides all the distances
+    int n;
+    for(n = g < RATE_MAX ? g : RATE_MAX; n > 1; n--)
+        if( g % n == 0 )
+            break;
+    if( n < 2 )
+        return 1;
+
+    // The first and last frames are played longer, up to RATE_MAX frames
+    r->rate = n;
+    while( first > RATE_MAX )
+        first -= n;
+    while( s->size - last > RATE_MAX )
+        last += n;
+    r->first = first;
+    r->last = s->size - last;
+    return n;
+}
+
+void rate_sections(const struct sapr *s, FILE *out)
+{
+    int start = 0, prev = 0, g = 0;
+    for(int f=1; f<=s->size; f++)
+    {
+        if( f < s->size && !frame_changes(s, f) )
+            continue;
+        int ng = f < s->size ? gcd(g, f - prev) : 1;
+        if( prev && ng < 2 )
+        {
+            // The section ends at the previous change
+            if( g > 1 && prev - start >= RATE_MIN_SECTION )
+                fprintf(out, "Update rate: frames %d to %d, every %d frames\n",
+                        start, prev, g);
+            start = prev;
+            ng = f - prev;
+        }
+        g = ng;
+        prev = f;
+    }
+}
+
+// Returns the number of stored frames of a song of "size" frames
+static int rate_stored(const struct rate *r, int size)
+{
+    return 2 + (size - r->first - r->last) / r->rate;
+}
+
+void rate_reduce(struct sapr *s, const struct rate *r)
+{
+    int m = rate_stored(r, s->size);
+    for(int i=0; i<s->nchn; i++)
+        for(int k=1; k<m; k++)
+            s->data[i][k] = s->data[i][r->first + (k - 1) * r->rate];
+    s->size = m;
+}
+
+int rate_expand(struct sapr *s, const struct rate *r)
+{
+    int m = s->size;
+    if( m < 2 )
+        return -1;
+    long size = r->first + (m - 2L) * r->rate + r->last;
+    if( size > SAPR_MAX_FRAMES )
+        return -1;
+    // From the end, so the frames can be expanded in place
+    for(int i=0; i<s->nchn; i++)
+    {
+        uint8_t *d = s->data[i];
+        int f = size;
+        for(int k=m-1; k>=0; k--)
+        {
+            int n = !k ? r->first : k == m-1 ? r->last : r->rate;
+            f -= n;
+            memset(d + f, d[k], n);
+        }
+    }
+    s->size = size;
+    return 0;
+}
+
+void rate_write(const struct rate *r, uint8_t hdr[RATE_HDR_SIZE])
+{
+    hdr[0] = r->rate;
+    hdr[1] = r->first;
+    hdr[2] = r->last;
+}
+
+int rate_read(struct rate *r, const uint8_t hdr[RATE_HDR_SIZE])
+{
+    r->rate = hdr[0];
+    r->first = hdr[1];
+    r->last = hdr[2];
+    return r->rate && r->first && r->last ? 0 : -1;
+}
@@ -0,0 +1,51 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Detection of the update rate: songs that only write the POKEY registers
+ * every N frames are stored with one frame for each update.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "sapr.h"
+
+// Maximum frames between two updates
+#define RATE_MAX 255
+// Size of the header before the compressed song
+#define RATE_HDR_SIZE 3
+// Approximate 6502 cycles added by asm/playlzs16u.asm to asm/playlzs16.asm
+#define RATE_CYC_WAIT    8  // Frame without update
+#define RATE_CYC_UPDATE 13  // Frame with update, reloads the counter
+
+// The song is stored with one frame for each update: the first frame is
+// played "first" frames, the last frame "last" frames and all the others
+// "rate" frames.
+struct rate
+{
+    int rate;
+    int first;
+    int last;
+};
+
+// Detects the update rate of the song, returns the rate, 1 if the song
+// changes at frames not separated by the same number of frames.
+int rate_detect(const struct sapr *s, struct rate *r);
+
+// Shows the sections of the song with an update rate greater than 1, if
+// the song has more than one rate.
+void rate_sections(const struct sapr *s, FILE *out);
+
+// Keeps only one frame for each update, the song must have the rate
+// returned by rate_detect().
+void rate_reduce(struct sapr *s, const struct rate *r);
+
+// Repeats the frames to play at the original rate, returns 0 on success or
+// -1 if the song would have more than SAPR_MAX_FRAMES frames.
+int rate_expand(struct sapr *s, const struct rate *r);
+
+// Writes or reads the header, read returns 0 on success.
+void rate_write(const struct rate *r, uint8_t hdr[RATE_HDR_SIZE]);
+int rate_read(struct rate *r, const uint8_t hdr[RATE_HDR_SIZE]);
@@ -0,0 +1,237 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Reads SAP type B and C files, running the player code in a 6502 emulator
+ * and storing the values written to the POKEY registers after each call.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "sapb.h"
+#include "cpu6502.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Song length used if the file has no TIME tag, in seconds
+#define SAPB_DEFAULT_TIME 180
+// Maximum number of instructions in the INIT and PLAYER calls
+#define SAPB_MAX_INIT 20000000
+#define SAPB_MAX_PLAY 1000000
+
+struct sapb
+{
+    int type;           // 'B' or 'C'
+    int init;
+    int player;
+    int music;
+    int fastplay;
+    int songs;
+    int defsong;
+    int stereo;
+    int ntsc;
+    double time;        // Length of the default song in seconds, or 0
+    uint8_t regs[SAPR_MAX_CHN]; // Current values of the POKEY registers
+    int pokeys;
+    unsigned rnd;       // State of the RANDOM register
+    int vcount;
+};
+
+static int hex_val(const char *s)
+{
+    return (int)strtol(s, 0, 16);
+}
+
+// Parses "mm:ss.xxx" into seconds
+static double time_val(const char *s)
+{
+    int m = atoi(s);
+    const char *p = strchr(s, ':');
+    return p ? m * 60.0 + atof(p + 1) : 0;
+}
+
+// Reads the header tags, returns the start of the binary data or 0 on error
+static const uint8_t *parse_header(struct sapb *h, const uint8_t *buf, size_t len)
+{
+    memset(h, 0, sizeof(*h));
+    h->init = h->player = h->music = -1;
+    h->fastplay = -1;
+    h->songs = 1;
+    int ntime = 0;
+    size_t pos = 0;
+    while( pos + 1 < len && !(buf[pos] == 0xFF && buf[pos+1] == 0xFF) )
+    {
+        char line[128];
+        size_t ln = 0;
+        while( pos < len && buf[pos] != '\n' && ln < sizeof(line) - 1 )
+            line[ln++] = buf[pos++];
+        if( pos >= len || buf[pos] != '\n' )
+            return 0;
+        pos++;
+        while( ln && (line[ln-1] == '\r' || line[ln-1] == ' ') )
+            ln--;
+        line[ln] = 0;
+
+        if( !strncmp(line, "TYPE ", 5) )
+            h->type = line[5];
+        else if( !strncmp(line, "INIT ", 5) )
+            h->init = hex_val(line + 5);
+        else if( !strncmp(line, "PLAYER ", 7) )
+            h->player = hex_val(line + 7);
+        else if( !strncmp(line, "MUSIC ", 6) )
+            h->music = hex_val(line + 6);
+        else if( !strncmp(line, "FASTPLAY ", 9) )
+            h->fastplay = atoi(line + 9);
+        else if( !strncmp(line, "SONGS ", 6) )
+            h->songs = atoi(line + 6);
+        else if( !strncmp(line, "DEFSONG ", 8) )
+            h->defsong = atoi(line + 8);
+        else if( !strcmp(line, "STEREO") )
+            h->stereo = 1;
+        else if( !strcmp(line, "NTSC") )
+            h->ntsc = 1;
+        else if( !strncmp(line, "TIME ", 5) )
+        {
+            if( ntime == h->defsong )
+                h->time = time_val(line + 5);
+            ntime++;
+        }
+    }
+    if( h->fastplay <= 0 )
+        h->fastplay = h->ntsc ? 262 : 312;
+    return pos + 1 < len ? buf + pos : 0;
+}
+
+// Loads the binary blocks to memory, returns 0 on success
+static int load_blocks(struct cpu6502 *c, const uint8_t *p, const uint8_t *end)
+{
+    while( p < end )
+    {
+        if( end - p >= 2 && p[0] == 0xFF && p[1] == 0xFF )
+            p += 2;
+        if( end - p < 4 )
+            return -1;
+        int start = p[0] | (p[1] << 8);
+        int last = p[2] | (p[3] << 8);
+        p += 4;
+        if( last < start || end - p < last - start + 1 )
+            return -1;
+        memcpy(c->mem + start, p, last - start + 1);
+        p += last - start + 1;
+    }
+    return 0;
+}
+
+static void pokey_write(void *ctx, uint16_t addr, uint8_t val)
+{
+    struct sapb *h = ctx;
+    if( (addr & 0xFF00) != 0xD200 )
+        return;
+    int chip = h->pokeys > 1 ? (addr >> 4) & 1 : 0;
+    int reg = addr & 0x0F;
+    if( reg < 9 )
+        h->regs[chip * 9 + reg] = val;
+}
+
+static uint8_t pokey_read(void *ctx, uint16_t addr)
+{
+    struct sapb *h = ctx;
+    if( (addr & 0xFF0F) == 0xD20A )
+    {
+        // RANDOM, a 17 bit polynomial counter
+        h->rnd = (h->rnd >> 1) | ((((h->rnd >> 5) ^ h->rnd) & 1) << 16);
+        return h->rnd;
+    }
+    else if( (addr & 0xFF0F) == 0xD40B )
+    {
+        // VCOUNT, advance on each read so wait loops end
+        h->vcount = (h->vcount + 1) % (h->ntsc ? 131 : 156);
+        return h->vcount;
+    }
+    else if( (addr & 0xFF1F) == 0xD014 )
+        return h->ntsc ? 0x0F : 0x01;   // PAL register
+    return 0xFF;
+}
+
+int sapb_load(struct sapr *s, const uint8_t *buf, size_t len, int pokeys,
+              struct arena *a)
+{
+    struct sapb h;
+    s->size = 0;
+    s->nchn = 0;
+    const uint8_t *bin = parse_header(&h, buf, len);
+    if( !bin || (h.type != 'B' && h.type != 'C') )
+    {
+        fprintf(stderr, "SAP: invalid header or unsupported type\n");
+        return -1;
+    }
+    if( h.player < 0 || (h.type == 'B' && h.init < 0) || (h.type == 'C' && h.music < 0) )
+    {
+        fprintf(stderr, "SAP: missing PLAYER, INIT or MUSIC address\n");
+        return -1;
+    }
+
+    struct cpu6502 *c = malloc(sizeof(*c));
+    if( !c )
+        return -1;
+    cpu_init(c);
+    if( load_blocks(c, bin, buf + len) )
+    {
+        fprintf(stderr, "SAP: invalid binary data\n");
+        free(c);
+        return -1;
+    }
+    h.pokeys = (pokeys >= 1 && pokeys <= SAPR_MAX_POKEY) ? pokeys : (h.stereo ? 2 : 1);
+    h.rnd = 0x1FFFF;
+    c->io_write = pokey_write;
+    c->io_read = pokey_read;
+    c->ctx = &h;
+
+    // Number of calls to the player
+    double lines = h.ntsc ? 262.0 * 60 : 312.0 * 50;
+    double time = h.time > 0 ? h.time : SAPB_DEFAULT_TIME;
+    int sz = time * lines / h.fastplay + 0.5;
+    if( sz > SAPR_MAX_FRAMES )
+        sz = SAPR_MAX_FRAMES;
+    if( sz < 1 )
+        sz = 1;
+
+    int nchn = 9 * h.pokeys;
+    s->size = sz;
+    s->nchn = nchn;
+    s->arena = a;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        s->data[i] = i < nchn ? arena_alloc(a, sz) : 0;
+        s->xform[i] = 0;
+    }
+
+    // Init the song
+    int e;
+    if( h.type == 'B' )
+        e = cpu_call(c, h.init, h.defsong, 0, 0, SAPB_MAX_INIT);
+    else
+        e = cpu_call(c, h.player + 3, 0x70, h.music & 0xFF, h.music >> 8, SAPB_MAX_INIT) ||
+            cpu_call(c, h.player + 3, 0x00, h.defsong, 0, SAPB_MAX_INIT);
+
+    // Call the player and store the registers after each call
+    int play = h.type == 'B' ? h.player : h.player + 6;
+    for(int j=0; j<sz && !e; j++)
+    {
+        e = cpu_call(c, play, 0, 0, 0, SAPB_MAX_PLAY);
+        for(int i=0; i<nchn; i++)
+            s->data[i][j] = sapr_simplify(i, h.regs[i]);
+    }
+    free(c);
+    if( e )
+    {
+        fprintf(stderr, "SAP: player code does not return or has invalid instructions\n");
+        sapr_free(s);
+        return -1;
+    }
+    if( h.fastplay != (h.ntsc ? 262 : 312) )
+        fprintf(stderr, "SAP: FASTPLAY %d, the SAP-R data has %.2f frames for each screen frame\n",
+                h.fastplay, (h.ntsc ? 262.0 : 312.0) / h.fastplay);
+    return 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Reads SAP type B and C files, running the player code in a 6502 emulator
+ * and storing the values written to the POKEY registers after each call.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "sapr.h"
+
+// Loads a SAP type B or C file from memory, converting to SAP-R data. The
+// player is called each FASTPLAY lines, for the time of the default song in
+// the TIME tag. Returns 0 on success.
+int sapb_load(struct sapr *s, const uint8_t *buf, size_t len, int pokeys,
+              struct arena *a);
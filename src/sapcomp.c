@@ -0,0 +1,405 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * This program compresses a SAP-R file with many codecs in one pass, sharing
+ * the parsing of the input and the match finding, and writes the smallest
+ * result.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "codec.h"
+#include "estimate.h"
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CODECS 32
+
+///////////////////////////////////////////////////////
+static const char *prog_name;
+static int pokeys;
+static void cmd_error(const char *msg)
+{
+    fprintf(stderr,"%s: error, %s\n"
+            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
+    exit(1);
+}
+
+// Reads one song, exits on error
+static void read_song(const char *fname, struct sapr *song, int do_trim)
+{
+    FILE *input_file = stdin;
+    if( fname )
+    {
+        input_file = fopen(fname, "rb");
+        if( !input_file )
+        {
+            fprintf(stderr, "%s: can't open input file '%s': %s\n",
+                    prog_name, fname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if( sapr_read(song, input_file, pokeys) )
+    {
+        fprintf(stderr, "%s: invalid input file\n", prog_name);
+        exit(EXIT_FAILURE);
+    }
+    if( input_file != stdin )
+        fclose(input_file);
+
+    // Perform trimming of the data:
+    if( do_trim )
+        sap_trim(song, fname ? fname : prog_name);
+}
+
+///////////////////////////////////////////////////////
+// Estimation mode: shows the estimated size of each file, and optionally
+// compares with the real compressed size.
+static void estimate_files(struct codec **c, int nc, char **files, int nfiles,
+                           int do_trim, int sample_pct, int budget, int validate)
+{
+    struct estimate *est = calloc(sizeof(struct estimate), nc);
+    // Validation statistics
+    double *err_sum = calloc(sizeof(double), nc);
+    double *err_max = calloc(sizeof(double), nc);
+    int *in_bounds = calloc(sizeof(int), nc);
+    int best_ok = 0;
+    clock_t t_est = 0, t_full = 0;
+
+    printf("%-24s %7s %-8s %8s %8s %8s", "file", "frames", "codec", "estimate",
+           "low", "high");
+    if( budget )
+        printf(" %5s", "fits");
+    if( validate )
+        printf(" %8s %7s", "actual", "error");
+    printf("\n");
+
+    for(int f=0; f<nfiles; f++)
+    {
+        struct sapr song;
+        int chn_skip[SAPR_MAX_CHN];
+        read_song(files[f], &song, do_trim);
+        sapr_skip_channels(&song, chn_skip, 0);
+
+        clock_t t0 = clock();
+        codec_estimate(c, nc, &song, chn_skip, sample_pct, est);
+        t_est += clock() - t0;
+
+        int *actual = calloc(sizeof(int), nc);
+        if( validate )
+        {
+            void **st = calloc(sizeof(void *), SAPR_MAX_CHN * nc);
+            t0 = clock();
+            codec_parse(c, nc, &song, chn_skip, st);
+            for(int n=0; n<nc; n++)
+            {
+                struct bf b;
+                bf_init(&b);
+                actual[n] = codec_encode(c[n], &b, &song, chn_skip, st + SAPR_MAX_CHN*n);
+                bf_free(&b);
+            }
+            t_full += clock() - t0;
+            codec_parse_free(c, nc, st);
+            free(st);
+        }
+
+        int best_est = 0, best_act = 0;
+        for(int n=0; n<nc; n++)
+        {
+            printf("%-24.24s %7d %-8s %8d %8d %8d", files[f], song.size, c[n]->name,
+                   est[n].bytes, est[n].low, est[n].high);
+            if( budget )
+                printf(" %5s", est[n].high <= budget ? "yes" :
+                               est[n].low <= budget ? "maybe" : "no");
+            if( validate )
+            {
+                double err = actual[n] ? (100.0 * (est[n].bytes - actual[n])) / actual[n] : 0;
+                printf(" %8d %+6.2f%%%s", actual[n], err,
+                       (actual[n] >= est[n].low && actual[n] <= est[n].high) ? "" : " *");
+                err_sum[n] += fabs(err);
+                if( fabs(err) > err_max[n] )
+                    err_max[n] = fabs(err);
+                if( actual[n] >= est[n].low && actual[n] <= est[n].high )
+                    in_bounds[n]++;
+            }
+            printf("\n");
+            if( est[n].bytes < est[best_est].bytes )
+                best_est = n;
+            if( actual[n] < actual[best_act] )
+                best_act = n;
+        }
+        if( best_est == best_act )
+            best_ok++;
+        free(actual);
+        sapr_free(&song);
+    }
+
+    if( validate && nfiles )
+    {
+        printf("\nvalidation over %d files (* = actual size out of bounds):\n", nfiles);
+        printf("%-8s %10s %10s %10s\n", "codec", "mean err", "max err", "in bounds");
+        for(int n=0; n<nc; n++)
+            printf("%-8s %9.2f%% %9.2f%% %6d/%d\n", c[n]->name, err_sum[n] / nfiles,
+                   err_max[n], in_bounds[n], nfiles);
+        printf("best codec predicted in %d/%d files\n", best_ok, nfiles);
+        printf("estimation time: %.3fs, full compression time: %.3fs (%.1f%%)\n",
+               (double)t_est / CLOCKS_PER_SEC, (double)t_full / CLOCKS_PER_SEC,
+               t_full ? (100.0 * t_est) / t_full : 0.0);
+    }
+    free(err_sum);
+    free(err_max);
+    free(in_bounds);
+    free(est);
+}
+
+///////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    const char *codec_list = codec_preset_names;
+    int do_trim = 0;
+    int show_stats = 1;
+    int force_last_literal = 1;
+    int format_version = 0;
+    int write_all = 0;
+    int estimate = 0;
+    int validate = 0;
+    int sample_pct = 10;
+    int budget = 0;
+
+    prog_name = argv[0];
+    int opt;
+    while( -1 != (opt = getopt(argc, argv, "hqvaextc:p:EVS:B:")) )
+    {
+        switch(opt)
+        {
+            case 'c':
+                codec_list = optarg;
+                break;
+            case 't':
+                do_trim = 1;
+                break;
+            case 'p':
+                pokeys = atoi(optarg);
+                break;
+            case 'a':
+                write_all = 1;
+                break;
+            case 'E':
+                estimate = 1;
+                break;
+            case 'V':
+                estimate = 1;
+                validate = 1;
+                break;
+            case 'S':
+                sample_pct = atoi(optarg);
+                break;
+            case 'B':
+                budget = atoi(optarg);
+                break;
+            case 'v':
+                show_stats = 2;
+                break;
+            case 'q':
+                show_stats = 0;
+                break;
+            case 'e':
+                force_last_literal = 0;
+                break;
+            case 'x':
+                format_version = 1;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr,
+                       "SAP Type-R multi-codec compressor - by dmsc.\n"
+                       "\n"
+                       "Usage: %s [options] <input_file> <output_file>\n"
+                       "       %s -E [options] <input_files...>\n"
+                       "\n"
+                       "Compresses the input with all the given codecs, writes the\n"
+                       "smallest result and shows a comparison table.\n"
+                       "\n"
+                       "If output_file is omitted, write to standard output, and if\n"
+                       "input_file is also omitted, read from standard input.\n"
+                       "\n"
+                       "Options:\n"
+                       "  -c LIST  Comma separated list of codecs to try\n"
+                       "           (default = %s).\n"
+                       "  -a       Also write all results, to 'output_file.codec'.\n"
+                       "  -t       Tries to trim SAP-R file before compressing.\n"
+                       "  -p NUM   Number of POKEY chips, 1 or 2 (default = from SAP header).\n"
+                       "  -e       Don't force a literal at end of stream (LZSS only).\n"
+                       "  -x       Old LZSS format with initial data only for skipped channels.\n"
+                       "  -E       Estimate mode, shows the estimated compressed size of\n"
+                       "           all the input files, without compressing.\n"
+                       "  -V       Estimate mode, also compress the files and show the\n"
+                       "           error of the estimation.\n"
+                       "  -S PCT   Percentage of the song to sample in estimate mode\n"
+                       "           (default = %d).\n"
+                       "  -B SIZE  Memory budget in bytes, shows if the song fits.\n"
+                       "  -v       Shows the full statistics of each codec.\n"
+                       "  -q       Don't show comparison table.\n"
+                       "  -h       Shows this help.\n",
+                       prog_name, prog_name, codec_preset_names, sample_pct);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if( pokeys < 0 || pokeys > SAPR_MAX_POKEY )
+        cmd_error("number of POKEY chips should be 1 or 2");
+
+    // Create all the codecs
+    struct codec *codecs[MAX_CODECS];
+    int nc = 0;
+    {
+        char name[64];
+        const char *p = codec_list;
+        while( *p )
+        {
+            size_t ln = strcspn(p, ",");
+            if( ln >= sizeof(name) )
+                cmd_error("invalid codec name");
+            memcpy(name, p, ln);
+            name[ln] = 0;
+            p += ln;
+            if( *p )
+                p++;
+            if( !ln )
+                continue;
+            if( nc >= MAX_CODECS )
+                cmd_error("too many codecs");
+            codecs[nc] = codec_preset(name, format_version, force_last_literal);
+            if( !codecs[nc] )
+            {
+                fprintf(stderr, "%s: error, invalid codec '%s', valid codecs are: %s\n",
+                        prog_name, name, codec_preset_names);
+                exit(EXIT_FAILURE);
+            }
+            nc++;
+        }
+    }
+    if( !nc )
+        cmd_error("no codecs given");
+
+    if( sample_pct < 1 || sample_pct > 100 )
+        cmd_error("sample percentage should be from 1 to 100");
+    if( budget < 0 )
+        cmd_error("memory budget should be positive");
+
+    if( estimate )
+    {
+        if( optind >= argc )
+            cmd_error("estimate mode needs input files");
+        estimate_files(codecs, nc, argv + optind, argc - optind, do_trim,
+                       sample_pct, budget, validate);
+        for(int n=0; n<nc; n++)
+            codec_free(codecs[n]);
+        return 0;
+    }
+
+    if( optind < argc-2 )
+        cmd_error("too many arguments: one input file and one output file expected");
+    if( write_all && optind >= argc-1 )
+        cmd_error("option '-a' needs an output file name");
+    // Set stdin and stdout as binary files
+    set_binary();
+
+    // Read input file
+    struct sapr song;
+    read_song(optind < argc ? argv[optind] : 0, &song, do_trim);
+
+    // Check for empty streams
+    int chn_skip[SAPR_MAX_CHN];
+    sapr_skip_channels(&song, chn_skip, show_stats > 1);
+
+    // Parse with all codecs at once
+    void **st = calloc(sizeof(void *), SAPR_MAX_CHN * nc);
+    struct bf *b = calloc(sizeof(struct bf), nc);
+    codec_parse(codecs, nc, &song, chn_skip, st);
+
+    // Encode and select the best
+    int best = 0;
+    for(int n=0; n<nc; n++)
+    {
+        bf_init(&b[n]);
+        codec_encode(codecs[n], &b[n], &song, chn_skip, st + SAPR_MAX_CHN*n);
+        if( b[n].len < b[best].len )
+            best = n;
+        if( show_stats > 1 )
+            codecs[n]->ops->stats(codecs[n], stderr, &song, chn_skip, st + SAPR_MAX_CHN*n, b[n].len, 1);
+    }
+
+    // Show comparison table
+    if( show_stats )
+    {
+        fprintf(stderr, "codec     \t  size\t ratio\tplayer\n");
+        for(int n=0; n<nc; n++)
+            fprintf(stderr, "%-10s\t%6d\t%5.2f%%\t%s%s\n", codecs[n]->name, b[n].len,
+                    (100.0*b[n].len) / (1.0*song.nchn*song.size),
+                    codec_player(codecs[n], &song),
+                    n == best ? "\t(best)" : "");
+    }
+
+    // Write outputs
+    if( write_all )
+    {
+        for(int n=0; n<nc; n++)
+        {
+            char fname[4096];
+            snprintf(fname, sizeof(fname), "%s.%s", argv[optind+1], codecs[n]->name);
+            FILE *f = fopen(fname, "wb");
+            if( !f || bf_write(&b[n], f) )
+            {
+                fprintf(stderr, "%s: can't write output file '%s': %s\n",
+                        prog_name, fname, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            fclose(f);
+        }
+    }
+
+    FILE *output_file = stdout;
+    if( optind < argc-1 )
+    {
+        output_file = fopen(argv[optind+1], "wb");
+        if( !output_file )
+        {
+            fprintf(stderr, "%s: can't open output file '%s': %s\n",
+                    prog_name, argv[optind+1], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if( bf_write(&b[best], output_file) )
+    {
+        fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if( output_file != stdout )
+        fclose(output_file);
+    else
+        fflush(stdout);
+
+    fprintf(stderr, "%s: best codec is %s, %d bytes.\n", prog_name,
+            codecs[best]->name, b[best].len);
+
+    // Free memory
+    codec_parse_free(codecs, nc, st);
+    for(int n=0; n<nc; n++)
+    {
+        bf_free(&b[n]);
+        codec_free(codecs[n]);
+    }
+    free(b);
+    free(st);
+    sapr_free(&song);
+    return 0;
+}
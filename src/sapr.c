@@ -0,0 +1,312 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * SAP-R file reading and preprocessing, shared by all the compressors.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "sapr.h"
+#include "sapb.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+void set_binary(void)
+{
+  setmode(fileno(stdout),O_BINARY);
+  setmode(fileno(stdin),O_BINARY);
+}
+#else
+void set_binary(void)
+{
+}
+#endif
+
+uint8_t sapr_simplify(int chn, uint8_t b)
+{
+    // Simplify patterns - rewrite silence as 0
+    if( (chn % 9) & 1 )
+    {
+        int vol  = b & 0x0F;
+        int dist = b & 0xF0;
+        if( vol == 0 )
+            b = 0;
+        else if( dist & 0x10 )
+            b &= 0x1F;     // volume-only, ignore other bits
+        else if( dist & 0x20 )
+            b &= 0xBF;     // no noise, ignore noise type bit
+    }
+    return b;
+}
+
+int sapr_load(struct sapr *s, const uint8_t *buf, size_t len, int pokeys,
+              struct arena *a)
+{
+    // Skip SAP header, lines of less than 80 characters
+    int stereo = 0;
+    size_t pos = 0;
+    while( pos < len )
+    {
+        const uint8_t *nl = memchr(buf + pos, '\n', len - pos < 79 ? len - pos : 79);
+        if( !nl )
+            break;
+        size_t ln = nl + 1 - (buf + pos);
+        if( ln >= 7 && !memcmp(buf + pos, "STEREO", 6) && (buf[pos+6] == '\r' || buf[pos+6] == '\n') )
+            stereo = 1;
+        // Other types are converted running the player code
+        if( ln >= 6 && !memcmp(buf + pos, "TYPE ", 5) && (buf[pos+5] == 'B' || buf[pos+5] == 'C') )
+            return sapb_load(s, buf, len, pokeys, a);
+        pos += ln;
+        if( (ln == 2 && buf[pos-2] == '\r') || (ln == 1) )
+            break;
+    }
+
+    if( pokeys < 1 || pokeys > SAPR_MAX_POKEY )
+        pokeys = stereo ? 2 : 1;
+
+    int nchn = 9 * pokeys;
+    int sz = (len - pos) / nchn;
+    if( sz > SAPR_MAX_FRAMES )
+        sz = SAPR_MAX_FRAMES;
+
+    s->size = sz;
+    s->nchn = nchn;
+    s->arena = a;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        s->data[i] = 0;
+        s->xform[i] = 0;
+    }
+    for(int i=0; i<nchn; i++)
+        s->data[i] = arena_alloc(a, sz ? sz : 1);
+    if( !sz )
+        for(int i=0; i<nchn; i++)
+            s->data[i][0] = 0;
+
+    // Read all data
+    for(int j=0; j<sz; j++, pos += nchn)
+    {
+        for(int i=0; i<nchn; i++)
+            s->data[i][j] = sapr_simplify(i, buf[pos+i]);
+    }
+    return 0;
+}
+
+int sapr_read(struct sapr *s, FILE *input_file, int pokeys)
+{
+    // Read all the file
+    size_t len = 0, alloc = 0;
+    uint8_t *buf = 0;
+    for(;;)
+    {
+        if( len == alloc )
+        {
+            alloc = alloc ? alloc * 2 : 65536;
+            uint8_t *nbuf = realloc(buf, alloc);
+            if( !nbuf )
+            {
+                fprintf(stderr, "SAP: out of memory reading the file\n");
+                free(buf);
+                return -1;
+            }
+            buf = nbuf;
+        }
+        size_t n = fread(buf + len, 1, alloc - len, input_file);
+        if( !n )
+            break;
+        len += n;
+    }
+    int e = sapr_load(s, buf, len, pokeys, 0);
+    free(buf);
+    return e;
+}
+
+int sapr_read_header(FILE *f, int pokeys)
+{
+    // Read lines of less than 80 characters, up to an empty line
+    int stereo = 0;
+    for(;;)
+    {
+        char line[80];
+        if( !fgets(line, sizeof(line), f) )
+            return -1;
+        size_t ln = strlen(line);
+        if( !ln || line[ln-1] != '\n' )
+            return -1;
+        if( !strcmp(line, "\n") || !strcmp(line, "\r\n") )
+            break;
+        if( !strcmp(line, "STEREO\n") || !strcmp(line, "STEREO\r\n") )
+            stereo = 1;
+        if( !strncmp(line, "TYPE ", 5) && line[5] != 'R' )
+            return -1;
+    }
+    if( pokeys < 1 || pokeys > SAPR_MAX_POKEY )
+        pokeys = stereo ? 2 : 1;
+    return 9 * pokeys;
+}
+
+void sapr_free(struct sapr *s)
+{
+    for(int i=0; i<s->nchn; i++)
+    {
+        arena_release(s->arena, s->data[i]);
+        s->data[i] = 0;
+    }
+    s->size = 0;
+}
+
+int sapr_skip_channels(const struct sapr *s, int chn_skip[SAPR_MAX_CHN], int verbose)
+{
+    int nskip = 0;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+        chn_skip[i] = 1;
+    for(int i=s->nchn-1; i>=0; i--)
+    {
+        const uint8_t *p = s->data[i], v = *p;
+        int n = 0;
+        for(int j=0; j<s->size; j++)
+            if( *p++ != v )
+                n++;
+        if( i != 0 && !n )
+        {
+            if( verbose )
+                fprintf(stderr,"Skipping channel #%d, set with $%02x.\n", i, v);
+            chn_skip[i] = 1;
+            nskip++;
+        }
+        else
+        {
+            chn_skip[i] = 0;
+            if( !n )
+            {
+                fprintf(stderr,"WARNING: stream #%d ", i);
+                if( v == 0 )
+                    fprintf(stderr,"is empty");
+                else
+                    fprintf(stderr,"contains only $%02X", v);
+                fprintf(stderr, ", should not be included in output!\n");
+            }
+        }
+    }
+    return nskip;
+}
+
+// Returns true if any channel has volume in this frame
+static int frame_audible(uint8_t *const data[SAPR_MAX_CHN], int nchn, int frame)
+{
+    for(int p = 0; p < nchn; p += 9)
+        for(int j = 1; j < 8; j += 2)
+            if( data[p + j][frame] & 0x0F )
+                return 1;
+    return 0;
+}
+
+int sap_trim(struct sapr *s, const char *name)
+{
+    uint8_t **data = s->data;
+    int nchn = s->nchn;
+    int sz = s->size;
+    if( !sz )
+        return sz;
+
+    // Detect silence at the end:
+    int start;
+    for(start = 0; sz > 0; start++)
+    {
+        if( frame_audible(data, nchn, sz - 1) )
+            break;
+        sz--;
+    }
+    if( sz <= 0 )
+    {
+        fprintf(stderr, "%s: song is completely silent, skipping.", name);
+        return s->size = 0;
+    }
+    if( start )
+        fprintf(stderr, "%s: skipping %d frames from the end.", name, start);
+
+    // Detect silence at the start:
+    for(start=0; start<sz; start++)
+    {
+        if( frame_audible(data, nchn, start) )
+            break;
+    }
+
+    if( start >= sz )
+    {
+        fprintf(stderr, "%s: song is completely silent, skipping.", name);
+        return s->size = 0;
+    }
+
+    // Move song data skipping the blank segment
+    if( start )
+    {
+        fprintf(stderr, "%s: skipping %d frames from the start.", name, start);
+        sz = sz - start;
+        for(int i=0; i<nchn; i++)
+            memmove(data[i], data[i] + start, sz);
+    }
+
+    // For loop-detecting, clean silent channels:
+    uint8_t *buf = malloc(nchn * sz);
+    if( !buf )
+    {
+        fprintf(stderr, "%s: can't detect loop - out of memory.", name);
+        return s->size = sz;
+    }
+    for(int i = 0; i < sz; i++)
+    {
+        for(int k = 0; k < nchn; k += 9)
+        {
+            uint8_t *p = buf + i * nchn + k;
+            uint8_t *const *d = data + k;
+            p[8] = 0;
+            for(int j = 0; j < 8; j += 2)
+            {
+                if( 0 != (d[j + 1][i] & 0x0F) )
+                {
+                    p[j + 0] = d[j + 0][i];
+                    p[j + 1] = d[j + 1][i];
+                    p[8] = d[8][i];
+                }
+                else
+                {
+                    p[j] = p[j + 1] = 0;
+                }
+            }
+        }
+    }
+
+    // Detect loops of at least one second at the end of the song
+    const int one_sec = 50;
+    if( sz < 2 * one_sec )
+    {
+        free(buf);
+        return s->size = sz;
+    }
+
+    for(start = 0; start < sz - 2 * one_sec; start++)
+    {
+        int top = sz - one_sec;
+        for(int i = start + 1; i < top; i++)
+        {
+            if( 0 != memcmp(buf + nchn * start, buf + nchn * i, nchn * (sz - i)) )
+                continue;
+
+            // Detected a loop
+            fprintf(stderr, "%s: loop detected from frame %d to %d (of %d)\n",
+                    name, i, start, sz);
+            // Simply return the shortened song
+            free(buf);
+            return s->size = i;
+        }
+    }
+
+    free(buf);
+    return s->size = sz;
+}
@@ -0,0 +1,61 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * SAP-R file reading and preprocessing, shared by all the compressors.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "arena.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Maximum number of frames read from one file
+#define SAPR_MAX_FRAMES (128*1024)
+// Maximum number of POKEY chips, and of streams (9 registers for each POKEY)
+#define SAPR_MAX_POKEY 2
+#define SAPR_MAX_CHN (9 * SAPR_MAX_POKEY)
+
+// SAP-R song data, one buffer for each POKEY register
+struct sapr
+{
+    int size;           // Number of frames
+    int nchn;           // Number of streams, 9 for mono and 18 for stereo
+    uint8_t *data[SAPR_MAX_CHN];  // Register values, one byte per frame
+    int xform[SAPR_MAX_CHN];      // Transform applied to each stream, see xform.h
+    struct arena *arena;// Memory used for the song and the parsing, or NULL
+};
+
+void set_binary(void);
+
+// Reads a SAP-R file, skipping the SAP header and simplifying the register
+// values that are not audible. The number of POKEY chips is given in
+// "pokeys", if 0 it is read from the "STEREO" tag in the header. SAP type B
+// and C files are converted running the player, see sapb.h.
+// Returns 0 on success, or prints the error to stderr and returns -1.
+int sapr_read(struct sapr *s, FILE *f, int pokeys);
+// Loads a SAP-R file from memory, allocating from the given arena. On error
+// the song is left empty.
+int sapr_load(struct sapr *s, const uint8_t *buf, size_t len, int pokeys,
+              struct arena *a);
+void sapr_free(struct sapr *s);
+// Reads only the header of a SAP-R file, for reading the frames one by one.
+// Returns the number of streams, from "pokeys" or the "STEREO" tag, or -1 if
+// the header is not valid or is not a type R file.
+int sapr_read_header(FILE *f, int pokeys);
+// Returns the register value of stream "chn" with the bits that are not
+// audible cleared, so equal sounds have the same value.
+uint8_t sapr_simplify(int chn, uint8_t val);
+
+// Removes silence at start and end of the song, and detects loops.
+// Returns the new song size.
+int sap_trim(struct sapr *s, const char *name);
+
+// Detects constant streams that don't need to be encoded. Channel 0 is never
+// skipped, as it is used to detect the end of the song. Channels above the
+// number of streams are marked as skipped.
+// Returns the number of skipped channels.
+int sapr_skip_channels(const struct sapr *s, int chn_skip[SAPR_MAX_CHN], int verbose);
@@ -0,0 +1,212 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Streaming LZSS encoder, compresses the song while the frames are produced
+ * using a fixed amount of memory.
+ *
+ * The optimal parse needs the stream from the end, so the encoder keeps a
+ * window with the frames inside the match offset and the lookahead frames,
+ * in "2 * max_off + lookahead" bytes for each stream.
+ * When the lookahead is full, it is parsed as if the song ended there and
+ * the tokens starting in the first half are written. The output is the
+ * normal LZSS format without skipped channels, as the constant streams are
+ * only known at the end.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "stream.h"
+#include "codec_lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct lzss_stream
+{
+    struct codec *c;
+    struct lzss *p;
+    FILE *out;
+    struct bf b;
+    struct sapr win;        // Frames from "base" to "avail"
+    int lookahead;
+    long base;              // First frame in the window
+    long emitted;           // Frames already written
+    long avail;             // Frames added
+    long lend[SAPR_MAX_CHN];// Last frame of the last token of each stream
+    int last_match[SAPR_MAX_CHN]; // Last token is a match
+    long total;             // Bytes written
+    int err;
+};
+
+struct lzss_stream *lzss_stream_new(struct codec *c, int nchn, int lookahead, FILE *out)
+{
+    struct lzss *p = c->priv;
+    if( c->xform || nchn < 1 || nchn > SAPR_MAX_CHN || lookahead < 2 )
+        return 0;
+
+    struct lzss_stream *z = calloc(1, sizeof(*z));
+    if( !z )
+        return 0;
+    z->c = c;
+    z->p = p;
+    z->out = out;
+    z->lookahead = lookahead;
+    bf_init(&z->b);
+    z->win.nchn = nchn;
+    for(int i=0; i<nchn; i++)
+    {
+        z->win.data[i] = malloc(2 * p->max_off + lookahead);
+        if( !z->win.data[i] )
+        {
+            fprintf(stderr, "error: out of memory in stream encoder\n");
+            exit(EXIT_FAILURE);
+        }
+        // The first frame is stored as the initial values
+        z->lend[i] = p->fmt_literal_first ? 0 : -1;
+    }
+    memset(p->stat_len, 0, sizeof(int) * (p->max_mlen + 1));
+    memset(p->stat_off, 0, sizeof(int) * (p->max_off + 1));
+    return z;
+}
+
+// Parses the frames from "emitted" to "end", returns the parse of each stream
+static void stream_parse(struct lzss_stream *z, void *st[SAPR_MAX_CHN], long end)
+{
+    const struct codec *c = z->c;
+    for(int i=0; i<SAPR_MAX_CHN; i++)
+    {
+        st[i] = 0;
+        if( i >= z->win.nchn )
+            continue;
+        st[i] = c->ops->parse_new(c, z->win.data[i], end - z->base, 0);
+        struct mrun m;
+        mrun_init(&m, z->win.data[i], end - z->base, c->max_off);
+        while( m.pos > z->emitted - z->base )
+        {
+            mrun_step(&m);
+            c->ops->parse_pos(c, st[i], &m);
+        }
+        mrun_free(&m);
+    }
+}
+
+// Writes the frames from "emitted" to "end"
+static void stream_encode(struct lzss_stream *z, void *st[SAPR_MAX_CHN], long end)
+{
+    struct lzss *p = z->p;
+    struct lzop **lz = (struct lzop **)st;
+    for(long f = z->emitted; f < end; f++)
+    {
+        if( p->fmt_frame_flags )
+            bflush_bits(&z->b);
+        for(int i=z->win.nchn-1; i>=0; i--)
+            if( f > z->lend[i] )
+            {
+                int pos = f - z->base;
+                z->last_match[i] = lz[i]->mlen[pos] >= p->min_mlen;
+                z->lend[i] = z->base + lzop_encode(p, &z->b, lz[i], pos, pos - 1);
+            }
+    }
+    z->emitted = end;
+    int len = z->b.len;
+    if( bf_write_ready(&z->b, z->out) )
+        z->err = 1;
+    z->total += len - z->b.len;
+}
+
+// Removes the frames before the match window, keeping the positions in the
+// window aligned to the match offset, as the offsets are coded modulo it.
+static void stream_slide(struct lzss_stream *z)
+{
+    long base = (z->emitted - z->p->max_off) & ~(long)(z->p->max_off - 1);
+    if( base <= z->base )
+        return;
+    for(int i=0; i<z->win.nchn; i++)
+        memmove(z->win.data[i], z->win.data[i] + base - z->base, z->avail - base);
+    z->base = base;
+}
+
+int lzss_stream_frame(struct lzss_stream *z, const uint8_t *regs)
+{
+    int nchn = z->win.nchn;
+    for(int i=0; i<nchn; i++)
+        z->win.data[i][z->avail - z->base] = sapr_simplify(i, regs[i]);
+    z->avail++;
+
+    // Write the header at the first frame, no skipped channels
+    if( z->avail == 1 )
+    {
+        for(int i=nchn-1; i>0; i--)
+            add_bit(&z->b, 0);
+        bflush(&z->b);
+        if( z->p->fmt_literal_first )
+            for(int i=nchn-1; i>=0; i--)
+                add_byte(&z->b, z->win.data[i][0]);
+        bflush(&z->b);
+    }
+
+    // Parse the lookahead and write the first half. The last frame is not
+    // parsed, so no match written reaches it and, if it is the end of the
+    // song, stream #0 can always be fixed to end in a literal.
+    if( z->avail - z->emitted == z->lookahead )
+    {
+        void *st[SAPR_MAX_CHN];
+        stream_parse(z, st, z->avail - 1);
+        stream_encode(z, st, z->emitted + z->lookahead / 2);
+        codec_parse_free(&z->c, 1, st);
+        stream_slide(z);
+        if( fflush(z->out) )
+            z->err = 1;
+    }
+    return z->err ? -1 : 0;
+}
+
+long lzss_stream_end(struct lzss_stream *z)
+{
+    struct lzss *p = z->p;
+    if( z->avail > z->emitted )
+    {
+        void *st[SAPR_MAX_CHN];
+        struct lzop **lz = (struct lzop **)st;
+        stream_parse(z, st, z->avail);
+
+        // Detect if all the streams end in a match, as lzss_encode
+        int end_not_ok = 1;
+        for(int i=0; i<z->win.nchn; i++)
+        {
+            int last = z->last_match[i];
+            for(long f = z->lend[i] + 1; f < z->avail; )
+            {
+                int mlen = lz[i]->mlen[f - z->base];
+                last = mlen >= p->min_mlen;
+                f += last ? mlen : 1;
+            }
+            end_not_ok &= last;
+        }
+        FILE *msg = z->c->msg ? z->c->msg : stderr;
+        if( p->force_last_literal && end_not_ok && z->lend[0] < z->avail - 1 )
+        {
+            fprintf(msg,"LZSS: fixing up stream #0 to end in a literal\n");
+            lzop_backfill(p, lz[0], 1);
+        }
+        else if( end_not_ok )
+        {
+            fprintf(msg,"WARNING: stream does not end in a literal.\n");
+            fprintf(msg,"WARNING: this can produce errors at the end of decoding.\n");
+        }
+        stream_encode(z, st, z->avail);
+        codec_parse_free(&z->c, 1, st);
+    }
+    bflush(&z->b);
+    if( bf_write(&z->b, z->out) || fflush(z->out) )
+        z->err = 1;
+    z->total += z->b.len;
+
+    long total = z->err ? -1 : z->total;
+    for(int i=0; i<z->win.nchn; i++)
+        free(z->win.data[i]);
+    bf_free(&z->b);
+    free(z);
+    return total;
+}
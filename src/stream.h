@@ -0,0 +1,27 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Streaming LZSS encoder, compresses the song while the frames are produced
+ * using a fixed amount of memory.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+struct lzss_stream;
+
+// Starts a compressed stream with "nchn" streams, written to "out". Each
+// time "lookahead" frames are buffered, the window is parsed as if the song
+// ended there and the first half of the frames are written. Returns NULL
+// if the codec options are not supported, the stream transforms need all
+// the song.
+struct lzss_stream *lzss_stream_new(struct codec *c, int nchn, int lookahead, FILE *out);
+// Adds one frame with the values of the "nchn" registers. Returns 0 on success.
+int lzss_stream_frame(struct lzss_stream *z, const uint8_t *regs);
+// Writes the rest of the song and frees the stream. Returns the total
+// number of bytes written, or -1 on error.
+long lzss_stream_end(struct lzss_stream *z);
@@ -0,0 +1,420 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Decompressor for the LZSS files, writes a SAP-R file. This is used to
+ * verify the compressed files without an Atari emulator.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "archive.h"
+#include "bank.h"
+#include "canon.h"
+#include "codec_lzss.h"
+#include "dict.h"
+#include "overlay.h"
+#include "pattern.h"
+#include "rate.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////
+static const char *prog_name;
+static void cmd_error(const char *msg)
+{
+    fprintf(stderr,"%s: error, %s\n"
+            "Try '%s -h' for help.\n", prog_name, msg, prog_name);
+    exit(1);
+}
+
+// Reads all the file to memory
+static uint8_t *read_file(FILE *f, int *len)
+{
+    size_t l = 0, alloc = 65536;
+    uint8_t *data = malloc(alloc);
+    size_t n;
+    while( data && 0 < (n = fread(data + l, 1, alloc - l, f)) )
+    {
+        l += n;
+        if( l == alloc )
+            data = realloc(data, alloc *= 2);
+    }
+    *len = l;
+    return data;
+}
+
+// Compares the decoded song with the original, returns the number of errors.
+// With "canon" the inaudible differences are not errors.
+static int verify(const struct sapr *s, const char *fname, int pokeys, int canon,
+                  int show_stats)
+{
+    FILE *f = fopen(fname, "rb");
+    if( !f )
+    {
+        fprintf(stderr, "%s: can't open file '%s': %s\n",
+                prog_name, fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct sapr orig;
+    if( sapr_read(&orig, f, pokeys) )
+    {
+        fprintf(stderr, "%s: invalid input file '%s'\n", prog_name, fname);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+
+    int err = 0;
+    if( orig.nchn != s->nchn )
+    {
+        fprintf(stderr, "%s: '%s' has %d streams, decoded %d\n", prog_name, fname,
+                orig.nchn, s->nchn);
+        err++;
+    }
+    else if( orig.size != s->size )
+    {
+        fprintf(stderr, "%s: '%s' has %d frames, decoded %d\n", prog_name, fname,
+                orig.size, s->size);
+        err++;
+    }
+    else
+    {
+        int fj = 0, fi = 0;
+        for(int i=0; i<s->nchn; i++)
+            for(int j=0; j<s->size; j++)
+                if( orig.data[i][j] != s->data[i][j] )
+                {
+                    if( !err || j < fj )
+                    {
+                        fj = j;
+                        fi = i;
+                    }
+                    err++;
+                }
+        // Songs compressed with "-c" only differ in the inaudible values
+        if( err && canon && canon_verify(&orig, s) < 0 )
+        {
+            if( show_stats )
+                fprintf(stderr, "%s: %d inaudible differences, sounds the same as '%s'\n",
+                        prog_name, err, fname);
+            err = 0;
+        }
+        else if( err )
+            fprintf(stderr, "%s: first difference at frame %d, stream #%d: $%02x should be $%02x\n",
+                    prog_name, fj, fi, s->data[fi][fj], orig.data[fi][fj]);
+        else if( show_stats )
+            fprintf(stderr, "%s: output is the same as '%s'\n", prog_name, fname);
+    }
+    sapr_free(&orig);
+    return err;
+}
+
+///////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int pokeys = 1;
+    int show_stats = 1;
+    int bank_size = 0;
+    int patterns = 0;
+    int do_rate = 0;
+    int do_canon = 0;
+    int arc_song = -1;
+    const char *codec_name = 0;
+    const char *check_file = 0;
+    const char *fx_file = 0;
+    const char *dict_file = 0;
+    int fx_start = 0;
+    struct lzss_opts lo;
+
+    lzss_opts_init(&lo);
+    prog_name = argv[0];
+    int opt;
+    while( -1 != (opt = getopt(argc, argv, "hqrRcp:k:B:a:C:O:F:D:" LZSS_OPTS)) )
+    {
+        if( lzss_opts_set(&lo, opt, optarg) )
+            continue;
+        switch(opt)
+        {
+            case 'p':
+                pokeys = atoi(optarg);
+                break;
+            case 'r':
+                patterns = 1;
+                break;
+            case 'R':
+                do_rate = 1;
+                break;
+            case 'C':
+                codec_name = optarg;
+                break;
+            case 'a':
+                arc_song = atoi(optarg);
+                break;
+            case 'B':
+                bank_size = atoi(optarg) * 1024;
+                break;
+            case 'k':
+                check_file = optarg;
+                break;
+            case 'c':
+                do_canon = 1;
+                break;
+            case 'O':
+                fx_file = optarg;
+                break;
+            case 'F':
+                fx_start = atoi(optarg);
+                break;
+            case 'D':
+                dict_file = optarg;
+                break;
+            case 'q':
+                show_stats = 0;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr,
+                       "LZSS SAP Type-R decompressor - by dmsc.\n"
+                       "\n"
+                       "Usage: %s [options] <input_file> <output_file>\n"
+                       "\n"
+                       "If output_file is omitted, write to standard output, and if\n"
+                       "input_file is also omitted, read from standard input.\n"
+                       "\n"
+                       "Options:\n"
+                       "  -8, -2, -6, -o, -l, -b, -m, -x, -T, -n, -V, -g\n"
+                       "           Match options, the same as used to compress.\n"
+                       "  -p NUM   Number of POKEY chips, 1 or 2 (default = %d).\n"
+                       "  -r       Input has repeated sections, compressed with -r.\n"
+                       "  -R       Input has the update rate header, compressed with -R.\n"
+                       "  -B KB    Input is split in cartridge banks of 8 or 16 KB.\n"
+                       "  -a NUM   Input is a song archive, decodes song NUM from 0. The\n"
+                       "           match options and POKEY chips are read from the archive.\n"
+                       "  -C NAME  Decodes a file compressed with the codec NAME of\n"
+                       "           'sapcomp' instead of LZSS, one of: %s.\n"
+                       "  -O FILE  Plays the sound effect FILE, compressed with 'lzss -E',\n"
+                       "           over the decoded song.\n"
+                       "  -F NUM   Frame of the song to start the effect (default = 0).\n"
+                       "  -D FILE  Reads the history buffers written by 'lzss -w'.\n"
+                       "  -k FILE  Checks the decoded song against the original SAP-R file.\n"
+                       "  -c       Accepts the inaudible differences with -k, for songs\n"
+                       "           compressed with 'lzss -c'.\n"
+                       "  -q       Don't show messages.\n"
+                       "  -h       Shows this help.\n",
+                       prog_name, pokeys, codec_decoder_names);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    const char *err = lzss_opts_check(&lo);
+    if( err )
+        cmd_error(err);
+    if( pokeys < 1 || pokeys > SAPR_MAX_POKEY )
+        cmd_error("number of POKEY chips should be 1 or 2");
+    if( bank_size && bank_size != 8192 && bank_size != 16384 )
+        cmd_error("bank size should be 8 or 16");
+    if( arc_song >= 0 && (patterns || bank_size) )
+        cmd_error("song archives can't be used with -r or -B");
+    if( do_rate && (patterns || bank_size || arc_song >= 0) )
+        cmd_error("update rate can't be used with -r, -B or -a");
+    if( fx_start < 0 )
+        cmd_error("effect start frame should be positive");
+    if( codec_name && arc_song >= 0 )
+        cmd_error("song archives can't be used with -C");
+    if( dict_file && (patterns || do_rate || bank_size || arc_song >= 0 || codec_name) )
+        cmd_error("dictionaries can't be used with -r, -R, -B, -a or -C");
+
+    if( optind < argc-2 )
+        cmd_error("too many arguments: one input file and one output file expected");
+    FILE *input_file = stdin;
+    if( optind < argc )
+    {
+        input_file = fopen(argv[optind], "rb");
+        if( !input_file )
+        {
+            fprintf(stderr, "%s: can't open input file '%s': %s\n",
+                    prog_name, argv[optind], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Set stdin and stdout as binary files
+    set_binary();
+
+    // Read and decode input file
+    int len;
+    uint8_t *data = read_file(input_file, &len);
+    if( !data )
+    {
+        fprintf(stderr, "%s: out of memory reading input\n", prog_name);
+        exit(EXIT_FAILURE);
+    }
+    if( input_file != stdin )
+        fclose(input_file);
+    if( bank_size )
+    {
+        int img_len = len;
+        uint8_t *img = data;
+        data = bank_read(img, img_len, bank_size, &len);
+        if( !data )
+        {
+            fprintf(stderr, "%s: invalid bank table\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        if( show_stats )
+            fprintf(stderr, "%s: read %d bytes from %d banks.\n", prog_name, len, img[0]);
+        free(img);
+    }
+
+    struct codec *lzss = codec_name ? codec_preset(codec_name, lo.format_version,
+                                                   lo.force_last_literal) :
+                                      lzss_opts_codec(&lo);
+    if( !lzss )
+        cmd_error("invalid codec name");
+    if( !lzss->ops->decode )
+        cmd_error("the codec has no decoder");
+    struct dict dict;
+    if( dict_file )
+    {
+        FILE *f = fopen(dict_file, "rb");
+        if( !f )
+        {
+            fprintf(stderr, "%s: can't open dictionary file '%s': %s\n",
+                    prog_name, dict_file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if( dict_read(&dict, lzss, 9 * pokeys, f) )
+        {
+            fprintf(stderr, "%s: invalid dictionary file '%s'\n", prog_name, dict_file);
+            exit(EXIT_FAILURE);
+        }
+        fclose(f);
+        lzss_set_dict(lzss, &dict);
+    }
+    struct sapr song;
+    if( arc_song >= 0 )
+    {
+        int n = archive_count(data, len);
+        if( n < 0 )
+        {
+            fprintf(stderr, "%s: invalid song archive\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        if( arc_song >= n )
+        {
+            fprintf(stderr, "%s: song %d not in archive, it has %d songs\n",
+                    prog_name, arc_song, n);
+            exit(EXIT_FAILURE);
+        }
+        if( archive_decode(data, len, arc_song, &song) )
+        {
+            fprintf(stderr, "%s: invalid compressed data\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        pokeys = song.nchn / 9;
+    }
+    else if( do_rate )
+    {
+        // Decode the stored frames and repeat each one until the next update
+        struct rate rt;
+        if( len < RATE_HDR_SIZE || rate_read(&rt, data) ||
+            lzss->ops->decode(lzss, &song, data + RATE_HDR_SIZE, len - RATE_HDR_SIZE,
+                              9 * pokeys) ||
+            rate_expand(&song, &rt) )
+        {
+            fprintf(stderr, "%s: invalid compressed data\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        if( show_stats )
+            fprintf(stderr, "%s: update rate every %d frames.\n", prog_name, rt.rate);
+    }
+    else if( patterns ? pattern_decode(lzss, &song, data, len, 9 * pokeys) :
+                        lzss->ops->decode(lzss, &song, data, len, 9 * pokeys) )
+    {
+        fprintf(stderr, "%s: invalid compressed data\n", prog_name);
+        exit(EXIT_FAILURE);
+    }
+    if( show_stats )
+        fprintf(stderr, "%s: decoded %d frames, %d streams.\n", prog_name,
+                song.size, song.nchn);
+
+    // Write the effect over the song
+    if( fx_file )
+    {
+        FILE *f = fopen(fx_file, "rb");
+        if( !f )
+        {
+            fprintf(stderr, "%s: can't open effect file '%s': %s\n",
+                    prog_name, fx_file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        int fx_len, fx_mask;
+        uint8_t *fx_data = read_file(f, &fx_len);
+        fclose(f);
+        struct codec *fxc = lzss_opts_codec(&lo);
+        struct sapr fx;
+        if( !fx_data || overlay_decode(fxc, &fx, &fx_mask, fx_data, fx_len, song.nchn) )
+        {
+            fprintf(stderr, "%s: invalid effect file '%s'\n", prog_name, fx_file);
+            exit(EXIT_FAILURE);
+        }
+        overlay_mix(&song, &fx, fx_mask, fx_start);
+        if( show_stats )
+            fprintf(stderr, "%s: effect of %d frames from frame %d.\n", prog_name,
+                    fx.size, fx_start);
+        sapr_free(&fx);
+        codec_free(fxc);
+        free(fx_data);
+    }
+
+    // Open output file if needed
+    FILE *output_file = stdout;
+    if( optind < argc-1 )
+    {
+        output_file = fopen(argv[optind+1], "wb");
+        if( !output_file )
+        {
+            fprintf(stderr, "%s: can't open output file '%s': %s\n",
+                    prog_name, argv[optind+1], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Write SAP-R file
+    fprintf(output_file, "SAP\r\nTYPE R\r\n%s\r\n", pokeys > 1 ? "STEREO\r\n" : "");
+    for(int j=0; j<song.size; j++)
+        for(int i=0; i<song.nchn; i++)
+            putc(song.data[i][j], output_file);
+    if( ferror(output_file) )
+    {
+        fprintf(stderr, "%s: error writing output: %s\n", prog_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if( output_file != stdout )
+        fclose(output_file);
+    else
+        fflush(stdout);
+
+    // Verify
+    int ret = 0;
+    if( check_file )
+    {
+        int e = verify(&song, check_file, pokeys, do_canon, show_stats);
+        if( e )
+        {
+            fprintf(stderr, "%s: %d differences with '%s'\n", prog_name, e, check_file);
+            ret = 1;
+        }
+    }
+
+    codec_free(lzss);
+    if( dict_file )
+        dict_free(&dict);
+    sapr_free(&song);
+    free(data);
+    return ret;
+}
@@ -0,0 +1,140 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Reversible transforms of the register streams.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+
+#include "xform.h"
+#include <stdlib.h>
+
+const char *xform_names[XF_COUNT] = { "none", "delta", "xor", "nibble" };
+
+int xform_partner(const struct sapr *s, int chn)
+{
+    // Only AUDF1-3 and AUDC1-3, paired with the register of the next voice
+    if( chn % 9 < 6 && chn + 2 < s->nchn )
+        return chn + 2;
+    return -1;
+}
+
+int xform_apply(const struct sapr *s, int chn, int xf, uint8_t *out)
+{
+    const uint8_t *d = s->data[chn];
+    int p = -1;
+    if( xf == XF_XOR && (p = xform_partner(s, chn)) < 0 )
+        return -1;
+
+    // Process from the end, so that "out" can be the same as the input
+    for(int i = s->size - 1; i >= 0; i--)
+    {
+        int last = i ? d[i-1] : 0;
+        switch(xf)
+        {
+            case XF_DELTA:
+                out[i] = d[i] - last;
+                break;
+            case XF_XOR:
+                out[i] = d[i] ^ s->data[p][i];
+                break;
+            case XF_NIBBLE:
+                out[i] = (d[i] & 0xF0) | ((d[i] - last) & 0x0F);
+                break;
+            default:
+                out[i] = d[i];
+                break;
+        }
+    }
+    return 0;
+}
+
+void xform_select(struct codec *c, struct sapr *s, const int chn_skip[SAPR_MAX_CHN],
+                  FILE *out, int level)
+{
+    int bits[XF_COUNT][SAPR_MAX_CHN];
+    void *st[SAPR_MAX_CHN];
+
+    // Parse the song with each transform
+    for(int xf=0; xf<XF_COUNT; xf++)
+    {
+        struct sapr t = *s;
+        int skip[SAPR_MAX_CHN];
+        for(int i=0; i<SAPR_MAX_CHN; i++)
+        {
+            skip[i] = chn_skip[i];
+            bits[xf][i] = -1;
+            if( i >= s->nchn || chn_skip[i] || xf == XF_NONE )
+                continue;
+            t.data[i] = arena_alloc(s->arena, s->size ? s->size : 1);
+            if( xform_apply(s, i, xf, t.data[i]) )
+            {
+                arena_release(s->arena, t.data[i]);
+                t.data[i] = s->data[i];
+                skip[i] = 1;
+            }
+        }
+        codec_parse(&c, 1, &t, skip, st);
+        for(int i=0; i<s->nchn; i++)
+            if( !skip[i] )
+            {
+                bits[xf][i] = c->ops->parse_bits(st[i], 0);
+                if( xf != XF_NONE )
+                    arena_release(s->arena, t.data[i]);
+            }
+        codec_parse_free(&c, 1, st);
+    }
+
+    // Select the best for each stream and apply. The XOR transform uses the
+    // untransformed data of the next voice, so process from the first stream.
+    int gain[XF_COUNT] = { 0 }, count[XF_COUNT] = { 0 };
+    for(int i=0; i<s->nchn; i++)
+    {
+        int best = XF_NONE;
+        for(int xf=1; xf<XF_COUNT; xf++)
+            if( bits[xf][i] >= 0 && bits[xf][i] < bits[best][i] )
+                best = xf;
+        s->xform[i] = best;
+        if( best == XF_NONE )
+            continue;
+        xform_apply(s, i, best, s->data[i]);
+        gain[best] += bits[XF_NONE][i] - bits[best][i];
+        count[best] ++;
+        if( level > 1 )
+            fprintf(out," Stream #%d: %s transform, %d bits saved\n", i,
+                    xform_names[best], bits[XF_NONE][i] - bits[best][i]);
+    }
+    if( level )
+        for(int xf=1; xf<XF_COUNT; xf++)
+            fprintf(out,"Transform %-6s: %2d streams, %5d bytes saved\n",
+                    xform_names[xf], count[xf], gain[xf] / 8);
+}
+
+void xform_undo(struct sapr *s)
+{
+    // Undo from the last stream, the XOR partner must be restored before
+    for(int i=s->nchn-1; i>=0; i--)
+    {
+        uint8_t *d = s->data[i];
+        int p = xform_partner(s, i);
+        for(int j=0; j<s->size; j++)
+        {
+            int last = j ? d[j-1] : 0;
+            switch(s->xform[i])
+            {
+                case XF_DELTA:
+                    d[j] = d[j] + last;
+                    break;
+                case XF_XOR:
+                    d[j] = d[j] ^ s->data[p][j];
+                    break;
+                case XF_NIBBLE:
+                    d[j] = (d[j] & 0xF0) | ((d[j] + last) & 0x0F);
+                    break;
+            }
+        }
+        s->xform[i] = XF_NONE;
+    }
+}
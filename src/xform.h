@@ -0,0 +1,44 @@
+/*
+ * Atari SAP-R File Compressor
+ * ---------------------------
+ *
+ * Reversible transforms of the register streams.
+ *
+ * (c) 2020 DMSC
+ * Code under MIT license, see LICENSE file.
+ */
+#pragma once
+
+#include "codec.h"
+
+// Transforms, the player undoes them after reading each value:
+enum xform_type
+{
+    XF_NONE = 0,    // Stream is stored as is
+    XF_DELTA,       // Difference with the value in the previous frame
+    XF_XOR,         // XOR with the paired register, see xform_partner()
+    XF_NIBBLE,      // High nibble as is, low nibble is a delta (AUDC volume)
+    XF_COUNT
+};
+// Name of each transform
+extern const char *xform_names[XF_COUNT];
+// Bits used to store the transform of each stream in the header
+#define XF_BITS 2
+
+// Returns the stream used by the XOR transform, this is the same register of
+// the next voice, so it is decoded before in the frame. Returns -1 if the
+// stream has no pair.
+int xform_partner(const struct sapr *s, int chn);
+
+// Writes the transformed stream "chn" to "out", using the untransformed data
+// of the song. Returns -1 if the transform is not possible for the stream.
+int xform_apply(const struct sapr *s, int chn, int xf, uint8_t *out);
+
+// Selects the transform that gives the smallest parse with the codec for
+// each stream, and transforms the song data in place. Shows the gain of each
+// transform if "level" > 0.
+void xform_select(struct codec *c, struct sapr *s, const int chn_skip[SAPR_MAX_CHN],
+                  FILE *out, int level);
+
+// Undoes the transforms of the song, in place.
+void xform_undo(struct sapr *s);